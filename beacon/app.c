@@ -32,6 +32,7 @@
 #include "src/common/src/test.h"
 #include "src/beacon.h"
 #include "src/common/src/riskinfo.h"
+#include "src/common/src/util/crc32.h"
 
 /*
  * Channel map is 5 bytes and contains 37 1-bit fields.
@@ -69,21 +70,39 @@ uint8_t pkt_rep_count = 0;
 uint32_t seq_num = 0;
 uint32_t pkt_len;
 uint32_t chunk_len = TEST_FILTER_LEN - HDR_SIZE_BYTES;
+#if BEACON_PER_ADV_CHAINED
+uint8_t test_data[PER_ADV_CHAIN_SIZE];
+#else
 uint8_t test_data[PER_ADV_SIZE];
+#endif
 uint8_t test_filter[MAX_FILTER_SIZE];
+uint32_t test_filter_crc;
+uint32_t test_payload_ver;
 
-void send_test_risk_data()
+/*
+ * write the next test risk packet to pkt and advance the sequence,
+ * returns the packet length
+ */
+static uint32_t prep_test_risk_pkt(uint8_t *pkt)
 {
-  float starttime = now();
-
   if (seq_num == 0) {
     beacon_storage_read_test_filter(get_beacon_storage(), test_filter);
+    test_filter_crc = crc32(test_filter, chunk_len);
+
+    // every chunk of the test payload carries the same filter
+    uint32_t crc = CRC32_INIT;
+    for (int c = 0; c < TEST_N_FILTERS_PER_PAYLOAD; c++) {
+      crc = crc32_update(crc, (uint8_t *) &test_filter_crc, sizeof(uint32_t));
+    }
+    test_payload_ver = crc32_final(crc);
   }
 
-  rpi_ble_hdr *rbh = (rpi_ble_hdr *) test_data;
+  rpi_ble_hdr *rbh = (rpi_ble_hdr *) pkt;
   rbh->pkt_seq = seq_num;
   rbh->chunkid = chunk_num;
   rbh->chunklen = chunk_len;
+  rbh->chunk_crc = test_filter_crc;
+  rbh->payload_ver = test_payload_ver;
 
   // data
 #define min(a,b) ((b) < (a) ? (b) : (a))
@@ -91,45 +110,764 @@ void send_test_risk_data()
       MAX_PAYLOAD_SIZE);
 #undef min
 
-  memcpy(test_data+sizeof(rpi_ble_hdr),
+  memcpy(pkt+sizeof(rpi_ble_hdr),
       test_filter + (seq_num*MAX_PAYLOAD_SIZE), pkt_len);
 
-  // set in BLE payload
-  set_risk_data(sizeof(rpi_ble_hdr)+pkt_len, test_data);
-
-  float endtime = now();
-  stat_add((endtime - starttime),
-      stats.broadcast_payload_update_duration);
+  uint32_t len = sizeof(rpi_ble_hdr) + pkt_len;
 
   // update sequence
   pkt_rep_count++;
   if (pkt_rep_count < PACKET_REPLICATION)
-    return;
+    return len;
 
   // all packet retransmissions complete
   pkt_rep_count = 0;
   seq_num++;
   if (seq_num < TEST_NUM_PACKETS_PER_FILTER)
-    return;
+    return len;
 
   // one filter retransmission complete
   seq_num = 0;
   chunk_rep_count++;
   if (chunk_rep_count < CHUNK_REPLICATION)
-    return;
+    return len;
 
   // all filter retransmissions complete
   chunk_rep_count = 0;
   chunk_num++;
   if (chunk_num < TEST_N_FILTERS_PER_PAYLOAD)
-    return;
+    return len;
 
   // payload transmission complete
   chunk_num = 0;
   log_debugf("switched to transmit chunk %lu\r\n", chunk_num);
+  return len;
+}
+
+void send_test_risk_data()
+{
+  float starttime = now();
+
+  // set in BLE payload
+#if BEACON_PER_ADV_CHAINED
+  memset(test_data, 0, PER_ADV_CHAIN_SIZE);
+  for (int i = 0; i < PER_ADV_CHAIN_LEN; i++) {
+    prep_test_risk_pkt(test_data + (i*PER_ADV_SIZE));
+  }
+  set_risk_data_chained(PER_ADV_CHAIN_SIZE, test_data);
+#else
+  uint32_t len = prep_test_risk_pkt(test_data);
+  set_risk_data(len, test_data);
+#endif
+
+  float endtime = now();
+  stat_add((endtime - starttime),
+      stats.broadcast_payload_update_duration);
 }
 #endif /* PERIODIC_TEST */
 
+#if BEACON_UART_FRAMED
+#if BEACON_CAROUSEL
+#define CAROUSEL_LOAD 0
+#define CAROUSEL_RUN  1
+
+#define RISK_INDEX_MAX_ENTRIES (MAX_NUM_CHUNKS + 1) // chunks and manifest
+#define UPDATE_COPY_PKTS 4 // packets copied per periodic adv. event
+#define NO_CHUNK 0xffff
+#define NO_ENTRY 0xffffffff
+
+/*
+ * risk carousel over the packets of the current generation in the risk
+ * store. until a first generation is complete, the pi client paces the
+ * broadcast.
+ */
+static struct
+{
+  int state;
+  int bank;               // bank being played
+  risk_store_hdr_t hdr;   // generation being played
+  uint32_t idx;           // next packet to send
+  uint32_t chunk_start;   // first packet of the current chunk
+  uint8_t pkt_rep;
+  uint8_t chunk_rep;
+  // runs of packets of each chunk in the bank, to copy unchanged chunks
+  uint32_t num_chunks;
+  struct
+  {
+    uint32_t crc;
+    uint16_t start;
+    uint16_t count;
+  } chunks[RISK_INDEX_MAX_ENTRIES];
+} carousel;
+
+/*
+ * next generation, built in the other bank from the chunk index sent by
+ * the pi client (see riskinfo.h). chunks whose CRC is in the current
+ * generation are copied a few packets per periodic adv. event, the
+ * others are received over UART. the carousel switches banks once every
+ * chunk is in, so it never plays a half-updated payload.
+ */
+static struct
+{
+  int active;
+  int bank;
+  uint32_t payload_ver;
+  uint32_t numchunks;
+  uint32_t num_entries;       // index entries, numchunks + manifest
+  uint32_t num_pkts;          // packets written to the bank
+  uint32_t erased_pages;      // bank pages erased so far, while loading
+  // index reassembly, the index is just the entry CRCs
+  int index_done;
+  uint32_t index_next_seq;
+  uint32_t crc[RISK_INDEX_MAX_ENTRIES];
+  uint16_t src[RISK_INDEX_MAX_ENTRIES]; // chunk in the current generation
+  uint8_t have[(RISK_INDEX_MAX_ENTRIES + 7) / 8];
+  // next packet to copy from the current generation
+  uint32_t copy_entry;
+  uint32_t copy_pkt;
+  // chunk being received over UART, and entries left to receive
+  uint32_t num_rx_left;
+  uint32_t rx_entry;
+  uint32_t rx_next_seq;
+  uint32_t rx_num_data_pkts;
+} update;
+
+// generation that did not fit into a bank, not retried
+static uint32_t update_failed_ver = 0;
+
+// pages of the spare bank erased since the carousel switched banks
+static uint32_t spare_erased_pages = 0;
+
+#define have_entry(e) ((update.have[(e) / 8] >> ((e) % 8)) & 1)
+#define set_have_entry(e) (update.have[(e) / 8] |= (1 << ((e) % 8)))
+#define entry_chunkid(e) \
+  (((e) < update.numchunks) ? (e) : RISK_MANIFEST_CHUNKID)
+
+/*
+ * the carousel advances once per periodic adv. event. events are
+ * counted from the tick at which the main loop synced up with the
+ * advertising interval.
+ */
+static sl_sleeptimer_timer_handle_t carousel_timer;
+static uint64_t carousel_phase_tick;
+static volatile uint32_t carousel_event;
+static uint32_t carousel_sent_event;
+
+#define carousel_event_tick(n) \
+  (carousel_phase_tick + ((((uint64_t) (n)) * PER_ADV_INTERVAL * 5 * \
+    sl_sleeptimer_get_timer_frequency()) / 4000))
+
+static void carousel_arm_timer(void);
+
+static void carousel_on_timer(
+    __attribute__ ((unused)) sl_sleeptimer_timer_handle_t *handle,
+    __attribute__ ((unused)) void *data)
+{
+  carousel_event++;
+  carousel_arm_timer();
+}
+
+static void carousel_arm_timer(void)
+{
+  uint64_t now_tick = sl_sleeptimer_get_tick_count64();
+  uint64_t next_tick = carousel_event_tick(carousel_event + 1);
+  uint32_t timeout = (next_tick > now_tick) ? (next_tick - now_tick) : 1;
+
+  sl_status_t sc = sl_sleeptimer_start_timer(&carousel_timer, timeout,
+      carousel_on_timer, NULL, MAIN_TIMER_PRIORT, 0);
+  if (sc != SL_STATUS_OK) {
+    log_errorf("Error starting carousel timer %d\r\n", sc);
+  }
+}
+
+#define pkt_hdr(pkt) ((rpi_ble_hdr *) (pkt)->data)
+
+/*
+ * find the run of packets of every chunk in the bank being played. an
+ * interrupted transfer may leave a partial run before the full one.
+ */
+static void carousel_scan_chunks()
+{
+  beacon_storage *sto = get_beacon_storage();
+  uint32_t crc = 0, start = 0;
+
+  carousel.num_chunks = 0;
+  for (uint32_t i = 0; i <= carousel.hdr.num_pkts; i++) {
+    const risk_store_slot_t *pkt = (i < carousel.hdr.num_pkts) ?
+      beacon_storage_risk_store_pkt(sto, carousel.bank, i) : NULL;
+    if (i > 0 && (!pkt || pkt_hdr(pkt)->chunk_crc != crc)) {
+      uint32_t c;
+      for (c = 0; c < carousel.num_chunks; c++) {
+        if (carousel.chunks[c].crc == crc)
+          break;
+      }
+      if (c == carousel.num_chunks && c < RISK_INDEX_MAX_ENTRIES)
+        carousel.num_chunks++;
+      if (c < carousel.num_chunks && carousel.chunks[c].count < i - start) {
+        carousel.chunks[c].crc = crc;
+        carousel.chunks[c].start = start;
+        carousel.chunks[c].count = i - start;
+      }
+      start = i;
+    }
+    if (pkt)
+      crc = pkt_hdr(pkt)->chunk_crc;
+  }
+}
+
+static void carousel_start()
+{
+  uint64_t now_tick = sl_sleeptimer_get_tick_count64();
+  uint64_t ticks_per_event = (((uint64_t) PER_ADV_INTERVAL) * 5 *
+      sl_sleeptimer_get_timer_frequency()) / 4000;
+
+  sl_sleeptimer_stop_timer(&carousel_timer);
+
+  carousel.state = CAROUSEL_RUN;
+  spare_erased_pages = 0;
+  carousel.idx = 0;
+  carousel.chunk_start = 0;
+  carousel.pkt_rep = 0;
+  carousel.chunk_rep = 0;
+  carousel_scan_chunks();
+
+  // first event after now, in phase with the advertising interval
+  carousel_event = (now_tick - carousel_phase_tick) / ticks_per_event;
+  carousel_sent_event = carousel_event;
+  carousel_arm_timer();
+
+  log_expf("[carousel] run bank: %d gen: %lu payload ver: 0x%lx "
+      "#pkts: %lu #chunks: %lu\r\n", carousel.bank,
+      carousel.hdr.generation, carousel.hdr.payload_ver,
+      carousel.hdr.num_pkts, carousel.num_chunks);
+}
+
+static void carousel_reset()
+{
+  sl_sleeptimer_stop_timer(&carousel_timer);
+  memset(&carousel, 0, sizeof(carousel));
+  carousel.state = CAROUSEL_LOAD;
+}
+
+/*
+ * next packet of the carousel, with packet and chunk replication as in
+ * prep_test_risk_pkt()
+ */
+static const risk_store_slot_t *carousel_next_pkt()
+{
+  beacon_storage *sto = get_beacon_storage();
+  const risk_store_slot_t *pkt = beacon_storage_risk_store_pkt(sto,
+      carousel.bank, carousel.idx);
+
+  carousel.pkt_rep++;
+  if (carousel.pkt_rep < BEACON_CAROUSEL_PKT_REPLICATION)
+    return pkt;
+
+  // all packet retransmissions complete
+  carousel.pkt_rep = 0;
+  uint32_t next = (carousel.idx + 1) % carousel.hdr.num_pkts;
+  if (next != 0 && pkt_hdr(beacon_storage_risk_store_pkt(sto,
+          carousel.bank, next))->chunkid == pkt_hdr(pkt)->chunkid) {
+    carousel.idx = next;
+    return pkt;
+  }
+
+  // one chunk retransmission complete
+  carousel.chunk_rep++;
+  if (carousel.chunk_rep < BEACON_CAROUSEL_CHUNK_REPLICATION) {
+    carousel.idx = carousel.chunk_start;
+    return pkt;
+  }
+
+  // all chunk retransmissions complete
+  carousel.chunk_rep = 0;
+  carousel.idx = carousel.chunk_start = next;
+  return pkt;
+}
+
+static void update_reset(uint32_t payload_ver)
+{
+  memset(&update, 0, sizeof(update));
+  update.active = 1;
+  update.payload_ver = payload_ver;
+  update.bank = (carousel.state == CAROUSEL_RUN) ? !carousel.bank : 0;
+  update.rx_entry = NO_ENTRY;
+}
+
+/*
+ * tell the pi client which index entries are still missing
+ */
+static void update_send_need()
+{
+  uint32_t nbytes = (update.num_entries + 7) / 8;
+
+  printf(RISK_INDEX_NEED_TAG " %08lx ", update.payload_ver);
+  for (uint32_t b = 0; b < nbytes; b++) {
+    uint8_t need = ~update.have[b];
+    if (b == nbytes - 1 && update.num_entries % 8)
+      need &= (1 << (update.num_entries % 8)) - 1;
+    printf("%02x", need);
+  }
+  printf("\r\n");
+}
+
+/*
+ * while loading, the pi client paces the broadcast and bank pages are
+ * erased as packets arrive. pages that are still blank are skipped.
+ */
+static void update_erase_page()
+{
+  beacon_storage *sto = get_beacon_storage();
+
+  if (!beacon_storage_risk_store_page_blank(sto, update.bank,
+        update.erased_pages))
+    beacon_storage_risk_store_erase(sto, update.bank, update.erased_pages);
+  update.erased_pages++;
+}
+
+/*
+ * while the carousel runs, the spare bank is erased ahead of the next
+ * update, one page right after a periodic adv. event was handed its
+ * data, so that no erase runs from the UART path into the next event.
+ * returns 1 if a page was erased.
+ */
+static int spare_erase_step()
+{
+  beacon_storage *sto = get_beacon_storage();
+  int bank = !carousel.bank;
+
+  while (spare_erased_pages < RISK_STORE_BANK_PAGES) {
+    uint32_t page = spare_erased_pages++;
+    if (!beacon_storage_risk_store_page_blank(sto, bank, page)) {
+      beacon_storage_risk_store_erase(sto, bank, page);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * give up on a generation that does not fit into a bank. the pi client
+ * paces the broadcast again until it sends a new payload.
+ */
+static void update_fail()
+{
+  update_failed_ver = update.payload_ver;
+  update.active = 0;
+  if (carousel.state == CAROUSEL_RUN) {
+    log_expf("%s", "[carousel] stopped, pi client paces the broadcast\r\n");
+    carousel_reset();
+  }
+}
+
+/*
+ * returns 1 if the page of the packet is not erased yet, it is sent
+ * again by the pi client or copied on a later event
+ */
+static int update_append(const uint8_t *data, uint16_t len)
+{
+  uint32_t page = RISK_STORE_PKT_PAGE(update.num_pkts);
+  if (carousel.state == CAROUSEL_RUN) {
+    if (page < RISK_STORE_BANK_PAGES && page >= spare_erased_pages)
+      return 1;
+  } else {
+    while (update.erased_pages <= page &&
+        update.erased_pages < RISK_STORE_BANK_PAGES)
+      update_erase_page();
+  }
+
+  if (beacon_storage_risk_store_append(get_beacon_storage(), update.bank,
+        update.num_pkts, data, len) != 0) {
+    log_errorf("[carousel] bank full at %lu pkts, payload ver: 0x%lx\r\n",
+        update.num_pkts, update.payload_ver);
+    update_fail();
+    return -1;
+  }
+
+  update.num_pkts++;
+  return 0;
+}
+
+/*
+ * switch the carousel to the new generation once every entry is in
+ */
+static void update_check_done()
+{
+  if (!update.active || !update.index_done || update.num_pkts == 0)
+    return;
+
+  for (uint32_t e = 0; e < update.num_entries; e++) {
+    if (!have_entry(e))
+      return;
+  }
+
+  risk_store_hdr_t hdr;
+  hdr.magic = RISK_STORE_MAGIC;
+  hdr.payload_ver = update.payload_ver;
+  hdr.num_pkts = update.num_pkts;
+  hdr.generation = (carousel.state == CAROUSEL_RUN) ?
+    carousel.hdr.generation + 1 : 1;
+  beacon_storage_risk_store_save_hdr(get_beacon_storage(), update.bank, &hdr);
+
+  stats.carousel_loads++;
+  update.active = 0;
+  carousel.bank = update.bank;
+  carousel.hdr = hdr;
+  carousel_start();
+}
+
+/*
+ * the chunk index is complete, find the entries that can be copied from
+ * the current generation and ask the pi client for the others
+ */
+static void update_begin(rpi_ble_hdr *rbh)
+{
+  uint32_t num_copy = 0;
+
+  update.index_done = 1;
+  update.numchunks = rbh->numchunks;
+  update.num_entries = rbh->chunklen / sizeof(uint32_t);
+  if (update.numchunks > MAX_NUM_CHUNKS ||
+      update.num_entries < update.numchunks ||
+      update.num_entries > update.numchunks + 1) {
+    log_errorf("[carousel] bad index, #chunks: %lu #entries: %lu\r\n",
+        update.numchunks, update.num_entries);
+    update_failed_ver = update.payload_ver;
+    update.active = 0;
+    return;
+  }
+
+  // the index does not tell the chunk sizes, assume full chunks
+  uint32_t max_pkts = (update.numchunks * RISK_STORE_CHUNK_PKTS) +
+    ((update.num_entries > update.numchunks) ? RISK_STORE_MANIFEST_PKTS : 0);
+  if (max_pkts > RISK_STORE_MAX_PKTS) {
+    log_errorf("[carousel] payload too large for a bank, #chunks: %lu "
+        "max: %lu\r\n", update.numchunks, (uint32_t) RISK_STORE_MAX_CHUNKS);
+    update_fail();
+    return;
+  }
+
+  for (uint32_t e = 0; e < update.num_entries; e++) {
+    update.src[e] = NO_CHUNK;
+    if (carousel.state != CAROUSEL_RUN)
+      continue;
+
+    for (uint32_t c = 0; c < carousel.num_chunks; c++) {
+      if (carousel.chunks[c].crc == update.crc[e]) {
+        update.src[e] = c;
+        num_copy++;
+        break;
+      }
+    }
+  }
+
+  update.num_rx_left = update.num_entries - num_copy;
+  log_expf("[carousel] update bank: %d payload ver: 0x%lx #entries: %lu "
+      "copy: %lu transfer: %lu\r\n", update.bank, update.payload_ver,
+      update.num_entries, num_copy, update.num_entries - num_copy);
+  update_send_need();
+}
+
+static void update_on_index(rpi_ble_hdr *rbh, uint8_t *data, int dlen)
+{
+  if (update.index_done) {
+    // the pi client starts a new rotation, ask again for what is missing
+    if (rbh->pkt_seq == 0)
+      update_send_need();
+    return;
+  }
+
+  if (rbh->pkt_seq == 0)
+    update.index_next_seq = 0;
+
+  uint32_t off = rbh->pkt_seq * MAX_PAYLOAD_SIZE;
+  if (rbh->pkt_seq != update.index_next_seq || off >= rbh->chunklen)
+    return;
+
+  if (rbh->chunklen > sizeof(update.crc)) {
+    log_errorf("[carousel] index too long: %lu\r\n", rbh->chunklen);
+    return;
+  }
+
+  uint32_t clen = ((uint32_t) dlen < rbh->chunklen - off) ?
+    (uint32_t) dlen : rbh->chunklen - off;
+  memcpy(((uint8_t *) update.crc) + off, data, clen);
+  update.index_next_seq++;
+  if (off + clen < rbh->chunklen)
+    return;
+
+  if (crc32((uint8_t *) update.crc, rbh->chunklen) != rbh->chunk_crc) {
+    update.index_next_seq = 0;
+    return;
+  }
+
+  update_begin(rbh);
+}
+
+/*
+ * a chunk received over UART ends at the first frame that does not
+ * continue it, so that its parity packets are kept too
+ */
+static void update_rx_end(rpi_ble_hdr *rbh)
+{
+  if (update.rx_entry == NO_ENTRY)
+    return;
+
+  if (rbh->chunkid == entry_chunkid(update.rx_entry) &&
+      rbh->pkt_seq == update.rx_next_seq)
+    return;
+
+  if (update.rx_next_seq >= update.rx_num_data_pkts) {
+    set_have_entry(update.rx_entry);
+    update.num_rx_left--;
+    stats.carousel_chunks_rx++;
+  }
+  update.rx_entry = NO_ENTRY;
+  update_check_done();
+}
+
+static void update_on_pkt(rpi_ble_hdr *rbh, uint8_t *data, int len)
+{
+  uint32_t e = (rbh->chunkid < update.numchunks) ? rbh->chunkid :
+    (rbh->chunkid == RISK_MANIFEST_CHUNKID) ? update.numchunks : NO_ENTRY;
+  if (e >= update.num_entries || update.src[e] != NO_CHUNK ||
+      rbh->chunk_crc != update.crc[e])
+    return;
+
+  if (e == update.rx_entry) {
+    // next packet of the chunk in flight, see update_rx_end()
+  } else if (rbh->pkt_seq == 0 && !have_entry(e)) {
+    update.rx_entry = e;
+    update.rx_next_seq = 0;
+    update.rx_num_data_pkts = ((rbh->chunklen - 1) / MAX_PAYLOAD_SIZE) + 1;
+  } else {
+    return;
+  }
+
+  if (update_append(data, len) != 0)
+    return;
+
+  update.rx_next_seq++;
+}
+
+/*
+ * copy the next packet of an unchanged chunk into the new generation,
+ * with the chunk id and payload version of the new generation
+ */
+static void update_copy_pkt()
+{
+  while (update.copy_entry < update.num_entries &&
+      update.src[update.copy_entry] == NO_CHUNK)
+    update.copy_entry++;
+
+  if (update.copy_entry >= update.num_entries)
+    return;
+
+  uint32_t e = update.copy_entry;
+  risk_store_slot_t pkt;
+  memcpy(&pkt, beacon_storage_risk_store_pkt(get_beacon_storage(),
+        carousel.bank, carousel.chunks[update.src[e]].start + update.copy_pkt),
+      sizeof(risk_store_slot_t));
+  pkt_hdr(&pkt)->chunkid = entry_chunkid(e);
+  pkt_hdr(&pkt)->numchunks = update.numchunks;
+  pkt_hdr(&pkt)->payload_ver = update.payload_ver;
+
+  if (update_append(pkt.data, pkt.len) != 0)
+    return;
+
+  update.copy_pkt++;
+  if (update.copy_pkt < carousel.chunks[update.src[e]].count)
+    return;
+
+  set_have_entry(e);
+  stats.carousel_chunks_copied++;
+  update.copy_entry++;
+  update.copy_pkt = 0;
+  update_check_done();
+}
+
+/*
+ * flash work for the update that fits between two periodic adv. events:
+ * copy UPDATE_COPY_PKTS packets
+ */
+static void update_step()
+{
+  if (!update.active || !update.index_done)
+    return;
+
+  for (int i = 0; i < UPDATE_COPY_PKTS && update.active; i++) {
+    update_copy_pkt();
+  }
+}
+
+/*
+ * returns 1 if the frame may be broadcast as it is, i.e., the pi client
+ * still paces the broadcast and the frame is not part of the index
+ */
+static int carousel_on_frame(uint8_t *data, int len)
+{
+  rpi_ble_hdr *rbh = (rpi_ble_hdr *) data;
+  uint8_t *pkt_data = data + sizeof(rpi_ble_hdr);
+  int dlen = len - sizeof(rpi_ble_hdr);
+
+  if (update.active)
+    update_rx_end(rbh);
+
+  if (!(carousel.state == CAROUSEL_RUN &&
+        rbh->payload_ver == carousel.hdr.payload_ver) &&
+      rbh->payload_ver != update_failed_ver &&
+      !(update.active && rbh->payload_ver == update.payload_ver)) {
+    log_expf("[carousel] new payload ver: 0x%lx\r\n", rbh->payload_ver);
+    update_reset(rbh->payload_ver);
+  }
+
+  if (update.active && rbh->payload_ver == update.payload_ver) {
+    if (rbh->chunkid == RISK_INDEX_CHUNKID)
+      update_on_index(rbh, pkt_data, dlen);
+    else if (update.index_done)
+      update_on_pkt(rbh, data, len);
+  }
+
+  return carousel.state != CAROUSEL_RUN && rbh->chunkid != RISK_INDEX_CHUNKID;
+}
+
+/*
+ * resume the latest complete generation, if any. phase_tick is a tick
+ * at which the risk data may be updated without racing a periodic adv.
+ * event.
+ */
+void beacon_carousel_init(uint64_t phase_tick)
+{
+  beacon_storage *sto = get_beacon_storage();
+  risk_store_hdr_t hdr;
+  int bank = -1;
+
+  carousel_reset();
+  memset(&update, 0, sizeof(update));
+  carousel_phase_tick = phase_tick;
+
+  for (int b = 0; b < RISK_STORE_NUM_BANKS; b++) {
+    if (beacon_storage_risk_store_read_hdr(sto, b, &hdr) != 0)
+      continue;
+
+    if (bank < 0 || hdr.generation > carousel.hdr.generation) {
+      bank = b;
+      carousel.hdr = hdr;
+    }
+  }
+
+  if (bank < 0) {
+    log_expf("%s", "[carousel] no stored payload, loading from pi\r\n");
+    return;
+  }
+
+  carousel.bank = bank;
+  carousel_start();
+}
+
+int beacon_carousel_running()
+{
+  return carousel.state == CAROUSEL_RUN;
+}
+
+/*
+ * 1 while the update still needs frames from the pi client, copies from
+ * the current generation do not
+ */
+int beacon_carousel_updating()
+{
+  return update.active && (!update.index_done || update.num_rx_left > 0 ||
+      update.rx_entry != NO_ENTRY);
+}
+
+/*
+ * update the risk data from the risk store if a periodic adv. event
+ * passed since the last update. events missed by the main loop are
+ * skipped rather than sent late. flash work for a pending update is
+ * done right after an update, to stay clear of the next event.
+ */
+void beacon_carousel_process()
+{
+  if (carousel.state != CAROUSEL_RUN || carousel_sent_event == carousel_event)
+    return;
+
+  carousel_sent_event = carousel_event;
+
+#if BEACON_PER_ADV_CHAINED
+  static uint8_t chain_data[PER_ADV_CHAIN_SIZE];
+  int len = 0;
+
+  memset(chain_data, 0, PER_ADV_CHAIN_SIZE);
+  for (int i = 0; i < PER_ADV_CHAIN_LEN; i++) {
+    const risk_store_slot_t *pkt = carousel_next_pkt();
+    memcpy(chain_data + (i*PER_ADV_SIZE), pkt->data, pkt->len);
+    len = (i*PER_ADV_SIZE) + pkt->len;
+  }
+  set_risk_data_chained(len, chain_data);
+#else
+  const risk_store_slot_t *pkt = carousel_next_pkt();
+  set_risk_data(pkt->len, (uint8_t *) pkt->data);
+#endif
+
+  // at most one page erase per event, which may take the whole interval
+  if (!spare_erase_step())
+    update_step();
+}
+
+#undef pkt_hdr
+#undef entry_chunkid
+#undef set_have_entry
+#undef have_entry
+#endif /* BEACON_CAROUSEL */
+
+#if BEACON_PER_ADV_CHAINED
+static uint8_t risk_frame_data[PER_ADV_CHAIN_SIZE];
+#endif
+static int risk_frame_off = 0;
+
+/*
+ * a risk packet arrived from the pi client. in chained mode, packets
+ * are collected into PER_ADV_SIZE slots until the train is full.
+ */
+void beacon_on_risk_frame(uint8_t *data, int len)
+{
+  stats.uart_frames++;
+
+  if (len > PER_ADV_SIZE)
+    return;
+
+#if BEACON_CAROUSEL
+  // once the carousel runs, frames only carry updates for the store
+  if (len < (int) sizeof(rpi_ble_hdr) || !carousel_on_frame(data, len))
+    return;
+#else
+  // the chunk index is only meant for the risk store
+  if (len >= (int) sizeof(rpi_ble_hdr) &&
+      ((rpi_ble_hdr *) data)->chunkid == RISK_INDEX_CHUNKID)
+    return;
+#endif
+
+#if BEACON_PER_ADV_CHAINED
+  memcpy(risk_frame_data + risk_frame_off, data, len);
+  risk_frame_off += PER_ADV_SIZE;
+  if (risk_frame_off < PER_ADV_CHAIN_SIZE)
+    return;
+
+  set_risk_data_chained(risk_frame_off - PER_ADV_SIZE + len,
+      risk_frame_data);
+  memset(risk_frame_data, 0, PER_ADV_CHAIN_SIZE);
+#else
+  set_risk_data(len, data);
+#endif
+  risk_frame_off = 0;
+}
+
+void beacon_on_risk_frame_error(void)
+{
+  stats.uart_frame_errors++;
+}
+#endif /* BEACON_UART_FRAMED */
+
 float adv_start = -1;
 
 void sl_timer_on_expire(
@@ -39,6 +39,7 @@
 #define READ_SIZE 8
 #define TICK_DELAY 0
 #define DATA_DELAY 68 // determined empirically to sync up with advertising interval
+#define FRAME_TIMEOUT_MS 100 // max wait for the pi client to send a frame
 
 // compute the current time as a float in ms
 #define now() ((((float) sl_sleeptimer_get_tick_count64()) /  \
@@ -55,6 +56,13 @@ beacon_storage *get_beacon_storage();
 void app_init(void);
 
 void set_risk_data(int len, uint8_t *data);
+void set_risk_data_chained(int len, uint8_t *data);
+void beacon_on_risk_frame(uint8_t *data, int len);
+void beacon_on_risk_frame_error(void);
+void beacon_carousel_init(uint64_t phase_tick);
+int beacon_carousel_running();
+int beacon_carousel_updating();
+void beacon_carousel_process();
 void send_test_risk_data();
 
 /***************************************************************************/ /**
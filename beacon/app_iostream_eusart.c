@@ -22,6 +22,13 @@
 #include "sl_iostream.h"
 #include "sl_iostream_init_instances.h"
 #include "sl_iostream_handles.h"
+#include "sl_iostream_uart.h"
+#include "sl_iostream_init_eusart_instances.h"
+
+#include "app.h"
+#include "src/beacon.h"
+#include "src/common/src/constants.h"
+#include "src/common/src/util/frame.h"
 
 /*******************************************************************************
  *******************************   DEFINES   ***********************************
@@ -43,6 +50,17 @@ uint8_t risk_data_buffer[4096];
 int data_ready = 0;
 int data_len = 0;
 
+#if BEACON_UART_FRAMED
+/*
+ * frames are decoded straight out of the iostream rx ring, which the
+ * eusart interrupt fills in the background
+ */
+#define FRAME_READ_SIZE 64
+
+static uint8_t frame_buf[FRAME_LEN_SIZE + PER_ADV_SIZE + FRAME_CRC_SIZE];
+static frame_dec_t frame_dec;
+#endif
+
 
 
 /*******************************************************************************
@@ -63,7 +81,39 @@ void app_iostream_eusart_init(void)
 
   sl_iostream_set_default(sl_iostream_vcom_handle);
 
+#if BEACON_UART_FRAMED
+  sl_iostream_uart_set_read_block(sl_iostream_uart_vcom_handle, false);
+  frame_dec_init(&frame_dec, frame_buf, sizeof(frame_buf));
+#endif
+}
+
+#if BEACON_UART_FRAMED
+/*
+ * decode the bytes received so far and hand each complete frame to
+ * beacon_on_risk_frame(). returns the number of valid frames.
+ */
+int app_iostream_eusart_read_frames(void)
+{
+  uint8_t buf[FRAME_READ_SIZE];
+  size_t rlen = 0;
+  int nframes = 0;
+
+  while (sl_iostream_read(sl_iostream_vcom_handle, buf, FRAME_READ_SIZE,
+        &rlen) == SL_STATUS_OK && rlen > 0) {
+    for (size_t i = 0; i < rlen; i++) {
+      int len = frame_dec_push(&frame_dec, buf[i]);
+      if (len > 0) {
+        beacon_on_risk_frame(frame_dec_data(&frame_dec), len);
+        nframes++;
+      } else if (len < 0) {
+        beacon_on_risk_frame_error();
+      }
+    }
+  }
+
+  return nframes;
 }
+#endif
 
 /***************************************************************************//**
  * Example ticking function.
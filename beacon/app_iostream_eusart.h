@@ -35,4 +35,9 @@ void app_iostream_eusart_init (void);
  ******************************************************************************/
 void app_iostream_eusart_process_action (void);
 
+/***************************************************************************//**
+ * decode risk data frames received on the iostream usart
+ ******************************************************************************/
+int app_iostream_eusart_read_frames (void);
+
 #endif  // APP_IOSTREAM_EUSART_H
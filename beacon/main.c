@@ -37,6 +37,7 @@
 #include "em_gpio.h"
 
 #include "src/led.h"
+#include "app_iostream_eusart.h"
 
 void add_delay_ticks(uint64_t ticks) {
   uint64_t start_delay = sl_sleeptimer_get_tick_count64();
@@ -53,6 +54,53 @@ void add_delay_ms(uint32_t ms) {
   add_delay_ticks(ticks);
 }
 
+#if BEACON_MODE__NETWORK && (PERIODIC_TEST == 0) && BEACON_UART_FRAMED
+/*
+ * raise the request pin until the pi client's next nwant frames are
+ * decoded, or FRAME_TIMEOUT_MS passes. the pi client sends
+ * UART_PKTS_PER_EDGE frames per edge.
+ */
+static int read_risk_frames(int nwant)
+{
+  int nframes = 0;
+
+  GPIO_PinOutSet(gpioPortB, 1);
+
+  float wait_start = now();
+  while (nframes < nwant && now() - wait_start < FRAME_TIMEOUT_MS)
+    nframes += app_iostream_eusart_read_frames();
+
+  GPIO_PinOutClear(gpioPortB, 1);
+  return nframes;
+}
+
+#if BEACON_CAROUSEL
+/*
+ * same as read_risk_frames(), without blocking the carousel. returns 1
+ * once the pull is over.
+ */
+static int poll_risk_frame(void)
+{
+  static int pulling = 0;
+  static float pull_start;
+
+  if (!pulling) {
+    GPIO_PinOutSet(gpioPortB, 1);
+    pull_start = now();
+    pulling = 1;
+  }
+
+  if (app_iostream_eusart_read_frames() == 0 &&
+      now() - pull_start < FRAME_TIMEOUT_MS)
+    return 0;
+
+  GPIO_PinOutClear(gpioPortB, 1);
+  pulling = 0;
+  return 1;
+}
+#endif
+#endif
+
 int main(void)
 {
   sl_status_t sc = 0;
@@ -97,7 +145,12 @@ int main(void)
         BEACON_TIMER_RESOLUTION, timer);
   }
 
-  uint8_t *buf = malloc(PER_ADV_SIZE);
+#if BEACON_PER_ADV_CHAINED
+#define RISK_BUF_SIZE PER_ADV_CHAIN_SIZE
+#else
+#define RISK_BUF_SIZE PER_ADV_SIZE
+#endif
+  uint8_t *buf = malloc(RISK_BUF_SIZE);
 
 #if BEACON_MODE__NETWORK
   int risk_timer_started = 0;
@@ -106,11 +159,17 @@ int main(void)
   float wait = -1; // wait time
   float time;      // cur time
   float delta;
+
+#if BEACON_CAROUSEL
+  uint64_t last_check_tick = 0;
+  uint64_t check_ticks = (uint64_t) sl_sleeptimer_ms_to_tick(
+      BEACON_TIMER_RESOLUTION) * BEACON_CAROUSEL_CHECK_INTERVAL;
+#endif
 #endif
 
   while (1) {
 
-    memset(buf, 0, PER_ADV_SIZE);
+    memset(buf, 0, RISK_BUF_SIZE);
 
 #define half_I ((((float)PER_ADV_INTERVAL)*1.25) / 2)
 #if BEACON_MODE__NETWORK
@@ -126,6 +185,10 @@ int main(void)
         continue;
 
       risk_timer_started = 1;
+#if BEACON_CAROUSEL
+      beacon_carousel_init(sl_sleeptimer_get_tick_count64());
+      last_check_tick = sl_sleeptimer_get_tick_count64();
+#endif
       log_infof("[periodic adv] risk timer start: %f ms delta: %f ms\r\n",
           time, delta);
       // TODO: make sure that the interval is synced properly below
@@ -138,6 +201,41 @@ int main(void)
        */
 
 #if (PERIODIC_TEST == 0)
+#if BEACON_UART_FRAMED
+#if BEACON_CAROUSEL
+      if (beacon_carousel_running()) {
+        beacon_carousel_process();
+
+        /*
+         * pull packets while a new generation is built, or one packet
+         * now and then to see if the pi client has a new payload
+         */
+        uint64_t tick = sl_sleeptimer_get_tick_count64();
+        if ((beacon_carousel_updating() ||
+              tick - last_check_tick >= check_ticks) &&
+            poll_risk_frame()) {
+          last_check_tick = tick;
+        }
+      } else
+#endif
+      {
+        uint64_t start_time = sl_sleeptimer_get_tick_count64();
+
+        /*
+         * the pi client writes a whole train per rising edge in chained
+         * mode, and one frame otherwise. frames are decoded as they
+         * arrive and go straight to the advertiser.
+         */
+        read_risk_frames(RISK_BUF_SIZE / PER_ADV_SIZE);
+
+        uint64_t end_time = sl_sleeptimer_get_tick_count64();
+        uint32_t ms = sl_sleeptimer_tick_to_ms(end_time-start_time);
+        stat_add(ms, stats.broadcast_payload_update_duration);
+
+        // add second delay to sync up with advertising interval
+        add_delay_ms(DATA_DELAY);
+      }
+#else
 /*
  * XXX: this is a hack!
  * we should only need this for the first couple of minutes
@@ -149,34 +247,42 @@ int main(void)
       // Start timer
       uint64_t start_time = sl_sleeptimer_get_tick_count64();
 
-      GPIO_PinOutSet(gpioPortB, 1);
+      /*
+       * the pi client writes one packet per rising edge, read as many
+       * packets as go into one periodic adv. event
+       */
+      for (int pkt_end = PER_ADV_SIZE; pkt_end <= RISK_BUF_SIZE;
+          pkt_end += PER_ADV_SIZE) {
 
-      while (tot_len < PER_ADV_SIZE) {
-        len = (PER_ADV_SIZE - tot_len > READ_SIZE) ?
-          READ_SIZE : (PER_ADV_SIZE - tot_len);
+        GPIO_PinOutSet(gpioPortB, 1);
 
-        int r = 0;
-        while (r < len) {
-          loops++;
-          if (loops >= LOOP_BREAK)
-            break;
+        while (tot_len < pkt_end) {
+          len = (pkt_end - tot_len > READ_SIZE) ?
+            READ_SIZE : (pkt_end - tot_len);
 
-          rlen = read(SL_IOSTREAM_STDIN, buf+off+r, len-r);
-          if (rlen < 0)
-            continue;
+          int r = 0;
+          while (r < len) {
+            loops++;
+            if (loops >= LOOP_BREAK)
+              break;
 
-          r += rlen;
-        }
+            rlen = read(SL_IOSTREAM_STDIN, buf+off+r, len-r);
+            if (rlen < 0)
+              continue;
 
-        off += len;
-        tot_len += len;
-        loops = 0;
+            r += rlen;
+          }
 
-        // add delay after read
-        add_delay_ticks(TICK_DELAY);
-      }
+          off += len;
+          tot_len += len;
+          loops = 0;
 
-      GPIO_PinOutClear(gpioPortB, 1);
+          // add delay after read
+          add_delay_ticks(TICK_DELAY);
+        }
+
+        GPIO_PinOutClear(gpioPortB, 1);
+      }
 
       // end timer
       uint64_t end_time = sl_sleeptimer_get_tick_count64();
@@ -189,7 +295,11 @@ int main(void)
           rbh->chunkid, rbh->pkt_seq, (uint32_t) rbh->chunklen, ms);
 
       if (rlen > 0) {
+#if BEACON_PER_ADV_CHAINED
+        set_risk_data_chained(tot_len, buf);
+#else
         set_risk_data(tot_len, buf);
+#endif
       }
 
       // end timer
@@ -200,6 +310,7 @@ int main(void)
 
       // add second delay to sync up with advertising interval
       add_delay_ms(DATA_DELAY);
+#endif // BEACON_UART_FRAMED
 
 #else // PERIODIC_TEST
 
@@ -212,6 +323,10 @@ int main(void)
 
 #endif // PERIODIC_TEST
     }
+#else // BEACON_MODE__NETWORK
+
+    beacon_ephid_precompute();
+
 #endif // BEACON_MODE__NETWORK
 
     /*
@@ -227,6 +342,11 @@ int main(void)
      */
     sl_system_process_action();
 
+#if BEACON_MODE__NETWORK
+    // PHY switches requested from the clock timer
+    beacon_per_adv_phy_process();
+#endif
+
 #if defined(SL_CATALOG_POWER_MANAGER_PRESENT)
     // Let the CPU go to sleep if the system allows it.
     // sl_power_manager_sleep();
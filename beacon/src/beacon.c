@@ -20,6 +20,7 @@
 #include <string.h>
 
 #include "sl_bluetooth.h"
+#include "em_core.h"
 #include "app_log.h"
 #include "led.h"
 #include "storage.h"
@@ -37,6 +38,12 @@ extern float adv_start;
 
 // The advertising set handle allocated from Bluetooth stack.
 static uint8_t advertising_set_handle = PER_ADV_HANDLE;
+// secondary PHY the periodic risk train is currently sent on
+static uint8_t per_adv_phy = sl_bt_gap_1m_phy;
+// PHY to switch to from the main loop, 0 for none
+static volatile uint8_t per_adv_phy_pending = 0;
+
+static void beacon_per_adv_phy_update();
 
 // Config
 beacon_config_t config;
@@ -49,6 +56,23 @@ static beacon_timer_t beacon_time;    // Beacon Clock
 static beacon_eph_id_t beacon_eph_id; // Ephemeral ID
 static beacon_epoch_counter_t epoch;  // track the current time epoch
 static beacon_timer_t cycles;         // total number of updates.
+static beacon_timer_t clock_journal_t;    // clock at the last journal record
+static beacon_timer_t clock_checkpoint_t; // clock at the last NVM3 checkpoint
+// sha-256 state after the secret key and location ID, each eph ID
+// only adds the epoch to a copy of it
+static hash_t ephid_midstate;
+static digest_t ephid_midstate_digest;
+static uint8_t ephid_ready;
+#if BEACON_EPHID_RING_SIZE
+// eph IDs of the coming epochs, slot epoch % BEACON_EPHID_RING_SIZE
+typedef struct
+{
+  uint8_t valid;
+  beacon_epoch_counter_t epoch;
+  beacon_eph_id_t id;
+} beacon_ephid_slot_t;
+static beacon_ephid_slot_t ephid_ring[BEACON_EPHID_RING_SIZE];
+#endif
 //
 // Bluetooth
 // Advertising handle
@@ -56,11 +80,11 @@ static uint8_t legacy_set_handle = 0xf1;
 static bt_wrapper_t payload; // container for actual blutooth payload
 
 #if MODE__SL_BEACON_TEST_CONFIG
-static pubkey_t TEST_BACKEND_PK = {
+static const pubkey_t TEST_BACKEND_PK = {
   {0xad, 0xf4, 0xca, 0x6c, 0xa6, 0xd9, 0x11, 0x22}
 };
 
-static beacon_sk_t TEST_BEACON_SK = {
+static const beacon_sk_t TEST_BEACON_SK = {
   {0xcb, 0x43, 0xf7, 0x56, 0x16, 0x25, 0xb3, 0xd0,
    0xd0, 0xbe, 0xad, 0xf4, 0x55, 0x66, 0x77, 0x99}
 };
@@ -75,11 +99,12 @@ static void beacon_config_init(beacon_config_t *cfg)
   if (!cfg)
     return;
 
-  cfg->backend_pk = malloc(PK_MAX_SIZE);
-  memset(cfg->backend_pk, 0, PK_MAX_SIZE);
+  // the keys are viewed in flash by beacon_storage_load_config
+  cfg->backend_pk_size = 0;
+  cfg->backend_pk = NULL;
 
-  cfg->beacon_sk = malloc(SK_MAX_SIZE);
-  memset(cfg->beacon_sk, 0, SK_MAX_SIZE);
+  cfg->beacon_sk_size = 0;
+  cfg->beacon_sk = NULL;
 }
 
 static void beacon_load()
@@ -98,12 +123,13 @@ static void beacon_load()
   config.t_init = TEST_BEACON_INIT_TIME;
   config.t_cur = 0;
   config.backend_pk_size = TEST_BACKEND_KEY_SIZE;
-  memcpy(config.backend_pk, &TEST_BACKEND_PK, config.backend_pk_size);
+  config.backend_pk = &TEST_BACKEND_PK;
   config.beacon_sk_size = TEST_BEACON_SK_SIZE;
-  memcpy(config.beacon_sk, &TEST_BEACON_SK, config.beacon_sk_size);
+  config.beacon_sk = &TEST_BEACON_SK;
   storage.test_filter_size = TEST_FILTER_LEN;
   beacon_storage_save_config(&storage, &config);
   nvm3_save_config(&storage, &config);
+  beacon_storage_time_journal_reset(&storage);
 #endif
 
   log_expf("=== INIT sto.t_cur: %u nvm.t_cur: %u ===\r\n", sto_t_cur, config.t_cur);
@@ -111,6 +137,15 @@ static void beacon_load()
   if (sto_t_cur == 0) {
     config.t_cur = 0;
     nvm3_save_clock_cursor(&storage, &config);
+    beacon_storage_time_journal_reset(&storage);
+    return;
+  }
+
+  // the journal is ahead of the NVM3 checkpoint, unless it was just erased
+  beacon_timer_t journal_t_cur;
+  if (beacon_storage_time_journal_load(&storage, &journal_t_cur) == 0 &&
+      journal_t_cur > config.t_cur) {
+    config.t_cur = journal_t_cur;
   }
 }
 
@@ -159,6 +194,7 @@ void beacon_info()
   log_expf("    Test filter length:       %lu\r\n", storage.test_filter_size);
   log_expf("    Config offset:            0x%0x\r\n", storage.map.config);
   log_expf("    Stat offset:              0x%0x\r\n", storage.map.stat);
+  log_expf("    Risk store offset:        0x%0x\r\n", storage.map.risk_store);
 
   log_expf("    Periodic interval:        %u\r\n", PER_ADV_INTERVAL);
   log_expf("    Min sync adv. interval:   %u\r\n", PER_ADV_MIN_INTERVAL);
@@ -206,6 +242,21 @@ static void beacon_stats_print()
 		  stats.crc_errors, stats.failures);
   stat_show(stats.broadcast_payload_update_duration,
       "[broadcast payload] Update duration", "ms");
+  stat_show(stats.broadcast_throughput,
+      "[broadcast payload] Throughput", "bytes/s");
+  log_expf("periodic adv PHY: %u switches: %u\r\n", per_adv_phy,
+      stats.phy_switches);
+  log_expf("uart frames: %u errors: %u\r\n", stats.uart_frames,
+      stats.uart_frame_errors);
+  stat_show(stats.broadcast_pkt_rate_pi,
+      "[broadcast payload] Pi-driven rate", "pkts/s");
+  stat_show(stats.broadcast_pkt_rate_carousel,
+      "[broadcast payload] Carousel rate", "pkts/s");
+  log_expf("carousel loads: %u chunks copied: %u received: %u\r\n",
+      stats.carousel_loads, stats.carousel_chunks_copied,
+      stats.carousel_chunks_rx);
+  log_expf("eph IDs precomputed: %u computed at epoch change: %u\r\n",
+      stats.ephids_precomputed, stats.ephids_computed);
 }
 
 #endif
@@ -217,6 +268,29 @@ static void _beacon_report_()
     return;
 
   beacon_stats_update();
+#if BEACON_MODE__NETWORK
+  double elapsed_s = ((double) (beacon_time - stats.start) *
+      BEACON_TIMER_RESOLUTION) / 1000;
+
+  // the main loop adds to the counters between any two reads here
+  CORE_DECLARE_IRQ_STATE;
+  CORE_ENTER_ATOMIC();
+  uint32_t broadcast_bytes = stats.broadcast_bytes;
+  uint32_t broadcast_pkts = stats.broadcast_pkts;
+  stats.broadcast_bytes = 0;
+  stats.broadcast_pkts = 0;
+  CORE_EXIT_ATOMIC();
+
+  stat_add(broadcast_bytes / elapsed_s, stats.broadcast_throughput);
+#if BEACON_CAROUSEL
+  if (beacon_carousel_running()) {
+    stat_add(broadcast_pkts / elapsed_s, stats.broadcast_pkt_rate_carousel);
+  } else
+#endif
+  {
+    stat_add(broadcast_pkts / elapsed_s, stats.broadcast_pkt_rate_pi);
+  }
+#endif
   beacon_stats_print();
   beacon_storage_save_stat(&storage, &config, &stats, sizeof(beacon_stats_t));
 //  beacon_stats_reset();
@@ -280,35 +354,99 @@ static void _beacon_encode_()
   _form_payload_();
 }
 
-static void _gen_ephid_()
+/*
+ * absorb the parts of the eph ID hash that do not change with the
+ * epoch, once the config is loaded
+ */
+static void _init_ephid_()
+{
+  sha_256_init(&ephid_midstate, ephid_midstate_digest.bytes);
+  sha_256_write(&ephid_midstate, config.beacon_sk, config.beacon_sk_size);
+  sha_256_write(&ephid_midstate, &config.beacon_location_id,
+      sizeof(beacon_location_id_t));
+#if BEACON_EPHID_RING_SIZE
+  memset(ephid_ring, 0, sizeof(ephid_ring));
+#endif
+  ephid_ready = 1;
+}
+
+static void _compute_ephid_(beacon_epoch_counter_t e, beacon_eph_id_t *id)
 {
   hash_t h;
   digest_t d;
-#define init() sha_256_init(&h, d.bytes)
+#define init() sha_256_copy(&h, &ephid_midstate, d.bytes)
 #define add(data, size) sha_256_write(&h, data, size)
 #define complete() sha_256_close(&h)
 
-  // Initialize hash
+  // Resume after the secret key and location
   init();
   // Add relevant data
-  add(config.beacon_sk, config.beacon_sk_size);
-  add(&config.beacon_location_id, sizeof(beacon_location_id_t));
-  add(&epoch, sizeof(beacon_epoch_counter_t));
+  add(&e, sizeof(beacon_epoch_counter_t));
   // finalize and copy to id
   complete();
-  memcpy(&beacon_eph_id, &d, BEACON_EPH_ID_HASH_LEN); // Little endian so these are the least significant
+  memcpy(id, &d, BEACON_EPH_ID_HASH_LEN); // Little endian so these are the least significant
 #undef complete
 #undef add
 #undef init
 }
 
+static void _gen_ephid_()
+{
+#if BEACON_EPHID_RING_SIZE
+  beacon_ephid_slot_t *slot = &ephid_ring[epoch % BEACON_EPHID_RING_SIZE];
+  if (slot->valid && slot->epoch == epoch) {
+    memcpy(&beacon_eph_id, &slot->id, sizeof(beacon_eph_id_t));
+    stats.ephids_precomputed++;
+    return;
+  }
+#endif
+  _compute_ephid_(epoch, &beacon_eph_id);
+  stats.ephids_computed++;
+}
+
+/*
+ * compute the eph ID of the next epoch missing from the ring, called
+ * from the main loop so that the epoch change in the clock timer
+ * callback only copies an ID.
+ * returns 1 if an ID was computed, 0 if the ring is full
+ */
+int beacon_ephid_precompute()
+{
+#if BEACON_EPHID_RING_SIZE
+  if (!ephid_ready)
+    return 0;
+
+  beacon_epoch_counter_t cur = epoch_i(beacon_time, config.t_init);
+  for (beacon_epoch_counter_t e = cur + 1;
+      e < cur + BEACON_EPHID_RING_SIZE; e++) {
+    beacon_ephid_slot_t *slot = &ephid_ring[e % BEACON_EPHID_RING_SIZE];
+    if (slot->valid && slot->epoch == e)
+      continue;
+
+    beacon_eph_id_t id;
+    memset(&id, 0, sizeof(beacon_eph_id_t));
+    _compute_ephid_(e, &id);
+
+    // the clock callback may read the slot at any point
+    CORE_DECLARE_IRQ_STATE;
+    CORE_ENTER_ATOMIC();
+    slot->epoch = e;
+    memcpy(&slot->id, &id, sizeof(beacon_eph_id_t));
+    slot->valid = 1;
+    CORE_EXIT_ATOMIC();
+    return 1;
+  }
+#endif
+  return 0;
+}
+
 static void beacon_stats_init()
 {
 #ifdef MODE__STAT
   stats.epochs = 1;
   stats.start = beacon_time;
-  beacon_storage_read_stat(&storage, &stats, sizeof(beacon_stats_t));
-  if (!stats.storage_checksum) {
+  if (beacon_storage_read_stat(&storage, &stats, sizeof(beacon_stats_t)) == 0 &&
+      !stats.storage_checksum) {
     log_infof("%s", "Existing Statistics Found\r\n");
     beacon_stats_print();
   } else {
@@ -402,6 +540,27 @@ void beacon_on_clock_update()
   _set_adv_data_();
 }
 
+/*
+ * append the clock to the time journal every BEACON_CLOCK_JOURNAL_INTERVAL
+ * and checkpoint it to NVM3 less often. the checkpoint also precedes the
+ * erase of a full journal page, so a reset right after the erase resumes
+ * from the checkpoint rather than from an older time.
+ */
+static void _beacon_save_clock_()
+{
+  if (config.t_cur - clock_journal_t < BEACON_CLOCK_JOURNAL_INTERVAL)
+    return;
+
+  if (beacon_storage_time_journal_full(&storage) ||
+      config.t_cur - clock_checkpoint_t >= BEACON_CLOCK_CHECKPOINT_INTERVAL) {
+    nvm3_save_clock_cursor(&storage, &config);
+    clock_checkpoint_t = config.t_cur;
+  }
+
+  beacon_storage_time_journal_append(&storage, config.t_cur);
+  clock_journal_t = config.t_cur;
+}
+
 int beacon_clock_increment(beacon_timer_t time)
 {
   beacon_time += time;
@@ -409,11 +568,13 @@ int beacon_clock_increment(beacon_timer_t time)
 
 #if BEACON_MODE__NETWORK == 0
   beacon_on_clock_update();
+#else
+  beacon_per_adv_phy_update();
 #endif
 
   // update beacon time in config and save to flash
   config.t_cur = beacon_time;
-  nvm3_save_clock_cursor(&storage, &config);
+  _beacon_save_clock_();
 //  beacon_storage_save_config(&storage, &config);
 
   // update stats and save to flash
@@ -432,11 +593,14 @@ void beacon_init()
 
   beacon_load();
   beacon_info();
+  _init_ephid_();
 
   epoch = 0;
   cycles = 0;
 
   beacon_time = config.t_cur > config.t_init ? config.t_cur : config.t_init;
+  clock_journal_t = beacon_time;
+  clock_checkpoint_t = beacon_time;
 
   beacon_stats_init();
 
@@ -460,14 +624,15 @@ void beacon_periodic_advertise()
     log_errorf("error creating advertising set, sc: 0x%X", sc);
   }
 
-#if 0
   /*
-   * set PHY config
+   * set PHY config, the primary channel stays on 1M
    */
+  per_adv_phy = PER_ADV_PHY;
   sc = sl_bt_advertiser_set_phy(advertising_set_handle,
-      sl_bt_gap_1m_phy, sl_bt_gap_2m_phy);
-  app_assert_status(sc);
-#endif
+      sl_bt_gap_1m_phy, per_adv_phy);
+  if (sc != 0) {
+    log_errorf("error setting advertiser phy, sc: 0x%X", sc);
+  }
 
   /*
    * set advertising power Level
@@ -491,8 +656,8 @@ void beacon_periodic_advertise()
     log_errorf("Error setting channel map, sc: 0x%X", sc);
   }
 
-  log_expf("=== Starting periodic advertising... Tx power: %d ===\r\n",
-      set_power);
+  log_expf("=== Starting periodic advertising... Tx power: %d PHY: %u ===\r\n",
+      set_power, per_adv_phy);
 
   sc = sl_bt_advertiser_start_periodic_advertising(
       advertising_set_handle, PER_ADV_INTERVAL, PER_ADV_INTERVAL,
@@ -503,6 +668,93 @@ void beacon_periodic_advertise()
   }
 }
 
+/*
+ * restart periodic advertising on a different secondary PHY. the risk
+ * data set on the advertising set is kept, synced dongles lose sync.
+ */
+static void beacon_switch_per_adv_phy(uint8_t phy)
+{
+  sl_status_t sc = 0;
+
+  if (phy == per_adv_phy)
+    return;
+
+  sc = sl_bt_advertiser_stop_periodic_advertising(advertising_set_handle);
+  if (sc != 0) {
+    log_errorf("error stopping periodic adv, sc: 0x%lx\r\n", sc);
+    return;
+  }
+
+  sc = sl_bt_advertiser_set_phy(advertising_set_handle,
+      sl_bt_gap_1m_phy, phy);
+  if (sc != 0) {
+    log_errorf("error setting advertiser phy %u, sc: 0x%lx\r\n", phy, sc);
+    phy = per_adv_phy;
+  }
+
+  sc = sl_bt_advertiser_start_periodic_advertising(
+      advertising_set_handle, PER_ADV_INTERVAL, PER_ADV_INTERVAL,
+      PER_FLAGS);
+  if (sc != 0) {
+    log_errorf("error restarting periodic adv, sc: 0x%lx\r\n", sc);
+  }
+
+  log_expf("[%lu] periodic adv PHY: %u -> %u\r\n", beacon_time,
+      per_adv_phy, phy);
+  per_adv_phy = phy;
+#ifdef MODE__STAT
+  stats.phy_switches++;
+#endif
+}
+
+/*
+ * in 2M mode, fall back to 1M for the last PER_ADV_1M_WINDOW minutes
+ * of every PER_ADV_PHY_CYCLE, so that dongles skipping 2M can download.
+ * called from the clock timer, the switch itself is left to
+ * beacon_per_adv_phy_process().
+ */
+static void beacon_per_adv_phy_update()
+{
+  if (PER_ADV_PHY != sl_bt_gap_2m_phy)
+    return;
+
+  uint8_t phy = ((beacon_time % PER_ADV_PHY_CYCLE) <
+      PER_ADV_PHY_CYCLE - PER_ADV_1M_WINDOW) ?
+    sl_bt_gap_2m_phy : sl_bt_gap_1m_phy;
+  if (phy != per_adv_phy)
+    per_adv_phy_pending = phy;
+}
+
+/*
+ * apply a PHY switch requested by the clock timer. the advertiser calls
+ * must not run in the timer callback, so this is called from the main
+ * loop.
+ */
+void beacon_per_adv_phy_process()
+{
+  uint8_t phy = per_adv_phy_pending;
+  if (phy == 0)
+    return;
+
+  per_adv_phy_pending = 0;
+  beacon_switch_per_adv_phy(phy);
+}
+
+#ifdef MODE__STAT
+/*
+ * the report in the clock timer reads and resets these counters, see
+ * _beacon_report_()
+ */
+static void beacon_count_broadcast(uint32_t bytes, uint32_t pkts)
+{
+  CORE_DECLARE_IRQ_STATE;
+  CORE_ENTER_ATOMIC();
+  stats.broadcast_bytes += bytes;
+  stats.broadcast_pkts += pkts;
+  CORE_EXIT_ATOMIC();
+}
+#endif
+
 /*
  * Update risk data after receive from raspberry pi client
  */
@@ -518,7 +770,46 @@ void set_risk_data(int len, uint8_t *data)
   sc = sl_bt_advertiser_set_data(advertising_set_handle, 8, len, data);
   if (sc != 0) {
     log_infof("[periodic adv] set data err, sc: 0x%lx\r\n", sc);
+    return;
+  }
+
+#ifdef MODE__STAT
+  beacon_count_broadcast(len, 1);
+#endif
+}
+
+/*
+ * Update risk data spanning several chained PDUs, up to
+ * PER_ADV_CHAIN_SIZE bytes. the data is staged in the system buffer
+ * one PER_ADV_SIZE slot at a time.
+ */
+void set_risk_data_chained(int len, uint8_t *data)
+{
+  sl_status_t sc = 0;
+
+  if (len > PER_ADV_CHAIN_SIZE)
+    return;
+
+  for (int off = 0; off < len; off += PER_ADV_SIZE) {
+    int wlen = (len - off > PER_ADV_SIZE) ? PER_ADV_SIZE : (len - off);
+    sc = sl_bt_system_data_buffer_write(wlen, data + off);
+    if (sc != 0) {
+      log_infof("[periodic adv] buffer write err, off: %d sc: 0x%lx\r\n",
+          off, sc);
+      sl_bt_system_data_buffer_clear();
+      return;
+    }
   }
+
+  sc = sl_bt_advertiser_set_long_data(advertising_set_handle, 8);
+  if (sc != 0) {
+    log_infof("[periodic adv] set long data err, sc: 0x%lx\r\n", sc);
+    return;
+  }
+
+#ifdef MODE__STAT
+  beacon_count_broadcast(len, ((len - 1) / PER_ADV_SIZE) + 1);
+#endif
 }
 
 #undef MODE__STAT
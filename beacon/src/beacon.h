@@ -27,6 +27,51 @@
  */
 #define BEACON_MODE__NETWORK    1
 
+/*
+ * config to pack PER_ADV_CHAIN_LEN risk packets into each periodic
+ * adv. event using chained extended advertising PDUs. with framed UART,
+ * the pi client sends a whole train per edge, and UART_PKTS_PER_EDGE
+ * must be PER_ADV_CHAIN_LEN.
+ *
+ * the UART still bounds what the pi client can feed: 115200 baud with
+ * 8E1 framing is about 10.4 kB/s, some 40 framed packets per second,
+ * against 80 periodic adv. events per second at PER_ADV_INTERVAL. trains
+ * only raise the broadcast rate once packets come from the risk store,
+ * see BEACON_CAROUSEL.
+ * 1 - chained periodic advertising
+ * 0 - one risk packet per periodic adv. event
+ */
+#define BEACON_PER_ADV_CHAINED  0
+
+/*
+ * risk packets from the pi client arrive as COBS frames with a CRC,
+ * see common/src/util/frame.h. must match UART_FRAMED on the pi client.
+ * 1 - framed packets
+ * 0 - raw PER_ADV_SIZE byte packets
+ */
+#define BEACON_UART_FRAMED      1
+
+/*
+ * config to run the risk carousel on the beacon. the payload is read
+ * once from the pi client into the flash risk store (see storage.h),
+ * then replayed with one update per periodic adv. event, so the
+ * broadcast rate is no longer bound by the UART. new payloads are built
+ * in a second bank, with only the changed chunks sent over UART. needs
+ * framed UART, and UART_DELTA on the pi client.
+ *
+ * off by default, a bank only holds RISK_STORE_MAX_CHUNKS chunks, far
+ * from a full payload, and larger payloads fall back to the pi client.
+ * the spare bank is erased a page per event, each erase stalls the CPU
+ * for the page erase time, see spare_erase_step() in app.c.
+ * 1 - beacon runs the carousel from the risk store
+ * 0 - pi client paces every packet
+ */
+#define BEACON_CAROUSEL         0
+
+#if BEACON_CAROUSEL && !BEACON_UART_FRAMED
+#error "BEACON_CAROUSEL needs BEACON_UART_FRAMED"
+#endif
+
 // #define BEACON_GAEN_ENABLED
 
 #include "common/src/constants.h"
@@ -42,9 +87,9 @@ typedef struct
   beacon_timer_t t_init;                   // Beacon initial clock
   beacon_timer_t t_cur;                    // Beacon current clock
   key_size_t backend_pk_size;              // Size of backend public key
-  pubkey_t *backend_pk;                     // Backend public key
+  const pubkey_t *backend_pk;              // Backend public key, in flash
   key_size_t beacon_sk_size;               // Size of secret key
-  beacon_sk_t *beacon_sk;                   // Secret Key
+  const beacon_sk_t *beacon_sk;            // Secret Key, in flash
 } beacon_config_t;
 
 /*
@@ -73,6 +118,42 @@ typedef struct
 #define PER_ADV_INTERVAL 10    // per. adv. interval (units of 1.25ms)
 #define PER_FLAGS 0            // no periodic advertising flags
 #define PER_TX_POWER GLOBAL_TX_POWER
+/*
+ * secondary PHY of the periodic risk train, set at build time. the beacon
+ * does not see the dongles' losses, so its 1M fallback is a fixed window.
+ * sl_bt_gap_2m_phy - 2M, with a 1M window of PER_ADV_1M_WINDOW minutes
+ *   every PER_ADV_PHY_CYCLE minutes for dongles that cannot sync on 2M
+ * sl_bt_gap_1m_phy - 1M only
+ */
+#define PER_ADV_PHY sl_bt_gap_1m_phy
+#define PER_ADV_PHY_CYCLE 60
+#define PER_ADV_1M_WINDOW 10
+
+/*
+ * risk carousel run by the beacon, see BEACON_CAROUSEL
+ * packets and chunks are repeated as in the PERIODIC_TEST carousel,
+ * the pi client is polled for a new payload version every
+ * BEACON_CAROUSEL_CHECK_INTERVAL minutes
+ */
+#define BEACON_CAROUSEL_PKT_REPLICATION 1
+#define BEACON_CAROUSEL_CHUNK_REPLICATION 1
+#define BEACON_CAROUSEL_CHECK_INTERVAL 60
+
+/*
+ * number of eph IDs kept precomputed for the coming epochs. the main
+ * loop fills the ring, so the epoch change only copies an ID.
+ * 0 - compute the eph ID at the epoch change
+ */
+#define BEACON_EPHID_RING_SIZE 4
+
+/*
+ * clock persistence. the clock cursor is appended to the time journal
+ * every BEACON_CLOCK_JOURNAL_INTERVAL minutes, and checkpointed to NVM3
+ * every BEACON_CLOCK_CHECKPOINT_INTERVAL minutes and before the journal
+ * page is erased. at boot the clock resumes from the later of the two.
+ */
+#define BEACON_CLOCK_JOURNAL_INTERVAL 1
+#define BEACON_CLOCK_CHECKPOINT_INTERVAL (24 * 60)
 
 /* Timers */
 #define LED_TIMER_MS 2000 // one second in ms, used for timer
@@ -125,6 +206,42 @@ typedef struct
   uint32_t crc_errors;
   uint32_t failures;
   stat_t broadcast_payload_update_duration;
+  /*
+   * risk data bytes handed to the advertiser since the last report
+   */
+  uint32_t broadcast_bytes;
+  stat_t broadcast_throughput;
+  /*
+   * number of periodic adv. restarts to switch the secondary PHY
+   */
+  uint32_t phy_switches;
+  /*
+   * risk data frames received from the pi client, and frames dropped
+   * for a bad length or CRC
+   */
+  uint32_t uart_frames;
+  uint32_t uart_frame_errors;
+  /*
+   * risk packets handed to the advertiser since the last report, and
+   * the resulting packets per second, for the pi-driven and carousel
+   * modes separately
+   */
+  uint32_t broadcast_pkts;
+  stat_t broadcast_pkt_rate_pi;
+  stat_t broadcast_pkt_rate_carousel;
+  /*
+   * number of payload generations completed in the risk store, and
+   * chunks copied from the previous generation or received over UART
+   */
+  uint32_t carousel_loads;
+  uint32_t carousel_chunks_copied;
+  uint32_t carousel_chunks_rx;
+  /*
+   * eph IDs taken from the precomputed ring, and computed in the
+   * clock callback at the epoch change
+   */
+  uint32_t ephids_precomputed;
+  uint32_t ephids_computed;
 } beacon_stats_t;
 
 extern beacon_stats_t stats;
@@ -136,6 +253,9 @@ void beacon_on_clock_update(void);
 int beacon_clock_increment(beacon_timer_t time);
 sl_status_t beacon_legacy_advertise();
 void beacon_periodic_advertise();
+void beacon_per_adv_phy_process();
 void set_risk_data(int len, uint8_t *data);
+void set_risk_data_chained(int len, uint8_t *data);
+int beacon_ephid_precompute();
 
 #endif
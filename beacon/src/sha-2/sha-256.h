@@ -49,6 +49,25 @@ struct Sha_256 {
  */
 void calc_sha_256(uint8_t hash[SIZE_OF_SHA_256_HASH], const void *input, size_t len);
 
+#ifdef SHA_256_CORE_SELECT
+/*
+ * @brief Compression functions, for testing and benchmarking them against each other.
+ *
+ * SHA_256_CORE_BYTEWISE is the original byte-oriented implementation, SHA_256_CORE_UNROLLED the portable default and
+ * SHA_256_CORE_SHA_NI uses the x86 SHA extensions, which are otherwise picked automatically when the CPU has them.
+ */
+enum sha_256_core { SHA_256_CORE_BYTEWISE, SHA_256_CORE_UNROLLED, SHA_256_CORE_SHA_NI };
+
+/*
+ * @brief Select the compression function for all following calculations.
+ * @param core The compression function.
+ * @return 0 on success, -1 if the core is not available on this machine.
+ *
+ * @note Only built with SHA_256_CORE_SELECT defined, as in the Makefile.
+ */
+int sha_256_select_core(enum sha_256_core core);
+#endif
+
 /*
  * @brief Initialize a SHA-256 streaming calculation.
  * @param sha_256 A pointer to a SHA-256 structure.
@@ -96,6 +115,22 @@ void sha_256_write(struct Sha_256 *sha_256, const void *data, size_t len);
  */
 uint8_t *sha_256_close(struct Sha_256 *sha_256);
 
+/*
+ * @brief Resume a SHA-256 streaming calculation from a saved state.
+ * @param dst A pointer to the SHA-256 structure to continue the calculation in.
+ * @param src A pointer to a SHA-256 structure that has been initialized and possibly written to, but not closed. It is
+ * left unchanged.
+ * @param hash Hash array, where the result of dst will be delivered.
+ *
+ * @note This is useful when many messages share a common prefix: stream the prefix once into src, then copy src for
+ * every message and only stream the rest. The result is the same as hashing each message from scratch.
+ *
+ * @note Plain assignment of the structure is not enough, as it holds a pointer into its own chunk buffer.
+ *
+ * @note If any of the passed pointers is NULL, the results are unpredictable.
+ */
+void sha_256_copy(struct Sha_256 *dst, const struct Sha_256 *src, uint8_t hash[SIZE_OF_SHA_256_HASH]);
+
 #ifdef __cplusplus
 }
 #endif
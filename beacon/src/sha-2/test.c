@@ -150,6 +150,46 @@ static void calc_sha_256_in_chunks(uint8_t hash[SIZE_OF_SHA_256_HASH], const voi
 }
 #endif
 
+/*
+ * Resume from a copy of the state after a common prefix, as done for eph IDs, and check that both the copy and the saved
+ * state give the same hash as a calculation from scratch.
+ */
+static int copy_test(void)
+{
+	static const size_t prefix_lens[] = {0, 1, 24, 55, 56, 63, 64, 65, 127, 128, 200, 2048};
+	static const size_t suffix_lens[] = {0, 1, 12, 64, 100};
+	static uint8_t msg[2048 + 100];
+	struct Sha_256 prefix, sha_256;
+	uint8_t prefix_hash[32], hash[32], expected[32];
+	size_t i, j, k;
+
+	for (i = 0; i < sizeof msg; i++)
+		msg[i] = (uint8_t)(i * 31 + (i >> 8));
+
+	for (i = 0; i < sizeof prefix_lens / sizeof prefix_lens[0]; i++) {
+		const size_t prefix_len = prefix_lens[i];
+		sha_256_init(&prefix, prefix_hash);
+		sha_256_write(&prefix, msg, prefix_len);
+		for (j = 0; j < sizeof suffix_lens / sizeof suffix_lens[0]; j++) {
+			const size_t len = prefix_len + suffix_lens[j];
+			calc_sha_256(expected, msg, len);
+			/* twice, the saved state must not change */
+			for (k = 0; k < 2; k++) {
+				sha_256_copy(&sha_256, &prefix, hash);
+				sha_256_write(&sha_256, msg + prefix_len, suffix_lens[j]);
+				(void)sha_256_close(&sha_256);
+				if (memcmp(hash, expected, sizeof hash)) {
+					printf("copy after %lu bytes, length %lu: FAILURE!\n\n", (unsigned long)prefix_len,
+					       (unsigned long)len);
+					return 1;
+				}
+			}
+		}
+	}
+	printf("copy of a saved state: SUCCESS!\n\n");
+	return 0;
+}
+
 /*
  * Limitation:
  * - The variable input_len will be truncated to its LONG_BIT least significant bits in the print output. This will
@@ -188,11 +228,7 @@ static int test(const uint8_t *input, size_t input_len, const char output[])
 	}
 }
 
-#ifdef MAIN
-int main(void)
-#else
-int sha_2_main(void)
-#endif
+static int run_tests(void)
 {
 	size_t i;
 	for (i = 0; i < (sizeof STRING_VECTORS / sizeof(struct string_vector)); i++) {
@@ -213,6 +249,8 @@ int sha_2_main(void)
 		}
 	}
 	destruct_binary_messages();
+	if (copy_test())
+		return 1;
 #if CALC_IN_CHUNKS
 	/* Test some silly corner cases. Only empty chunks and no chunk at all. */
 	assert(strlen(STRING_VECTORS[0].input) == 0);
@@ -225,3 +263,28 @@ int sha_2_main(void)
 #endif
 	return 0;
 }
+
+#ifdef MAIN
+int main(void)
+#else
+int sha_2_main(void)
+#endif
+{
+#ifdef SHA_256_CORE_SELECT
+	/* All vectors for every compression function this machine has. */
+	static const char *const core_names[] = {"bytewise", "unrolled", "SHA-NI"};
+	int core;
+	for (core = SHA_256_CORE_BYTEWISE; core <= SHA_256_CORE_SHA_NI; core++) {
+		if (sha_256_select_core((enum sha_256_core)core)) {
+			printf("=== core %s: not available ===\n\n", core_names[core]);
+			continue;
+		}
+		printf("=== core %s ===\n\n", core_names[core]);
+		if (run_tests())
+			return 1;
+	}
+	return 0;
+#else
+	return run_tests();
+#endif
+}
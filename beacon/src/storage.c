@@ -2,9 +2,12 @@
 
 #include "storage.h"
 
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common/src/platform/gecko.h"
+#include "common/src/util/crc32.h"
 #include "common/src/util/log.h"
 #include "common/src/util/util.h"
 
@@ -40,7 +43,7 @@ int _flash_read_(__attribute__((unused)) beacon_storage *sto, storage_addr_t off
 }
 
 int _flash_write_(__attribute__((unused)) beacon_storage *sto, storage_addr_t off,
-    void *data, size_t size)
+    const void *data, size_t size)
 {
   log_debugf("size: %d bytes, addr: 0x%x, flash off: 0x%0x\r\n",
       size, off, sto->map.config);
@@ -70,6 +73,9 @@ void beacon_storage_init(beacon_storage *sto)
   beacon_storage_init_device(sto);
   beacon_storage_get_info(sto);
   sto->map.config = FLASH_OFFSET;
+  sto->map.risk_store = RISK_STORE_OFFSET;
+  sto->map.time_journal = TIME_JOURNAL_OFFSET;
+  sto->time_journal_next = 0;
   if (FLASH_OFFSET % sto->page_size != 0) {
     log_errorf("storage start addr %u is not page (%u) aligned!\r\n",
         FLASH_OFFSET, sto->page_size);
@@ -77,6 +83,68 @@ void beacon_storage_init(beacon_storage *sto)
 //  sto->map.stat = sto->total_size - (3*sto->page_size);
 }
 
+/*
+ * read-only view of size bytes of the config at off, flash being memory
+ * mapped. NULL if the range is not within the config page.
+ */
+static const void *_config_view_(beacon_storage *sto, storage_addr_t off,
+    size_t size)
+{
+  if (off < sto->map.config ||
+      off + size > sto->map.config + sto->page_size) {
+    log_errorf("config view 0x%x (%u B) outside config page 0x%x\r\n",
+        off, size, sto->map.config);
+    return NULL;
+  }
+  return (const void *) off;
+}
+
+static int _in_config_page_(beacon_storage *sto, const void *p)
+{
+  return (storage_addr_t) p >= sto->map.config &&
+    (storage_addr_t) p < sto->map.config + sto->page_size;
+}
+
+#define stat_journal_slot_addr(sto, idx) \
+  ((sto)->map.stat + sizeof(beacon_timer_t) + \
+   ((idx) * STAT_JOURNAL_SLOT_SIZE))
+
+static uint32_t _stat_journal_crc_(const stat_journal_hdr_t *hdr,
+    const void *stat)
+{
+  uint32_t crc = crc32_update(CRC32_INIT, (const uint8_t *) hdr,
+      offsetof(stat_journal_hdr_t, crc));
+  crc = crc32_update(crc, (const uint8_t *) stat, hdr->len);
+  return crc32_final(crc);
+}
+
+/*
+ * find the latest valid snapshot and the next free slot. slots are used
+ * in order, a torn one is skipped as it cannot be reused until erased.
+ */
+static const stat_journal_hdr_t *_stat_journal_scan_(beacon_storage *sto)
+{
+  const stat_journal_hdr_t *hdr, *latest = NULL;
+  uint32_t i;
+
+  for (i = 0; i < STAT_JOURNAL_NUM_SLOTS; i++) {
+    hdr = (const stat_journal_hdr_t *) stat_journal_slot_addr(sto, i);
+    if (hdr->seq == 0xffffffff)
+      break;
+    if (hdr->len <= sizeof(beacon_stats_t) &&
+        hdr->crc == _stat_journal_crc_(hdr, hdr + 1) &&
+        (!latest || hdr->seq > latest->seq)) {
+      latest = hdr;
+    }
+  }
+  sto->stat_journal_next = i;
+  sto->stat_journal_seq = latest ? latest->seq : 0;
+
+  log_debugf("stat journal: %u slots used, seq: %u\r\n", i,
+      sto->stat_journal_seq);
+  return latest;
+}
+
 // Read data from flashed storage
 // Format matches the fixed structure which is also used as a protocol when appending non-app
 // data to the device image.
@@ -96,10 +164,14 @@ void beacon_storage_load_config(beacon_storage *sto, beacon_config_t *cfg)
     cfg->backend_pk_size = PK_MAX_SIZE;
   }
 
-  read(cfg->backend_pk_size, cfg->backend_pk);
-  hexdumpn(cfg->backend_pk->bytes, 16, "   Server PK");
-  // slide through the extra space for a pubkey
-  off += PK_MAX_SIZE - cfg->backend_pk_size;
+  // keys are not copied to RAM, the config points at them in flash
+  cfg->backend_pk = _config_view_(sto, off, sizeof(pubkey_t));
+  if (!cfg->backend_pk)
+    cfg->backend_pk_size = 0;
+  else {
+    hexdumpn(cfg->backend_pk->bytes, 16, "   Server PK");
+  }
+  off += PK_MAX_SIZE;
 
   read(sizeof(key_size_t), &cfg->beacon_sk_size);
   log_debugf("beacon key off: 0x%0x, size: %u\r\n", off, cfg->beacon_sk_size);
@@ -108,10 +180,13 @@ void beacon_storage_load_config(beacon_storage *sto, beacon_config_t *cfg)
         cfg->beacon_sk_size, SK_MAX_SIZE);
     cfg->beacon_sk_size = SK_MAX_SIZE;
   }
-  read(cfg->beacon_sk_size, cfg->beacon_sk);
-  hexdumpn(cfg->beacon_sk->bytes, 16, "Si Beacon SK");
-  // slide through the extra space for a pubkey
-  off += SK_MAX_SIZE - cfg->beacon_sk_size;
+  cfg->beacon_sk = _config_view_(sto, off, sizeof(beacon_sk_t));
+  if (!cfg->beacon_sk)
+    cfg->beacon_sk_size = 0;
+  else {
+    hexdumpn(cfg->beacon_sk->bytes, 16, "Si Beacon SK");
+  }
+  off += SK_MAX_SIZE;
 
   read(sizeof(test_filter_size_t), &sto->test_filter_size);
 
@@ -134,6 +209,12 @@ void beacon_storage_load_config(beacon_storage *sto, beacon_config_t *cfg)
   off = sto->map.stat;
   read(sizeof(beacon_timer_t), &cfg->t_cur);
 #undef read
+  _stat_journal_scan_(sto);
+
+  if (sto->map.stat + sto->page_size > sto->map.risk_store) {
+    log_errorf("stat page 0x%x overlaps risk store 0x%x\r\n",
+        sto->map.stat, sto->map.risk_store);
+  }
 }
 
 void beacon_storage_save_config(beacon_storage *sto, beacon_config_t *cfg)
@@ -143,6 +224,31 @@ void beacon_storage_save_config(beacon_storage *sto, beacon_config_t *cfg)
     sizeof(pubkey_t) + sizeof(beacon_sk_t) +
     sizeof(test_filter_size_t);
 
+  storage_addr_t pk_off, sk_off;
+  uint8_t *keys = NULL;
+
+  /*
+   * the keys are usually views of this page, copy them out before it is
+   * erased and view the rewritten ones after. a key that could not be
+   * viewed is NULL and written as zeros.
+   */
+  if (!cfg->backend_pk || !cfg->beacon_sk ||
+      _in_config_page_(sto, cfg->backend_pk) ||
+      _in_config_page_(sto, cfg->beacon_sk)) {
+    keys = malloc(sizeof(pubkey_t) + sizeof(beacon_sk_t));
+    if (!keys) {
+      log_errorf("%s", "no memory to copy the keys, config not saved\r\n");
+      return;
+    }
+    memset(keys, 0, sizeof(pubkey_t) + sizeof(beacon_sk_t));
+    if (cfg->backend_pk)
+      memcpy(keys, cfg->backend_pk, cfg->backend_pk_size);
+    if (cfg->beacon_sk)
+      memcpy(keys + sizeof(pubkey_t), cfg->beacon_sk, cfg->beacon_sk_size);
+    cfg->backend_pk = (const pubkey_t *) keys;
+    cfg->beacon_sk = (const beacon_sk_t *) (keys + sizeof(pubkey_t));
+  }
+
   // erase from the beginning of config page
   pre_erase(sto, off, total_size);
 
@@ -159,14 +265,21 @@ void beacon_storage_save_config(beacon_storage *sto, beacon_config_t *cfg)
   write(&cfg->beacon_location_id, sizeof(beacon_location_id_t));
   write(&cfg->t_init, sizeof(beacon_timer_t));
   write(&cfg->backend_pk_size, sizeof(key_size_t));
+  pk_off = off;
   write(cfg->backend_pk, cfg->backend_pk_size);
   off += PK_MAX_SIZE - cfg->backend_pk_size;
   write(&cfg->beacon_sk_size, sizeof(key_size_t));
+  sk_off = off;
   write(cfg->beacon_sk, cfg->beacon_sk_size);
   off += SK_MAX_SIZE - cfg->beacon_sk_size;
 
   // write test filter len
   write(&sto->test_filter_size, sizeof(test_filter_size_t));
+#undef write
+
+  cfg->backend_pk = _config_view_(sto, pk_off, sizeof(pubkey_t));
+  cfg->beacon_sk = _config_view_(sto, sk_off, sizeof(beacon_sk_t));
+  free(keys);
 
 }
 
@@ -174,21 +287,182 @@ void beacon_storage_save_config(beacon_storage *sto, beacon_config_t *cfg)
 void beacon_storage_save_stat(beacon_storage *sto, beacon_config_t *cfg,
     void *stat, size_t len)
 {
-  beacon_storage_erase(sto, sto->map.stat);
-  storage_addr_t off = sto->map.stat;
-  _flash_write_(sto, off, &cfg->t_cur, sizeof(beacon_timer_t));
-  off += sizeof(beacon_timer_t);
-  _flash_write_(sto, off, stat, len);
+  stat_journal_hdr_t hdr;
+  beacon_timer_t t_mark;
+
+  if (len > sizeof(beacon_stats_t)) {
+    log_errorf("stat snapshot too large (%u > %u)\r\n", len,
+        sizeof(beacon_stats_t));
+    return;
+  }
+
+  // a flashed beacon keeps a zero clock mark until its first snapshot
+  _flash_read_(sto, sto->map.stat, &t_mark, sizeof(beacon_timer_t));
+  if (t_mark == 0 || sto->stat_journal_next >= STAT_JOURNAL_NUM_SLOTS) {
+    beacon_storage_reset_stat(sto);
+    t_mark = 0xffffffff;
+  }
+  if (t_mark == 0xffffffff) {
+    _flash_write_(sto, sto->map.stat, &cfg->t_cur, sizeof(beacon_timer_t));
+  }
+
+  hdr.seq = ++sto->stat_journal_seq;
+  hdr.t_cur = cfg->t_cur;
+  hdr.len = len;
+  hdr.crc = _stat_journal_crc_(&hdr, stat);
+
+  // header first, so that a torn slot is not taken for a free one
+  storage_addr_t off = stat_journal_slot_addr(sto, sto->stat_journal_next);
+  _flash_write_(sto, off, &hdr, sizeof(stat_journal_hdr_t));
+  _flash_write_(sto, off + sizeof(stat_journal_hdr_t), stat, len);
+  sto->stat_journal_next++;
 }
 
-void beacon_storage_read_stat(beacon_storage *sto, void *stat, size_t len)
+int beacon_storage_read_stat(beacon_storage *sto, void *stat, size_t len)
 {
-  _flash_read_(sto, sto->map.stat, stat, len);
+  const stat_journal_hdr_t *latest = _stat_journal_scan_(sto);
+  if (!latest)
+    return -1;
+
+  // snapshots of an older, shorter stats struct leave new fields zero
+  memset(stat, 0, len);
+  memcpy(stat, latest + 1, latest->len < len ? latest->len : len);
+  return 0;
+}
+
+void beacon_storage_reset_stat(beacon_storage *sto)
+{
+  beacon_storage_erase(sto, sto->map.stat);
+  sto->stat_journal_next = 0;
 }
 
+#undef stat_journal_slot_addr
+
 void beacon_storage_read_test_filter(beacon_storage *sto, uint8_t *buf)
 {
   _flash_read_(sto, sto->map.test_filter, buf, sto->test_filter_size);
 }
 
+#define time_journal_rec_addr(sto, idx) \
+  ((sto)->map.time_journal + ((idx) * sizeof(time_journal_rec_t)))
+
+int beacon_storage_time_journal_load(beacon_storage *sto,
+    beacon_timer_t *t_cur)
+{
+  const time_journal_rec_t *rec;
+  int found = -1;
+  uint32_t i;
+
+  for (i = 0; i < TIME_JOURNAL_NUM_RECS; i++) {
+    rec = (const time_journal_rec_t *) time_journal_rec_addr(sto, i);
+    if (rec->t_cur == 0xffffffff && rec->check == 0xffffffff)
+      break;
+    // a torn record is skipped, its slot cannot be reused until erased
+    if (rec->check == ~rec->t_cur && (found < 0 || rec->t_cur > *t_cur)) {
+      *t_cur = rec->t_cur;
+      found = 0;
+    }
+  }
+  sto->time_journal_next = i;
+
+  log_expf("time journal: %u records, t_cur: %u\r\n", i,
+      found ? 0 : *t_cur);
+  return found;
+}
+
+int beacon_storage_time_journal_full(beacon_storage *sto)
+{
+  return sto->time_journal_next >= TIME_JOURNAL_NUM_RECS;
+}
+
+void beacon_storage_time_journal_append(beacon_storage *sto,
+    beacon_timer_t t_cur)
+{
+  time_journal_rec_t rec = { .t_cur = t_cur, .check = ~t_cur };
+
+  if (beacon_storage_time_journal_full(sto))
+    beacon_storage_time_journal_reset(sto);
+
+  _flash_write_(sto, time_journal_rec_addr(sto, sto->time_journal_next),
+      &rec, sizeof(time_journal_rec_t));
+  sto->time_journal_next++;
+}
+
+void beacon_storage_time_journal_reset(beacon_storage *sto)
+{
+  beacon_storage_erase(sto, sto->map.time_journal);
+  sto->time_journal_next = 0;
+}
+
+#undef time_journal_rec_addr
+
+#define risk_store_slot_addr(sto, bank, idx) \
+  ((sto)->map.risk_store + \
+   ((((bank) * RISK_STORE_BANK_PAGES) + \
+     ((idx) / RISK_STORE_SLOTS_PER_PAGE)) * (sto)->page_size) + \
+   (((idx) % RISK_STORE_SLOTS_PER_PAGE) * RISK_STORE_SLOT_SIZE))
+
+void beacon_storage_risk_store_erase(beacon_storage *sto, int bank,
+    uint32_t page)
+{
+  beacon_storage_erase(sto, risk_store_slot_addr(sto, bank,
+        page * RISK_STORE_SLOTS_PER_PAGE));
+}
+
+// 1 if the page is still erased, and need not be erased again
+int beacon_storage_risk_store_page_blank(beacon_storage *sto, int bank,
+    uint32_t page)
+{
+  const uint32_t *word = (const uint32_t *) risk_store_slot_addr(sto, bank,
+      page * RISK_STORE_SLOTS_PER_PAGE);
+
+  for (uint32_t i = 0; i < sto->page_size / sizeof(uint32_t); i++) {
+    if (word[i] != 0xffffffff)
+      return 0;
+  }
+  return 1;
+}
+
+// packet idx goes in slot idx+1, after the header
+int beacon_storage_risk_store_append(beacon_storage *sto, int bank,
+    uint32_t idx, const uint8_t *data, uint16_t len)
+{
+  uint32_t slot = idx + 1;
+  if (idx >= RISK_STORE_MAX_PKTS || len > PER_ADV_SIZE)
+    return -1;
+
+  storage_addr_t off = risk_store_slot_addr(sto, bank, slot);
+  risk_store_slot_t pkt;
+  memset(&pkt, 0, sizeof(risk_store_slot_t));
+  pkt.len = len;
+  memcpy(pkt.data, data, len);
+  return _flash_write_(sto, off, &pkt, sizeof(risk_store_slot_t));
+}
+
+void beacon_storage_risk_store_save_hdr(beacon_storage *sto, int bank,
+    risk_store_hdr_t *hdr)
+{
+  _flash_write_(sto, risk_store_slot_addr(sto, bank, 0), hdr,
+      sizeof(risk_store_hdr_t));
+}
+
+int beacon_storage_risk_store_read_hdr(beacon_storage *sto, int bank,
+    risk_store_hdr_t *hdr)
+{
+  _flash_read_(sto, risk_store_slot_addr(sto, bank, 0), hdr,
+      sizeof(risk_store_hdr_t));
+  if (hdr->magic != RISK_STORE_MAGIC || hdr->num_pkts == 0 ||
+      hdr->num_pkts > RISK_STORE_MAX_PKTS)
+    return -1;
+
+  return 0;
+}
+
+const risk_store_slot_t *beacon_storage_risk_store_pkt(beacon_storage *sto,
+    int bank, uint32_t idx)
+{
+  return (const risk_store_slot_t *) risk_store_slot_addr(sto, bank, idx + 1);
+}
+
+#undef risk_store_slot_addr
 #undef next_multiple
@@ -9,6 +9,7 @@
 
 #include "beacon.h"
 #include "common/src/test.h"
+#include "common/src/platform/gecko.h"
 
 #include <stddef.h>
 
@@ -20,11 +21,101 @@
 #include "em_msc.h"
 typedef uint32_t storage_addr_t;
 
+/*
+ * risk payload store for the carousel run by the beacon itself, see
+ * BEACON_CAROUSEL. placed after the config and stat pages, below the
+ * NVM3 instance at the end of flash. the store has two banks, so that
+ * the next payload generation is built while the current one is played.
+ * packets are kept in fixed slots that do not cross a page, slot 0 of
+ * each bank holds its header.
+ */
+#define RISK_STORE_OFFSET 0x64000
+#define RISK_STORE_NUM_BANKS 2
+#define RISK_STORE_BANK_PAGES 4
+#define RISK_STORE_SLOT_SIZE 252 // packet length + PER_ADV_SIZE, word aligned
+#define RISK_STORE_SLOTS_PER_PAGE (FLASH_DEVICE_PAGE_SIZE / RISK_STORE_SLOT_SIZE)
+#define RISK_STORE_MAX_PKTS \
+  ((RISK_STORE_BANK_PAGES * RISK_STORE_SLOTS_PER_PAGE) - 1)
+#define RISK_STORE_PKT_PAGE(idx) (((idx) + 1) / RISK_STORE_SLOTS_PER_PAGE)
+
+/*
+ * a bank holds RISK_STORE_MAX_PKTS packets, 127 with 8 kB pages. a chunk
+ * of CF_SIZE_BYTES takes RISK_STORE_CHUNK_PKTS of them (8 data and 2
+ * parity packets), so a bank fits RISK_STORE_MAX_CHUNKS = 12 chunks, far
+ * fewer than MAX_NUM_CHUNKS. even without the parity packets, a bank
+ * would only fit 15 chunks. the banks cannot grow, the 512 kB flash
+ * only has the time journal page left between the store and NVM3. a
+ * payload that does not fit is paced by the pi client, see update_begin().
+ */
+#define RISK_STORE_CHUNK_PKTS \
+  (MAX_NUM_PACKETS_PER_FILTER + MAX_NUM_FEC_PACKETS_PER_FILTER)
+#define RISK_STORE_MANIFEST_PKTS \
+  (MAX_NUM_PACKETS_PER_MANIFEST + \
+   (((MAX_NUM_PACKETS_PER_MANIFEST-1) / RISK_FEC_GROUP_SIZE) + 1))
+#define RISK_STORE_MAX_CHUNKS (RISK_STORE_MAX_PKTS / RISK_STORE_CHUNK_PKTS)
+#define RISK_STORE_MAGIC 0x52534b32 // "RSK2"
+
+typedef struct
+{
+  uint16_t len;
+  uint8_t data[PER_ADV_SIZE];
+} risk_store_slot_t;
+
+/*
+ * written last, once every packet of the generation is in the bank.
+ * the valid bank with the highest generation is the current payload.
+ */
+typedef struct
+{
+  uint32_t magic;
+  uint32_t payload_ver;
+  uint32_t num_pkts;
+  uint32_t generation;
+} risk_store_hdr_t;
+
+/*
+ * time journal, an append-only log of the clock cursor in the page after
+ * the risk store. records are appended in order and the page is only
+ * erased once it is full, the last valid record is the saved clock.
+ */
+#define TIME_JOURNAL_OFFSET (RISK_STORE_OFFSET + \
+    (RISK_STORE_NUM_BANKS * RISK_STORE_BANK_PAGES * FLASH_DEVICE_PAGE_SIZE))
+#define TIME_JOURNAL_NUM_RECS \
+  (FLASH_DEVICE_PAGE_SIZE / sizeof(time_journal_rec_t))
+
+typedef struct
+{
+  beacon_timer_t t_cur;
+  uint32_t check; // ~t_cur, tells a written record from an erased or torn one
+} time_journal_rec_t;
+
+/*
+ * the stat page starts with the clock at its last erase, which tells a
+ * freshly flashed beacon (zero) apart, followed by a journal of stats
+ * snapshots in fixed slots. snapshots are appended and the page is only
+ * erased once every slot is used. the valid snapshot with the highest
+ * sequence number is the current one.
+ */
+typedef struct
+{
+  uint32_t seq;
+  beacon_timer_t t_cur;
+  uint32_t len;
+  uint32_t crc; // crc32 of the fields above and the snapshot
+} stat_journal_hdr_t;
+
+#define STAT_JOURNAL_SLOT_SIZE \
+  ((sizeof(stat_journal_hdr_t) + sizeof(beacon_stats_t) + 3) & ~3)
+#define STAT_JOURNAL_NUM_SLOTS \
+  ((FLASH_DEVICE_PAGE_SIZE - sizeof(beacon_timer_t)) / STAT_JOURNAL_SLOT_SIZE)
+
 typedef struct
 {
   storage_addr_t config;  // address of device configuration
   storage_addr_t test_filter; // test cuckoo filter
   storage_addr_t stat;    // address of saved statistics
+  storage_addr_t risk_store; // stored risk payload
+  storage_addr_t time_journal; // clock cursor log
 } _beacon_storage_map_;
 
 typedef struct
@@ -37,6 +128,9 @@ typedef struct
   _beacon_storage_map_ map;
   uint64_t numErasures;
   test_filter_size_t test_filter_size;
+  uint32_t time_journal_next; // index of the next free journal record
+  uint32_t stat_journal_next; // index of the next free stats slot
+  uint32_t stat_journal_seq;  // sequence number of the last snapshot
 } beacon_storage;
 
 // STORAGE INIT
@@ -52,9 +146,44 @@ void beacon_storage_init(beacon_storage *sto);
 void beacon_storage_load_config(beacon_storage *sto, beacon_config_t *cfg);
 void beacon_storage_save_config(beacon_storage *sto, beacon_config_t *cfg);
 
+// STATS
+// *save_stat* appends a snapshot to the stats journal, *read_stat* loads
+// the latest valid one and returns -1 if there is none. *reset_stat*
+// erases the page, dropping the snapshots and the saved clock.
 void beacon_storage_save_stat(beacon_storage *sto, beacon_config_t *cfg,
     void * stat, size_t len);
-void beacon_storage_read_stat(beacon_storage *sto, void * stat, size_t len);
+int beacon_storage_read_stat(beacon_storage *sto, void * stat, size_t len);
+void beacon_storage_reset_stat(beacon_storage *sto);
 void beacon_storage_read_test_filter(beacon_storage *sto, uint8_t *buf);
 
+// TIME JOURNAL
+// *time_journal_load* finds the last valid record and the next free one,
+// it returns -1 if the journal holds no valid record. *time_journal_append*
+// erases the page first when it is full, *time_journal_full* tells the
+// caller to checkpoint the clock elsewhere before that.
+int beacon_storage_time_journal_load(beacon_storage *sto,
+    beacon_timer_t *t_cur);
+int beacon_storage_time_journal_full(beacon_storage *sto);
+void beacon_storage_time_journal_append(beacon_storage *sto,
+    beacon_timer_t t_cur);
+void beacon_storage_time_journal_reset(beacon_storage *sto);
+
+// RISK STORE
+// Packets are appended to a bank in order, to pages erased beforehand
+// with *risk_store_erase* (page 0 also holds the header). The header is
+// written once the generation is complete. Stored packets are read in
+// place from the memory-mapped flash.
+void beacon_storage_risk_store_erase(beacon_storage *sto, int bank,
+    uint32_t page);
+int beacon_storage_risk_store_page_blank(beacon_storage *sto, int bank,
+    uint32_t page);
+int beacon_storage_risk_store_append(beacon_storage *sto, int bank,
+    uint32_t idx, const uint8_t *data, uint16_t len);
+void beacon_storage_risk_store_save_hdr(beacon_storage *sto, int bank,
+    risk_store_hdr_t *hdr);
+int beacon_storage_risk_store_read_hdr(beacon_storage *sto, int bank,
+    risk_store_hdr_t *hdr);
+const risk_store_slot_t *beacon_storage_risk_store_pkt(beacon_storage *sto,
+    int bank, uint32_t idx);
+
 #endif
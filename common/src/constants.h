@@ -114,5 +114,17 @@ static const beacon_id_t BEACON_SERVICE_ID_MASK = 0xffff0000;
 #define PACKET_HEADER_LEN (sizeof(rpi_ble_hdr))
 #define MAX_PAYLOAD_SIZE (PER_ADV_SIZE - PACKET_HEADER_LEN)              // S
 #define MAX_NUM_PACKETS_PER_FILTER (((CF_SIZE_BYTES-1) / MAX_PAYLOAD_SIZE) + 1)
+// parity packets that may follow the data packets of a chunk
+#define MAX_NUM_FEC_PACKETS_PER_FILTER \
+  (((MAX_NUM_PACKETS_PER_FILTER-1) / RISK_FEC_GROUP_SIZE) + 1)
+#define MAX_NUM_PACKETS_PER_MANIFEST \
+  (((RISK_MANIFEST_LEN(MAX_NUM_CHUNKS)-1) / MAX_PAYLOAD_SIZE) + 1)
+
+/*
+ * risk packets sent back to back in one chained periodic adv. event,
+ * each in a PER_ADV_SIZE slot. a train carries at most 1650 bytes.
+ */
+#define PER_ADV_CHAIN_LEN 4
+#define PER_ADV_CHAIN_SIZE (PER_ADV_CHAIN_LEN * PER_ADV_SIZE)
 
 #endif /* COMMON_CONSTANTS__H */
@@ -10,6 +10,8 @@
 #ifndef __RISKINFO_H__
 #define __RISKINFO_H__
 
+#include <stdint.h>
+
 typedef struct chunk_hdr {
   uint64_t payload_len;
 } chunk_hdr;
@@ -19,6 +21,82 @@ typedef struct rpi_ble_hdr {
   uint32_t chunkid;
   uint32_t chunklen;
   uint32_t numchunks;
+  // CRC-32 of the chunklen bytes of the chunk, see util/crc32.h
+  uint32_t chunk_crc;
+  // CRC-32 over the chunk_crc of all chunks, changes with any chunk
+  uint32_t payload_ver;
 } rpi_ble_hdr;
 
+/*
+ * ==========================================
+ * forward error correction for risk chunks
+ * ==========================================
+ *
+ * A chunk of n data packets is followed by ceil(n/RISK_FEC_GROUP_SIZE)
+ * parity packets, with pkt_seq values n, n+1, ... The data packets are
+ * interleaved across parity groups (packet i belongs to group i % #groups),
+ * so that a burst of consecutive losses hits different groups. Each parity
+ * payload is the XOR of the (zero-padded) payloads in its group, and lets
+ * the receiver rebuild a single missing data packet of that group without
+ * waiting for the next carousel rotation.
+ */
+
+#define RISK_FEC_GROUP_SIZE 4
+
+/*
+ * ===================================
+ * signed manifest of the risk payload
+ * ===================================
+ *
+ * The manifest is broadcast like a chunk, with chunkid RISK_MANIFEST_CHUNKID.
+ * It consists of a risk_manifest_hdr, followed by the first
+ * RISK_CHUNK_HASH_LEN bytes of the SHA-256 of every chunk, followed by an
+ * ECDSA P-256 signature (r || s) by the backend over the SHA-256 of all
+ * preceding bytes. Verifying the manifest once authenticates every chunk.
+ */
+
+#define RISK_MANIFEST_CHUNKID 0xffffffff
+#define RISK_CHUNK_HASH_LEN 8
+#define RISK_MANIFEST_SIG_LEN 64
+
+typedef struct risk_manifest_hdr {
+  uint32_t numchunks;
+  uint32_t reserved;
+} risk_manifest_hdr;
+
+#define RISK_MANIFEST_LEN(numchunks) \
+  (sizeof(risk_manifest_hdr) + ((numchunks) * RISK_CHUNK_HASH_LEN) + \
+   RISK_MANIFEST_SIG_LEN)
+
+/*
+ * ===============================
+ * chunk index on the beacon UART
+ * ===============================
+ *
+ * When the beacon runs the carousel from its own store, the pi client
+ * starts every rotation with the chunk index, sent like a chunk with
+ * chunkid RISK_INDEX_CHUNKID but never broadcast. It lists the chunk_crc
+ * of every chunk of the payload, in chunkid order, followed by that of
+ * the manifest, if any. The beacon copies chunks with a known CRC from
+ * its current generation, and asks for the others with a line
+ *
+ *   @need <payload_ver> <bitmap>
+ *
+ * in its log output. The bitmap has one bit per index entry, LSB first,
+ * as hex bytes. The pi client then only sends the chunks still needed.
+ */
+
+#define RISK_INDEX_CHUNKID 0xfffffffe
+#define RISK_INDEX_NEED_TAG "@need"
+
+static inline uint32_t risk_fec_num_groups(uint32_t num_data_pkts)
+{
+  return (num_data_pkts + RISK_FEC_GROUP_SIZE - 1) / RISK_FEC_GROUP_SIZE;
+}
+
+static inline uint32_t risk_fec_group(uint32_t pkt_seq, uint32_t num_data_pkts)
+{
+  return pkt_seq % risk_fec_num_groups(num_data_pkts);
+}
+
 #endif /* __RISKINFO_H__ */
@@ -0,0 +1,43 @@
+#ifndef COMMON_CRC32__H
+#define COMMON_CRC32__H
+
+/*
+ * CRC-32 (IEEE 802.3, reflected polynomial 0xedb88320), as computed by
+ * zlib's crc32(). Uses a 16-entry table so that it stays small on the
+ * devices and can be updated one packet at a time.
+ */
+
+#include <stdint.h>
+
+static const uint32_t crc32_nibble_table[16] = {
+  0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+  0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+  0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+  0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+#define CRC32_INIT 0xffffffff
+
+static inline uint32_t crc32_update(uint32_t crc, const uint8_t *buf,
+    uint32_t len)
+{
+  for (uint32_t i = 0; i < len; i++) {
+    crc ^= buf[i];
+    crc = (crc >> 4) ^ crc32_nibble_table[crc & 0x0f];
+    crc = (crc >> 4) ^ crc32_nibble_table[crc & 0x0f];
+  }
+
+  return crc;
+}
+
+static inline uint32_t crc32_final(uint32_t crc)
+{
+  return crc ^ 0xffffffff;
+}
+
+static inline uint32_t crc32(const uint8_t *buf, uint32_t len)
+{
+  return crc32_final(crc32_update(CRC32_INIT, buf, len));
+}
+
+#endif /* COMMON_CRC32__H */
@@ -0,0 +1,168 @@
+#ifndef COMMON_FRAME__H
+#define COMMON_FRAME__H
+
+/*
+ * Binary framing for risk packets on the UART between the pi client and
+ * the network beacon. A frame is
+ *
+ *   COBS( len (2B, LE) | data (len B) | CRC-32 of len and data (4B, LE) ) | 0x00
+ *
+ * COBS removes every zero byte from the encoded frame, so the 0x00
+ * delimiter always marks a frame boundary and the receiver can resync
+ * after dropped or corrupted bytes.
+ */
+
+#include <stdint.h>
+
+#include "crc32.h"
+
+#define FRAME_DELIM 0x00
+#define FRAME_LEN_SIZE 2
+#define FRAME_CRC_SIZE 4
+
+// max encoded size of a frame carrying len data bytes, with the delimiter
+#define FRAME_MAX_ENCODED_LEN(len) \
+  ((len) + FRAME_LEN_SIZE + FRAME_CRC_SIZE + \
+   (((len) + FRAME_LEN_SIZE + FRAME_CRC_SIZE) / 254) + 2)
+
+typedef struct {
+  uint8_t *buf;     // decoded len | data | crc
+  uint32_t size;    // capacity of buf
+  uint32_t len;     // decoded bytes so far
+  uint8_t code;     // current COBS code byte
+  uint8_t left;     // bytes left in the current COBS block
+  uint8_t overflow; // frame did not fit in buf, drop it
+} frame_dec_t;
+
+/*
+ * encode the len1 bytes at data1 followed by the len2 bytes at data2 as
+ * one frame, e.g., a header and a payload that are not contiguous, into
+ * out, which must hold at least FRAME_MAX_ENCODED_LEN(len1 + len2) bytes.
+ * returns the encoded length.
+ */
+static inline uint32_t frame_encode2(const uint8_t *data1, uint16_t len1,
+    const uint8_t *data2, uint16_t len2, uint8_t *out)
+{
+  uint16_t len = len1 + len2;
+  uint8_t hdr[FRAME_LEN_SIZE] = { len & 0xff, len >> 8 };
+  uint32_t crc = crc32_final(crc32_update(crc32_update(crc32_update(
+            CRC32_INIT, hdr, FRAME_LEN_SIZE), data1, len1), data2, len2));
+  uint8_t tail[FRAME_CRC_SIZE] = {
+    crc & 0xff, (crc >> 8) & 0xff, (crc >> 16) & 0xff, crc >> 24
+  };
+  uint32_t total = FRAME_LEN_SIZE + len + FRAME_CRC_SIZE;
+  uint32_t code_idx = 0, out_len = 1;
+  uint8_t code = 1;
+
+  for (uint32_t i = 0; i < total; i++) {
+    uint8_t c = (i < FRAME_LEN_SIZE) ? hdr[i] :
+      (i < FRAME_LEN_SIZE + len1) ? data1[i - FRAME_LEN_SIZE] :
+      (i < FRAME_LEN_SIZE + len) ? data2[i - FRAME_LEN_SIZE - len1] :
+      tail[i - FRAME_LEN_SIZE - len];
+
+    if (c != 0) {
+      out[out_len++] = c;
+      code++;
+    }
+
+    if (c == 0 || code == 0xff) {
+      out[code_idx] = code;
+      code = 1;
+      code_idx = out_len++;
+    }
+  }
+
+  out[code_idx] = code;
+  out[out_len++] = FRAME_DELIM;
+  return out_len;
+}
+
+/*
+ * encode len bytes of data into out, which must hold at least
+ * FRAME_MAX_ENCODED_LEN(len) bytes. returns the encoded length.
+ */
+static inline uint32_t frame_encode(const uint8_t *data, uint16_t len,
+    uint8_t *out)
+{
+  return frame_encode2(data, len, NULL, 0, out);
+}
+
+static inline void frame_dec_init(frame_dec_t *dec, uint8_t *buf,
+    uint32_t size)
+{
+  dec->buf = buf;
+  dec->size = size;
+  dec->len = 0;
+  dec->code = 0xff;
+  dec->left = 0;
+  dec->overflow = 0;
+}
+
+static inline void frame_dec_reset(frame_dec_t *dec)
+{
+  frame_dec_init(dec, dec->buf, dec->size);
+}
+
+/*
+ * feed one received byte to the decoder.
+ * > 0 - a valid frame ended, returns its data length; the data is at
+ *       frame_dec_data(dec) until the next call
+ * 0 - frame not complete yet
+ * -1 - a frame ended but was too long, truncated or failed the CRC
+ */
+static inline int frame_dec_push(frame_dec_t *dec, uint8_t c)
+{
+  if (c == FRAME_DELIM) {
+    int ret = -1;
+    uint32_t len = dec->len;
+
+    if (!dec->overflow && dec->left == 0 &&
+        len >= FRAME_LEN_SIZE + FRAME_CRC_SIZE) {
+      uint32_t dlen = dec->buf[0] | (dec->buf[1] << 8);
+      uint8_t *p = dec->buf + len - FRAME_CRC_SIZE;
+      uint32_t crc = p[0] | (p[1] << 8) | (p[2] << 16) |
+        ((uint32_t) p[3] << 24);
+
+      if (dlen == len - FRAME_LEN_SIZE - FRAME_CRC_SIZE &&
+          crc == crc32(dec->buf, len - FRAME_CRC_SIZE))
+        ret = (int) dlen;
+    }
+
+    // an empty frame is just a resync delimiter
+    if (len == 0 && dec->left == 0 && !dec->overflow)
+      ret = 0;
+
+    frame_dec_reset(dec);
+    return ret;
+  }
+
+  if (dec->overflow)
+    return 0;
+
+  if (dec->left == 0) {
+    // start of a block, the previous block ended with an implicit zero
+    if (dec->code != 0xff) {
+      if (dec->len >= dec->size) {
+        dec->overflow = 1;
+        return 0;
+      }
+      dec->buf[dec->len++] = 0;
+    }
+    dec->code = c;
+    dec->left = c - 1;
+    return 0;
+  }
+
+  if (dec->len >= dec->size) {
+    dec->overflow = 1;
+    return 0;
+  }
+
+  dec->buf[dec->len++] = c;
+  dec->left--;
+  return 0;
+}
+
+#define frame_dec_data(dec) ((dec)->buf + FRAME_LEN_SIZE)
+
+#endif /* COMMON_FRAME__H */
@@ -47,6 +47,12 @@ static uint16_t num_sync_open_attempts = 0;
 dongle_timer_t last_sync_open_time = 0, last_sync_close_time = 0;
 dongle_timer_t last_download_start_time = 0;
 
+// secondary PHY of the periodic train synced with, and 2M fallback state
+uint8_t sync_phy = sl_bt_gap_1m_phy;
+static uint8_t num_2m_sync_fails = 0;
+static int phy_2m_fallback = 0;
+static dongle_timer_t phy_2m_fallback_time = 0;
+
 /*
  * state machine for download
  *                    | dwnld_start | dwnld_end | sync_open | sync_close | #attempts | synced | active | sync_handle | prev_handle
@@ -73,6 +79,54 @@ dongle_timer_t last_download_start_time = 0;
  */
 int synced = 0; // no concurrency control but acts as an eventual state signal
 
+/*
+ * whether to sync with a periodic train on the given secondary PHY.
+ * 2M trains cut the radio-on time per download, but are skipped for
+ * PHY_2M_RETRY_INTERVAL after repeated failed syncs on 2M.
+ */
+static int dongle_accept_sync_phy(uint8_t phy)
+{
+  if (phy != sl_bt_gap_2m_phy)
+    return 1;
+
+  if (!DONGLE_PER_ADV_2M)
+    return 0;
+
+  if (phy_2m_fallback &&
+      dongle_time - phy_2m_fallback_time >= PHY_2M_RETRY_INTERVAL) {
+    phy_2m_fallback = 0;
+    num_2m_sync_fails = 0;
+  }
+
+  return !phy_2m_fallback;
+}
+
+static void dongle_on_sync_end()
+{
+  if (sync_phy != sl_bt_gap_2m_phy)
+    return;
+
+  if (dongle_download_complete_status() == 1) {
+    num_2m_sync_fails = 0;
+    return;
+  }
+
+#if MODE__STAT
+  stats->stat_ints.num_2m_sync_fails++;
+#endif
+
+  if (++num_2m_sync_fails < PHY_2M_MAX_SYNC_FAILS || phy_2m_fallback)
+    return;
+
+  phy_2m_fallback = 1;
+  phy_2m_fallback_time = dongle_time;
+#if MODE__STAT
+  stats->stat_ints.num_2m_fallbacks++;
+#endif
+  log_expf("[%u] %u failed syncs on 2M, using 1M trains\r\n",
+      dongle_time, num_2m_sync_fails);
+}
+
 void sl_timer_on_expire(sl_sleeptimer_timer_handle_t *handle,
     __attribute__ ((unused)) void *data)
 {
@@ -208,6 +262,7 @@ void sl_bt_on_event (sl_bt_msg_t *evt)
       // then check for periodic info in packet
       if (!synced &&
           evt->data.evt_scanner_scan_report.periodic_interval != 0 &&
+          dongle_accept_sync_phy(report.secondary_phy) &&
           num_sync_open_attempts < NUM_SYNC_ATTEMPTS &&
           ((int16_t) prev_sync_handle == -1 ||
            (stats->stat_ints.last_download_end_time >=
@@ -226,6 +281,7 @@ void sl_bt_on_event (sl_bt_msg_t *evt)
                        &sync_handle);
         last_sync_open_time = dongle_time;
         last_download_start_time = dongle_time;
+        sync_phy = report.secondary_phy;
         if (prev_sync_handle != sync_handle) {
           log_expf("open sync addr[%d, 0x%02x]: %0x:%0x:%0x:%0x:%0x:%0x "
             "sid: %u phy(%d, %d) chan: %d intvl: %d h: %d p: %d #attempts: %d "
@@ -264,6 +320,7 @@ void sl_bt_on_event (sl_bt_msg_t *evt)
 
     case sl_bt_evt_sync_closed_id:
       log_expf("Sync lost...\r\n");
+      dongle_on_sync_end();
       dongle_on_sync_lost();
       synced = 0;
       break;
@@ -295,15 +352,10 @@ void sl_bt_on_event (sl_bt_msg_t *evt)
           dongle_download_complete_status(), download->is_active, synced,
           (int16_t) sync_handle, sc);
       } else {
-#define ERROR_STATUS 0x02
-        if (evt->data.evt_sync_data.data_status == ERROR_STATUS) {
-          dongle_on_periodic_data_error(evt->data.evt_sync_data.rssi);
-        } else {
-          dongle_on_periodic_data(evt->data.evt_sync_data.data.data,
-              evt->data.evt_sync_data.data.len,
-              evt->data.evt_sync_data.rssi);
-        }
-#undef ERROR_STATUS
+        dongle_on_sync_data(evt->data.evt_sync_data.data.data,
+            evt->data.evt_sync_data.data.len,
+            evt->data.evt_sync_data.data_status,
+            evt->data.evt_sync_data.rssi);
       }
 
       break;
@@ -16,6 +16,7 @@
 #define PSA_WANT_KEY_TYPE_ECC_KEY_PAIR
 #define PSA_WANT_ECC_SECP_R1_256
 #define PSA_WANT_ALG_ECDH
+#define PSA_WANT_ALG_ECDSA
 #define MBEDTLS_PSA_CRYPTO_EXTERNAL_RNG
 #define MBEDTLS_PSA_ACCEL_ALG_SHA_1
 #define MBEDTLS_PSA_ACCEL_ALG_SHA_224
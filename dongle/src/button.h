@@ -70,6 +70,9 @@ void sl_button_on_change(const sl_button_t *handle)
   config.en_head = 0;
   config.en_tail = 0;
 
+  // the log is gone, match every chunk on the next download
+  dongle_download_reset_delta();
+
   // on a long button press, additionally reset clock, stats, and ongoing scans
   if (button_delay > (float) BUTTON_DELAY_SHORT_MS) {
     dongle_time = config.t_cur = config.t_init;
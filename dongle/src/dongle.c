@@ -41,6 +41,7 @@ enctr_bitmap_t enctr_bmap;
 dongle_stats_t *stats;
 size_t cur_id_idx;
 extern download_t *download;
+extern download_delta_t download_delta;
 
 // 5. Statistics and Telemetry
 // Global high-precision timer, in milliseconds
@@ -53,11 +54,12 @@ static void dongle_config_init(dongle_config_t *cfg,
   if (!cfg)
     return;
 
-  cfg->backend_pk = malloc(PK_MAX_SIZE);
-  memset(cfg->backend_pk, 0, PK_MAX_SIZE);
+  // the keys are viewed in flash by dongle_storage_load_config
+  cfg->backend_pk_size = 0;
+  cfg->backend_pk = NULL;
 
-  cfg->dongle_sk = malloc(SK_MAX_SIZE);
-  memset(cfg->dongle_sk, 0, SK_MAX_SIZE);
+  cfg->dongle_sk_size = 0;
+  cfg->dongle_sk = NULL;
 
   if (enctr_list_p) {
     enctr_list_t *enctr_list = malloc(DONGLE_MAX_BC_TRACKED *
@@ -78,23 +80,11 @@ static void dongle_config_init(dongle_config_t *cfg,
 
   if (download_p) {
     download_t *download = malloc(sizeof(download_t));
-    dongle_download_init();
     *download_p = download;
+    dongle_download_init();
   }
 }
 
-void dongle_cleanup_config(dongle_config_t *cfg)
-{
-  if (!cfg)
-    return;
-
-  if (cfg->backend_pk)
-    free(cfg->backend_pk);
-
-  if (cfg->dongle_sk)
-    free(cfg->dongle_sk);
-}
-
 /*
  * invoke after kernel has initialized and bluetooth device is booted.
  * load config from flash and nvm3, init or reset variables and init scan
@@ -119,6 +109,7 @@ void dongle_init()
   nvm3_load_config(&config);
   nvm3_load_enctr_bmap(&enctr_bmap);
   dongle_print_bitmap_all(&enctr_bmap);
+  nvm3_load_download_delta(&download_delta);
 //  nvm3_save_enctr_bmap(&enctr_bmap);
 //  nvm3_load_enctr_bmap(&enctr_bmap);
 
@@ -126,8 +117,13 @@ void dongle_init()
   config.t_init = sto_cfg.t_init;
   config.backend_pk_size = sto_cfg.backend_pk_size;
   config.dongle_sk_size = sto_cfg.dongle_sk_size;
-  memcpy(config.backend_pk, sto_cfg.backend_pk, sto_cfg.backend_pk_size);
-  memcpy(config.dongle_sk, sto_cfg.dongle_sk, sto_cfg.dongle_sk_size);
+  // both share the read-only views of the keys in the config page
+  config.backend_pk = sto_cfg.backend_pk;
+  config.dongle_sk = sto_cfg.dongle_sk;
+
+#if DONGLE_PAYLOAD_AUTH
+  dongle_download_auth_init(config.backend_pk, config.backend_pk_size);
+#endif
 
   // load stats
   dongle_storage_read_stat(&sto_stats, sizeof(dongle_stats_t));
@@ -137,12 +133,9 @@ void dongle_init()
       config.t_cur, config.en_head, config.en_tail, sto_cfg.t_cur,
       sto_cfg.en_head, sto_cfg.en_tail, sto_stats.storage_checksum);
 
-  // reset nvm3 state and stats if checksum on dongle flash does not match
+  // reset nvm3 state and stats if the config on dongle flash is new
   // we reset checksum when flashing image through config scripts
-  if (sto_stats.storage_checksum != DONGLE_STORAGE_STAT_CHKSUM) {
-    sto_stats.storage_checksum = DONGLE_STORAGE_STAT_CHKSUM;
-    dongle_storage_save_stat(&sto_cfg, &sto_stats, sizeof(dongle_stats_t));
-
+  if (dongle_storage_config_is_new(&sto_stats)) {
 //    config.t_cur = config.en_head = config.en_tail = 0;
     config.t_cur = sto_cfg.t_cur;
     config.en_head = sto_cfg.en_head;
@@ -153,11 +146,14 @@ void dongle_init()
     if (sto_cfg.en_head == 0 && sto_cfg.en_tail == 0) {
       dongle_reset_bitmap_all(&enctr_bmap);
       nvm3_save_enctr_bmap(&enctr_bmap);
+      dongle_download_reset_delta();
     }
 
     dongle_stats_reset(stats);
     nvm3_save_stat(stats);
   }
+  // after the reset, so that it is redone if the dongle restarts midway
+  dongle_storage_ack_config(&sto_cfg, &sto_stats);
 
 //  dongle_load();
 
@@ -212,8 +208,6 @@ void dongle_init()
   run_psa_benchmark();
 #endif
 
-  dongle_cleanup_config(&sto_cfg);
-
   // initialize periodic advertisement scanning
   dongle_init_scan();
 }
@@ -580,6 +574,9 @@ void dongle_info()
   log_expf("   Periodic adv retry, new interval: %u min, %u min\r\n",
     (RETRY_DOWNLOAD_INTERVAL * DONGLE_TIMER_RESOLUTION)/60000,
     (NEW_DOWNLOAD_INTERVAL * DONGLE_TIMER_RESOLUTION)/60000);
+  log_expf("   Periodic adv 2M, #fails, retry:   %d, %d, %u min\r\n",
+    DONGLE_PER_ADV_2M, PHY_2M_MAX_SYNC_FAILS,
+    (PHY_2M_RETRY_INTERVAL * DONGLE_TIMER_RESOLUTION)/60000);
 
   log_expf("   Flash page size, count, total:    %u B, %u, %u B\r\n",
     FLASH_DEVICE_PAGE_SIZE, FLASH_DEVICE_NUM_PAGES,
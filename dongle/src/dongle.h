@@ -17,6 +17,13 @@
  */
 #define DONGLE_CRYPTO 0
 
+/*
+ * authenticate risk payloads with the signed manifest and backend_pk
+ * 1 - only match chunks whose hash is listed in a verified manifest
+ * 0 - match every chunk that passes the CRC check
+ */
+#define DONGLE_PAYLOAD_AUTH 0
+
 /*
  * button to reset dongle state
  * 1 - enable use of button to reset dongle state
@@ -118,6 +125,23 @@
  */
 #define LED_RESET_INTERVAL ((2*60*60000)/DONGLE_TIMER_RESOLUTION)
 
+/*
+ * sync with periodic risk trains sent on the 2M PHY, set at build time
+ * 1 - sync on 2M or 1M, skip 2M trains for a while after repeated failures
+ * 0 - only sync on 1M
+ */
+#define DONGLE_PER_ADV_2M 1
+/*
+ * consecutive failed syncs on 2M before falling back to 1M trains
+ */
+#define PHY_2M_MAX_SYNC_FAILS 3
+/*
+ * time to stay on 1M trains before trying 2M again
+ *
+ * unit: depends on the unit of the dongle's timer clock
+ */
+#define PHY_2M_RETRY_INTERVAL ((6*60*60000)/DONGLE_TIMER_RESOLUTION)
+
 // Data Structures
 
 // Count for number of encounters
@@ -134,9 +158,9 @@ typedef struct {
   dongle_timer_t t_init;
   dongle_timer_t t_cur;
   key_size_t backend_pk_size;     // size of backend public key
-  pubkey_t *backend_pk;           // Backend public key
+  const pubkey_t *backend_pk;     // Backend public key, in flash
   key_size_t dongle_sk_size;      // size of secret key
-  seckey_t *dongle_sk;            // Secret Key
+  const seckey_t *dongle_sk;      // Secret Key, in flash
   enctr_entry_counter_t en_tail;  // Encounter cursor tail
   enctr_entry_counter_t en_head;  // Encounter cursor head
 } dongle_config_t;
@@ -11,6 +11,7 @@
 #include "common/src/util/util.h"
 #include "common/src/test.h"
 #include "common/src/riskinfo.h"
+#include "common/src/util/crc32.h"
 
 extern dongle_stats_t *stats;
 extern float dongle_hp_timer;
@@ -19,12 +20,30 @@ extern dongle_timer_t dongle_time;
 float payload_start_ticks = 0, payload_end_ticks = 0;
 extern dongle_timer_t last_download_start_time;
 extern enctr_bitmap_t enctr_bmap;
+extern uint8_t sync_phy;
 
 //int32_t prev_chunkid = -1;
 
 download_t *download;
+download_delta_t download_delta;
 cf_t cf;
 
+#if DONGLE_PAYLOAD_AUTH
+static psa_key_id_t backend_key_id = 0;
+#endif
+
+/*
+ * periodic data spread over chained PDUs arrives in several sync data
+ * events, see PER_ADV_CHAIN_LEN. kept out of download_t, which is reset
+ * when one of the packets in the train completes the download.
+ */
+#define SYNC_DATA_COMPLETE  0
+#define SYNC_DATA_PARTIAL   1
+#define SYNC_DATA_TRUNCATED 2
+
+static uint8_t chain_data[PER_ADV_CHAIN_SIZE];
+static uint16_t chain_len = 0;
+
 float dongle_download_estimate_loss(download_t *d)
 {
 #if 1
@@ -72,6 +91,9 @@ float dongle_download_estimate_loss(download_t *d)
 
 static inline void dongle_download_reset()
 {
+#if DONGLE_PAYLOAD_AUTH
+  psa_hash_abort(&download->packet_buffer.crc.hash_op);
+#endif
   memset(download, 0, sizeof(download_t));
 }
 
@@ -81,9 +103,80 @@ void dongle_download_init()
   memset(&cf, 0, sizeof(cf_t));
 }
 
+/*
+ * import the backend public key (uncompressed P-256 point) for verifying
+ * manifest signatures. without it, no chunk passes authentication.
+ */
+int dongle_download_auth_init(const pubkey_t *backend_pk __attribute__((unused)),
+    key_size_t backend_pk_size __attribute__((unused)))
+{
+#if DONGLE_PAYLOAD_AUTH
+  psa_status_t status = psa_crypto_init();
+  if (status != PSA_SUCCESS) {
+    log_errorf("psa crypto init failed, status: %ld\r\n", status);
+    return -1;
+  }
+
+  psa_key_attributes_t attr = PSA_KEY_ATTRIBUTES_INIT;
+  psa_set_key_type(&attr, PSA_KEY_TYPE_ECC_PUBLIC_KEY(PSA_ECC_FAMILY_SECP_R1));
+  psa_set_key_bits(&attr, 256);
+  psa_set_key_usage_flags(&attr, PSA_KEY_USAGE_VERIFY_HASH);
+  psa_set_key_algorithm(&attr, PSA_ALG_ECDSA(PSA_ALG_SHA_256));
+
+  status = psa_import_key(&attr, backend_pk->bytes, backend_pk_size,
+      &backend_key_id);
+  if (status != PSA_SUCCESS) {
+    log_errorf("backend pk import failed, size: %lu status: %ld\r\n",
+        backend_pk_size, status);
+    backend_key_id = 0;
+    return -1;
+  }
+#endif
+
+  return 0;
+}
+
+void dongle_download_reset_delta()
+{
+  memset(&download_delta, 0, sizeof(download_delta_t));
+  nvm3_save_download_delta(&download_delta);
+}
+
+/*
+ * a risk entry is published only after its epoch has started, so an
+ * encounter that starts at least one epoch after the last match cannot
+ * be in a chunk that has not changed since. encounters logged before
+ * that point must still be checked against the unchanged chunks.
+ */
+static int download_delta_needs_rematch()
+{
+  enctr_entry_counter_t num_new, num_since;
+  dongle_encounter_entry_t en;
+
+  num_new = num_encounters_current(config.en_head, download_delta.en_head);
+  num_since = num_encounters_current(config.en_head, config.en_tail);
+
+  // no new encounters since the last match
+  if (num_new == 0)
+    return 0;
+
+  // log wrapped past the last match, cannot tell what is new
+  if (num_new > num_since)
+    return 1;
+
+  // the log is in time order, checking the oldest new entry suffices
+  dongle_storage_load_single_encounter(download_delta.en_head, &en);
+  return (en.dongle_time_start <
+      download_delta.t_matched + BEACON_EPOCH_LENGTH);
+}
+
 void dongle_download_start()
 {
   download->is_active = 1;
+  download->phy = sync_phy;
+  download->delta_head = config.en_head;
+  download->delta_rematch = download_delta.valid ?
+    download_delta_needs_rematch() : 0;
 #if MODE__STAT
   stats->stat_ints.payloads_started++;
 #endif
@@ -312,6 +405,7 @@ int dongle_count_bitmap_bit_set(enctr_bitmap_t *enctr_bmap)
 
 void dongle_on_sync_lost()
 {
+  chain_len = 0;
   if (download->is_active) {
     log_infof("%s", "Download failed - lost sync.\r\n");
     download->n_syncs_lost++;
@@ -332,7 +426,14 @@ static int download_one_chunk_complete(download_t *download, uint32_t chunkid)
   if (!download)
     return -1;
 
-  for (uint32_t j = 0; j < MAX_NUM_PACKETS_PER_FILTER; j++) {
+  if (download->packet_buffer.chunk_arr[chunkid].skipped)
+    return 1;
+
+  uint32_t num_pkts = download->packet_buffer.chunk_arr[chunkid].num_pkts;
+  if (num_pkts == 0)
+    num_pkts = MAX_NUM_PACKETS_PER_FILTER;
+
+  for (uint32_t j = 0; j < num_pkts; j++) {
     if (download->packet_buffer.chunk_arr[chunkid].counts[j] <= 0)
       return 0;
   }
@@ -340,6 +441,256 @@ static int download_one_chunk_complete(download_t *download, uint32_t chunkid)
   return 1;
 }
 
+static inline uint32_t download_pkt_len(uint64_t chunklen, uint32_t pkt_seq)
+{
+  uint64_t off = pkt_seq * MAX_PAYLOAD_SIZE;
+  return (chunklen - off > MAX_PAYLOAD_SIZE) ? MAX_PAYLOAD_SIZE :
+    (uint32_t) (chunklen - off);
+}
+
+/*
+ * rebuild the single missing data packet of a parity group, if the
+ * parity packet and all other packets of the group are available
+ */
+static int download_fec_recover(download_t *download, uint32_t chunkid,
+    uint32_t chunklen, uint32_t group)
+{
+  uint32_t num_pkts = download->packet_buffer.chunk_arr[chunkid].num_pkts;
+  uint32_t num_groups = risk_fec_num_groups(num_pkts);
+  int8_t *counts = download->packet_buffer.chunk_arr[chunkid].counts;
+  uint8_t *buf = download->packet_buffer.buffer.data;
+  int missing = -1;
+
+  if (download->packet_buffer.fec.chunkid != chunkid ||
+      !download->packet_buffer.fec.valid[group])
+    return 0;
+
+  for (uint32_t i = group; i < num_pkts; i += num_groups) {
+    if (counts[i] > 0) {
+      // received, but the slot was since overwritten by another chunk
+      if (download->packet_buffer.buffer.slot_chunkid[i] != chunkid)
+        return 0;
+      continue;
+    }
+
+    if (missing >= 0)
+      return 0;
+
+    missing = i;
+  }
+
+  if (missing < 0)
+    return 0;
+
+  uint8_t tmp[MAX_PAYLOAD_SIZE];
+  memcpy(tmp, download->packet_buffer.fec.data[group], MAX_PAYLOAD_SIZE);
+  for (uint32_t i = group; i < num_pkts; i += num_groups) {
+    if ((int) i == missing)
+      continue;
+
+    uint32_t len = download_pkt_len(chunklen, i);
+    for (uint32_t b = 0; b < len; b++)
+      tmp[b] ^= buf[(i*MAX_PAYLOAD_SIZE) + b];
+  }
+
+  uint32_t len = download_pkt_len(chunklen, missing);
+  memcpy(buf + (missing*MAX_PAYLOAD_SIZE), tmp, len);
+  download->packet_buffer.buffer.slot_chunkid[missing] = chunkid;
+  counts[missing] = 1;
+  download->packet_buffer.num_distinct++;
+  download->packet_buffer.received += len;
+  download->n_fec_recovered++;
+
+  return 1;
+}
+
+static void download_crc_reset(download_t *download, uint32_t chunkid)
+{
+#if DONGLE_PAYLOAD_AUTH
+  psa_hash_abort(&download->packet_buffer.crc.hash_op);
+#endif
+  memset(&download->packet_buffer.crc, 0, sizeof(download->packet_buffer.crc));
+  download->packet_buffer.crc.chunkid = chunkid;
+  download->packet_buffer.crc.crc = CRC32_INIT;
+#if DONGLE_PAYLOAD_AUTH
+  psa_hash_setup(&download->packet_buffer.crc.hash_op, PSA_ALG_SHA_256);
+#endif
+}
+
+/*
+ * fold the packets of a chunk into its CRC (and hash) as soon as they are
+ * contiguous, so that verifying a completed chunk costs nothing extra
+ */
+static void download_crc_advance(download_t *download, uint32_t chunkid,
+    uint32_t chunklen)
+{
+  uint32_t num_pkts = download->packet_buffer.chunk_arr[chunkid].num_pkts;
+  int8_t *counts = download->packet_buffer.chunk_arr[chunkid].counts;
+
+  if (download->packet_buffer.crc.chunkid != chunkid ||
+      download->packet_buffer.crc.next_seq == 0) {
+    download_crc_reset(download, chunkid);
+  }
+
+  uint32_t seq = download->packet_buffer.crc.next_seq;
+  while (seq < num_pkts && counts[seq] > 0 &&
+      download->packet_buffer.buffer.slot_chunkid[seq] == chunkid) {
+    uint8_t *pkt = download->packet_buffer.buffer.data + (seq*MAX_PAYLOAD_SIZE);
+    uint32_t len = download_pkt_len(chunklen, seq);
+    download->packet_buffer.crc.crc =
+      crc32_update(download->packet_buffer.crc.crc, pkt, len);
+#if DONGLE_PAYLOAD_AUTH
+    float startts = now();
+    psa_hash_update(&download->packet_buffer.crc.hash_op, pkt, len);
+    download->auth_time += (now() - startts);
+#endif
+    seq++;
+  }
+  download->packet_buffer.crc.next_seq = seq;
+}
+
+static int download_crc_verify(download_t *download, uint32_t chunkid,
+    uint32_t chunk_crc)
+{
+  uint32_t num_pkts = download->packet_buffer.chunk_arr[chunkid].num_pkts;
+
+  return (download->packet_buffer.crc.chunkid == chunkid &&
+      download->packet_buffer.crc.next_seq == num_pkts &&
+      crc32_final(download->packet_buffer.crc.crc) == chunk_crc);
+}
+
+/*
+ * forget the data packets of a chunk that is downloaded again, so that
+ * they are not counted twice in num_distinct and received when they
+ * come around again
+ */
+static void download_chunk_drop(download_t *download, uint32_t chunkid,
+    uint64_t chunklen)
+{
+  uint32_t num_pkts = download->packet_buffer.chunk_arr[chunkid].num_pkts;
+  int8_t *counts = download->packet_buffer.chunk_arr[chunkid].counts;
+
+  for (uint32_t i = 0; i < num_pkts; i++) {
+    if (counts[i] <= 0)
+      continue;
+
+    download->packet_buffer.num_distinct--;
+    download->packet_buffer.received -= download_pkt_len(chunklen, i);
+  }
+
+  memset(download->packet_buffer.chunk_arr[chunkid].counts, 0,
+      sizeof(download->packet_buffer.chunk_arr[chunkid].counts));
+}
+
+#if DONGLE_PAYLOAD_AUTH
+static void download_manifest_verify(download_t *download)
+{
+  risk_manifest_hdr *hdr = (risk_manifest_hdr *) download->manifest.data;
+  uint32_t body_len = download->manifest.len - RISK_MANIFEST_SIG_LEN;
+  uint8_t hash[PSA_HASH_LENGTH(PSA_ALG_SHA_256)];
+  size_t hash_len = 0;
+  psa_status_t status;
+
+  if (hdr->numchunks > MAX_NUM_CHUNKS ||
+      RISK_MANIFEST_LEN(hdr->numchunks) != download->manifest.len) {
+    log_errorf("bad manifest, #chunks: %lu len: %lu\r\n",
+        hdr->numchunks, download->manifest.len);
+    goto fail;
+  }
+
+  float startts = now();
+  status = psa_hash_compute(PSA_ALG_SHA_256, download->manifest.data,
+      body_len, hash, sizeof(hash), &hash_len);
+  if (status == PSA_SUCCESS) {
+    status = psa_verify_hash(backend_key_id, PSA_ALG_ECDSA(PSA_ALG_SHA_256),
+        hash, hash_len, download->manifest.data + body_len,
+        RISK_MANIFEST_SIG_LEN);
+  }
+  download->auth_time += (now() - startts);
+
+  if (status != PSA_SUCCESS) {
+    log_errorf("manifest signature check failed, status: %ld\r\n", status);
+    goto fail;
+  }
+
+  log_expf("manifest verified, #chunks: %lu\r\n", hdr->numchunks);
+  download->manifest.verified = 1;
+  return;
+
+fail:
+  memset(download->manifest.counts, 0, sizeof(download->manifest.counts));
+}
+
+static void download_manifest_on_packet(download_t *download,
+    rpi_ble_hdr *rbh, uint8_t *payload, uint8_t len)
+{
+  uint32_t chunklen = rbh->chunklen;
+  uint32_t num_pkts = (chunklen == 0) ? 0 :
+    ((chunklen - 1) / MAX_PAYLOAD_SIZE) + 1;
+
+  // parity packets are not needed for the manifest
+  if (download->manifest.verified || num_pkts == 0 ||
+      num_pkts > MAX_NUM_PACKETS_PER_MANIFEST || rbh->pkt_seq >= num_pkts)
+    return;
+
+  if (download->manifest.len != chunklen) {
+    memset(download->manifest.counts, 0, sizeof(download->manifest.counts));
+    download->manifest.len = chunklen;
+  }
+
+  if (download->manifest.counts[rbh->pkt_seq]++ > 0)
+    return;
+
+  uint32_t pkt_len = download_pkt_len(chunklen, rbh->pkt_seq);
+  memcpy(download->manifest.data + (rbh->pkt_seq*MAX_PAYLOAD_SIZE), payload,
+      (len < pkt_len) ? len : pkt_len);
+
+  for (uint32_t i = 0; i < num_pkts; i++) {
+    if (download->manifest.counts[i] == 0)
+      return;
+  }
+
+  if (crc32(download->manifest.data, chunklen) != rbh->chunk_crc) {
+    log_errorf("manifest crc mismatch, len: %lu\r\n", chunklen);
+    memset(download->manifest.counts, 0, sizeof(download->manifest.counts));
+    return;
+  }
+
+  download_manifest_verify(download);
+}
+
+static uint8_t *download_manifest_hash(download_t *download, uint32_t chunkid)
+{
+  return download->manifest.data + sizeof(risk_manifest_hdr) +
+    (chunkid * RISK_CHUNK_HASH_LEN);
+}
+
+/*
+ * 1 - chunk hash is listed in the verified manifest
+ * 0 - chunk hash does not match the manifest
+ * -1 - no verified manifest yet, chunk cannot be checked
+ */
+static int download_auth_verify(download_t *download, uint32_t chunkid)
+{
+  risk_manifest_hdr *hdr = (risk_manifest_hdr *) download->manifest.data;
+  uint8_t *expected = download_manifest_hash(download, chunkid);
+  uint8_t hash[PSA_HASH_LENGTH(PSA_ALG_SHA_256)];
+  size_t hash_len = 0;
+
+  if (!download->manifest.verified)
+    return -1;
+
+  if (chunkid >= hdr->numchunks)
+    return 0;
+
+  if (psa_hash_finish(&download->packet_buffer.crc.hash_op, hash,
+        sizeof(hash), &hash_len) != PSA_SUCCESS)
+    return 0;
+
+  return (memcmp(hash, expected, RISK_CHUNK_HASH_LEN) == 0);
+}
+#endif /* DONGLE_PAYLOAD_AUTH */
+
 #if 0
 int download_prev_chunk_complete(download_t *download, uint32_t chunkid)
 {
@@ -388,6 +739,14 @@ static int download_all_chunks_complete(download_t *download)
   if (!download)
     return -1;
 
+#if DONGLE_PAYLOAD_AUTH
+  // the chunk count in the packet headers is not signed
+  risk_manifest_hdr *hdr = (risk_manifest_hdr *) download->manifest.data;
+  if (!download->manifest.verified ||
+      hdr->numchunks != download->packet_buffer.numchunks)
+    return 0;
+#endif
+
   for (uint32_t i = 0; i < download->packet_buffer.numchunks; i++) {
     if (download_one_chunk_complete(download, i) == 0)
       return 0;
@@ -404,6 +763,123 @@ static int download_all_chunks_complete(download_t *download)
   return 1;
 }
 
+/*
+ * chunk is the one the last completed download matched. with
+ * DONGLE_PAYLOAD_AUTH only the verified manifest is trusted for this,
+ * not the chunk_crc in the packet header.
+ */
+static int download_delta_unchanged(download_t *download, uint32_t chunkid,
+    uint32_t chunk_crc __attribute__((unused)))
+{
+  if (!download_delta.valid || chunkid >= download_delta.numchunks)
+    return 0;
+
+#if DONGLE_PAYLOAD_AUTH
+  risk_manifest_hdr *hdr = (risk_manifest_hdr *) download->manifest.data;
+  if (!download->manifest.verified || chunkid >= hdr->numchunks)
+    return 0;
+
+  return (memcmp(download_manifest_hash(download, chunkid),
+        download_delta.chunk_hash[chunkid], RISK_CHUNK_HASH_LEN) == 0);
+#else
+  return (download_delta.chunk_crc[chunkid] == chunk_crc);
+#endif
+}
+
+/*
+ * the whole payload is the one the last completed download matched
+ */
+static int download_delta_all_unchanged(download_t *download,
+    rpi_ble_hdr *rbh)
+{
+#if DONGLE_PAYLOAD_AUTH
+  risk_manifest_hdr *hdr = (risk_manifest_hdr *) download->manifest.data;
+  if (!download->manifest.verified ||
+      hdr->numchunks != download_delta.numchunks)
+    return 0;
+
+  for (uint32_t c = 0; c < download_delta.numchunks; c++) {
+    if (!download_delta_unchanged(download, c, 0))
+      return 0;
+  }
+  return 1;
+#else
+  return (rbh->payload_ver == download_delta.payload_ver &&
+      rbh->numchunks == download_delta.numchunks);
+#endif
+}
+
+/*
+ * skip chunks that are unchanged since the last completed download. if no
+ * new encounter needs to be checked against them, they need not be
+ * received. returns 1 if the packet needs no further processing.
+ */
+static int download_delta_skip(download_t *download, rpi_ble_hdr *rbh)
+{
+  download->payload_ver = rbh->payload_ver;
+
+  if (!download_delta.valid)
+    return 0;
+
+  if (download->packet_buffer.chunk_arr[rbh->chunkid].skipped)
+    return 1;
+
+  if (download->delta_rematch ||
+      !download_delta_unchanged(download, rbh->chunkid, rbh->chunk_crc))
+    return 0;
+
+  // nothing changed, every chunk was already matched
+  if (download_delta_all_unchanged(download, rbh)) {
+    download->packet_buffer.numchunks = download_delta.numchunks;
+    for (uint32_t c = 0; c < download_delta.numchunks; c++) {
+      download->packet_buffer.chunk_arr[c].skipped = 1;
+      download->packet_buffer.chunk_arr[c].crc = download_delta.chunk_crc[c];
+    }
+    download->n_chunks_skipped += download_delta.numchunks;
+    return 1;
+  }
+
+  download->packet_buffer.chunk_arr[rbh->chunkid].skipped = 1;
+  download->packet_buffer.chunk_arr[rbh->chunkid].crc =
+    download_delta.chunk_crc[rbh->chunkid];
+  download->n_chunks_skipped++;
+  return 1;
+}
+
+static void download_finish()
+{
+  dongle_print_bitmap_all(&enctr_bmap);
+  nvm3_save_enctr_bmap(&enctr_bmap);
+
+  if (dongle_has_bitmap_bit_set(&enctr_bmap)) {
+    dongle_led_notify();
+  }
+  // there may be extra data in the packet
+  dongle_download_complete();
+}
+
+static void download_delta_save(download_t *download)
+{
+  download_delta.valid = 1;
+  download_delta.payload_ver = download->payload_ver;
+  download_delta.numchunks = download->packet_buffer.numchunks;
+  download_delta.en_head = download->delta_head;
+  download_delta.t_matched = dongle_time;
+  for (uint32_t c = 0; c < MAX_NUM_CHUNKS; c++) {
+    download_delta.chunk_crc[c] = (c < download_delta.numchunks) ?
+      download->packet_buffer.chunk_arr[c].crc : 0;
+  }
+#if DONGLE_PAYLOAD_AUTH
+  // every chunk was checked against, or skipped by, the verified manifest
+  memset(download_delta.chunk_hash, 0, sizeof(download_delta.chunk_hash));
+  for (uint32_t c = 0; c < download_delta.numchunks; c++) {
+    memcpy(download_delta.chunk_hash[c], download_manifest_hash(download, c),
+        RISK_CHUNK_HASH_LEN);
+  }
+#endif
+  nvm3_save_download_delta(&download_delta);
+}
+
 void dongle_on_periodic_data(uint8_t *data, uint8_t data_len, int8_t rssi __attribute__((unused)))
 {
 
@@ -438,10 +914,27 @@ void dongle_on_periodic_data(uint8_t *data, uint8_t data_len, int8_t rssi __attr
   stat_add(rssi, stats->stat_grp.periodic_data_rssi);
 #endif
 
-  if (rbh->pkt_seq >= MAX_NUM_PACKETS_PER_FILTER ||
-      (int32_t) rbh->chunklen < 0) {
-    log_errorf("seq#: %d, max pkts: %d, chunklen: %d\r\n",
-        rbh->pkt_seq, MAX_NUM_PACKETS_PER_FILTER, rbh->chunklen);
+#if DONGLE_PAYLOAD_AUTH
+  if (rbh->chunkid == RISK_MANIFEST_CHUNKID) {
+    if (!download->is_active) {
+      dongle_download_start();
+    }
+
+    download_manifest_on_packet(download, rbh, data + sizeof(rpi_ble_hdr),
+        data_len - sizeof(rpi_ble_hdr));
+    return;
+  }
+#endif
+
+  uint32_t num_pkts = (rbh->chunklen == 0) ? 0 :
+    ((rbh->chunklen - 1) / MAX_PAYLOAD_SIZE) + 1;
+
+  if (num_pkts == 0 || num_pkts > MAX_NUM_PACKETS_PER_FILTER ||
+      rbh->pkt_seq >= num_pkts + risk_fec_num_groups(num_pkts) ||
+      rbh->chunkid >= MAX_NUM_CHUNKS) {
+    log_errorf("seq#: %d, max pkts: %d, chunk: %d, chunklen: %d\r\n",
+        rbh->pkt_seq, MAX_NUM_PACKETS_PER_FILTER, rbh->chunkid,
+        rbh->chunklen);
     return;
   }
 
@@ -502,25 +995,63 @@ void dongle_on_periodic_data(uint8_t *data, uint8_t data_len, int8_t rssi __attr
   prev_chunkid = rbh->chunkid;
 #endif
 
+  download->packet_buffer.numchunks = rbh->numchunks;
+
+  if (download_delta_skip(download, rbh)) {
+    if (download_all_chunks_complete(download))
+      download_finish();
+    return;
+  }
+
   download->packet_buffer.cur_chunkid = rbh->chunkid;
   download->packet_buffer.buffer.data_len = rbh->chunklen;
-  download->packet_buffer.numchunks = rbh->numchunks;
 
-  download->n_total_packets++;
+  download->packet_buffer.chunk_arr[rbh->chunkid].num_pkts = num_pkts;
+
   int prev = download->packet_buffer.chunk_arr[rbh->chunkid].counts[rbh->pkt_seq];
   download->packet_buffer.chunk_arr[rbh->chunkid].counts[rbh->pkt_seq]++;
 //  download->packet_buffer.chunk_prev_counts[rbh->pkt_seq]++;
 
-  // duplicate packet
-  if (prev > 0)
+  uint8_t len = data_len - sizeof(rpi_ble_hdr);
+  uint32_t fec_group;
+
+  if (len > MAX_PAYLOAD_SIZE)
+    len = MAX_PAYLOAD_SIZE;
+
+  if (rbh->pkt_seq >= num_pkts) {
+    // parity packet, only kept for the chunk currently on air
+    fec_group = rbh->pkt_seq - num_pkts;
+    if (download->packet_buffer.fec.chunkid != rbh->chunkid) {
+      memset(&download->packet_buffer.fec, 0,
+          sizeof(download->packet_buffer.fec));
+      download->packet_buffer.fec.chunkid = rbh->chunkid;
+    }
+
+    memcpy(download->packet_buffer.fec.data[fec_group],
+        data + sizeof(rpi_ble_hdr), len);
+    download->packet_buffer.fec.valid[fec_group] = 1;
+  } else {
+    download->n_total_packets++;
+
+    // duplicate packet
+    if (prev > 0)
+      return;
+
+    // this is an unseen packet
+    download->packet_buffer.num_distinct++;
+    memcpy(download->packet_buffer.buffer.data + (rbh->pkt_seq*MAX_PAYLOAD_SIZE),
+      data + sizeof(rpi_ble_hdr), len);
+    download->packet_buffer.buffer.slot_chunkid[rbh->pkt_seq] = rbh->chunkid;
+    download->packet_buffer.received += len;
+    fec_group = risk_fec_group(rbh->pkt_seq, num_pkts);
+  }
+
+  // a parity packet only matters if it completes a missing data packet
+  if (!download_fec_recover(download, rbh->chunkid, rbh->chunklen, fec_group) &&
+      rbh->pkt_seq >= num_pkts)
     return;
 
-  // this is an unseen packet
-  download->packet_buffer.num_distinct++;
-  uint8_t len = data_len - sizeof(rpi_ble_hdr);
-  memcpy(download->packet_buffer.buffer.data + (rbh->pkt_seq*MAX_PAYLOAD_SIZE),
-    data + sizeof(rpi_ble_hdr), len);
-  download->packet_buffer.received += len;
+  download_crc_advance(download, rbh->chunkid, rbh->chunklen);
 
 #if 0
   log_expf("%.0f %d %d active: %d chunkid: [%u/%u]/%u, pkt: %u "
@@ -540,6 +1071,37 @@ void dongle_on_periodic_data(uint8_t *data, uint8_t data_len, int8_t rssi __attr
     //  bitdump(download->packet_buffer.buffer.data,
     //      download->packet_buffer.buffer.data_len, "risk chunk");
 
+    /*
+     * do not scan the log with a corrupted or mixed-up filter,
+     * download the chunk again instead
+     */
+    if (!download_crc_verify(download, rbh->chunkid, rbh->chunk_crc)) {
+      log_errorf("chunk %lu crc mismatch, expected: 0x%08lx got: 0x%08lx\r\n",
+          rbh->chunkid, rbh->chunk_crc,
+          crc32_final(download->packet_buffer.crc.crc));
+      download->n_crc_fail++;
+      download_chunk_drop(download, rbh->chunkid, rbh->chunklen);
+      download_crc_reset(download, rbh->chunkid);
+      return;
+    }
+
+#if DONGLE_PAYLOAD_AUTH
+    /*
+     * chunks completed before the manifest is verified are dropped and
+     * downloaded again on the next rotation
+     */
+    int auth = download_auth_verify(download, rbh->chunkid);
+    if (auth != 1) {
+      if (auth == 0) {
+        log_errorf("chunk %lu hash not in manifest\r\n", rbh->chunkid);
+        download->n_auth_fail++;
+      }
+      download_chunk_drop(download, rbh->chunkid, rbh->chunklen);
+      download_crc_reset(download, rbh->chunkid);
+      return;
+    }
+#endif
+
     debug_chunkid = rbh->chunkid;
     num_buckets =
       cf_gadget_num_buckets(download->packet_buffer.buffer.data_len);
@@ -553,30 +1115,39 @@ void dongle_on_periodic_data(uint8_t *data, uint8_t data_len, int8_t rssi __attr
     run_fixed_cf_test(download, num_buckets);
 #else
 
-    // check existing log entries against the new filter
-    dongle_storage_load_encounter(config.en_tail,
-        num_encounters_current(config.en_head, config.en_tail),
+    /*
+     * check existing log entries against the new filter. an unchanged
+     * chunk was already matched against the entries logged before the
+     * last download, and only needs the entries since then.
+     */
+    enctr_entry_counter_t en_start = config.en_tail;
+    enctr_entry_counter_t num_en =
+      num_encounters_current(config.en_head, config.en_tail);
+    if (download_delta_unchanged(download, rbh->chunkid, rbh->chunk_crc) &&
+        num_encounters_current(config.en_head, download_delta.en_head) <=
+        num_en) {
+      en_start = download_delta.en_head;
+      num_en = num_encounters_current(config.en_head, en_start);
+    }
+    dongle_storage_load_encounter(en_start, num_en,
         dongle_download_check_match, num_buckets);
 
 #endif /* CUCKOOFILTER_FIXED_TEST */
 
-    memset(download->packet_buffer.buffer.data, 0, CF_SIZE_BYTES);
+    download->packet_buffer.chunk_arr[rbh->chunkid].crc = rbh->chunk_crc;
+
+    memset(download->packet_buffer.buffer.data, 0,
+        sizeof(download->packet_buffer.buffer.data));
     download->packet_buffer.buffer.data_len = 0;
+    memset(&download->packet_buffer.fec, 0,
+        sizeof(download->packet_buffer.fec));
     memset(&cf, 0, sizeof(cf_t));
   }
 #endif
 
   // TODO: replace with download_all_chunks_complete_2
   if (download_all_chunks_complete(download)) {
-
-    dongle_print_bitmap_all(&enctr_bmap);
-    nvm3_save_enctr_bmap(&enctr_bmap);
-
-    if (dongle_has_bitmap_bit_set(&enctr_bmap)) {
-      dongle_led_notify();
-    }
-    // there may be extra data in the packet
-    dongle_download_complete();
+    download_finish();
   }
 }
 
@@ -586,6 +1157,8 @@ void dongle_download_complete()
 
   stats->stat_ints.last_download_end_time = dongle_time;
 
+  download_delta_save(download);
+
   payload_end_ticks = dongle_hp_timer;
 
   log_expf("[%u] Download complete! last dnwld time: %lu "
@@ -621,6 +1194,17 @@ void dongle_download_complete()
   dongle_update_download_stats(stats->all_download_stats, download);
   dongle_update_download_stats(stats->completed_download_stats, download);
   stat_add(lat, stats->stat_grp.completed_periodic_data_avg_payload_lat);
+  int phy_idx = PER_ADV_PHY_IDX(download->phy);
+  stat_add(lat, stats->all_download_stats.phy[phy_idx].latency);
+  stat_add(lat, stats->completed_download_stats.phy[phy_idx].latency);
+#if DONGLE_PAYLOAD_AUTH
+  if (lat > 0) {
+    double auth_overhead = (100 * download->auth_time) / lat;
+    stat_add(auth_overhead, stats->all_download_stats.chunk.auth_overhead);
+    stat_add(auth_overhead,
+        stats->completed_download_stats.chunk.auth_overhead);
+  }
+#endif
   nvm3_save_stat(stats);
 #endif
 
@@ -652,3 +1236,43 @@ void dongle_download_info()
   log_infof("Packets Received: %lu\r\n", download->n_total_packets);
   log_infof("Data bytes downloaded: %lu\r\n", download->packet_buffer.received);
 }
+
+void dongle_on_sync_data(uint8_t *data, uint8_t data_len, uint8_t status,
+    int8_t rssi)
+{
+  // a single PDU carrying one risk packet
+  if (status == SYNC_DATA_COMPLETE && chain_len == 0) {
+    dongle_on_periodic_data(data, data_len, rssi);
+    return;
+  }
+
+  if (status == SYNC_DATA_TRUNCATED ||
+      chain_len + data_len > PER_ADV_CHAIN_SIZE) {
+    chain_len = 0;
+    dongle_on_periodic_data_error(rssi);
+    return;
+  }
+
+  memcpy(chain_data + chain_len, data, data_len);
+  chain_len += data_len;
+
+  if (status == SYNC_DATA_PARTIAL)
+    return;
+
+#if MODE__STAT
+  stats->stat_ints.num_periodic_data_chained++;
+#endif
+
+  // the train is complete, hand over its risk packets one at a time
+  for (uint16_t off = 0; off < chain_len; off += PER_ADV_SIZE) {
+    // remaining packets would start another download
+    if (dongle_download_complete_status() == 1)
+      break;
+
+    uint16_t len = (chain_len - off > PER_ADV_SIZE) ?
+      PER_ADV_SIZE : (chain_len - off);
+    dongle_on_periodic_data(chain_data + off, len, rssi);
+  }
+
+  chain_len = 0;
+}
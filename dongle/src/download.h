@@ -2,10 +2,40 @@
 #define DONGLE_DOWNLOAD__H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include "common/src/constants.h"
 #include "storage.h"
 
+#if DONGLE_PAYLOAD_AUTH
+#include "psa/crypto.h"
+#endif
+
+/*
+ * chunks matched by the last completed download, kept in nvm3 so that
+ * unchanged chunks can be skipped by the next download
+ */
+typedef struct {
+  uint32_t valid;
+  uint32_t payload_ver;
+  uint32_t numchunks;
+  // log head when that download started
+  enctr_entry_counter_t en_head;
+  // dongle time when that download completed
+  dongle_timer_t t_matched;
+  uint32_t chunk_crc[MAX_NUM_CHUNKS];
+#if DONGLE_PAYLOAD_AUTH
+  /*
+   * manifest hash of each matched chunk. the crc and payload version in
+   * the packet headers are not signed, so with authentication a chunk
+   * only counts as unchanged if the verified manifest lists this hash.
+   */
+  uint8_t chunk_hash[MAX_NUM_CHUNKS][RISK_CHUNK_HASH_LEN];
+#endif
+} download_delta_t;
+
+#define DOWNLOAD_DELTA_HDR_SIZE (offsetof(download_delta_t, chunk_crc))
+
 typedef struct {
   int is_active;
   double time;
@@ -13,6 +43,23 @@ typedef struct {
   uint32_t n_total_packets;
   uint32_t n_corrupt_packets;
   uint32_t n_matches;
+  // number of data packets rebuilt from parity packets
+  uint32_t n_fec_recovered;
+  // number of completed chunks that failed the integrity check
+  uint32_t n_crc_fail;
+  // number of completed chunks that did not match the manifest
+  uint32_t n_auth_fail;
+  // time spent hashing chunks and verifying the manifest, in ms
+  float auth_time;
+  // number of chunks skipped because they were matched by a past download
+  uint32_t n_chunks_skipped;
+  // payload version and log head at the start of this download
+  uint32_t payload_ver;
+  enctr_entry_counter_t delta_head;
+  // encounters logged since the last match may be in unchanged chunks
+  int delta_rematch;
+  // secondary PHY of the periodic train being downloaded
+  uint8_t phy;
   struct {
     // number of unique packets seen
     int num_distinct;
@@ -34,16 +81,52 @@ typedef struct {
     struct {
       // map of sequence number to packet count for that number
       // used to track completion of the download
-      int8_t counts[MAX_NUM_PACKETS_PER_FILTER];
+      // parity packets are counted after the data packets
+      int8_t counts[MAX_NUM_PACKETS_PER_FILTER +
+        MAX_NUM_FEC_PACKETS_PER_FILTER];
+      // number of data packets in the chunk, derived from chunklen
+      uint8_t num_pkts;
+      // already matched, see download_delta_t
+      uint8_t skipped;
+      uint32_t crc;
     } chunk_arr[MAX_NUM_CHUNKS];
 
-    // actual received payload
+    // actual received payload, padded to a whole number of packets
     struct {
       uint64_t data_len;
-      uint8_t data[CF_SIZE_BYTES];
+      uint8_t data[MAX_NUM_PACKETS_PER_FILTER * MAX_PAYLOAD_SIZE];
+      // chunk whose payload currently occupies each packet slot
+      uint32_t slot_chunkid[MAX_NUM_PACKETS_PER_FILTER];
     } buffer;
 
+    // parity payloads received for one chunk
+    struct {
+      uint32_t chunkid;
+      uint8_t valid[MAX_NUM_FEC_PACKETS_PER_FILTER];
+      uint8_t data[MAX_NUM_FEC_PACKETS_PER_FILTER][MAX_PAYLOAD_SIZE];
+    } fec;
+
+    // running CRC over the contiguous prefix of a chunk received so far
+    struct {
+      uint32_t chunkid;
+      uint32_t crc;
+      uint32_t next_seq;
+#if DONGLE_PAYLOAD_AUTH
+      psa_hash_operation_t hash_op;
+#endif
+    } crc;
+
   } packet_buffer;
+
+#if DONGLE_PAYLOAD_AUTH
+  // signed manifest of chunk hashes for the current payload
+  struct {
+    int verified;
+    uint32_t len;
+    int8_t counts[MAX_NUM_PACKETS_PER_MANIFEST];
+    uint8_t data[MAX_NUM_PACKETS_PER_MANIFEST * MAX_PAYLOAD_SIZE];
+  } manifest;
+#endif
 } download_t;
 
 typedef struct enctr_bitmap {
@@ -70,15 +153,24 @@ typedef struct enctr_bitmap {
     dongle_download_duplication(s, d); \
     float loss_est = dongle_download_estimate_loss(d); \
     stat_add(loss_est, s.est_pkt_loss);  \
+    stat_add(loss_est, s.phy[PER_ADV_PHY_IDX(d->phy)].est_pkt_loss); \
+    stat_add(d->n_fec_recovered, s.chunk.fec_recovered); \
+    stat_add(d->n_crc_fail, s.chunk.crc_fail); \
+    stat_add(d->n_auth_fail, s.chunk.auth_fail); \
+    stat_add(d->n_chunks_skipped, s.chunk.skipped); \
   } while (0)
 
 void dongle_download_init();
+int dongle_download_auth_init(const pubkey_t *backend_pk, key_size_t backend_pk_size);
+void dongle_download_reset_delta();
 void dongle_download_info();
 void dongle_download_complete();
 void dongle_download_fail();
 
 void dongle_on_periodic_data(uint8_t *data, uint8_t data_len, int8_t rssi);
 void dongle_on_periodic_data_error(int8_t rssi);
+void dongle_on_sync_data(uint8_t *data, uint8_t data_len, uint8_t status,
+    int8_t rssi);
 void dongle_on_sync_lost();
 
 int dongle_download_complete_status();
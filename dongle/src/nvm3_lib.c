@@ -40,14 +40,35 @@ enum {
   NVM3_MAX_COUNTERS
 };
 
+/*
+ * objects added after the encounter bitmap keys, so that the keys of
+ * existing objects stay the same
+ */
+#define NUM_DELTA_CRC_PER_NVM3_KEY 32
+#define NUM_NVM3_DELTA_CRC_KEYS \
+  (((MAX_NUM_CHUNKS - 1) / NUM_DELTA_CRC_PER_NVM3_KEY) + 1)
+#define NUM_DELTA_HASH_PER_NVM3_KEY 16
+#define NUM_NVM3_DELTA_HASH_KEYS \
+  (((MAX_NUM_CHUNKS - 1) / NUM_DELTA_HASH_PER_NVM3_KEY) + 1)
+
+enum {
+  NVM3_STAT_ALL_DWNLD_CHUNK = NVM3_MAX_COUNTERS + NUM_NVM3_BITMAP_KEYS,
+  NVM3_STAT_COMPLETED_DWNLD_CHUNK,
+  NVM3_STAT_ALL_DWNLD_PHY,
+  NVM3_STAT_COMPLETED_DWNLD_PHY,
+  NVM3_DWNLD_DELTA_HDR,
+  NVM3_DWNLD_DELTA_CRC,
+  NVM3_DWNLD_DELTA_HASH = NVM3_DWNLD_DELTA_CRC + NUM_NVM3_DELTA_CRC_KEYS,
+  NVM3_MAX_KEYS = NVM3_DWNLD_DELTA_HASH + NUM_NVM3_DELTA_HASH_KEYS
+};
+
 int NVM3_ENCTR_RISK_MAP[NUM_NVM3_BITMAP_KEYS];
 
 extern dongle_timer_t last_download_start_time;
 
 // Max and min keys for data objects
 #define MIN_DATA_KEY  NVM3_KEY_MIN
-#define MAX_DATA_KEY  \
-  (MIN_DATA_KEY + NVM3_MAX_COUNTERS + NUM_NVM3_BITMAP_KEYS - 1)
+#define MAX_DATA_KEY  (MIN_DATA_KEY + NVM3_MAX_KEYS - 1)
 
 
 /*******************************************************************************
@@ -92,9 +113,8 @@ void nvm3_app_init(void)
 
 size_t nvm3_count_objects(void)
 {
-  nvm3_ObjectKey_t keys[NVM3_MAX_COUNTERS + NUM_NVM3_BITMAP_KEYS];
-  memset(keys, 0, sizeof(nvm3_ObjectKey_t) *
-      (NVM3_MAX_COUNTERS + NUM_NVM3_BITMAP_KEYS));
+  nvm3_ObjectKey_t keys[NVM3_MAX_KEYS];
+  memset(keys, 0, sizeof(nvm3_ObjectKey_t) * NVM3_MAX_KEYS);
 
   size_t nvm3_objcnt = nvm3_enumObjects(NVM3_DEFAULT_HANDLE, (uint32_t *) keys,
       sizeof(keys)/sizeof(keys[0]), MIN_DATA_KEY, MAX_DATA_KEY);
@@ -147,23 +167,53 @@ void nvm3_save_clock_cursor(dongle_config_t *cfg)
 #undef nvm3_write
 }
 
+/*
+ * write a stats object only if it differs from the stored one. most
+ * objects, e.g. the download stats, do not change between reports, and
+ * every write takes space in nvm3 that has to be reclaimed by an erase.
+ */
+static Ecode_t _nvm3_write_changed_(nvm3_ObjectKey_t key, const void *objp,
+    size_t len, int *num_written)
+{
+  uint8_t buf[NVM3_DEFAULT_MAX_OBJECT_SIZE];
+
+  if (len <= sizeof(buf) &&
+      nvm3_readData(NVM3_DEFAULT_HANDLE, key, buf, len) == ECODE_NVM3_OK &&
+      memcmp(buf, objp, len) == 0) {
+    return ECODE_NVM3_OK;
+  }
+
+  (*num_written)++;
+  return nvm3_writeData(NVM3_DEFAULT_HANDLE, key, objp, len);
+}
+
 void nvm3_save_stat(void *stat)
 {
-  Ecode_t err[NVM3_MAX_COUNTERS] __attribute__((unused));
+  Ecode_t err[NVM3_MAX_KEYS] __attribute__((unused));
   dongle_stats_t *statp = NULL;
+  int num_written = 0;
 
   statp = (dongle_stats_t *) stat;
 
-#define nvm3_write(cntr_id, objp)  \
-  err[cntr_id] = nvm3_writeData(NVM3_DEFAULT_HANDLE, cntr_id, \
-                    (objp), sizeof(*(objp)))
+#define nvm3_write_len(cntr_id, objp, len)  \
+  err[cntr_id] = _nvm3_write_changed_(cntr_id, (objp), (len), &num_written)
+#define nvm3_write(cntr_id, objp) nvm3_write_len(cntr_id, objp, sizeof(*(objp)))
 
   nvm3_write(NVM3_STAT_INTS, &(statp->stat_ints));
   nvm3_write(NVM3_STAT_GROUP, &(statp->stat_grp));
-  nvm3_write(NVM3_STAT_ALL_DWNLD, &(statp->all_download_stats));
-  nvm3_write(NVM3_STAT_COMPLETED_DWNLD, &(statp->completed_download_stats));
-  log_expf("[NVM3] write dwnld: %u -> %u #ephids: %.0f "
+  nvm3_write_len(NVM3_STAT_ALL_DWNLD, &(statp->all_download_stats),
+      DOWNLOAD_STATS_BASE_SIZE);
+  nvm3_write_len(NVM3_STAT_COMPLETED_DWNLD,
+      &(statp->completed_download_stats), DOWNLOAD_STATS_BASE_SIZE);
+  nvm3_write(NVM3_STAT_ALL_DWNLD_CHUNK, &(statp->all_download_stats.chunk));
+  nvm3_write(NVM3_STAT_COMPLETED_DWNLD_CHUNK,
+      &(statp->completed_download_stats.chunk));
+  nvm3_write(NVM3_STAT_ALL_DWNLD_PHY, &(statp->all_download_stats.phy));
+  nvm3_write(NVM3_STAT_COMPLETED_DWNLD_PHY,
+      &(statp->completed_download_stats.phy));
+  log_expf("[NVM3] write %d objs dwnld: %u -> %u #ephids: %.0f "
       "#scans: %.0f #bytes: %.0f errs: 0x%0x 0x%0x 0x%0x 0x%0x\r\n",
+      num_written,
       last_download_start_time, statp->stat_ints.last_download_end_time,
       statp->stat_grp.enctr_rssi.n, statp->stat_grp.scan_rssi.n,
       (statp->all_download_stats.n_bytes.mu *
@@ -172,6 +222,7 @@ void nvm3_save_stat(void *stat)
       err[NVM3_STAT_COMPLETED_DWNLD]);
 
 #undef nvm3_write
+#undef nvm3_write_len
 }
 
 void nvm3_save_enctr_bmap(enctr_bitmap_t *enctr_bmap)
@@ -197,19 +248,27 @@ void nvm3_save_enctr_bmap(enctr_bitmap_t *enctr_bmap)
 
 void nvm3_load_stat(void *stat)
 {
-  Ecode_t err[NVM3_MAX_COUNTERS] __attribute__((unused));
+  Ecode_t err[NVM3_MAX_KEYS] __attribute__((unused));
   dongle_stats_t *statp = NULL;
 
   statp = (dongle_stats_t *) stat;
 
-#define nvm3_read(cntr_id, valp)  \
-  err[cntr_id] = nvm3_readData(NVM3_DEFAULT_HANDLE, cntr_id,  \
-                    (valp), sizeof(*(valp)))
+#define nvm3_read_len(cntr_id, valp, len)  \
+  err[cntr_id] = nvm3_readData(NVM3_DEFAULT_HANDLE, cntr_id, (valp), (len))
+#define nvm3_read(cntr_id, valp) nvm3_read_len(cntr_id, valp, sizeof(*(valp)))
 
   nvm3_read(NVM3_STAT_INTS, &(statp->stat_ints));
   nvm3_read(NVM3_STAT_GROUP, &(statp->stat_grp));
-  nvm3_read(NVM3_STAT_ALL_DWNLD, &(statp->all_download_stats));
-  nvm3_read(NVM3_STAT_COMPLETED_DWNLD, &(statp->completed_download_stats));
+  nvm3_read_len(NVM3_STAT_ALL_DWNLD, &(statp->all_download_stats),
+      DOWNLOAD_STATS_BASE_SIZE);
+  nvm3_read_len(NVM3_STAT_COMPLETED_DWNLD,
+      &(statp->completed_download_stats), DOWNLOAD_STATS_BASE_SIZE);
+  nvm3_read(NVM3_STAT_ALL_DWNLD_CHUNK, &(statp->all_download_stats.chunk));
+  nvm3_read(NVM3_STAT_COMPLETED_DWNLD_CHUNK,
+      &(statp->completed_download_stats.chunk));
+  nvm3_read(NVM3_STAT_ALL_DWNLD_PHY, &(statp->all_download_stats.phy));
+  nvm3_read(NVM3_STAT_COMPLETED_DWNLD_PHY,
+      &(statp->completed_download_stats.phy));
   log_expf("[NVM3] read dwnld: %lu -> %lu #ephids: %.0f "
       "#scans: %.0f #bytes: %.0f ret: 0x%0x 0x%0x 0x%0x 0x%0x\r\n",
       last_download_start_time, statp->stat_ints.last_download_end_time,
@@ -220,6 +279,7 @@ void nvm3_load_stat(void *stat)
       err[NVM3_STAT_COMPLETED_DWNLD]);
 
 #undef nvm3_read
+#undef nvm3_read_len
 }
 
 void nvm3_load_config(dongle_config_t *cfg)
@@ -238,8 +298,12 @@ void nvm3_load_config(dongle_config_t *cfg)
   memset(tmp_stats, 0, sizeof(dongle_stats_t));
   nvm3_read(NVM3_STAT_INTS, &(tmp_stats->stat_ints));
   nvm3_read(NVM3_STAT_GROUP, &(tmp_stats->stat_grp));
-  nvm3_read(NVM3_STAT_ALL_DWNLD, &(tmp_stats->all_download_stats));
-  nvm3_read(NVM3_STAT_COMPLETED_DWNLD, &(tmp_stats->completed_download_stats));
+  err[NVM3_STAT_ALL_DWNLD] = nvm3_readData(NVM3_DEFAULT_HANDLE,
+      NVM3_STAT_ALL_DWNLD, &(tmp_stats->all_download_stats),
+      DOWNLOAD_STATS_BASE_SIZE);
+  err[NVM3_STAT_COMPLETED_DWNLD] = nvm3_readData(NVM3_DEFAULT_HANDLE,
+      NVM3_STAT_COMPLETED_DWNLD, &(tmp_stats->completed_download_stats),
+      DOWNLOAD_STATS_BASE_SIZE);
 
   int i = 0, found_err = 0;
   for (i = 0; i < NVM3_MAX_COUNTERS; i++) {
@@ -290,6 +354,65 @@ void nvm3_load_enctr_bmap(enctr_bitmap_t *enctr_bmap)
   }
 }
 
+void nvm3_save_download_delta(download_delta_t *delta)
+{
+  if (!delta)
+    return;
+
+  Ecode_t err __attribute__((unused));
+
+  err = nvm3_writeData(NVM3_DEFAULT_HANDLE, NVM3_DWNLD_DELTA_HDR, delta,
+      DOWNLOAD_DELTA_HDR_SIZE);
+  for (unsigned int i = 0; i < NUM_NVM3_DELTA_CRC_KEYS; i++) {
+    err |= nvm3_writeData(NVM3_DEFAULT_HANDLE, NVM3_DWNLD_DELTA_CRC + i,
+        &delta->chunk_crc[i*NUM_DELTA_CRC_PER_NVM3_KEY],
+        sizeof(uint32_t)*NUM_DELTA_CRC_PER_NVM3_KEY);
+  }
+#if DONGLE_PAYLOAD_AUTH
+  for (unsigned int i = 0; i < NUM_NVM3_DELTA_HASH_KEYS; i++) {
+    err |= nvm3_writeData(NVM3_DEFAULT_HANDLE, NVM3_DWNLD_DELTA_HASH + i,
+        delta->chunk_hash[i*NUM_DELTA_HASH_PER_NVM3_KEY],
+        RISK_CHUNK_HASH_LEN*NUM_DELTA_HASH_PER_NVM3_KEY);
+  }
+#endif
+
+  log_infof("[NVM3] delta ver: 0x%08lx #chunks: %lu H: %u t: %u err: 0x%0x\r\n",
+      delta->payload_ver, delta->numchunks, delta->en_head,
+      delta->t_matched, err);
+}
+
+void nvm3_load_download_delta(download_delta_t *delta)
+{
+  if (!delta)
+    return;
+
+  Ecode_t err;
+
+  memset(delta, 0, sizeof(download_delta_t));
+  err = nvm3_readData(NVM3_DEFAULT_HANDLE, NVM3_DWNLD_DELTA_HDR, delta,
+      DOWNLOAD_DELTA_HDR_SIZE);
+  for (unsigned int i = 0; i < NUM_NVM3_DELTA_CRC_KEYS; i++) {
+    err |= nvm3_readData(NVM3_DEFAULT_HANDLE, NVM3_DWNLD_DELTA_CRC + i,
+        &delta->chunk_crc[i*NUM_DELTA_CRC_PER_NVM3_KEY],
+        sizeof(uint32_t)*NUM_DELTA_CRC_PER_NVM3_KEY);
+  }
+#if DONGLE_PAYLOAD_AUTH
+  for (unsigned int i = 0; i < NUM_NVM3_DELTA_HASH_KEYS; i++) {
+    err |= nvm3_readData(NVM3_DEFAULT_HANDLE, NVM3_DWNLD_DELTA_HASH + i,
+        delta->chunk_hash[i*NUM_DELTA_HASH_PER_NVM3_KEY],
+        RISK_CHUNK_HASH_LEN*NUM_DELTA_HASH_PER_NVM3_KEY);
+  }
+#endif
+
+  // missing or partial state, next download matches every chunk
+  if (err != ECODE_NVM3_OK)
+    memset(delta, 0, sizeof(download_delta_t));
+
+  log_expf("[NVM3] delta valid: %lu ver: 0x%08lx #chunks: %lu H: %u t: %u "
+      "err: 0x%0x\r\n", delta->valid, delta->payload_ver, delta->numchunks,
+      delta->en_head, delta->t_matched, err);
+}
+
 /***************************************************************************//**
  * NVM3 ticking function.
  ******************************************************************************/
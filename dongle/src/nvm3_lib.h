@@ -41,10 +41,12 @@ void nvm3_save_config(dongle_config_t *cfg);
 void nvm3_save_clock_cursor(dongle_config_t *cfg);
 void nvm3_save_stat(void *stat);
 void nvm3_save_enctr_bmap(enctr_bitmap_t *bmap);
+void nvm3_save_download_delta(download_delta_t *delta);
 
 void nvm3_load_stat(void *stat);
 void nvm3_load_config(dongle_config_t *cfg);
 void nvm3_load_enctr_bmap(enctr_bitmap_t *bmap);
+void nvm3_load_download_delta(download_delta_t *delta);
 
 /***************************************************************************//**
  * NVM3 ticking function
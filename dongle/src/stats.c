@@ -61,6 +61,17 @@ void dongle_download_show_stats(download_stats_t *stats, char *name)
   stat_show(stats->est_pkt_loss, "Estimated loss rate", "% packets");
   stat_show(stats->n_bytes, "Bytes Received", "bytes");
   stat_show(stats->syncs_lost, "Syncs Lost", "syncs");
+  stat_show(stats->chunk.fec_recovered, "FEC Recovered", "packets");
+  stat_show(stats->chunk.crc_fail, "Chunk CRC Failures", "chunks");
+  stat_show(stats->chunk.auth_fail, "Chunk Auth Failures", "chunks");
+  stat_show(stats->chunk.auth_overhead, "Auth Overhead", "% download time");
+  stat_show(stats->chunk.skipped, "Unchanged Chunks Skipped", "chunks");
+  stat_show(stats->phy[0].est_pkt_loss, "[1M] Estimated loss rate",
+      "% packets");
+  stat_show(stats->phy[0].latency, "[1M] Download latency", "ms");
+  stat_show(stats->phy[1].est_pkt_loss, "[2M] Estimated loss rate",
+      "% packets");
+  stat_show(stats->phy[1].latency, "[2M] Download latency", "ms");
 }
 
 void dongle_stats(dongle_stats_t *stats)
@@ -74,13 +85,16 @@ void dongle_stats(dongle_stats_t *stats)
       "[Period adv] Data RSSI", "");
   stat_show(stats->stat_grp.periodic_data_size,
       "[Period adv] Pkt size", "bytes");
-  log_expf("[Period adv] #rcvd: %.02f, #error: %lu, #bytes: %.02f"
-      ", time: %.02f s, xput: %.02f Kbps\r\n",
+  log_expf("[Period adv] #rcvd: %.02f, #error: %lu, #chained: %lu, "
+      "#bytes: %.02f, time: %.02f s, xput: %.02f Kbps\r\n",
       stats->stat_grp.periodic_data_size.n,
       stats->stat_ints.num_periodic_data_error,
+      stats->stat_ints.num_periodic_data_chained,
       (stats->stat_grp.periodic_data_size.mu *
        stats->stat_grp.periodic_data_size.n),
       stats->stat_ints.total_periodic_data_time, xput);
+  log_expf("[Period adv] 2M sync fails: %lu, fallbacks to 1M: %lu\r\n",
+      stats->stat_ints.num_2m_sync_fails, stats->stat_ints.num_2m_fallbacks);
 
   // ignore printing stats if no downloads even started
   // may be because beacon not configured to broadcast risk data yet
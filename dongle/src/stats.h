@@ -2,6 +2,7 @@
 #define DONGLE_STATS__H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include "dongle.h"
 #include "storage.h"
@@ -10,13 +11,37 @@
 
 typedef int download_fail_reason;
 
+// periodic adv. secondary PHYs that download stats are kept for
+#define NUM_PER_ADV_PHYS 2
+#define PER_ADV_PHY_IDX(phy) ((phy) == sl_bt_gap_2m_phy ? 1 : 0)
+
 typedef struct {
   stat_t pkt_duplication;
   stat_t n_bytes;
   stat_t syncs_lost;
   stat_t est_pkt_loss;
+  /*
+   * per-chunk recovery and integrity stats, saved as a separate nvm3
+   * object to stay within NVM3_DEFAULT_MAX_OBJECT_SIZE
+   */
+  struct {
+    stat_t fec_recovered;
+    stat_t crc_fail;
+    stat_t auth_fail;
+    stat_t auth_overhead;   // % of download time
+    stat_t skipped;
+  } chunk;
+  /*
+   * per secondary PHY loss and latency, saved as one more nvm3 object
+   */
+  struct {
+    stat_t est_pkt_loss;
+    stat_t latency;   // completed downloads only
+  } phy[NUM_PER_ADV_PHYS];
 } download_stats_t;
 
+#define DOWNLOAD_STATS_BASE_SIZE (offsetof(download_stats_t, chunk))
+
 typedef struct {
   /*
    * last report time
@@ -65,6 +90,16 @@ typedef struct {
    */
   download_fail_reason switch_chunk;
   double total_periodic_data_time;   // seconds
+  /*
+   * # of syncs on 2M closed before the download completed, and
+   * # of times the dongle fell back to 1M trains
+   */
+  uint32_t num_2m_sync_fails;
+  uint32_t num_2m_fallbacks;
+  /*
+   * number of chained periodic adv. trains reassembled
+   */
+  uint32_t num_periodic_data_chained;
 } stat_ints_t;
 
 typedef struct {
@@ -2,6 +2,7 @@
 #include "dongle.h"
 #include "nvm3_lib.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "common/src/platform/gecko.h"
@@ -13,6 +14,7 @@
 
 #define OTP(i) (DONGLE_OTPSTORE_OFFSET + (i * sizeof(dongle_otp_t)))
 
+extern dongle_config_t config;
 extern dongle_stats_t stats;
 extern enctr_bitmap_t enctr_bmap;
 
@@ -48,6 +50,47 @@ static inline int _flash_write_(storage_addr_t off, void *data, size_t size)
   return MSC_WriteWord((uint32_t *) off, data, (uint32_t)size);
 }
 
+/*
+ * read-only view of size bytes of the config at off, flash being memory
+ * mapped. NULL if the range is not within the config page.
+ */
+static const void *_config_view_(storage_addr_t off, size_t size)
+{
+  if (off < DONGLE_CONFIG_OFFSET ||
+      off + size > DONGLE_CONFIG_OFFSET + FLASH_DEVICE_PAGE_SIZE) {
+    log_errorf("config view 0x%x (%u B) outside config page 0x%x\r\n",
+        off, size, DONGLE_CONFIG_OFFSET);
+    return NULL;
+  }
+  return (const void *) off;
+}
+
+/*
+ * copy the keys to RAM before the config page they are viewed in is
+ * erased, the copy is written back by the caller
+ */
+static uint8_t *_config_copy_keys_(dongle_config_t *cfg)
+{
+  uint8_t *keys = malloc(sizeof(pubkey_t) + sizeof(seckey_t));
+  if (!keys) {
+    log_errorf("%s", "no memory to copy the keys, config not saved\r\n");
+    return NULL;
+  }
+
+  memset(keys, 0, sizeof(pubkey_t) + sizeof(seckey_t));
+  if (cfg->backend_pk)
+    memcpy(keys, cfg->backend_pk, sizeof(pubkey_t));
+  if (cfg->dongle_sk)
+    memcpy(keys + sizeof(pubkey_t), cfg->dongle_sk, sizeof(seckey_t));
+  return keys;
+}
+
+static void _config_view_keys_(dongle_config_t *cfg)
+{
+  cfg->backend_pk = _config_view_(DONGLE_CONFIG_PK_OFFSET, sizeof(pubkey_t));
+  cfg->dongle_sk = _config_view_(DONGLE_CONFIG_SK_OFFSET, sizeof(seckey_t));
+}
+
 static inline void dongle_storage_init_device(void)
 {
   MSC_ExecConfig_TypeDef execConfig = MSC_EXECCONFIG_DEFAULT;
@@ -76,10 +119,14 @@ void dongle_storage_load_config(dongle_config_t *cfg)
         cfg->backend_pk_size, PK_MAX_SIZE);
     cfg->backend_pk_size = PK_MAX_SIZE;
   }
-  read(cfg->backend_pk_size, cfg->backend_pk);
-  hexdumpn(cfg->backend_pk->bytes, 16, "   Server PK");
-  // slide through the extra space for a pubkey
-  off += PK_MAX_SIZE - cfg->backend_pk_size;
+  // keys are not copied to RAM, the config points at them in flash
+  cfg->backend_pk = _config_view_(off, sizeof(pubkey_t));
+  if (!cfg->backend_pk)
+    cfg->backend_pk_size = 0;
+  else {
+    hexdumpn(cfg->backend_pk->bytes, 16, "   Server PK");
+  }
+  off += PK_MAX_SIZE;
 
   read(sizeof(key_size_t), &cfg->dongle_sk_size);
   log_infof("dongle key off: %u, size: %u\r\n", off, cfg->dongle_sk_size);
@@ -88,10 +135,13 @@ void dongle_storage_load_config(dongle_config_t *cfg)
         cfg->dongle_sk_size, SK_MAX_SIZE);
     cfg->dongle_sk_size = SK_MAX_SIZE;
   }
-  read(cfg->dongle_sk_size, cfg->dongle_sk);
-  hexdumpn(cfg->dongle_sk->bytes, 16, "Si Dongle SK");
-  // slide through the extra space for a pubkey
-  off += SK_MAX_SIZE - cfg->dongle_sk_size;
+  cfg->dongle_sk = _config_view_(off, sizeof(seckey_t));
+  if (!cfg->dongle_sk)
+    cfg->dongle_sk_size = 0;
+  else {
+    hexdumpn(cfg->dongle_sk->bytes, 16, "Si Dongle SK");
+  }
+  off += SK_MAX_SIZE;
 
   read(sizeof(uint32_t), &cfg->en_tail);
   read(sizeof(uint32_t), &cfg->en_head);
@@ -111,6 +161,10 @@ void dongle_storage_save_config(dongle_config_t *cfg)
   char statbuf[sizeof(dongle_stats_t)];
   _flash_read_(DONGLE_STATSTORE_OFFSET, statbuf, sizeof(dongle_stats_t));
 
+  uint8_t *keys = _config_copy_keys_(cfg);
+  if (!keys)
+    return;
+
   pre_erase(off, total_size);
 
 #define write(data, size) \
@@ -120,11 +174,13 @@ void dongle_storage_save_config(dongle_config_t *cfg)
   write(&cfg->t_init, sizeof(dongle_timer_t));
   write(&cfg->t_cur, sizeof(dongle_timer_t));
   write(&cfg->backend_pk_size, sizeof(key_size_t));
-  write(cfg->backend_pk, PK_MAX_SIZE);
+  write(keys, PK_MAX_SIZE);
   write(&cfg->dongle_sk_size, sizeof(key_size_t));
-  write(cfg->dongle_sk, SK_MAX_SIZE);
+  write(keys + sizeof(pubkey_t), SK_MAX_SIZE);
   write(&cfg->en_tail, sizeof(uint32_t));
   write(&cfg->en_head, sizeof(uint32_t));
+  free(keys);
+  _config_view_keys_(cfg);
 
   // write OTPs
   off = OTP(0);
@@ -322,6 +378,10 @@ void dongle_storage_save_stat(dongle_config_t *cfg __attribute__((unused)),
   dongle_otp_t otps[NUM_OTP];
   _flash_read_(OTP(0), otps, NUM_OTP*sizeof(dongle_otp_t));
 
+  uint8_t *keys = _config_copy_keys_(cfg);
+  if (!keys)
+    return;
+
   pre_erase(DONGLE_CONFIG_OFFSET, total_size);
 
 #define write(data, size) \
@@ -331,11 +391,13 @@ void dongle_storage_save_stat(dongle_config_t *cfg __attribute__((unused)),
   write(&cfg->t_init, sizeof(dongle_timer_t));
   write(&cfg->t_cur, sizeof(dongle_timer_t));
   write(&cfg->backend_pk_size, sizeof(key_size_t));
-  write(cfg->backend_pk, PK_MAX_SIZE);
+  write(keys, PK_MAX_SIZE);
   write(&cfg->dongle_sk_size, sizeof(key_size_t));
-  write(cfg->dongle_sk, SK_MAX_SIZE);
+  write(keys + sizeof(pubkey_t), SK_MAX_SIZE);
   write(&cfg->en_tail, sizeof(uint32_t));
   write(&cfg->en_head, sizeof(uint32_t));
+  free(keys);
+  _config_view_keys_(cfg);
 
   _flash_write_(DONGLE_OTPSTORE_OFFSET, otps, NUM_OTP*sizeof(dongle_otp_t));
   _flash_write_(DONGLE_STATSTORE_OFFSET, stat, len);
@@ -346,4 +408,37 @@ void dongle_storage_read_stat(void * stat, size_t len __attribute__((unused)))
   _flash_read_(DONGLE_STATSTORE_OFFSET, stat, len);
 }
 
+int dongle_storage_config_is_new(void *sto_stats)
+{
+  uint32_t ack;
+  _flash_read_(DONGLE_CONFIG_ACK_OFFSET, &ack, sizeof(uint32_t));
+  if (ack == DONGLE_CONFIG_ACK)
+    return 0;
+
+  // not acknowledged yet, or set up by a version that rewrote the page
+  return ((dongle_stats_t *) sto_stats)->storage_checksum !=
+    DONGLE_STORAGE_STAT_CHKSUM;
+}
+
+void dongle_storage_ack_config(dongle_config_t *cfg, void *sto_stats)
+{
+  uint32_t ack;
+  _flash_read_(DONGLE_CONFIG_ACK_OFFSET, &ack, sizeof(uint32_t));
+  if (ack == DONGLE_CONFIG_ACK)
+    return;
+
+  if (ack == 0xffffffff) {
+    ack = DONGLE_CONFIG_ACK;
+    _flash_write_(DONGLE_CONFIG_ACK_OFFSET, &ack, sizeof(uint32_t));
+    return;
+  }
+
+  // the page was flashed with data past the stats object
+  log_errorf("config ack word 0x%x not erased, rewriting config page\r\n",
+      ack);
+  ((dongle_stats_t *) sto_stats)->storage_checksum =
+    DONGLE_STORAGE_STAT_CHKSUM;
+  dongle_storage_save_stat(cfg, sto_stats, sizeof(dongle_stats_t));
+}
+
 #undef next_multiple
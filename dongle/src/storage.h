@@ -85,6 +85,16 @@
    (2*sizeof(key_size_t)) + PK_MAX_SIZE + SK_MAX_SIZE + \
    (2*sizeof(enctr_entry_counter_t)))
 
+/*
+ * storage addresses of the keys in the config page, which are read in
+ * place instead of copied to RAM
+ */
+#define DONGLE_CONFIG_PK_OFFSET \
+  (DONGLE_CONFIG_OFFSET + sizeof(dongle_id_t) + \
+   (2*sizeof(dongle_timer_t)) + sizeof(key_size_t))
+#define DONGLE_CONFIG_SK_OFFSET \
+  (DONGLE_CONFIG_PK_OFFSET + PK_MAX_SIZE + sizeof(key_size_t))
+
 /*
  * storage address for OTPs
  */
@@ -97,6 +107,16 @@
 #define DONGLE_STATSTORE_OFFSET \
   (DONGLE_OTPSTORE_OFFSET + (NUM_OTP*sizeof(dongle_otp_t)))
 
+/*
+ * the config page is written once, by the config scripts. the dongle
+ * acknowledges a newly flashed config by writing DONGLE_CONFIG_ACK to
+ * the erased word after the stats object, instead of erasing the page
+ * and rewriting the keys to set the stats checksum.
+ */
+#define DONGLE_CONFIG_ACK_OFFSET \
+  (((DONGLE_STATSTORE_OFFSET + sizeof(dongle_stats_t)) + 3) & ~3)
+#define DONGLE_CONFIG_ACK 0x41434b31 // "ACK1"
+
 /*
  * space available for encounter log (in bytes)
  */
@@ -182,4 +202,16 @@ void dongle_storage_log_encounter(dongle_config_t *cfg,
 void dongle_storage_save_stat(dongle_config_t *cfg, void * stat, size_t len);
 void dongle_storage_read_stat(void * stat, size_t len);
 
+/*
+ * returns 1 if the config page was flashed since the dongle last
+ * acknowledged it, given the stats object read from the page
+ */
+int dongle_storage_config_is_new(void *sto_stats);
+
+/*
+ * acknowledge the flashed config. falls back to rewriting the page with
+ * the stats checksum if the ack word is not erased
+ */
+void dongle_storage_ack_config(dongle_config_t *cfg, void *sto_stats);
+
 #endif
@@ -0,0 +1,321 @@
+#include "ephid.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include "../../beacon/src/sha-2/sha-256.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define EPHID_X86 1
+#include <immintrin.h>
+#else
+#define EPHID_X86 0
+#endif
+
+/*
+ * records per sink call, a multiple of the eight AVX2 lanes
+ */
+#define EPHID_BATCH 256
+
+/*
+ * hash state after the secret key and location id of a beacon, shared
+ * by all its epochs. the epoch is hashed as the little endian bytes of
+ * the counter, as on the beacons.
+ */
+static void ephid_midstate(const ephid_beacon_t *beacon, struct Sha_256 *mid,
+    uint8_t mid_hash[SIZE_OF_SHA_256_HASH])
+{
+  sha_256_init(mid, mid_hash);
+  sha_256_write(mid, beacon->sk, beacon->sk_size);
+  sha_256_write(mid, &beacon->location_id, sizeof(beacon_location_id_t));
+}
+
+static void ephid_from_midstate(const struct Sha_256 *mid,
+    beacon_epoch_counter_t epoch, uint8_t id[BEACON_EPH_ID_HASH_LEN])
+{
+  struct Sha_256 h;
+  uint8_t d[SIZE_OF_SHA_256_HASH];
+
+  sha_256_copy(&h, mid, d);
+  sha_256_write(&h, &epoch, sizeof(beacon_epoch_counter_t));
+  sha_256_close(&h);
+  memcpy(id, d, BEACON_EPH_ID_HASH_LEN);
+}
+
+void ephid_compute(const ephid_beacon_t *beacon,
+    beacon_epoch_counter_t epoch, uint8_t id[BEACON_EPH_ID_HASH_LEN])
+{
+  struct Sha_256 mid;
+  uint8_t mid_hash[SIZE_OF_SHA_256_HASH];
+
+  ephid_midstate(beacon, &mid, mid_hash);
+  ephid_from_midstate(&mid, epoch, id);
+}
+
+static void gen_scalar(const ephid_beacon_t *beacon, const struct Sha_256 *mid,
+    beacon_epoch_counter_t first_epoch, uint32_t num_epochs,
+    ephid_record_t *recs)
+{
+  for (uint32_t i = 0; i < num_epochs; i++) {
+    recs[i].beacon_id = beacon->beacon_id;
+    recs[i].epoch = first_epoch + i;
+    ephid_from_midstate(mid, first_epoch + i, recs[i].id);
+  }
+}
+
+#if EPHID_X86
+static const uint32_t k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) \
+  _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define XOR3(x, y, z) _mm256_xor_si256(_mm256_xor_si256(x, y), z)
+#define ADD(x, y) _mm256_add_epi32(x, y)
+
+/*
+ * one SHA-256 compression of eight independent messages, one per
+ * 32-bit lane of the state and message words
+ */
+__attribute__((target("avx2")))
+static void sha256_x8_block(__m256i s[8], const __m256i m[16])
+{
+  __m256i w[16];
+  __m256i a = s[0], b = s[1], c = s[2], d = s[3];
+  __m256i e = s[4], f = s[5], g = s[6], h = s[7];
+
+  for (int i = 0; i < 64; i++) {
+    __m256i wi;
+    if (i < 16) {
+      wi = w[i] = m[i];
+    } else {
+      __m256i w15 = w[(i + 1) & 0xf], w2 = w[(i + 14) & 0xf];
+      __m256i s0 = XOR3(ROTR(w15, 7), ROTR(w15, 18), _mm256_srli_epi32(w15, 3));
+      __m256i s1 = XOR3(ROTR(w2, 17), ROTR(w2, 19), _mm256_srli_epi32(w2, 10));
+      wi = w[i & 0xf] = ADD(ADD(w[i & 0xf], s0), ADD(w[(i + 9) & 0xf], s1));
+    }
+
+    __m256i bsig1 = XOR3(ROTR(e, 6), ROTR(e, 11), ROTR(e, 25));
+    __m256i ch = _mm256_xor_si256(g, _mm256_and_si256(e, _mm256_xor_si256(f, g)));
+    __m256i t1 = ADD(ADD(h, bsig1), ADD(ch,
+          ADD(_mm256_set1_epi32((int) k[i]), wi)));
+    __m256i bsig0 = XOR3(ROTR(a, 2), ROTR(a, 13), ROTR(a, 22));
+    __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b),
+        _mm256_and_si256(c, _mm256_or_si256(a, b)));
+
+    h = g;
+    g = f;
+    f = e;
+    e = ADD(d, t1);
+    d = c;
+    c = b;
+    b = a;
+    a = ADD(t1, ADD(bsig0, maj));
+  }
+
+  s[0] = ADD(s[0], a);
+  s[1] = ADD(s[1], b);
+  s[2] = ADD(s[2], c);
+  s[3] = ADD(s[3], d);
+  s[4] = ADD(s[4], e);
+  s[5] = ADD(s[5], f);
+  s[6] = ADD(s[6], g);
+  s[7] = ADD(s[7], h);
+}
+
+#undef ADD
+#undef XOR3
+#undef ROTR
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+    (uint32_t) p[2] << 8 | (uint32_t) p[3];
+}
+
+/*
+ * finish the hash of eight epochs at a time from the midstate. all
+ * epochs of a beacon have the same padded tail except for the epoch
+ * bytes, which touch at most two message words.
+ */
+__attribute__((target("avx2")))
+static void gen_avx2(const ephid_beacon_t *beacon, const struct Sha_256 *mid,
+    beacon_epoch_counter_t first_epoch, uint32_t num_epochs,
+    ephid_record_t *recs)
+{
+  // the sha-2 library keeps the unprocessed bytes in its chunk buffer
+  const uint32_t buffered = SIZE_OF_SHA_256_CHUNK - mid->space_left;
+  const uint64_t bits = (uint64_t) (mid->total_len +
+      sizeof(beacon_epoch_counter_t)) * 8;
+  const int num_blocks = (buffered + sizeof(beacon_epoch_counter_t) + 1 + 8
+      <= SIZE_OF_SHA_256_CHUNK) ? 1 : 2;
+  const int ew = buffered / 4;  // first message word with epoch bytes
+  const int eoff = buffered % 4;
+  uint8_t tail[2 * SIZE_OF_SHA_256_CHUNK + 8];
+  uint32_t base[2 * 16];
+
+  memset(tail, 0, sizeof(tail));
+  memcpy(tail, mid->chunk, buffered);
+  tail[buffered + sizeof(beacon_epoch_counter_t)] = 0x80;
+  for (int i = 0; i < 8; i++)
+    tail[num_blocks * SIZE_OF_SHA_256_CHUNK - 1 - i] = (uint8_t) (bits >> (8 * i));
+  for (int j = 0; j < num_blocks * 16; j++)
+    base[j] = load_be32(tail + 4 * j);
+
+  for (uint32_t done = 0; done < num_epochs; done += 8) {
+    uint32_t lane_w[2][8];
+    for (int l = 0; l < 8; l++) {
+      beacon_epoch_counter_t epoch = first_epoch + done + l;
+      uint8_t t[8];
+      memcpy(t, tail + 4 * ew, sizeof(t));
+      memcpy(t + eoff, &epoch, sizeof(epoch));
+      lane_w[0][l] = load_be32(t);
+      lane_w[1][l] = load_be32(t + 4);
+    }
+
+    __m256i s[8];
+    for (int i = 0; i < 8; i++)
+      s[i] = _mm256_set1_epi32((int) mid->h[i]);
+
+    for (int blk = 0; blk < num_blocks; blk++) {
+      __m256i m[16];
+      for (int j = 0; j < 16; j++) {
+        int wj = blk * 16 + j;
+        if (wj == ew || (eoff > 0 && wj == ew + 1))
+          m[j] = _mm256_loadu_si256((const __m256i *) lane_w[wj - ew]);
+        else
+          m[j] = _mm256_set1_epi32((int) base[wj]);
+      }
+      sha256_x8_block(s, m);
+    }
+
+    uint32_t out[4][8];
+    for (int i = 0; i < 4; i++)
+      _mm256_storeu_si256((__m256i *) out[i], s[i]);
+
+    uint32_t n = num_epochs - done < 8 ? num_epochs - done : 8;
+    for (uint32_t l = 0; l < n; l++) {
+      ephid_record_t *rec = &recs[done + l];
+      uint8_t d[16];
+      for (int i = 0; i < 4; i++) {
+        d[4 * i] = out[i][l] >> 24;
+        d[4 * i + 1] = out[i][l] >> 16;
+        d[4 * i + 2] = out[i][l] >> 8;
+        d[4 * i + 3] = out[i][l];
+      }
+      rec->beacon_id = beacon->beacon_id;
+      rec->epoch = first_epoch + done + l;
+      memcpy(rec->id, d, BEACON_EPH_ID_HASH_LEN);
+    }
+  }
+}
+#endif
+
+int ephid_avx2_available(void)
+{
+#if EPHID_X86
+  return __builtin_cpu_supports("avx2");
+#else
+  return 0;
+#endif
+}
+
+typedef void (*gen_fn)(const ephid_beacon_t *beacon, const struct Sha_256 *mid,
+    beacon_epoch_counter_t first_epoch, uint32_t num_epochs,
+    ephid_record_t *recs);
+
+typedef struct {
+  const ephid_beacon_t *beacons;
+  size_t num_beacons;
+  const ephid_gen_params *params;
+  gen_fn gen;
+  size_t next_beacon;
+} gen_ctx;
+
+static void *gen_worker(void *arg)
+{
+  gen_ctx *ctx = (gen_ctx *) arg;
+  const ephid_gen_params *p = ctx->params;
+  ephid_record_t recs[EPHID_BATCH];
+  struct Sha_256 mid;
+  uint8_t mid_hash[SIZE_OF_SHA_256_HASH];
+  size_t i;
+
+  while ((i = __atomic_fetch_add(&ctx->next_beacon, 1, __ATOMIC_RELAXED)) <
+      ctx->num_beacons) {
+    const ephid_beacon_t *beacon = &ctx->beacons[i];
+    ephid_midstate(beacon, &mid, mid_hash);
+
+    for (uint32_t done = 0; done < p->num_epochs; done += EPHID_BATCH) {
+      uint32_t n = p->num_epochs - done < EPHID_BATCH ?
+        p->num_epochs - done : EPHID_BATCH;
+      ctx->gen(beacon, &mid, p->first_epoch + done, n, recs);
+      if (p->sink)
+        p->sink(recs, n, p->sink_arg);
+    }
+  }
+
+  return NULL;
+}
+
+int ephid_gen(const ephid_beacon_t *beacons, size_t num_beacons,
+    const ephid_gen_params *params)
+{
+  gen_ctx ctx = {
+    .beacons = beacons,
+    .num_beacons = num_beacons,
+    .params = params,
+    .gen = gen_scalar,
+    .next_beacon = 0,
+  };
+
+  for (size_t i = 0; i < num_beacons; i++) {
+    if (beacons[i].sk_size > SK_MAX_SIZE)
+      return -1;
+  }
+
+  switch (params->impl) {
+    case EPHID_IMPL_SCALAR:
+      break;
+    case EPHID_IMPL_AVX2:
+      if (!ephid_avx2_available())
+        return -1;
+      // fall through
+    case EPHID_IMPL_AUTO:
+#if EPHID_X86
+      if (ephid_avx2_available())
+        ctx.gen = gen_avx2;
+#endif
+      break;
+    default:
+      return -1;
+  }
+
+  int num_threads = params->num_threads > 0 ? params->num_threads : 1;
+  pthread_t tids[num_threads];
+  int started = 0;
+
+  for (; started < num_threads; started++) {
+    if (pthread_create(&tids[started], NULL, gen_worker, &ctx) != 0)
+      break;
+  }
+
+  // finish in this thread if no worker could be started
+  if (started == 0)
+    gen_worker(&ctx);
+
+  for (int t = 0; t < started; t++)
+    pthread_join(tids[t], NULL);
+
+  return 0;
+}
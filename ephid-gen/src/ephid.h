@@ -0,0 +1,77 @@
+#ifndef EPHID_H
+#define EPHID_H
+
+/*
+ * Bulk generation of beacon eph IDs on Linux, for building risk filters
+ * and testing matching at scale. Each ID is computed exactly as
+ * _gen_ephid_() on the beacons:
+ *
+ *   SHA-256(sk | location id | epoch) truncated to BEACON_EPH_ID_HASH_LEN
+ *
+ * The hash state after sk and location id is computed once per beacon.
+ * With AVX2, eight epochs of a beacon are then finished side by side,
+ * one per 32-bit lane. Beacons are spread over worker threads.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../common/src/constants.h"
+
+typedef struct {
+  beacon_id_t beacon_id;
+  beacon_location_id_t location_id;
+  key_size_t sk_size;
+  const uint8_t *sk;
+} ephid_beacon_t;
+
+/*
+ * one generated ID, also the record format of the output file
+ */
+typedef struct __attribute__((packed)) {
+  beacon_id_t beacon_id;
+  beacon_epoch_counter_t epoch;
+  uint8_t id[BEACON_EPH_ID_HASH_LEN];
+} ephid_record_t;
+
+/*
+ * receives the IDs of one beacon, for consecutive epochs. called from
+ * the worker threads concurrently, so it must be thread-safe. the
+ * records are only valid during the call.
+ */
+typedef void (*ephid_sink_fn)(const ephid_record_t *recs, size_t num_recs,
+    void *arg);
+
+enum ephid_impl {
+  EPHID_IMPL_AUTO,    // AVX2 if the CPU has it, else scalar
+  EPHID_IMPL_SCALAR,  // the sha-2 library, one ID at a time
+  EPHID_IMPL_AVX2,    // eight epochs per SHA-256 compression
+};
+
+typedef struct {
+  beacon_epoch_counter_t first_epoch;
+  uint32_t num_epochs;
+  int num_threads;
+  enum ephid_impl impl;
+  ephid_sink_fn sink;
+  void *sink_arg;
+} ephid_gen_params;
+
+/*
+ * compute the ID of one beacon and epoch with the sha-2 library, as
+ * the beacon does
+ */
+void ephid_compute(const ephid_beacon_t *beacon,
+    beacon_epoch_counter_t epoch, uint8_t id[BEACON_EPH_ID_HASH_LEN]);
+
+/*
+ * generate the IDs of all beacons for the epoch range in params.
+ * returns 0 on success, -1 on bad params or if the implementation
+ * is not available on this CPU
+ */
+int ephid_gen(const ephid_beacon_t *beacons, size_t num_beacons,
+    const ephid_gen_params *params);
+
+int ephid_avx2_available(void);
+
+#endif // EPHID_H
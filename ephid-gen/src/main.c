@@ -0,0 +1,340 @@
+/*
+ * Bulk eph ID generator, see ephid.h.
+ *
+ * Usage: ./ephid_gen [-i beacons | -n num random beacons [-k sk size]]
+ *            [-e first:count] [-t threads] [-m auto|scalar|avx2]
+ *            [-o out file | -o -] [-c] [-b]
+ *   -i  one beacon per line: beacon id, location id, secret key in hex
+ *   -n  random beacons with ids 0..n-1 and -k byte keys, for testing
+ *   -e  epoch range, by default 14 days of epochs from 0
+ *   -o  writes ephid_record_t records, in no particular order across
+ *       beacons; '-' writes to stdout, e.g. to pipe into a filter builder
+ *   -c  checks the selected implementation against the sha-2 library
+ *   -b  reports IDs/s for each implementation and 1..threads threads
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ephid.h"
+
+#define LINE_SIZE (2 * SK_MAX_SIZE + 64)
+#define DEFAULT_EPOCHS (14 * 24 * 60 / BEACON_EPOCH_LENGTH)
+
+typedef struct {
+  pthread_mutex_t mutex;
+  FILE *out;
+  uint64_t count;
+  int err;
+} file_sink_t;
+
+static double now_s()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void file_sink(const ephid_record_t *recs, size_t num_recs, void *arg)
+{
+  file_sink_t *s = (file_sink_t *) arg;
+
+  pthread_mutex_lock(&s->mutex);
+  if (s->out && fwrite(recs, sizeof(ephid_record_t), num_recs, s->out) !=
+      num_recs)
+    s->err = errno;
+  s->count += num_recs;
+  pthread_mutex_unlock(&s->mutex);
+}
+
+static void count_sink(const ephid_record_t *recs, size_t num_recs, void *arg)
+{
+  (void) recs;
+  __atomic_fetch_add((uint64_t *) arg, num_recs, __ATOMIC_RELAXED);
+}
+
+static int parse_hex(const char *hex, uint8_t *out, size_t max)
+{
+  size_t len = strlen(hex);
+  if (len % 2 || len / 2 > max)
+    return -1;
+
+  for (size_t i = 0; i < len / 2; i++) {
+    unsigned b;
+    if (sscanf(hex + 2 * i, "%2x", &b) != 1)
+      return -1;
+    out[i] = b;
+  }
+  return len / 2;
+}
+
+static ephid_beacon_t *load_beacons(const char *path, size_t *num_beacons)
+{
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return NULL;
+  }
+
+  size_t cap = 1024, n = 0;
+  ephid_beacon_t *beacons = malloc(cap * sizeof(ephid_beacon_t));
+  char *line = malloc(LINE_SIZE), hex[LINE_SIZE];
+  int lineno = 0;
+
+  while (beacons && fgets(line, LINE_SIZE, f)) {
+    unsigned long long id, loc;
+    lineno++;
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+
+    if (sscanf(line, "%lli %lli %s", &id, &loc, hex) != 3) {
+      fprintf(stderr, "%s:%d: expected <beacon id> <location id> <sk hex>\n",
+          path, lineno);
+      goto fail;
+    }
+
+    if (n == cap) {
+      cap *= 2;
+      ephid_beacon_t *b = realloc(beacons, cap * sizeof(ephid_beacon_t));
+      if (!b)
+        goto fail;
+      beacons = b;
+    }
+
+    uint8_t *sk = malloc(SK_MAX_SIZE);
+    int sk_size = sk ? parse_hex(hex, sk, SK_MAX_SIZE) : -1;
+    if (sk_size < 0) {
+      fprintf(stderr, "%s:%d: bad secret key\n", path, lineno);
+      free(sk);
+      goto fail;
+    }
+
+    beacons[n].beacon_id = id;
+    beacons[n].location_id = loc;
+    beacons[n].sk_size = sk_size;
+    beacons[n].sk = sk;
+    n++;
+  }
+
+  free(line);
+  fclose(f);
+  *num_beacons = n;
+  return beacons;
+
+fail:
+  for (size_t i = 0; i < n; i++)
+    free((void *) beacons[i].sk);
+  free(beacons);
+  free(line);
+  fclose(f);
+  return NULL;
+}
+
+static ephid_beacon_t *random_beacons(size_t num_beacons, int sk_size)
+{
+  ephid_beacon_t *beacons = malloc(num_beacons * sizeof(ephid_beacon_t));
+  if (!beacons)
+    return NULL;
+
+  for (size_t i = 0; i < num_beacons; i++) {
+    uint8_t *sk = malloc(sk_size ? sk_size : 1);
+    for (int b = 0; sk && b < sk_size; b++)
+      sk[b] = rand();
+    beacons[i].beacon_id = i;
+    beacons[i].location_id = ((uint64_t) rand() << 32) | rand();
+    beacons[i].sk_size = sk_size;
+    beacons[i].sk = sk;
+  }
+  return beacons;
+}
+
+/*
+ * compare the IDs of the selected implementation with ephid_compute()
+ * for every beacon and epoch
+ */
+typedef struct {
+  const ephid_beacon_t *beacons;
+  size_t num_beacons;
+  uint64_t checked;
+  uint64_t mismatched;
+} check_sink_t;
+
+static void check_sink(const ephid_record_t *recs, size_t num_recs, void *arg)
+{
+  check_sink_t *c = (check_sink_t *) arg;
+  uint64_t bad = 0;
+
+  for (size_t i = 0; i < num_recs; i++) {
+    uint8_t id[BEACON_EPH_ID_HASH_LEN];
+    const ephid_beacon_t *b = NULL;
+    // random and loaded beacons are usually numbered by index
+    if (recs[i].beacon_id < c->num_beacons &&
+        c->beacons[recs[i].beacon_id].beacon_id == recs[i].beacon_id)
+      b = &c->beacons[recs[i].beacon_id];
+    for (size_t j = 0; !b && j < c->num_beacons; j++) {
+      if (c->beacons[j].beacon_id == recs[i].beacon_id)
+        b = &c->beacons[j];
+    }
+
+    ephid_compute(b, recs[i].epoch, id);
+    if (memcmp(id, recs[i].id, BEACON_EPH_ID_HASH_LEN))
+      bad++;
+  }
+
+  __atomic_fetch_add(&c->checked, num_recs, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->mismatched, bad, __ATOMIC_RELAXED);
+}
+
+static int check(const ephid_beacon_t *beacons, size_t num_beacons,
+    ephid_gen_params params)
+{
+  check_sink_t c = { .beacons = beacons, .num_beacons = num_beacons };
+
+  params.sink = check_sink;
+  params.sink_arg = &c;
+  if (ephid_gen(beacons, num_beacons, &params) < 0) {
+    fprintf(stderr, "implementation not available\n");
+    return 1;
+  }
+
+  printf("checked %lu IDs against the sha-2 library: %lu mismatched\n",
+      (unsigned long) c.checked, (unsigned long) c.mismatched);
+  return c.mismatched || c.checked !=
+    (uint64_t) num_beacons * params.num_epochs;
+}
+
+static void bench(const ephid_beacon_t *beacons, size_t num_beacons,
+    ephid_gen_params params, int max_threads)
+{
+  static const char *impl_names[] = { "auto", "scalar", "avx2" };
+  uint64_t count;
+
+  params.sink = count_sink;
+  params.sink_arg = &count;
+
+  printf("%lu beacons x %u epochs, sk %u B\n", (unsigned long) num_beacons,
+      params.num_epochs, num_beacons ? beacons[0].sk_size : 0);
+  printf("%8s %8s %12s %14s %8s\n", "impl", "threads", "IDs/s",
+      "IDs/s/thread", "scaling");
+
+  for (int impl = EPHID_IMPL_SCALAR; impl <= EPHID_IMPL_AVX2; impl++) {
+    double single = 0;
+    params.impl = impl;
+    for (int t = 1; t <= max_threads;
+        t = (t < max_threads && t * 2 > max_threads) ? max_threads : t * 2) {
+      params.num_threads = t;
+      count = 0;
+      double start = now_s();
+      if (ephid_gen(beacons, num_beacons, &params) < 0) {
+        printf("%8s not available\n", impl_names[impl]);
+        break;
+      }
+      double rate = count / (now_s() - start);
+      if (t == 1)
+        single = rate;
+      printf("%8s %8d %12.0f %14.0f %7.2fx\n", impl_names[impl], t, rate,
+          rate / t, rate / single);
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  const char *in_path = NULL, *out_path = NULL;
+  size_t num_beacons = 0;
+  int sk_size = 16, do_check = 0, do_bench = 0, opt;
+  long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+  ephid_gen_params params = {
+    .first_epoch = 0,
+    .num_epochs = DEFAULT_EPOCHS,
+    .num_threads = nproc > 0 ? nproc : 1,
+    .impl = EPHID_IMPL_AUTO,
+  };
+
+  while ((opt = getopt(argc, argv, "i:n:k:e:t:m:o:cb")) != -1) {
+    switch (opt) {
+      case 'i': in_path = optarg; break;
+      case 'n': num_beacons = strtoul(optarg, NULL, 0); break;
+      case 'k': sk_size = atoi(optarg); break;
+      case 'e':
+        if (sscanf(optarg, "%u:%u", &params.first_epoch,
+              &params.num_epochs) != 2)
+          goto usage;
+        break;
+      case 't': params.num_threads = atoi(optarg); break;
+      case 'm':
+        if (!strcmp(optarg, "auto"))
+          params.impl = EPHID_IMPL_AUTO;
+        else if (!strcmp(optarg, "scalar"))
+          params.impl = EPHID_IMPL_SCALAR;
+        else if (!strcmp(optarg, "avx2"))
+          params.impl = EPHID_IMPL_AVX2;
+        else
+          goto usage;
+        break;
+      case 'o': out_path = optarg; break;
+      case 'c': do_check = 1; break;
+      case 'b': do_bench = 1; break;
+      default: goto usage;
+    }
+  }
+
+  if ((!in_path && !num_beacons) || sk_size < 0 || sk_size > SK_MAX_SIZE)
+    goto usage;
+
+  ephid_beacon_t *beacons = in_path ? load_beacons(in_path, &num_beacons) :
+    random_beacons(num_beacons, sk_size);
+  if (!beacons)
+    return 1;
+
+  if (do_check)
+    return check(beacons, num_beacons, params);
+
+  if (do_bench) {
+    bench(beacons, num_beacons, params, params.num_threads);
+    return 0;
+  }
+
+  file_sink_t sink = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+  if (out_path) {
+    sink.out = strcmp(out_path, "-") ? fopen(out_path, "wb") : stdout;
+    if (!sink.out) {
+      perror(out_path);
+      return 1;
+    }
+  }
+  params.sink = file_sink;
+  params.sink_arg = &sink;
+
+  double start = now_s();
+  if (ephid_gen(beacons, num_beacons, &params) < 0) {
+    fprintf(stderr, "implementation not available\n");
+    return 1;
+  }
+  double elapsed = now_s() - start;
+
+  if (sink.out && fflush(sink.out) != 0)
+    sink.err = errno;
+  if (sink.err) {
+    fprintf(stderr, "%s: %s\n", out_path, strerror(sink.err));
+    return 1;
+  }
+
+  fprintf(stderr, "%lu IDs in %.3f s, %.0f IDs/s with %d threads\n",
+      (unsigned long) sink.count, elapsed, sink.count / elapsed,
+      params.num_threads);
+  return 0;
+
+usage:
+  fprintf(stderr, "usage: %s [-i beacons | -n num beacons [-k sk size]] "
+      "[-e first:count] [-t threads] [-m auto|scalar|avx2] [-o out] "
+      "[-c] [-b]\n", argv[0]);
+  return 1;
+}
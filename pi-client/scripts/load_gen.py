@@ -0,0 +1,188 @@
+"""
+End-to-end load test of the pi-client against the local backend
+stand-in, risk_server.py. Runs many clients at once, each on its own
+pseudo-terminal, cache and metrics log, and reports:
+
+  - refresh latency, from the clients' metrics logs (see sched.h): fetch,
+    build and the time until the new payload went out, for the first,
+    cold-cache refresh and for the later ones
+  - server throughput, from the server's stats
+  - client CPU and memory, sampled from /proc every second
+
+The clients are client-sim (make client-sim), which runs without a
+Raspberry Pi. Its beacon side is simulated by this script, which drains
+every terminal and counts the bytes sent.
+
+Usage: python3 load_gen.py [--clients N] [--duration S] [--interval S]
+           [--client PATH] [--port P] [-- risk_server.py options]
+"""
+import argparse
+import os
+import pty
+import selectors
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+import tty
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+CLK_TCK = os.sysconf('SC_CLK_TCK')
+PAGE_SIZE = os.sysconf('SC_PAGE_SIZE')
+
+
+class Client:
+    def __init__(self, i, args, url, workdir):
+        self.dir = os.path.join(workdir, 'client%d' % i)
+        os.mkdir(self.dir)
+        self.metrics = os.path.join(self.dir, 'refresh.log')
+        self.master, slave = pty.openpty()
+        tty.setraw(self.master)
+        tty.setraw(slave)
+        os.set_blocking(self.master, False)
+        self.rx_bytes = 0
+        self.cpu = 0.0
+        self.rss_max = 0
+
+        cmd = [args.client, '-t', os.ttyname(slave), '-u', url,
+               '-c', os.path.join(self.dir, 'cache'), '-m', self.metrics,
+               '-i', str(args.interval), '-j', str(args.jitter)]
+        self.log = open(os.path.join(self.dir, 'client.log'), 'wb')
+        self.proc = subprocess.Popen(cmd, stdout=self.log,
+                                     stderr=subprocess.STDOUT)
+        os.close(slave)
+
+    def sample(self):
+        """CPU seconds so far and resident set size, from /proc"""
+        try:
+            with open('/proc/%d/stat' % self.proc.pid) as f:
+                fields = f.read().rsplit(')', 1)[1].split()
+            with open('/proc/%d/statm' % self.proc.pid) as f:
+                rss = int(f.read().split()[1]) * PAGE_SIZE
+        except (OSError, IndexError):
+            return
+        # utime and stime are fields 14 and 15, the 12th and 13th after comm
+        self.cpu = (int(fields[11]) + int(fields[12])) / CLK_TCK
+        self.rss_max = max(self.rss_max, rss)
+
+    def stop(self):
+        self.proc.terminate()
+        self.proc.wait()
+        self.log.close()
+        os.close(self.master)
+
+    def refreshes(self):
+        """the metrics log lines, as dicts"""
+        rows = []
+        try:
+            with open(self.metrics) as f:
+                for line in f:
+                    fields = line.split()
+                    rows.append(dict(kv.split('=', 1) for kv in fields[1:]))
+        except OSError:
+            pass
+        return rows
+
+
+def percentiles(values):
+    if not values:
+        return 'n/a'
+    v = sorted(values)
+
+    def pct(p):
+        return v[min(len(v) - 1, int(p / 100 * len(v)))]
+    return 'p50 %7.3f  p90 %7.3f  p99 %7.3f  max %7.3f  (n=%d)' % (
+        pct(50), pct(90), pct(99), v[-1], len(v))
+
+
+def report(clients, server_stats, duration):
+    cold, warm = [], []
+    for c in clients:
+        rows = [r for r in c.refreshes() if r['result'] == 'ok']
+        cold += rows[:1]
+        warm += rows[1:]
+    failed = sum(r['result'] != 'ok' for c in clients for r in c.refreshes())
+
+    print('\n%d clients, %.0f s, %d refreshes ok, %d failed' % (
+        len(clients), duration, len(cold) + len(warm), failed))
+    for name, rows in (('first refresh', cold), ('later refreshes', warm)):
+        print('%s:' % name)
+        for key in ('fetch', 'build', 'switch', 'late'):
+            vals = [float(r[key]) for r in rows if float(r[key]) >= 0]
+            print('  %-6s s  %s' % (key, percentiles(vals)))
+
+    print('server: %s' % (server_stats or 'no stats'))
+    cpu = [100 * c.cpu / duration for c in clients]
+    rss = [c.rss_max / 1024 for c in clients]
+    print('client cpu %%:    %s' % percentiles(cpu))
+    print('client max rss KB: %s' % percentiles(rss))
+    print('sent to beacons: %.0f B/s per client' % (
+        sum(c.rx_bytes for c in clients) / len(clients) / duration))
+
+
+def main():
+    p = argparse.ArgumentParser()
+    p.add_argument('--clients', type=int, default=10)
+    p.add_argument('--duration', type=float, default=30, help='s')
+    p.add_argument('--interval', type=float, default=10,
+                   help='refresh interval of the clients, s')
+    p.add_argument('--jitter', type=float, default=1, help='s')
+    p.add_argument('--client', default=os.path.join(HERE, '../src/client-sim'))
+    p.add_argument('--port', type=int, default=8090)
+    p.add_argument('--keep', action='store_true',
+                   help='keep the clients\' logs and caches')
+    p.add_argument('server_args', nargs='*',
+                   help='options for risk_server.py, after --')
+    a = p.parse_args()
+
+    if not os.access(a.client, os.X_OK):
+        sys.exit('%s not found, run make client-sim' % a.client)
+
+    workdir = tempfile.mkdtemp(prefix='pancast-load-')
+    server = subprocess.Popen(
+        [sys.executable, os.path.join(HERE, 'risk_server.py'),
+         '--port', str(a.port)] + a.server_args,
+        stdout=subprocess.PIPE, text=True)
+    print(server.stdout.readline().strip())
+
+    url = 'http://127.0.0.1:%d/' % a.port
+    clients = [Client(i, a, url, workdir) for i in range(a.clients)]
+    sel = selectors.DefaultSelector()
+    for c in clients:
+        sel.register(c.master, selectors.EVENT_READ, c)
+
+    start = time.monotonic()
+    next_sample = start
+    try:
+        while time.monotonic() - start < a.duration:
+            for key, _ in sel.select(timeout=0.1):
+                try:
+                    key.data.rx_bytes += len(os.read(key.fd, 65536))
+                except (BlockingIOError, OSError):
+                    pass
+            if time.monotonic() >= next_sample:
+                for c in clients:
+                    c.sample()
+                next_sample += 1
+    except KeyboardInterrupt:
+        pass
+    duration = time.monotonic() - start
+
+    for c in clients:
+        c.sample()
+        c.stop()
+    server.send_signal(signal.SIGTERM)
+    server_stats = server.stdout.read().strip()
+    server.wait()
+
+    report(clients, server_stats, duration)
+    if a.keep:
+        print('logs and caches in %s' % workdir)
+    else:
+        shutil.rmtree(workdir)
+
+
+if __name__ == '__main__':
+    main()
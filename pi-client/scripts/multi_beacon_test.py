@@ -0,0 +1,256 @@
+"""
+Host test of one pi-client feeding several beacons. Starts
+risk_server.py and client-sim (make client-sim) with one pseudo-terminal
+per simulated beacon, each paced differently, and checks that:
+
+  - every beacon gets valid frames, and every chunk of the payload, with
+    the CRC of its header
+  - the beacons start their rotations at chunks spread evenly over the
+    payload (UART_STAGGER)
+  - each beacon is sent packets at the pace of its own GPIO edges
+  - a need line from one beacon only changes what that beacon is sent
+  - a beacon that goes away does not stop the others
+
+and reports how much sooner a dongle in range of all beacons has every
+chunk than one in range of a single beacon.
+
+Usage: python3 multi_beacon_test.py [--beacons N] [--client PATH]
+"""
+import argparse
+import os
+import pty
+import selectors
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import tty
+import zlib
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+HDR = struct.Struct('<6I')   # rpi_ble_hdr
+PKT_PAYLOAD_SIZE = 250 - HDR.size
+INDEX_CHUNKID = 0xfffffffe
+
+
+def cobs_decode(frame):
+    out = bytearray()
+    i = 0
+    while i < len(frame):
+        code = frame[i]
+        if code == 0 or i + code > len(frame) + 1:
+            return None
+        out += frame[i + 1:i + code]
+        i += code
+        if code < 0xff and i < len(frame):
+            out.append(0)
+    return bytes(out)
+
+
+def unframe(frame):
+    """the packet in a frame of frame.h, or None if it is corrupt"""
+    x = cobs_decode(frame)
+    if x is None or len(x) < 6:
+        return None
+    n = x[0] | x[1] << 8
+    if len(x) != n + 6 or zlib.crc32(x[:-4]) != struct.unpack('<I', x[-4:])[0]:
+        return None
+    return x[2:-4]
+
+
+class Beacon:
+    def __init__(self, i, edge_us):
+        self.id = i
+        self.edge_us = edge_us
+        self.master, slave = pty.openpty()
+        tty.setraw(self.master)
+        tty.setraw(slave)
+        os.set_blocking(self.master, False)
+        self.slave = slave
+        self.buf = b''
+        self.packets = 0
+        self.bad = 0
+        self.order = []         # chunk ids, in the order they started
+        self.chunks = {}        # chunk id -> {seq: data}
+        self.complete_at = {}   # chunk id -> time it was complete
+        self.numchunks = 0
+        self.payload_ver = None
+        self.first_at = None
+
+    def feed(self, data, now):
+        self.buf += data
+        *frames, self.buf = self.buf.split(b'\0')
+        for f in frames:
+            pkt = unframe(f)
+            if pkt is None or len(pkt) < HDR.size:
+                self.bad += 1
+                continue
+            self.packets += 1
+            if self.first_at is None:
+                self.first_at = now
+            seq, cid, clen, numchunks, crc, ver = HDR.unpack_from(pkt)
+            self.numchunks, self.payload_ver = numchunks, ver
+            if not self.order or self.order[-1] != cid:
+                self.order.append(cid)
+            if cid >= numchunks:
+                continue
+            ndata = (clen + PKT_PAYLOAD_SIZE - 1) // PKT_PAYLOAD_SIZE
+            if seq >= ndata:
+                continue    # parity
+            got = self.chunks.setdefault(cid, {})
+            got[seq] = pkt[HDR.size:]
+            if len(got) == ndata and cid not in self.complete_at:
+                data = b''.join(got[s] for s in range(ndata))
+                if zlib.crc32(data) != crc or len(data) != clen:
+                    self.bad += 1
+                else:
+                    self.complete_at[cid] = now
+
+    def send(self, line):
+        os.write(self.master, line.encode() + b'\n')
+
+
+def run(client, beacons, seconds):
+    sel = selectors.DefaultSelector()
+    for b in beacons:
+        sel.register(b.master, selectors.EVENT_READ, b)
+    start = time.monotonic()
+    while (now := time.monotonic()) - start < seconds:
+        if client.poll() is not None:
+            sys.exit('client exited: %d' % client.returncode)
+        for key, _ in sel.select(timeout=0.05):
+            b = key.data
+            try:
+                b.feed(os.read(key.fd, 65536), now - start)
+            except OSError:
+                pass
+    sel.close()
+
+
+def check(cond, msg, errors):
+    print('%s %s' % ('ok  ' if cond else 'FAIL', msg))
+    if not cond:
+        errors.append(msg)
+
+
+def main():
+    p = argparse.ArgumentParser()
+    p.add_argument('--beacons', type=int, default=3)
+    p.add_argument('--chunks', type=int, default=12)
+    p.add_argument('--client', default=os.path.join(HERE, '../src/client-sim'))
+    p.add_argument('--port', type=int, default=8092)
+    a = p.parse_args()
+
+    if not os.access(a.client, os.X_OK):
+        sys.exit('%s not found, run make client-sim' % a.client)
+
+    # the first beacon twice as fast as the others
+    edges = [250] + [500] * (a.beacons - 1)
+    beacons = [Beacon(i, edges[i]) for i in range(a.beacons)]
+    workdir = tempfile.mkdtemp(prefix='pancast-multi-')
+
+    server = subprocess.Popen(
+        [sys.executable, os.path.join(HERE, 'risk_server.py'),
+         '--port', str(a.port), '--chunks', str(a.chunks),
+         '--chunk-size', '2048'], stdout=subprocess.PIPE, text=True)
+    server.stdout.readline()
+
+    cmd = [a.client, '-u', 'http://127.0.0.1:%d/' % a.port,
+           '-c', os.path.join(workdir, 'cache'),
+           '-m', os.path.join(workdir, 'refresh.log'), '-i', '3600']
+    for b in beacons:
+        cmd += ['-t', '%s:%d' % (os.ttyname(b.slave), 20 + b.id)]
+    env = dict(os.environ,
+               PIGPIO_SIM_EDGE_US=','.join(str(e) for e in edges))
+    log = open(os.path.join(workdir, 'client.log'), 'w')
+    client = subprocess.Popen(cmd, stdout=log, stderr=subprocess.STDOUT,
+                              env=env)
+
+    errors = []
+    try:
+        # every beacon goes around its rotation a few times
+        run(client, beacons, 4)
+
+        n = beacons[0].numchunks
+        for b in beacons:
+            check(b.packets > 0 and b.bad == 0,
+                  'beacon %d: %d packets, %d bad' % (b.id, b.packets, b.bad),
+                  errors)
+            check(len(b.complete_at) == n,
+                  'beacon %d: %d of %d chunks' % (b.id, len(b.complete_at), n),
+                  errors)
+
+        # the first chunk after the index is the beacon's offset
+        for b in beacons:
+            first = next((c for prev, c in zip(b.order, b.order[1:])
+                          if prev == INDEX_CHUNKID), None)
+            check(first == n * b.id // a.beacons,
+                  'beacon %d: rotation starts at chunk %s, expected %d' % (
+                      b.id, first, n * b.id // a.beacons), errors)
+
+        # one packet per rising edge, i.e., every two edges
+        before = [b.packets for b in beacons]
+        run(client, beacons, 1)
+        rates = [b.packets - p for b, p in zip(beacons, before)]
+        for b, r in zip(beacons, rates):
+            expected = 1e6 / (2 * b.edge_us)
+            check(0.7 * expected < r < 1.1 * expected,
+                  'beacon %d: %.0f packets/s, paced for %.0f' % (
+                      b.id, r, expected), errors)
+
+        # a dongle in range of the equally paced beacons against one in
+        # range of one, from when the payload first went out
+        start = min(b.first_at for b in beacons)
+        single = max(beacons[1].complete_at.values()) - start
+        union = {}
+        for b in beacons[1:]:
+            for c, t in b.complete_at.items():
+                union[c] = min(t, union.get(c, t))
+        print('     all chunks: %.3f s from beacon 1, %.3f s from beacons '
+              '1-%d' % (single, max(union.values()) - start, a.beacons - 1))
+
+        # beacon 1 only asks for chunk 0, the others keep getting all
+        if a.beacons > 1:
+            bitmap = bytearray((n + 1 + 7) // 8)
+            bitmap[0] = 1
+            beacons[1].send('@need %08x %s' % (beacons[1].payload_ver,
+                                               bitmap.hex()))
+            # let the packets queued before the need line go out
+            run(client, beacons, 0.5)
+            for b in beacons:
+                b.order = []
+            run(client, beacons, 1)
+            sent = set(beacons[1].order) - {INDEX_CHUNKID}
+            check(sent == {0}, 'beacon 1 after its need line: chunks %s' %
+                  sorted(sent), errors)
+            sent = set(beacons[0].order) - {INDEX_CHUNKID}
+            check(len(sent) == n, 'beacon 0 after beacon 1 need line: %d '
+                  'chunks' % len(sent), errors)
+
+        # the last beacon goes away, the others carry on
+        if a.beacons > 1:
+            gone = beacons[-1]
+            os.close(gone.master)
+            os.close(gone.slave)
+            before = [b.packets for b in beacons[:-1]]
+            run(client, beacons[:-1], 1)
+            check(all(b.packets > p for b, p in zip(beacons, before)),
+                  'beacons 0-%d carry on after beacon %d is gone' % (
+                      a.beacons - 2, gone.id), errors)
+    finally:
+        client.terminate()
+        client.wait()
+        server.terminate()
+        server.wait()
+        log.close()
+
+    if errors:
+        print('FAILED, client log in %s' % workdir)
+        return 1
+    print('ok')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,268 @@
+"""
+Local stand-in for the PanCast backend, to run the pi-client and its
+benchmarks offline. Serves the endpoints that pi-client/src/request.c
+uses:
+
+  GET /update/count       number of chunks, uint32
+  GET /update?chunk=N     chunk N, a chunk_hdr (uint64 length) and data
+  GET /update/manifest    404, no signed manifest
+
+The chunks are random, or with --dir the files in a directory, in the
+order of their names (numbers sort numerically). The directory is read
+again on every count request if it changed, so replacing a file there
+changes that chunk for the next refresh.
+
+Every chunk has an ETag, the CRC-32 of its response, and a request with
+a matching If-None-Match gets a 304 with no body. --changed replaces that
+many random chunks on every count request, i.e., at the start of every
+refresh.
+
+--rtt delays every response by one round trip, and the first response on
+a new connection by two more, for the TCP and TLS handshakes that a
+connection to the real backend costs. --bandwidth shares that many
+bytes/s among all responses, like the uplink of the backend.
+
+Usage: python3 risk_server.py [--port P] [--chunks N] [--chunk-size B]
+           [--changed N] [--dir DIR] [--rtt MS] [--bandwidth B/S] [--tls]
+"""
+import argparse
+import http.server
+import os
+import random
+import shutil
+import signal
+import socket
+import socketserver
+import ssl
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.parse
+import zlib
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.connections = 0
+        self.requests = 0
+        self.not_modified = 0
+        self.bytes = 0
+
+    def add(self, connections=0, requests=0, not_modified=0, nbytes=0):
+        with self.lock:
+            self.connections += connections
+            self.requests += requests
+            self.not_modified += not_modified
+            self.bytes += nbytes
+
+
+class Shaper:
+    """hands out send slots so that all writes together keep to rate"""
+
+    def __init__(self, rate):
+        self.rate = rate
+        self.lock = threading.Lock()
+        self.next_free = 0.0
+
+    def take(self, nbytes):
+        with self.lock:
+            start = max(time.monotonic(), self.next_free)
+            self.next_free = start + nbytes / self.rate
+            done = self.next_free
+        delay = done - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+
+
+class ChunkDir:
+    """the chunks of a payload, one file each"""
+
+    def __init__(self, path):
+        self.path = path
+        self.stamp = None
+        self.chunks = []
+
+    @staticmethod
+    def order(name):
+        return (0, int(name), '') if name.isdigit() else (1, 0, name)
+
+    def load(self):
+        """re-read the files if the directory or any file changed"""
+        names = sorted((n for n in os.listdir(self.path)
+                        if os.path.isfile(os.path.join(self.path, n))),
+                       key=self.order)
+        stamp = [(n, os.stat(os.path.join(self.path, n)).st_mtime_ns)
+                 for n in names]
+        if stamp != self.stamp:
+            chunks = []
+            for n in names:
+                with open(os.path.join(self.path, n), 'rb') as f:
+                    chunks.append(f.read())
+            self.stamp, self.chunks = stamp, chunks
+        return self.chunks
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'   # keep connections open
+
+    def setup(self):
+        # headers and body go out in separate writes, do not let Nagle and
+        # delayed acks hold back the body on a kept-alive connection
+        self.request.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        super().setup()
+        self.server.stats.add(connections=1)
+        self.handshake_done = False
+
+    def log_message(self, fmt, *args):
+        if self.server.verbose:
+            super().log_message(fmt, *args)
+
+    def reply(self, code, body=b'', etag=None):
+        rtt = self.server.rtt
+        if not self.handshake_done:
+            rtt *= 3
+            self.handshake_done = True
+        if rtt:
+            time.sleep(rtt)
+        self.send_response(code)
+        if etag:
+            self.send_header('ETag', etag)
+        if code != 304:
+            self.send_header('Content-Type', 'application/octet-stream')
+            self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        if self.server.shaper:
+            for off in range(0, len(body), SHAPER_SLICE):
+                piece = body[off:off + SHAPER_SLICE]
+                self.server.shaper.take(len(piece))
+                self.wfile.write(piece)
+        else:
+            self.wfile.write(body)
+        self.server.stats.add(requests=1, not_modified=int(code == 304),
+                              nbytes=len(body))
+
+    def do_GET(self):
+        url = urllib.parse.urlsplit(self.path)
+        srv = self.server
+        if url.path == '/update/count':
+            with srv.lock:
+                if srv.chunk_dir:
+                    srv.chunks = srv.chunk_dir.load()
+                for _ in range(srv.changed):
+                    i = srv.rng.randrange(len(srv.chunks))
+                    srv.chunks[i] = random_chunk(srv.rng, srv.chunk_size)
+            self.reply(200, struct.pack('<I', len(srv.chunks)))
+        elif url.path == '/update':
+            query = urllib.parse.parse_qs(url.query)
+            try:
+                with srv.lock:
+                    chunk = srv.chunks[int(query['chunk'][0])]
+            except (KeyError, ValueError, IndexError):
+                self.reply(404)
+                return
+            body = struct.pack('<Q', len(chunk)) + chunk
+            etag = '"%08x"' % zlib.crc32(body)
+            if self.headers.get('If-None-Match') == etag:
+                self.reply(304, etag=etag)
+            else:
+                self.reply(200, body, etag)
+        else:
+            self.reply(404)
+
+
+# bytes written at a time under --bandwidth
+SHAPER_SLICE = 16384
+
+
+def random_chunk(rng, size):
+    return bytes(rng.randrange(256) for _ in range(size))
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+
+def self_signed_context():
+    """a TLS context with a throwaway self-signed certificate"""
+    openssl = shutil.which('openssl')
+    if not openssl:
+        sys.exit('--tls needs openssl')
+    d = tempfile.mkdtemp()
+    cert, key = os.path.join(d, 'cert.pem'), os.path.join(d, 'key.pem')
+    subprocess.run([openssl, 'req', '-x509', '-newkey', 'rsa:2048',
+                    '-nodes', '-days', '1', '-subj', '/CN=localhost',
+                    '-keyout', key, '-out', cert], check=True,
+                   stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    ctx.load_cert_chain(cert, key)
+    shutil.rmtree(d)
+    return ctx
+
+
+def main():
+    p = argparse.ArgumentParser()
+    p.add_argument('--port', type=int, default=8081)
+    p.add_argument('--chunks', type=int, default=128)
+    p.add_argument('--chunk-size', type=int, default=4096)
+    p.add_argument('--changed', type=int, default=0,
+                   help='chunks replaced per refresh')
+    p.add_argument('--dir', help='serve the files in DIR as the chunks')
+    p.add_argument('--rtt', type=float, default=0, help='ms')
+    p.add_argument('--bandwidth', type=float, default=0,
+                   help='bytes/s for all responses together, 0 for no limit')
+    p.add_argument('--tls', action='store_true')
+    p.add_argument('--seed', type=int, default=1)
+    p.add_argument('-v', '--verbose', action='store_true')
+    a = p.parse_args()
+
+    srv = Server(('127.0.0.1', a.port), Handler)
+    srv.rng = random.Random(a.seed)
+    srv.lock = threading.Lock()
+    srv.chunk_size = a.chunk_size
+    srv.changed = a.changed
+    srv.chunk_dir = ChunkDir(a.dir) if a.dir else None
+    if srv.chunk_dir:
+        srv.chunks = srv.chunk_dir.load()
+        if not srv.chunks:
+            sys.exit('no chunk files in %s' % a.dir)
+    else:
+        srv.chunks = [random_chunk(srv.rng, a.chunk_size)
+                      for _ in range(a.chunks)]
+    srv.shaper = Shaper(a.bandwidth) if a.bandwidth > 0 else None
+    srv.rtt = a.rtt / 1000
+    srv.verbose = a.verbose
+    srv.stats = Stats()
+    if a.tls:
+        # handshakes happen in the connection threads, not at accept
+        srv.socket = self_signed_context().wrap_socket(
+            srv.socket, server_side=True, do_handshake_on_connect=False)
+
+    print('serving %u chunks, %u B, on %s://127.0.0.1:%u/, rtt %.1f ms, '
+          'bandwidth %s' % (
+              len(srv.chunks), sum(len(c) for c in srv.chunks),
+              'https' if a.tls else 'http', a.port, a.rtt,
+              '%.0f B/s' % a.bandwidth if a.bandwidth > 0 else 'unlimited'),
+          flush=True)
+    start = time.monotonic()
+    signal.signal(signal.SIGTERM, lambda *_: sys.exit(0))
+    try:
+        srv.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        s = srv.stats
+        elapsed = time.monotonic() - start
+        print('%u connections, %u requests, %u not modified, %u bytes in '
+              '%.1f s, %.0f B/s' % (
+                  s.connections, s.requests, s.not_modified, s.bytes,
+                  elapsed, s.bytes / elapsed), flush=True)
+
+
+if __name__ == '__main__':
+    main()
+
@@ -0,0 +1,251 @@
+#include "cache.h"
+#include "../../common/src/util/crc32.h"
+#include "../../common/src/settings.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_CHUNK_MAGIC 0x6b6e6863 /* "chnk" */
+#define CACHE_PAYLOAD_MAGIC 0x64617970 /* "payd" */
+
+typedef struct cache_hdr {
+  uint32_t magic;
+  uint32_t crc;     // of the data after the header
+  uint64_t size;
+  char etag[REQ_ETAG_LEN];
+} cache_hdr;
+
+typedef struct cache_payload_hdr {
+  uint32_t magic;
+  uint32_t num_chunks;
+  // followed by the crc of every chunk
+} cache_payload_hdr;
+
+static char cache_dir[PATH_MAX / 2];
+
+int cache_init(const char *dir)
+{
+  if (!dir)
+    dir = CACHE_DIR;
+
+  if (strlen(dir) >= sizeof(cache_dir)) {
+    fprintf(stderr, "cache dir too long: %s\r\n", dir);
+    return -EINVAL;
+  }
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    fprintf(stderr, "cache dir %s: %s, running without cache\r\n", dir,
+        strerror(errno));
+    return -errno;
+  }
+
+  strcpy(cache_dir, dir);
+  dprintf(LVL_EXP, "cache dir: %s\r\n", cache_dir);
+  return 0;
+}
+
+static void cache_path(char *path, const char *name, int chunk)
+{
+  if (chunk < 0)
+    snprintf(path, PATH_MAX, "%s/%s", cache_dir, name);
+  else
+    snprintf(path, PATH_MAX, "%s/%s_%d", cache_dir, name, chunk);
+}
+
+/*
+ * write hdr and data to a temporary file and rename it over path, so that
+ * a file in the cache is always complete
+ */
+static int cache_write(const char *path, const void *hdr, size_t hdr_len,
+    const void *data, size_t size)
+{
+  char tmp[PATH_MAX + 4];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "cache: %s: %s\r\n", tmp, strerror(errno));
+    return -errno;
+  }
+
+  int err = (write(fd, hdr, hdr_len) != (ssize_t) hdr_len ||
+      write(fd, data, size) != (ssize_t) size || fsync(fd) < 0);
+  close(fd);
+
+  if (err || rename(tmp, path) < 0) {
+    fprintf(stderr, "cache: %s: %s\r\n", path, strerror(errno));
+    unlink(tmp);
+    return -EIO;
+  }
+  return 0;
+}
+
+/*
+ * map a whole file read-only, returns its length or a negative error
+ */
+static ssize_t cache_map(const char *path, void **map)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -errno;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return -EINVAL;
+  }
+
+  *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (*map == MAP_FAILED)
+    return -errno;
+
+  return st.st_size;
+}
+
+int cache_load_chunk(int chunk, cache_chunk *cc)
+{
+  char path[PATH_MAX];
+  void *map;
+
+  memset(cc, 0, sizeof(cache_chunk));
+  if (!cache_dir[0])
+    return -ENOENT;
+
+  cache_path(path, "chunk", chunk);
+  ssize_t len = cache_map(path, &map);
+  if (len < 0)
+    return len;
+
+  const cache_hdr *hdr = (const cache_hdr *) map;
+  const char *data = (const char *) map + sizeof(cache_hdr);
+  if (len < sizeof(cache_hdr) || hdr->magic != CACHE_CHUNK_MAGIC ||
+      hdr->size != len - sizeof(cache_hdr) ||
+      hdr->etag[REQ_ETAG_LEN - 1] != '\0' ||
+      crc32((const uint8_t *) data, hdr->size) != hdr->crc) {
+    fprintf(stderr, "cache: %s is corrupt\r\n", path);
+    munmap(map, len);
+    return -EINVAL;
+  }
+
+  cc->map = map;
+  cc->map_len = len;
+  cc->data = data;
+  cc->size = hdr->size;
+  cc->crc = hdr->crc;
+  cc->etag = hdr->etag;
+  return 0;
+}
+
+void cache_release_chunk(cache_chunk *cc)
+{
+  if (cc->map)
+    munmap(cc->map, cc->map_len);
+  memset(cc, 0, sizeof(cache_chunk));
+}
+
+int cache_store_chunk(int chunk, const char *etag, const char *data,
+    size_t size)
+{
+  char path[PATH_MAX];
+  cache_hdr hdr;
+
+  if (!cache_dir[0])
+    return -ENOENT;
+
+  memset(&hdr, 0, sizeof(cache_hdr));
+  hdr.magic = CACHE_CHUNK_MAGIC;
+  hdr.crc = crc32((const uint8_t *) data, size);
+  hdr.size = size;
+  if (etag)
+    strncpy(hdr.etag, etag, REQ_ETAG_LEN - 1);
+
+  cache_path(path, "chunk", chunk);
+  return cache_write(path, &hdr, sizeof(cache_hdr), data, size);
+}
+
+int cache_store_payload(const cache_chunk *chunks, int num_chunks)
+{
+  char path[PATH_MAX];
+  cache_payload_hdr hdr = {
+    .magic = CACHE_PAYLOAD_MAGIC,
+    .num_chunks = num_chunks,
+  };
+
+  if (!cache_dir[0])
+    return -ENOENT;
+
+  uint32_t *crcs = malloc(num_chunks * sizeof(uint32_t));
+  if (!crcs)
+    return -ENOMEM;
+
+  for (int i = 0; i < num_chunks; i++) {
+    if (!chunks[i].map) {
+      free(crcs);
+      return -ENOENT;
+    }
+    crcs[i] = chunks[i].crc;
+  }
+
+  cache_path(path, "payload", -1);
+  int err = cache_write(path, &hdr, sizeof(hdr), crcs,
+      num_chunks * sizeof(uint32_t));
+  free(crcs);
+  return err;
+}
+
+int cache_load_payload(cache_chunk **chunks)
+{
+  char path[PATH_MAX];
+  void *map;
+
+  *chunks = NULL;
+  if (!cache_dir[0])
+    return -ENOENT;
+
+  cache_path(path, "payload", -1);
+  ssize_t len = cache_map(path, &map);
+  if (len < 0)
+    return len;
+
+  const cache_payload_hdr *hdr = (const cache_payload_hdr *) map;
+  const uint32_t *crcs = (const uint32_t *) (hdr + 1);
+  if (len < sizeof(cache_payload_hdr) || hdr->magic != CACHE_PAYLOAD_MAGIC ||
+      hdr->num_chunks == 0 || hdr->num_chunks > MAX_NUM_CHUNKS ||
+      len != sizeof(cache_payload_hdr) + hdr->num_chunks * sizeof(uint32_t)) {
+    munmap(map, len);
+    return -EINVAL;
+  }
+
+  int num_chunks = hdr->num_chunks;
+  cache_chunk *cc = calloc(num_chunks, sizeof(cache_chunk));
+  int err = cc ? 0 : -ENOMEM;
+  for (int i = 0; !err && i < num_chunks; i++) {
+    err = cache_load_chunk(i, &cc[i]);
+    // a chunk of a later refresh that did not complete
+    if (!err && cc[i].crc != crcs[i])
+      err = -ESTALE;
+  }
+  munmap(map, len);
+
+  if (err) {
+    if (cc)
+      cache_release_payload(cc, num_chunks);
+    return err;
+  }
+
+  *chunks = cc;
+  return num_chunks;
+}
+
+void cache_release_payload(cache_chunk *chunks, int num_chunks)
+{
+  if (!chunks)
+    return;
+
+  for (int i = 0; i < num_chunks; i++)
+    cache_release_chunk(&chunks[i]);
+  free(chunks);
+}
@@ -0,0 +1,46 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "common.h"
+
+/*
+ * directory where fetched chunks are kept across restarts, one file per
+ * chunk with its ETag, and an index of the last complete payload
+ */
+#define CACHE_DIR "/var/cache/pancast"
+
+/*
+ * a chunk in the cache, mapped read-only from its file. data and size
+ * are the response of the chunk request, a chunk_hdr and the chunk.
+ */
+typedef struct cache_chunk {
+  void *map;
+  size_t map_len;
+  const char *data;
+  size_t size;
+  uint32_t crc;
+  const char *etag;
+} cache_chunk;
+
+/*
+ * use dir, or CACHE_DIR if NULL, creating it if needed. without a usable
+ * directory, the cache stays disabled and every other call fails.
+ */
+int cache_init(const char *dir);
+
+int cache_load_chunk(int chunk, cache_chunk *cc);
+void cache_release_chunk(cache_chunk *cc);
+int cache_store_chunk(int chunk, const char *etag, const char *data,
+    size_t size);
+
+/*
+ * the payload index records which version of every chunk makes up the
+ * last complete payload, so that a payload is never loaded from chunks
+ * of different refreshes. cache_load_payload() maps all its chunks into
+ * a new array of *chunks and returns their number.
+ */
+int cache_store_payload(const cache_chunk *chunks, int num_chunks);
+int cache_load_payload(cache_chunk **chunks);
+void cache_release_payload(cache_chunk *chunks, int num_chunks);
+
+#endif // CACHE_H
@@ -1,8 +1,76 @@
 #include "client.h"
 
+#include <getopt.h>
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-t terminal[:gpio]]... [-u backend url] "
+      "[-c cache dir] [-m metrics log] [-i refresh interval s] "
+      "[-j jitter s] [-f metrics file] [-s metrics socket]\r\n"
+      "  every -t adds a beacon, up to %d. the gpio of the first defaults "
+      "to %d.\r\n", prog, UART_MAX_BEACONS, PIN);
+}
+
+/*
+ * terminal[:gpio], the terminal of a beacon and the pin it requests
+ * packets on
+ */
+static int add_beacon(uart_config *cfg, char *arg)
+{
+  int n = cfg->num_beacons;
+  if (n == UART_MAX_BEACONS)
+    return -1;
+
+  char *pin = strrchr(arg, ':');
+  if (pin) {
+    *pin++ = '\0';
+    cfg->pins[n] = atoi(pin);
+  } else if (n == 0) {
+    cfg->pins[n] = PIN;
+  } else {
+    return -1;
+  }
+
+  cfg->terminals[n] = arg;
+  cfg->num_beacons++;
+  return 0;
+}
+
 int main(int argc, char *argv[]) 
 {
-  uart_main((void *) 0);
+  uart_config cfg = UART_CONFIG_DEFAULT;
+  int opt, beacons = 0;
+
+  while ((opt = getopt(argc, argv, "t:u:c:m:i:j:f:s:")) != -1) {
+    switch (opt) {
+      case 't':
+        // the first -t replaces the default beacon
+        if (beacons++ == 0)
+          cfg.num_beacons = 0;
+        if (add_beacon(&cfg, optarg) < 0) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'u': cfg.backend_url = optarg; break;
+      case 'c': cfg.cache_dir = optarg; break;
+      case 'm': cfg.metrics_log = optarg; break;
+      case 'i': cfg.interval = atof(optarg); break;
+      case 'j': cfg.jitter = atof(optarg); break;
+      case 'f': cfg.metrics_file = optarg; break;
+      case 's': cfg.metrics_socket = optarg; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (cfg.interval <= 0 || cfg.jitter < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  uart_main(&cfg);
 
   fprintf(stderr, "exiting main! should not get here\r\n");
 
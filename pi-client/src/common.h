@@ -10,15 +10,33 @@
 #include <string.h>
 #include <errno.h>
 
+/*
+ * max length of an HTTP entity tag, with its quotes
+ */
+#define REQ_ETAG_LEN 64
+
 struct req_data {
    char *response;
    size_t size;
+   /*
+    * HTTP status of the response, and its ETag. an etag set before the
+    * request makes it conditional, and a 304 status then means that the
+    * data has not changed and there is no response.
+    */
+   long status;
+   char etag[REQ_ETAG_LEN];
+   /*
+    * if set, the response is passed to on_data with sink as it arrives,
+    * instead of being collected in response. a non-zero return aborts
+    * the transfer.
+    */
+   int (*on_data)(void *sink, const char *data, size_t len);
+   void *sink;
 };
 
 struct risk_data {
     pthread_mutex_t mutex;
     pthread_cond_t uart_ready_cond;
-    pthread_cond_t request_ready_cond;
     int uart_ready;
     int request_ready;
     int data_ready;
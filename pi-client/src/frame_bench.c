@@ -0,0 +1,197 @@
+/*
+ * Host stand-in for the beacon's UART frame parser (see frame.h).
+ *
+ * A writer thread sends framed risk packets into one end of a
+ * pseudo-terminal, the main thread reads the other end with the same
+ * decoder as the beacon and reports the sustained frames per second.
+ *
+ * Usage: ./frame_bench [-n frames] [-s pkt size] [-r bytes/s] [-e err rate]
+ *   -r limits the writer to the given wire rate, e.g. 10472 for 115200
+ *      baud with 8E1 framing; 0 sends as fast as the pty allows
+ *   -e corrupts one byte in the given fraction of frames, to check that
+ *      the parser drops them and resyncs on the next frame
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../common/src/util/frame.h"
+
+#define PER_ADV_SIZE 250
+#define READ_SIZE 64
+
+typedef struct {
+  int fd;
+  long nframes;
+  int pkt_size;
+  long rate;
+  double err_rate;
+  long ncorrupted;
+} bench_args;
+
+static double now_s()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *writer(void *arg)
+{
+  bench_args *args = (bench_args *) arg;
+  uint8_t pkt[PER_ADV_SIZE];
+  uint8_t frame[FRAME_MAX_ENCODED_LEN(PER_ADV_SIZE)];
+  double start = now_s();
+  long sent_bytes = 0;
+
+  for (long i = 0; i < args->nframes; i++) {
+    // risk packets are mostly filter bytes, with plenty of zeros
+    for (int b = 0; b < args->pkt_size; b++)
+      pkt[b] = (rand() % 4 == 0) ? 0 : rand();
+    memcpy(pkt, &i, sizeof(i));
+
+    int len = frame_encode(pkt, args->pkt_size, frame);
+    if (args->err_rate > 0 && rand() < args->err_rate * RAND_MAX) {
+      frame[rand() % (len - 1)] ^= 0x20;
+      args->ncorrupted++;
+    }
+
+    for (int off = 0; off < len; ) {
+      int w = write(args->fd, frame + off, len - off);
+      if (w < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+          continue;
+        perror("write");
+        return NULL;
+      }
+      off += w;
+    }
+
+    sent_bytes += len;
+    if (args->rate > 0) {
+      double ahead = (double) sent_bytes / args->rate - (now_s() - start);
+      if (ahead > 0)
+        usleep(ahead * 1e6);
+    }
+  }
+
+  // flush the last frame through the decoder
+  uint8_t delim = FRAME_DELIM;
+  if (write(args->fd, &delim, 1) != 1)
+    perror("write");
+
+  return NULL;
+}
+
+static int open_pty(int *master, int *slave)
+{
+  struct termios tty;
+
+  *master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (*master < 0 || grantpt(*master) < 0 || unlockpt(*master) < 0) {
+    perror("posix_openpt");
+    return -1;
+  }
+
+  *slave = open(ptsname(*master), O_RDWR | O_NOCTTY);
+  if (*slave < 0) {
+    perror("open slave");
+    return -1;
+  }
+
+  // raw binary mode on both ends, as on the pi client's serial port
+  tcgetattr(*slave, &tty);
+  cfmakeraw(&tty);
+  tcsetattr(*slave, TCSANOW, &tty);
+  tcgetattr(*master, &tty);
+  cfmakeraw(&tty);
+  tcsetattr(*master, TCSANOW, &tty);
+
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  bench_args args = { .nframes = 100000, .pkt_size = PER_ADV_SIZE };
+  int opt, master, slave;
+
+  while ((opt = getopt(argc, argv, "n:s:r:e:")) != -1) {
+    switch (opt) {
+      case 'n': args.nframes = atol(optarg); break;
+      case 's': args.pkt_size = atoi(optarg); break;
+      case 'r': args.rate = atol(optarg); break;
+      case 'e': args.err_rate = atof(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-n frames] [-s pkt size] "
+            "[-r bytes/s] [-e err rate]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (args.pkt_size <= (int) sizeof(long) || args.pkt_size > PER_ADV_SIZE) {
+    fprintf(stderr, "pkt size must be in (%zu, %d]\n", sizeof(long),
+        PER_ADV_SIZE);
+    return 1;
+  }
+
+  if (open_pty(&master, &slave) < 0)
+    return 1;
+
+  uint8_t dec_buf[FRAME_LEN_SIZE + PER_ADV_SIZE + FRAME_CRC_SIZE];
+  frame_dec_t dec;
+  frame_dec_init(&dec, dec_buf, sizeof(dec_buf));
+
+  args.fd = master;
+  pthread_t tid;
+  double start = now_s();
+  pthread_create(&tid, NULL, writer, &args);
+
+  uint8_t buf[READ_SIZE];
+  long nframes = 0, nerrors = 0, nbytes = 0, nmisordered = 0, last = -1;
+  while (nframes + nerrors < args.nframes) {
+    int r = read(slave, buf, READ_SIZE);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR)
+        continue;
+      break;
+    }
+
+    nbytes += r;
+    for (int i = 0; i < r; i++) {
+      int len = frame_dec_push(&dec, buf[i]);
+      if (len < 0) {
+        nerrors++;
+      } else if (len > 0) {
+        long seq;
+        memcpy(&seq, frame_dec_data(&dec), sizeof(seq));
+        if (seq <= last)
+          nmisordered++;
+        last = seq;
+        nframes++;
+      }
+    }
+  }
+
+  double elapsed = now_s() - start;
+  pthread_join(tid, NULL);
+
+  printf("pkt size: %d B, rate limit: %ld B/s\n", args.pkt_size, args.rate);
+  printf("frames: %ld ok, %ld dropped (%ld corrupted), %ld misordered\n",
+      nframes, nerrors, args.ncorrupted, nmisordered);
+  printf("time: %.3f s, %.0f frames/s, %.1f KB/s on the wire, "
+      "%.1f KB/s of packets\n", elapsed, nframes / elapsed,
+      nbytes / elapsed / 1024, nframes * (double) args.pkt_size /
+      elapsed / 1024);
+
+  close(slave);
+  close(master);
+  return (nframes + nerrors == args.nframes) ? 0 : 1;
+}
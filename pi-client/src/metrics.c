@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+
+#include "metrics.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+/*
+ * max length of a snapshot, which is cut there
+ */
+#define METRICS_LINE_SIZE 8192
+
+metrics_cell metrics_counters[M_NUM_COUNTERS];
+metrics_histogram metrics_hists[M_NUM_HISTS];
+
+static const char *metrics_counter_names[M_NUM_COUNTERS] = {
+  [M_REFRESH_OK] = "refresh_ok",
+  [M_REFRESH_FAILED] = "refresh_failed",
+  [M_CHUNKS_FETCHED] = "chunks_fetched",
+  [M_CHUNKS_UNCHANGED] = "chunks_unchanged",
+  [M_BYTES_FETCHED] = "bytes_fetched",
+  [M_GPIO_EDGES] = "gpio_edges",
+  [M_PKTS_SENT] = "pkts_sent",
+  [M_BYTES_SENT] = "bytes_sent",
+  [M_TX_QUEUE_FULL] = "tx_queue_full",
+  [M_TX_PORT_CLOSED] = "tx_port_closed",
+  [M_SERIAL_WRITE_ERRORS] = "serial_write_errors",
+  [M_CAROUSEL_CYCLES] = "carousel_cycles",
+};
+
+static const char *metrics_hist_names[M_NUM_HISTS] = {
+  [H_FETCH] = "fetch_us",
+  [H_BUILD] = "build_us",
+  [H_SWITCH] = "switch_us",
+  [H_CYCLE] = "cycle_us",
+};
+
+static metrics_config config;
+
+/*
+ * counters at the last export, for the rates. only the exporter moves
+ * them on, the lock is for metrics_snapshot() from other threads.
+ */
+static pthread_mutex_t prev_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t prev[M_NUM_COUNTERS];
+static double prev_t = -1;
+
+static double mono_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * largest value of bucket b, in us. the last bucket has no bound.
+ */
+static uint64_t bucket_le(int b)
+{
+  if (b == METRICS_HIST_BUCKETS - 1)
+    return UINT64_MAX;
+  return ((uint64_t) 1 << b) - 1;
+}
+
+/*
+ * the upper bound of the bucket that the p-th percentile falls in
+ */
+static uint64_t percentile(const uint64_t *buckets, uint64_t count, double p)
+{
+  uint64_t rank = (uint64_t) (p / 100 * count), seen = 0;
+  for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+    seen += buckets[b];
+    if (seen > rank)
+      return bucket_le(b);
+  }
+  return bucket_le(METRICS_HIST_BUCKETS - 1);
+}
+
+#define APPEND(...) do { \
+    int n = snprintf(len < size ? buf + len : NULL, \
+        len < size ? size - len : 0, __VA_ARGS__); \
+    if (n > 0) \
+      len += n; \
+  } while (0)
+
+static int snapshot(char *buf, size_t size, int advance)
+{
+  size_t len = 0;
+  double now = mono_s();
+  uint64_t cur[M_NUM_COUNTERS];
+
+  for (int c = 0; c < M_NUM_COUNTERS; c++)
+    cur[c] = __atomic_load_n(&metrics_counters[c].v, __ATOMIC_RELAXED);
+
+  APPEND("{\"time\":%ld,\"mono\":%.3f,\"counters\":{", (long) time(NULL),
+      now);
+  for (int c = 0; c < M_NUM_COUNTERS; c++)
+    APPEND("%s\"%s\":%llu", c ? "," : "", metrics_counter_names[c],
+        (unsigned long long) cur[c]);
+
+  pthread_mutex_lock(&prev_lock);
+  double dt = (prev_t < 0) ? 0 : now - prev_t;
+  APPEND("},\"per_s\":{");
+  for (int c = 0; c < M_NUM_COUNTERS; c++)
+    APPEND("%s\"%s\":%.2f", c ? "," : "", metrics_counter_names[c],
+        dt > 0 ? (cur[c] - prev[c]) / dt : 0.0);
+  if (advance) {
+    memcpy(prev, cur, sizeof(prev));
+    prev_t = now;
+  }
+  pthread_mutex_unlock(&prev_lock);
+
+  // percentiles are bucket upper bounds, i.e., within a factor of two
+  APPEND("},\"hists\":{");
+  for (int h = 0; h < M_NUM_HISTS; h++) {
+    metrics_histogram *hist = &metrics_hists[h];
+    uint64_t buckets[METRICS_HIST_BUCKETS], count = 0;
+    for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+      buckets[b] = __atomic_load_n(&hist->buckets[b], __ATOMIC_RELAXED);
+      count += buckets[b];
+    }
+
+    APPEND("%s\"%s\":{\"count\":%llu,\"sum\":%llu,\"max\":%llu,"
+        "\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"le\":{", h ? "," : "",
+        metrics_hist_names[h], (unsigned long long) count,
+        (unsigned long long) __atomic_load_n(&hist->sum, __ATOMIC_RELAXED),
+        (unsigned long long) __atomic_load_n(&hist->max, __ATOMIC_RELAXED),
+        (unsigned long long) percentile(buckets, count, 50),
+        (unsigned long long) percentile(buckets, count, 90),
+        (unsigned long long) percentile(buckets, count, 99));
+    // only the buckets with anything in them
+    int first = 1;
+    for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+      if (!buckets[b])
+        continue;
+      APPEND("%s\"%llu\":%llu", first ? "" : ",",
+          (unsigned long long) bucket_le(b),
+          (unsigned long long) buckets[b]);
+      first = 0;
+    }
+    APPEND("}}");
+  }
+  APPEND("}}");
+
+  return (int) len;
+}
+
+int metrics_snapshot(char *buf, size_t size)
+{
+  return snapshot(buf, size, 0);
+}
+
+/*
+ * replace the file with the line, so that a reader never sees half of it
+ */
+static void export_file(const char *line, int len)
+{
+  char tmp[256];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", config.file);
+
+  FILE *f = fopen(tmp, "w");
+  if (!f) {
+    fprintf(stderr, "metrics: %s: %s\r\n", tmp, strerror(errno));
+    return;
+  }
+  fwrite(line, 1, len, f);
+  fputc('\n', f);
+  if (fclose(f) != 0 || rename(tmp, config.file) < 0)
+    fprintf(stderr, "metrics: %s: %s\r\n", config.file, strerror(errno));
+}
+
+static int listen_socket(const char *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -ENAMETOOLONG;
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -errno;
+
+  // a socket left over from an earlier run
+  unlink(path);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(fd, 4) < 0) {
+    int err = -errno;
+    close(fd);
+    return err;
+  }
+  return fd;
+}
+
+/*
+ * the latest snapshot to a client of the socket, which is then closed.
+ * a client that does not read it in time does not hold up the exporter.
+ */
+static void serve_socket(int lfd)
+{
+  int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  char line[METRICS_LINE_SIZE];
+  int len = snapshot(line, sizeof(line) - 1, 0);
+  if (len > (int) sizeof(line) - 2)
+    len = sizeof(line) - 2;
+  line[len++] = '\n';
+  if (send(fd, line, len, MSG_NOSIGNAL) < 0)
+    dprintf(LVL_DBG, "metrics: socket: %s\r\n", strerror(errno));
+  close(fd);
+}
+
+static void *metrics_main(void *arg)
+{
+  int lfd = -1;
+  if (config.socket) {
+    lfd = listen_socket(config.socket);
+    if (lfd < 0)
+      fprintf(stderr, "metrics: socket %s: %s\r\n", config.socket,
+          strerror(-lfd));
+  }
+
+  double next = mono_s() + config.interval;
+  for (;;) {
+    double left = next - mono_s();
+    if (left > 0) {
+      struct pollfd pfd = { .fd = lfd, .events = POLLIN };
+      // poll() ignores a negative fd, and then only sleeps
+      if (poll(&pfd, 1, (int) (left * 1000) + 1) > 0)
+        serve_socket(lfd);
+      continue;
+    }
+    // not a burst of exports after the thread was held up
+    next += config.interval;
+    if (next < mono_s())
+      next = mono_s() + config.interval;
+
+    char line[METRICS_LINE_SIZE];
+    int len = snapshot(line, sizeof(line), 1);
+    if (len >= (int) sizeof(line))
+      len = sizeof(line) - 1;
+
+    dprintf(LVL_EXP, "%s\r\n", line);
+    if (config.file)
+      export_file(line, len);
+  }
+  return NULL;
+}
+
+int metrics_start(const metrics_config *cfg)
+{
+  config = *cfg;
+  if (config.interval <= 0)
+    return -EINVAL;
+
+  pthread_mutex_lock(&prev_lock);
+  for (int c = 0; c < M_NUM_COUNTERS; c++)
+    prev[c] = __atomic_load_n(&metrics_counters[c].v, __ATOMIC_RELAXED);
+  prev_t = mono_s();
+  pthread_mutex_unlock(&prev_lock);
+
+  pthread_t thread;
+  int err = pthread_create(&thread, NULL, metrics_main, NULL);
+  if (err)
+    return -err;
+  pthread_detach(thread);
+
+  dprintf(LVL_EXP, "metrics every %.0f s%s%s%s%s\r\n", config.interval,
+      config.file ? " to " : "", config.file ? config.file : "",
+      config.socket ? ", socket " : "", config.socket ? config.socket : "");
+  return 0;
+}
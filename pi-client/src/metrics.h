@@ -0,0 +1,130 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "common.h"
+
+/*
+ * histograms have a bucket per power of two of microseconds, the last
+ * one for everything from 2^(METRICS_HIST_BUCKETS-2) us, i.e., about 2.2
+ * years, on
+ */
+#define METRICS_HIST_BUCKETS 48
+
+/*
+ * counters, see metrics_counter_names in metrics.c for how they are
+ * exported
+ */
+typedef enum metrics_counter {
+  M_REFRESH_OK,
+  M_REFRESH_FAILED,
+  M_CHUNKS_FETCHED,     // with a response, i.e., not a 304
+  M_CHUNKS_UNCHANGED,   // answered with a 304
+  M_BYTES_FETCHED,
+  M_GPIO_EDGES,
+  M_PKTS_SENT,
+  M_BYTES_SENT,
+  M_TX_QUEUE_FULL,      // packets held back as the serial queue was full
+  M_TX_PORT_CLOSED,     // packets for a beacon that went away
+  M_SERIAL_WRITE_ERRORS,
+  M_CAROUSEL_CYCLES,
+  M_NUM_COUNTERS
+} metrics_counter;
+
+/*
+ * latency histograms, in microseconds
+ */
+typedef enum metrics_hist {
+  H_FETCH,      // fetching the chunks of a refresh
+  H_BUILD,      // building its packets
+  H_SWITCH,     // from the start of a refresh until it is sent
+  H_CYCLE,      // a beacon going once through its rotation
+  M_NUM_HISTS
+} metrics_hist;
+
+/*
+ * where and how often metrics_start() exports a snapshot. with neither
+ * file nor socket set, the snapshot only goes to the log.
+ */
+typedef struct metrics_config {
+  double interval;      // s between exports
+  const char *file;     // replaced with the latest snapshot, or NULL
+  const char *socket;   // UNIX socket that sends a snapshot on every
+                        // connection, or NULL
+} metrics_config;
+
+/*
+ * one cache line per counter, so that threads counting different things
+ * do not contend
+ */
+typedef struct metrics_cell {
+  uint64_t v;
+} __attribute__((aligned(64))) metrics_cell;
+
+typedef struct metrics_histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[METRICS_HIST_BUCKETS];
+} __attribute__((aligned(64))) metrics_histogram;
+
+extern metrics_cell metrics_counters[M_NUM_COUNTERS];
+extern metrics_histogram metrics_hists[M_NUM_HISTS];
+
+/*
+ * add n to counter c. lock-free, safe from any thread, including the
+ * GPIO callback.
+ */
+static inline void metrics_add(metrics_counter c, uint64_t n)
+{
+  __atomic_fetch_add(&metrics_counters[c].v, n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_inc(metrics_counter c)
+{
+  metrics_add(c, 1);
+}
+
+static inline int metrics_bucket(uint64_t us)
+{
+  // 0 us is bucket 0, [2^(i-1), 2^i) us is bucket i
+  int b = us ? 64 - __builtin_clzll(us) : 0;
+  return b < METRICS_HIST_BUCKETS ? b : METRICS_HIST_BUCKETS - 1;
+}
+
+/*
+ * record a latency of us microseconds in histogram h. lock-free, like
+ * metrics_add().
+ */
+static inline void metrics_observe_us(metrics_hist h, uint64_t us)
+{
+  metrics_histogram *hist = &metrics_hists[h];
+  __atomic_fetch_add(&hist->buckets[metrics_bucket(us)], 1,
+      __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->sum, us, __ATOMIC_RELAXED);
+
+  uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+  while (us > max && !__atomic_compare_exchange_n(&hist->max, &max, us, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static inline void metrics_observe(metrics_hist h, double s)
+{
+  metrics_observe_us(h, s > 0 ? (uint64_t) (s * 1e6) : 0);
+}
+
+/*
+ * write a snapshot of all metrics as one line of JSON, without a
+ * newline, into buf. rates are per second since the last snapshot of
+ * the exporter, or since the start. returns the length, as snprintf().
+ */
+int metrics_snapshot(char *buf, size_t size);
+
+/*
+ * start the thread that exports a snapshot every interval. returns 0, or
+ * a negative error.
+ */
+int metrics_start(const metrics_config *cfg);
+
+#endif // METRICS_H
@@ -0,0 +1,197 @@
+/*
+ * Host benchmark of recording metrics on the pi client's hot path, see
+ * metrics.h: the cost of metrics_inc() and metrics_observe_us(), against
+ * an empty loop and a counter behind a mutex, from 1 to -t threads at
+ * once. every thread either records into the same counter and histogram,
+ * the worst case, or into its own.
+ *
+ * Reports the CPU time per operation, summed over the threads, so that
+ * the numbers also compare on a host with fewer cores than threads.
+ * Checks that no update was lost, and prints a snapshot at the end.
+ *
+ * Usage: ./metrics_bench [-n ops per thread] [-t max threads]
+ */
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "metrics.h"
+
+typedef enum {
+  OP_EMPTY,
+  OP_MUTEX,
+  OP_INC,
+  OP_OBSERVE,
+  NUM_OPS
+} op;
+
+static const char *op_names[NUM_OPS] = {
+  [OP_EMPTY] = "empty loop",
+  [OP_MUTEX] = "mutex counter",
+  [OP_INC] = "metrics_inc",
+  [OP_OBSERVE] = "metrics_observe_us",
+};
+
+typedef struct {
+  op op;
+  int shared;
+  int id;
+  long n;
+  pthread_barrier_t *start;
+} bench_args;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t locked_count;
+
+static double process_cpu_s()
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void *bench_thread(void *arg)
+{
+  bench_args *a = arg;
+  // threads that do not share use counters and histograms of their own
+  metrics_counter c = a->shared ? 0 : a->id % M_NUM_COUNTERS;
+  metrics_hist h = a->shared ? 0 : a->id % M_NUM_HISTS;
+
+  pthread_barrier_wait(a->start);
+  for (long i = 0; i < a->n; i++) {
+    switch (a->op) {
+      case OP_EMPTY:
+        // keeps the loop from being optimized away
+        __asm__ volatile("" ::: "memory");
+        break;
+      case OP_MUTEX:
+        pthread_mutex_lock(&lock);
+        locked_count++;
+        pthread_mutex_unlock(&lock);
+        break;
+      case OP_INC:
+        metrics_inc(c);
+        break;
+      case OP_OBSERVE:
+        // latencies from 1 us to about 1 s
+        metrics_observe_us(h, (i * 2654435761u) & 0xfffff);
+        break;
+      default:
+        break;
+    }
+  }
+  return NULL;
+}
+
+static uint64_t total_count(void)
+{
+  uint64_t n = locked_count;
+  for (int c = 0; c < M_NUM_COUNTERS; c++)
+    n += metrics_counters[c].v;
+  return n;
+}
+
+static uint64_t total_observed(void)
+{
+  uint64_t n = 0;
+  for (int h = 0; h < M_NUM_HISTS; h++) {
+    uint64_t buckets = 0;
+    for (int b = 0; b < METRICS_HIST_BUCKETS; b++)
+      buckets += metrics_hists[h].buckets[b];
+    // a bucket update that is lost would leave the two apart
+    if (buckets != metrics_hists[h].count)
+      return -1;
+    n += buckets;
+  }
+  return n;
+}
+
+/*
+ * CPU ns per operation, or < 0 if updates were lost
+ */
+static double run(op o, int shared, int nthreads, long n)
+{
+  pthread_t threads[nthreads];
+  bench_args args[nthreads];
+  pthread_barrier_t start;
+  pthread_barrier_init(&start, NULL, nthreads + 1);
+
+  uint64_t count_before = total_count(), observed_before = total_observed();
+  for (int i = 0; i < nthreads; i++) {
+    args[i] = (bench_args) { o, shared, i, n, &start };
+    pthread_create(&threads[i], NULL, bench_thread, &args[i]);
+  }
+
+  // the main thread only waits from here on
+  double t0 = process_cpu_s();
+  pthread_barrier_wait(&start);
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  double cpu = process_cpu_s() - t0;
+  pthread_barrier_destroy(&start);
+
+  uint64_t expected = (uint64_t) nthreads * n;
+  if ((o == OP_MUTEX || o == OP_INC) &&
+      total_count() - count_before != expected)
+    return -1;
+  if (o == OP_OBSERVE && total_observed() - observed_before != expected)
+    return -1;
+
+  return cpu * 1e9 / expected;
+}
+
+int main(int argc, char *argv[])
+{
+  long n = 10000000;
+  int max_threads = 4, opt, failed = 0;
+
+  while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+    switch (opt) {
+      case 'n': n = atol(optarg); break;
+      case 't': max_threads = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-n ops per thread] [-t max threads]\n",
+            argv[0]);
+        return 1;
+    }
+  }
+
+  printf("CPU ns per op, %ld ops per thread, %ld cpus\n", n,
+      sysconf(_SC_NPROCESSORS_ONLN));
+  printf("%-20s %-8s", "", "");
+  for (int t = 1; t <= max_threads; t *= 2)
+    printf(" %7d thr", t);
+  printf("\n");
+
+  for (int o = 0; o < NUM_OPS; o++) {
+    for (int shared = 1; shared >= 0; shared--) {
+      // an empty loop and a single lock do not have a per-thread variant
+      if (!shared && (o == OP_EMPTY || o == OP_MUTEX))
+        continue;
+      printf("%-20s %-8s", op_names[o], shared ? "shared" : "own");
+      for (int t = 1; t <= max_threads; t *= 2) {
+        double ns = run(o, shared, t, n);
+        if (ns < 0) {
+          printf(" %11s", "LOST");
+          failed++;
+        } else {
+          printf(" %11.2f", ns);
+        }
+      }
+      printf("\n");
+    }
+  }
+
+  char line[8192];
+  metrics_snapshot(line, sizeof(line));
+  printf("\n%s\n", line);
+
+  if (failed) {
+    printf("FAILED, updates were lost\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,204 @@
+#include "packet.h"
+#include "../../common/src/util/crc32.h"
+
+int packet_chunk_init(chunk *chnk, uint32_t chunkid, const char *data,
+    uint64_t len, int fec)
+{
+  memset(chnk, 0, sizeof(chunk));
+  chnk->chunkid = chunkid;
+  chnk->data = data;
+  chnk->len = len;
+  chnk->crc = crc32((const uint8_t *) data, len);
+  chnk->num_data_pkts = (len + PKT_PAYLOAD_SIZE - 1) / PKT_PAYLOAD_SIZE;
+  chnk->pkt_cnt = chnk->num_data_pkts;
+
+  if (!fec)
+    return 0;
+
+  /*
+   * one parity packet per group, each the XOR of the zero-padded
+   * payloads of the data packets in that group
+   */
+  uint32_t num_groups = risk_fec_num_groups(chnk->num_data_pkts);
+  chnk->parity = calloc(num_groups, PKT_PAYLOAD_SIZE);
+  if (num_groups && !chnk->parity)
+    return -ENOMEM;
+
+  for (uint32_t i = 0; i < chnk->num_data_pkts; i++) {
+    char *parity = chnk->parity + (i % num_groups) * PKT_PAYLOAD_SIZE;
+    uint64_t off = i * PKT_PAYLOAD_SIZE;
+    uint64_t plen = (len - off > PKT_PAYLOAD_SIZE) ?
+      PKT_PAYLOAD_SIZE : (len - off);
+    for (uint64_t b = 0; b < plen; b++)
+      parity[b] ^= data[off + b];
+  }
+
+  chnk->pkt_cnt += num_groups;
+  return 0;
+}
+
+void packet_chunk_free(chunk *chnk)
+{
+  free(chnk->parity);
+  memset(chnk, 0, sizeof(chunk));
+}
+
+void packet_view(const chunk *chnk, uint32_t pkt_seq, uint32_t numchunks,
+    uint32_t payload_ver, ble_pkt *pkt)
+{
+  pkt->hdr.pkt_seq = pkt_seq;
+  pkt->hdr.chunkid = chnk->chunkid;
+  pkt->hdr.chunklen = chnk->len;
+  pkt->hdr.numchunks = numchunks;
+  pkt->hdr.chunk_crc = chnk->crc;
+  pkt->hdr.payload_ver = payload_ver;
+
+  if (pkt_seq < chnk->num_data_pkts) {
+    uint64_t off = (uint64_t) pkt_seq * PKT_PAYLOAD_SIZE;
+    pkt->data = chnk->data + off;
+    pkt->len = (chnk->len - off > PKT_PAYLOAD_SIZE) ?
+      PKT_PAYLOAD_SIZE : (chnk->len - off);
+  } else if (pkt_seq < chnk->pkt_cnt) {
+    pkt->data = chnk->parity +
+      (pkt_seq - chnk->num_data_pkts) * PKT_PAYLOAD_SIZE;
+    pkt->len = PKT_PAYLOAD_SIZE;
+  } else {
+    // only a header, for an empty chunk
+    pkt->data = NULL;
+    pkt->len = 0;
+  }
+}
+
+void packet_stream_init(packet_stream *ps, int fec)
+{
+  memset(ps, 0, sizeof(packet_stream));
+  ps->crc = CRC32_INIT;
+  ps->fec = fec;
+}
+
+void packet_stream_free(packet_stream *ps)
+{
+  free(ps->buf);
+  free(ps->parity);
+  packet_chunk_free(&ps->chnk);
+  packet_stream_init(ps, ps->fec);
+}
+
+/*
+ * size the buffer and the parity packets from the chunk_hdr
+ */
+static int packet_stream_start(packet_stream *ps, uint64_t len)
+{
+  if (len > PKT_MAX_CHUNK_LEN) {
+    fprintf(stderr, "chunk too long: %llu\r\n", (unsigned long long) len);
+    return -EINVAL;
+  }
+
+  char *buf = realloc(ps->buf, sizeof(chunk_hdr) + len);
+  if (!buf)
+    return -ENOMEM;
+  ps->buf = buf;
+  ps->size = sizeof(chunk_hdr) + len;
+
+  if (ps->fec) {
+    uint32_t num_data_pkts = (len + PKT_PAYLOAD_SIZE - 1) / PKT_PAYLOAD_SIZE;
+    ps->num_groups = risk_fec_num_groups(num_data_pkts);
+    ps->parity = calloc(ps->num_groups, PKT_PAYLOAD_SIZE);
+    if (ps->num_groups && !ps->parity) {
+      fprintf(stderr, "no memory for parity packets\r\n");
+      ps->num_groups = 0;
+      ps->fec = 0;
+    }
+  }
+  return 0;
+}
+
+/*
+ * fold len bytes of the chunk, at offset off, into the parity packets
+ */
+static void packet_stream_parity(packet_stream *ps, uint64_t off,
+    const char *data, size_t len)
+{
+  while (len > 0) {
+    uint64_t pkt = off / PKT_PAYLOAD_SIZE;
+    uint32_t pos = off % PKT_PAYLOAD_SIZE;
+    size_t n = PKT_PAYLOAD_SIZE - pos;
+    if (n > len)
+      n = len;
+
+    char *parity = ps->parity + (pkt % ps->num_groups) * PKT_PAYLOAD_SIZE;
+    for (size_t b = 0; b < n; b++)
+      parity[pos + b] ^= data[b];
+
+    off += n;
+    data += n;
+    len -= n;
+  }
+}
+
+int packet_stream_write(packet_stream *ps, const char *data, size_t len)
+{
+  // the chunk_hdr, which may arrive in pieces, is kept in a small buffer
+  // until the size of the whole response is known
+  if (ps->received < sizeof(chunk_hdr)) {
+    if (!ps->buf && !(ps->buf = malloc(sizeof(chunk_hdr))))
+      return -ENOMEM;
+
+    size_t n = sizeof(chunk_hdr) - ps->received;
+    if (n > len)
+      n = len;
+    memcpy(ps->buf + ps->received, data, n);
+    ps->received += n;
+    data += n;
+    len -= n;
+
+    if (ps->received < sizeof(chunk_hdr))
+      return 0;
+
+    int err = packet_stream_start(ps, ((chunk_hdr *) ps->buf)->payload_len);
+    if (err)
+      return err;
+  }
+
+  // bytes after the announced chunk are dropped
+  if (len > ps->size - ps->received)
+    len = ps->size - ps->received;
+
+  uint64_t off = ps->received - sizeof(chunk_hdr);
+  memcpy(ps->buf + ps->received, data, len);
+  ps->received += len;
+  ps->crc = crc32_update(ps->crc, (const uint8_t *) data, len);
+  if (ps->num_groups)
+    packet_stream_parity(ps, off, data, len);
+
+  return 0;
+}
+
+int packet_stream_finish(packet_stream *ps, uint32_t chunkid)
+{
+  if (ps->received < sizeof(chunk_hdr) || ps->received < ps->size)
+    return -EIO;
+
+  chunk *chnk = &ps->chnk;
+  memset(chnk, 0, sizeof(chunk));
+  chnk->chunkid = chunkid;
+  chnk->data = ps->buf + sizeof(chunk_hdr);
+  chnk->len = ps->size - sizeof(chunk_hdr);
+  chnk->crc = crc32_final(ps->crc);
+  chnk->num_data_pkts = (chnk->len + PKT_PAYLOAD_SIZE - 1) / PKT_PAYLOAD_SIZE;
+  chnk->pkt_cnt = chnk->num_data_pkts + ps->num_groups;
+
+  // the chunk owns the parity packets from now on
+  chnk->parity = ps->parity;
+  ps->parity = NULL;
+  ps->done = 1;
+  return 0;
+}
+
+char *packet_stream_take(packet_stream *ps, size_t *size)
+{
+  char *buf = ps->buf;
+  *size = ps->received;
+  ps->buf = NULL;
+  return buf;
+}
@@ -0,0 +1,97 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include "common.h"
+#include "../../common/src/riskinfo.h"
+
+#define PER_ADV_SIZE 250
+
+/*
+ * max chunk bytes in a packet, after its rpi_ble_hdr
+ */
+#define PKT_PAYLOAD_SIZE (PER_ADV_SIZE - sizeof(rpi_ble_hdr))
+
+/*
+ * a chunk and the packets it is sent as. packets are not stored: packet
+ * pkt_seq is a view of the chunk data at pkt_seq * PKT_PAYLOAD_SIZE, or
+ * of the parity packets, and its header is built when it is sent. data
+ * is not owned by the chunk and must stay valid as long as it is.
+ */
+typedef struct chunk {
+  uint32_t chunkid;
+  uint32_t pkt_cnt;
+  uint32_t num_data_pkts;
+  uint32_t crc;
+  const char *data;
+  uint64_t len;
+  char *parity;
+} chunk;
+
+/*
+ * a packet to send, as its header and a view of its payload
+ */
+typedef struct ble_pkt {
+  rpi_ble_hdr hdr;
+  const char *data;
+  uint32_t len;
+} ble_pkt;
+
+/*
+ * describe the packets of a chunk, with fec parity packets if fec is set.
+ * returns 0, or -ENOMEM if the parity packets do not fit in memory.
+ */
+int packet_chunk_init(chunk *chnk, uint32_t chunkid, const char *data,
+    uint64_t len, int fec);
+void packet_chunk_free(chunk *chnk);
+
+/*
+ * packet pkt_seq of a chunk in a payload of numchunks chunks
+ */
+void packet_view(const chunk *chnk, uint32_t pkt_seq, uint32_t numchunks,
+    uint32_t payload_ver, ble_pkt *pkt);
+
+/*
+ * max chunk length a backend response may announce in its chunk_hdr
+ */
+#define PKT_MAX_CHUNK_LEN (64 << 20)
+
+/*
+ * a chunk packetized while its response arrives. the response buffer is
+ * allocated once, at the size its chunk_hdr announces, and the crc and
+ * parity packets of the chunk are updated with every write, so that the
+ * packets are described when the last byte is in. see
+ * packet_stream_finish().
+ */
+typedef struct packet_stream {
+  char *buf;            // the response, a chunk_hdr and the chunk
+  uint64_t size;        // of buf
+  uint64_t received;
+  uint32_t crc;
+  uint32_t num_groups;
+  char *parity;
+  int fec;
+  int done;
+  chunk chnk;
+} packet_stream;
+
+void packet_stream_init(packet_stream *ps, int fec);
+void packet_stream_free(packet_stream *ps);
+
+/*
+ * take the next len bytes of the response. returns 0, or a negative error
+ * for a bad chunk_hdr or if the chunk does not fit in memory.
+ */
+int packet_stream_write(packet_stream *ps, const char *data, size_t len);
+
+/*
+ * describe the packets of the complete response in ps->chnk, with
+ * chunkid. returns 0, or -EIO if the response was short.
+ */
+int packet_stream_finish(packet_stream *ps, uint32_t chunkid);
+
+/*
+ * hand over the response buffer, and its size, to the caller
+ */
+char *packet_stream_take(packet_stream *ps, size_t *size);
+
+#endif // PACKET_H
@@ -0,0 +1,239 @@
+/*
+ * Host check of the packet views in packet.c, on a payload of more
+ * packets than the 10000 that the old packet array held.
+ *
+ * Every packet of every chunk is framed from its header and payload view
+ * as gpio_callback() does, decoded as the beacon does, and checked: the
+ * data packets must rebuild the chunk, and each parity packet must
+ * rebuild any one data packet of its group.
+ *
+ * Every chunk is also streamed through a packet_stream, as curl hands
+ * over a response, in random pieces, and must come out described the
+ * same as by packet_chunk_init().
+ *
+ * Usage: ./packet_test [-c chunks] [-s max chunk size]
+ */
+#define _GNU_SOURCE
+
+#include <getopt.h>
+
+#include "packet.h"
+#include "../../common/src/util/frame.h"
+
+static int errors;
+
+#define check(cond, F, A...) \
+  do { \
+    if (!(cond)) { \
+      if (errors++ < 10) \
+        fprintf(stderr, "%s:%d " F "\n", __func__, __LINE__, A); \
+    } \
+  } while (0)
+
+/*
+ * frame the packet, decode it and return the decoded header and payload
+ */
+static int round_trip(const ble_pkt *pkt, uint8_t *out)
+{
+  uint8_t frame[FRAME_MAX_ENCODED_LEN(PER_ADV_SIZE)];
+  uint8_t dec_buf[FRAME_LEN_SIZE + PER_ADV_SIZE + FRAME_CRC_SIZE];
+  frame_dec_t dec;
+  int len = 0;
+
+  uint32_t flen = frame_encode2((const uint8_t *) &pkt->hdr,
+      sizeof(rpi_ble_hdr), (const uint8_t *) pkt->data, pkt->len, frame);
+
+  frame_dec_init(&dec, dec_buf, sizeof(dec_buf));
+  for (uint32_t i = 0; i < flen; i++)
+    len = frame_dec_push(&dec, frame[i]);
+
+  if (len > 0)
+    memcpy(out, frame_dec_data(&dec), len);
+  return len;
+}
+
+static void check_chunk(const chunk *chnk, uint32_t numchunks,
+    uint32_t payload_ver, const char *data, uint64_t len)
+{
+  uint32_t num_groups = risk_fec_num_groups(chnk->num_data_pkts);
+  char *rebuilt = calloc(1, len + 1);
+  char *group = calloc(num_groups ? num_groups : 1, PKT_PAYLOAD_SIZE);
+  uint8_t out[PER_ADV_SIZE];
+
+  check(chnk->pkt_cnt == chnk->num_data_pkts + num_groups,
+      "chunk %u: %u packets", chnk->chunkid, chnk->pkt_cnt);
+
+  for (uint32_t seq = 0; seq < chnk->pkt_cnt; seq++) {
+    ble_pkt pkt;
+    packet_view(chnk, seq, numchunks, payload_ver, &pkt);
+
+    int n = round_trip(&pkt, out);
+    rpi_ble_hdr *hdr = (rpi_ble_hdr *) out;
+    const char *payload = (const char *) out + sizeof(rpi_ble_hdr);
+    check(n == sizeof(rpi_ble_hdr) + pkt.len, "chunk %u pkt %u: len %d",
+        chnk->chunkid, seq, n);
+    if (n < (int) sizeof(rpi_ble_hdr))
+      continue;
+
+    check(hdr->pkt_seq == seq && hdr->chunkid == chnk->chunkid &&
+        hdr->chunklen == len && hdr->numchunks == numchunks &&
+        hdr->chunk_crc == crc32((const uint8_t *) data, len) &&
+        hdr->payload_ver == payload_ver, "chunk %u pkt %u: bad header",
+        chnk->chunkid, seq);
+
+    if (seq < chnk->num_data_pkts) {
+      uint64_t off = (uint64_t) seq * PKT_PAYLOAD_SIZE;
+      check(pkt.len == ((len - off > PKT_PAYLOAD_SIZE) ?
+            PKT_PAYLOAD_SIZE : len - off), "chunk %u pkt %u: len %u",
+          chnk->chunkid, seq, pkt.len);
+      memcpy(rebuilt + off, payload, pkt.len);
+      // accumulate the group's parity of the data packets
+      for (uint32_t b = 0; b < pkt.len; b++)
+        group[(seq % num_groups) * PKT_PAYLOAD_SIZE + b] ^= payload[b];
+    } else {
+      // XOR of the parity and all data packets of the group is zero, so
+      // any one data packet can be rebuilt from the others
+      char *g = group + (seq - chnk->num_data_pkts) * PKT_PAYLOAD_SIZE;
+      for (uint32_t b = 0; b < PKT_PAYLOAD_SIZE; b++)
+        check(!(g[b] ^ payload[b]), "chunk %u pkt %u: bad parity",
+            chnk->chunkid, seq);
+    }
+  }
+
+  check(memcmp(rebuilt, data, len) == 0, "chunk %u: data differs",
+      chnk->chunkid);
+  free(group);
+  free(rebuilt);
+}
+
+/*
+ * stream the response of a chunk, a chunk_hdr and the data, in pieces of
+ * random length and compare with chnk
+ */
+static void check_stream(const chunk *chnk, const char *data, uint64_t len)
+{
+  chunk_hdr hdr = { .payload_len = len };
+  size_t resp_len = sizeof(chunk_hdr) + len;
+  char *resp = malloc(resp_len);
+  memcpy(resp, &hdr, sizeof(chunk_hdr));
+  memcpy(resp + sizeof(chunk_hdr), data, len);
+
+  packet_stream ps;
+  packet_stream_init(&ps, 1);
+  for (size_t off = 0; off < resp_len; ) {
+    size_t n = 1 + rand() % (off < sizeof(chunk_hdr) ? 4 : 3 * 1024);
+    if (n > resp_len - off)
+      n = resp_len - off;
+    check(packet_stream_write(&ps, resp + off, n) == 0,
+        "chunk %u: stream write at %zu", chnk->chunkid, off);
+    // not complete until the last byte
+    check(off + n == resp_len || packet_stream_finish(&ps, 0) == -EIO,
+        "chunk %u: finished at %zu", chnk->chunkid, off + n);
+    off += n;
+  }
+
+  check(packet_stream_finish(&ps, chnk->chunkid) == 0,
+      "chunk %u: stream not finished", chnk->chunkid);
+  const chunk *s = &ps.chnk;
+  check(s->chunkid == chnk->chunkid && s->len == chnk->len &&
+      s->crc == chnk->crc && s->pkt_cnt == chnk->pkt_cnt &&
+      s->num_data_pkts == chnk->num_data_pkts, "chunk %u: stream differs",
+      chnk->chunkid);
+  check(memcmp(s->data, data, len) == 0, "chunk %u: stream data differs",
+      chnk->chunkid);
+  uint32_t num_parity = chnk->pkt_cnt - chnk->num_data_pkts;
+  check(!num_parity || memcmp(s->parity, chnk->parity,
+        num_parity * PKT_PAYLOAD_SIZE) == 0,
+      "chunk %u: stream parity differs", chnk->chunkid);
+
+  size_t size;
+  char *buf = packet_stream_take(&ps, &size);
+  check(size == resp_len && memcmp(buf, resp, resp_len) == 0,
+      "chunk %u: stream response differs", chnk->chunkid);
+  free(buf);
+  packet_stream_free(&ps);
+  free(resp);
+}
+
+/*
+ * a chunk_hdr announcing more than PKT_MAX_CHUNK_LEN is refused
+ */
+static void check_stream_too_long(void)
+{
+  chunk_hdr hdr = { .payload_len = (uint64_t) PKT_MAX_CHUNK_LEN + 1 };
+  packet_stream ps;
+  packet_stream_init(&ps, 1);
+  check(packet_stream_write(&ps, (const char *) &hdr, sizeof(hdr)) < 0,
+      "%s", "too long chunk accepted");
+  packet_stream_free(&ps);
+}
+
+int main(int argc, char *argv[])
+{
+  int num_chunks = 128, max_size = 24 * 1024, opt;
+
+  while ((opt = getopt(argc, argv, "c:s:")) != -1) {
+    switch (opt) {
+      case 'c': num_chunks = atoi(optarg); break;
+      case 's': max_size = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-c chunks] [-s max chunk size]\n",
+            argv[0]);
+        return 1;
+    }
+  }
+
+  if (num_chunks < 1 || max_size < 1) {
+    fprintf(stderr, "chunks and max chunk size must be >= 1\n");
+    return 1;
+  }
+
+  char **data = calloc(num_chunks, sizeof(char *));
+  uint64_t *lens = calloc(num_chunks, sizeof(uint64_t));
+  chunk *chunks = calloc(num_chunks, sizeof(chunk));
+  uint64_t num_pkts = 0, payload_bytes = 0, parity_bytes = 0;
+  srand(1);
+
+  for (int c = 0; c < num_chunks; c++) {
+    // the edge cases first: one byte, exactly one and two packets, then
+    // random sizes up to max_size
+    uint64_t edges[] = { 1, PKT_PAYLOAD_SIZE, 2 * PKT_PAYLOAD_SIZE };
+    lens[c] = (c < 3) ? edges[c] :
+      (max_size / 2 + rand() % (max_size / 2 + 1));
+    data[c] = malloc(lens[c]);
+    for (uint64_t b = 0; b < lens[c]; b++)
+      data[c][b] = rand();
+
+    if (packet_chunk_init(&chunks[c], c, data[c], lens[c], 1) < 0) {
+      fprintf(stderr, "chunk %d: out of memory\n", c);
+      return 1;
+    }
+    num_pkts += chunks[c].pkt_cnt;
+    payload_bytes += lens[c];
+    parity_bytes += (chunks[c].pkt_cnt - chunks[c].num_data_pkts) *
+      PKT_PAYLOAD_SIZE;
+  }
+
+  uint32_t payload_ver = 0x12345678;
+  for (int c = 0; c < num_chunks; c++) {
+    check_chunk(&chunks[c], num_chunks, payload_ver, data[c], lens[c]);
+    check_stream(&chunks[c], data[c], lens[c]);
+  }
+  check_stream_too_long();
+
+  printf("%d chunks, %llu packets, %llu B of chunks\n", num_chunks,
+      (unsigned long long) num_pkts, (unsigned long long) payload_bytes);
+  printf("packet memory: %llu B of chunk descriptors and parity, was %d B "
+      "for 10000 packets\n", (unsigned long long) (num_chunks *
+        sizeof(chunk) + parity_bytes), 10000 * (PER_ADV_SIZE + 1));
+  printf("%s\n", errors ? "FAILED" : "ok");
+
+  for (int c = 0; c < num_chunks; c++) {
+    packet_chunk_free(&chunks[c]);
+    free(data[c]);
+  }
+  free(chunks);
+  free(lens);
+  free(data);
+  return errors ? 1 : 0;
+}
@@ -1,10 +1,22 @@
 #include "request.h"
 
-//const char domain[] = "https://127.0.0.1:8081/";
-const char domain[] = "https://pancast.cs.ubc.ca:443/";
+#include <strings.h>
+
+//const char default_domain[] = "https://127.0.0.1:8081/";
+const char default_domain[] = "https://pancast.cs.ubc.ca:443/";
 const char request[] = "update";
-#define DOMAIN_LEN strnlen(domain, 64)
-#define REQUEST_LEN strnlen(request, 16)
+
+#define MAX_URL_LEN 256
+
+/*
+ * all transfers go through one multi handle, whose connection cache keeps
+ * the connections to the backend, and their TLS sessions, open from one
+ * request to the next. handles[] are reused for the same reason.
+ */
+static char domain[MAX_URL_LEN];
+static CURLM *multi;
+static CURL *handles[REQUEST_MAX_PARALLEL];
+static struct curl_slist *headers[REQUEST_MAX_PARALLEL];
 
 /*
  * Write data from stream, from CURLOPT_WRITEFUNCTION example
@@ -19,6 +31,10 @@ size_t write_function(char *data, size_t size, size_t nmemb, void *userdata)
 {
   size_t realsize = size * nmemb;
   struct req_data *mem = (struct req_data*)userdata;
+
+  if (mem->on_data)
+    return mem->on_data(mem->sink, data, realsize) == 0 ? realsize : 0;
+
   char *ptr = realloc(mem->response, mem->size + realsize + 1);
   if(ptr == NULL) {
     printf("out of memory!");
@@ -33,96 +49,313 @@ size_t write_function(char *data, size_t size, size_t nmemb, void *userdata)
 }
 
 /*
- * Handle HTTP request to pancast server adapted from
- * https://github.com/CedricFauth/c-client-flask-server-test
+ * keep the ETag of the response, from CURLOPT_HEADERFUNCTION
  */
-int handle_request_chunk(struct req_data *data, int chunk)
+static size_t header_function(char *buf, size_t size, size_t nitems,
+    void *userdata)
 {
-#define MAX_URL_LEN 256
-  char url[MAX_URL_LEN];
-  memset(url, 0, MAX_URL_LEN);
-  sprintf(url, "%s%s?chunk=%d", domain, request, chunk);
+  size_t len = size * nitems;
+  struct req_data *mem = (struct req_data *) userdata;
+  const char name[] = "etag:";
 
-  dprintf(LVL_DBG, "Making request to server: %s\r\n", url);
+  if (len <= sizeof(name) - 1 || strncasecmp(buf, name, sizeof(name) - 1))
+    return len;
+
+  char *val = buf + sizeof(name) - 1;
+  char *end = buf + len;
+  while (val < end && (*val == ' ' || *val == '\t'))
+    val++;
+  while (end > val && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' '))
+    end--;
+
+  if (end - val < REQ_ETAG_LEN) {
+    memcpy(mem->etag, val, end - val);
+    mem->etag[end - val] = '\0';
+  }
+  return len;
+}
+
+int request_init(const char *base_url)
+{
+  if (multi)
+    return 0;
 
-  curl_global_init(CURL_GLOBAL_ALL);
+  if (!base_url)
+    base_url = default_domain;
 
-  CURL *curl = curl_easy_init();
-  if (!curl)
+  if (strlen(base_url) >= MAX_URL_LEN / 2) {
+    fprintf(stderr, "base url too long: %s\r\n", base_url);
     return -EINVAL;
+  }
+  strcpy(domain, base_url);
 
-  CURLcode res;
-  curl_easy_setopt(curl, CURLOPT_URL, url);
+  if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK)
+    return -1;
 
-  // disable SSL verification for now
-  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
+  multi = curl_multi_init();
+  if (!multi) {
+    curl_global_cleanup();
+    return -1;
+  }
+
+  // HTTP/2 backends serve parallel chunks over a single connection
+  curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+      (long) REQUEST_MAX_PARALLEL);
+
+  for (int i = 0; i < REQUEST_MAX_PARALLEL; i++) {
+    handles[i] = curl_easy_init();
+    if (!handles[i]) {
+      request_cleanup();
+      return -1;
+    }
 
-  // send all data to write function
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_function);
+    // disable SSL verification for now
+    curl_easy_setopt(handles[i], CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(handles[i], CURLOPT_SSL_VERIFYHOST, 0L);
+
+    // an HTTP error status is a failed request, not a response to parse
+    curl_easy_setopt(handles[i], CURLOPT_FAILONERROR, 1L);
+
+    // send all data to write function
+    curl_easy_setopt(handles[i], CURLOPT_WRITEFUNCTION, write_function);
+    curl_easy_setopt(handles[i], CURLOPT_HEADERFUNCTION, header_function);
+  }
+
+  dprintf(LVL_EXP, "backend: %s, libcurl %s\r\n", domain,
+      curl_version_info(CURLVERSION_NOW)->version);
+  return 0;
+}
+
+void request_cleanup(void)
+{
+  for (int i = 0; i < REQUEST_MAX_PARALLEL; i++) {
+    if (handles[i])
+      curl_easy_cleanup(handles[i]);
+    handles[i] = NULL;
+    curl_slist_free_all(headers[i]);
+    headers[i] = NULL;
+  }
+
+  if (multi) {
+    curl_multi_cleanup(multi);
+    multi = NULL;
+    curl_global_cleanup();
+  }
+}
+
+/*
+ * point a handle at a URL and a response buffer, and add it to the
+ * multi handle. makes the request conditional on data->etag, if set.
+ */
+static int start_transfer(CURL *curl, const char *url, struct req_data *data)
+{
+  int h = 0;
+  while (handles[h] != curl)
+    h++;
+
+  dprintf(LVL_DBG, "Making request to server: %s\r\n", url);
+
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+
+  curl_slist_free_all(headers[h]);
+  headers[h] = NULL;
+  if (data->etag[0]) {
+    char hdr[sizeof("If-None-Match: ") + REQ_ETAG_LEN];
+    snprintf(hdr, sizeof(hdr), "If-None-Match: %s", data->etag);
+    headers[h] = curl_slist_append(NULL, hdr);
+  }
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers[h]);
+  data->etag[0] = '\0';
+  data->status = 0;
 
   // pass 'data' struct to the callback function
   curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) data);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *) data);
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *) data);
+
+  return curl_multi_add_handle(multi, curl) == CURLM_OK ? 0 : -1;
+}
+
+/*
+ * wait for the next finished transfer, and remove it from the multi
+ * handle. returns the handle, or NULL if the multi handle failed.
+ */
+static CURL *finish_transfer(CURLcode *res)
+{
+  int running, pending;
+  CURLMsg *msg;
+
+  while (1) {
+    if (curl_multi_perform(multi, &running) != CURLM_OK) {
+      fprintf(stderr, "error: curl multi failed\r\n");
+      return NULL;
+    }
+
+    while ((msg = curl_multi_info_read(multi, &pending))) {
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+
+      *res = msg->data.result;
+      CURL *curl = msg->easy_handle;
+      curl_multi_remove_handle(multi, curl);
+
+      struct req_data *data;
+      curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **) &data);
+      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &data->status);
+      return curl;
+    }
+
+    if (curl_multi_wait(multi, NULL, 0, 1000, NULL) != CURLM_OK) {
+      fprintf(stderr, "error: curl multi wait failed\r\n");
+      return NULL;
+    }
+  }
+}
+
+/*
+ * fetch the path under the backend url into data
+ */
+static int request_path(const char *path, struct req_data *data)
+{
+  char url[MAX_URL_LEN];
+  CURLcode res;
+
+  if (!multi && request_init(NULL) < 0)
+    return -1;
+
+  snprintf(url, MAX_URL_LEN, "%s%s", domain, path);
+  if (start_transfer(handles[0], url, data) < 0 || !finish_transfer(&res))
+    return -1;
 
-  res = curl_easy_perform(curl);
   if (res != CURLE_OK) {
     fprintf(stderr, "error: %s\r\n", curl_easy_strerror(res));
     return -1;
   }
 
-  dprintf(LVL_EXP, "res: %d, data size: %d buf hdr: %llu\r\n", res,
-      (int) data->size, ((uint64_t *) data->response)[0]);
-
-  curl_easy_cleanup(curl);
-  curl_global_cleanup();
-
   return 0;
 }
 
-
 /*
  * Handle HTTP request to pancast server adapted from
  * https://github.com/CedricFauth/c-client-flask-server-test
  */
-int handle_request_count(struct req_data *data)
+int handle_request_chunk(struct req_data *data, int chunk)
 {
-#define COUNT_LEN 6
-#define MAX_URL_LEN 256
-  char url[MAX_URL_LEN];
-  memset(url, 0, MAX_URL_LEN);
-  sprintf(url, "%s%s/count", domain, request);
+  char path[MAX_URL_LEN];
+  snprintf(path, MAX_URL_LEN, "%s?chunk=%d", request, chunk);
 
-  dprintf(LVL_DBG, "Making request to server: %s\r\n", url);
+  if (request_path(path, data) < 0)
+    return -1;
+
+  dprintf(LVL_EXP, "data size: %d buf hdr: %llu\r\n", (int) data->size,
+      data->size >= sizeof(uint64_t) ?
+      (unsigned long long) ((uint64_t *) data->response)[0] : 0);
 
-  curl_global_init(CURL_GLOBAL_ALL);
+  return 0;
+}
+
+/*
+ * fetch chunks first .. first+num-1 into data[0 .. num-1], keeping up to
+ * parallel requests in flight. chunks with an etag are only sent if they
+ * changed, see struct req_data. returns the number of chunks that could
+ * not be fetched.
+ */
+int handle_request_chunks(struct req_data *data, int first, int num,
+    int parallel)
+{
+  // the domain, the request and the chunk number always fit
+  char url[sizeof(domain) + sizeof(request) + sizeof("?chunk=") + 11];
+  int next = 0, running = 0, failed = 0;
+  CURLcode res;
 
-  CURL *curl = curl_easy_init();
-  if (curl) {
+  if (!multi && request_init(NULL) < 0)
+    return num;
 
-    CURLcode res;
-    curl_easy_setopt(curl, CURLOPT_URL, url);
+  if (parallel < 1)
+    parallel = 1;
+  if (parallel > REQUEST_MAX_PARALLEL)
+    parallel = REQUEST_MAX_PARALLEL;
 
-    // Disable SSL verification for now
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
+  // a chunk that cannot be started is failed, its handle takes the next
+  for (; next < num && running < parallel; next++) {
+    snprintf(url, sizeof(url), "%s%s?chunk=%d", domain, request,
+        first + next);
+    if (start_transfer(handles[running], url, &data[next]) == 0)
+      running++;
+    else
+      failed++;
+  }
 
-    // send all data to write function
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_function);
+  while (running > 0) {
+    CURL *curl = finish_transfer(&res);
+    if (!curl)
+      return failed + (num - next) + running;
+    running--;
 
-    // pass 'data' struct to the callback function
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) data);
+    struct req_data *done;
+    curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **) &done);
+    if (res != CURLE_OK) {
+      fprintf(stderr, "error: chunk %d: %s\r\n",
+          first + (int) (done - data), curl_easy_strerror(res));
+      failed++;
+    }
 
-    res = curl_easy_perform(curl);
-    if(res != CURLE_OK) {	
-      fprintf(stderr, "error: %s\r\n", curl_easy_strerror(res));
-      return -1;
+    // hand the free handle the next chunk
+    if (next < num) {
+      snprintf(url, sizeof(url), "%s%s?chunk=%d", domain, request,
+          first + next);
+      if (start_transfer(curl, url, &data[next]) == 0)
+        running++;
+      else
+        failed++;
+      next++;
     }
+  }
+
+  dprintf(LVL_EXP, "fetched chunks %d-%d, %d in parallel, %d failed\r\n",
+      first, first + num - 1, parallel, failed);
+  return failed;
+}
+
 
-    dprintf(LVL_EXP, "res: %d, size: %d #chunk: %d\r\n", res, (int) data->size,
-        *(uint32_t *) data->response);
+/*
+ * Handle HTTP request to pancast server adapted from
+ * https://github.com/CedricFauth/c-client-flask-server-test
+ */
+int handle_request_count(struct req_data *data)
+{
+  char path[MAX_URL_LEN];
+  snprintf(path, MAX_URL_LEN, "%s/count", request);
 
-    curl_easy_cleanup(curl);
+  if (request_path(path, data) < 0)
+    return -1;
+
+  if (data->size < sizeof(uint32_t)) {
+    fprintf(stderr, "error: short chunk count, size: %d\r\n",
+        (int) data->size);
+    return -1;
   }
-  curl_global_cleanup();
+
+  dprintf(LVL_EXP, "size: %d #chunk: %d\r\n", (int) data->size,
+      *(uint32_t *) data->response);
+
+  return 0;
+}
+
+/*
+ * fetch the signed manifest of chunk hashes for the current payload,
+ * prefixed with a chunk_hdr like a regular chunk
+ */
+int handle_request_manifest(struct req_data *data)
+{
+  char path[MAX_URL_LEN];
+  snprintf(path, MAX_URL_LEN, "%s/manifest", request);
+
+  if (request_path(path, data) < 0)
+    return -1;
+
+  dprintf(LVL_EXP, "manifest size: %d\r\n", (int) data->size);
+
   return 0;
 }
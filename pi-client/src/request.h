@@ -5,8 +5,30 @@
 
 #include <curl/curl.h>
 
+/*
+ * max number of chunks fetched at the same time, each over its own
+ * connection unless the backend multiplexes them over HTTP/2
+ */
+#define REQUEST_MAX_PARALLEL 16
+
+/*
+ * number of chunks fetched at the same time by a payload refresh
+ */
+#define REQUEST_PARALLEL 8
+
+/*
+ * set up libcurl and the connections to the backend at base_url, e.g.,
+ * "https://pancast.cs.ubc.ca:443/", or the default backend if NULL.
+ * connections are kept open between requests until request_cleanup().
+ */
+int request_init(const char *base_url);
+void request_cleanup(void);
+
 int handle_request(struct req_data* data);
 int handle_request_chunk(struct req_data* data, int chunk);
+int handle_request_chunks(struct req_data *data, int first, int num,
+    int parallel);
 int handle_request_count(struct req_data* data);
+int handle_request_manifest(struct req_data* data);
 
 #endif // REQUEST_H
@@ -0,0 +1,192 @@
+/*
+ * End-to-end payload refresh time of the pi client against a backend,
+ * e.g., the local stand-in in ../scripts/risk_server.py.
+ *
+ * A refresh fetches the chunk count and then every chunk, as
+ * make_request() does. Compares the old way, which set up libcurl and a
+ * new connection for every chunk and fetched the chunks one after
+ * another, with request.c, which keeps its connections across requests
+ * and refreshes and fetches up to -p chunks in parallel.
+ *
+ * Usage: ./request_bench [-u base url] [-p max parallel] [-r refreshes]
+ *   -u  backend, by default http://127.0.0.1:8081/
+ *   -r  refreshes per run; the first one opens the connections, the
+ *       others show the steady state of the daily refresh
+ */
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <time.h>
+
+#include "request.h"
+#include "../../common/src/riskinfo.h"
+
+static double now_s()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+extern size_t write_function(char *data, size_t size, size_t nmemb,
+    void *userdata);
+
+/*
+ * request of the old handle_request_chunk(), libcurl set up and torn down
+ * for every chunk
+ */
+static int old_request(const char *url, struct req_data *data)
+{
+  curl_global_init(CURL_GLOBAL_ALL);
+
+  CURL *curl = curl_easy_init();
+  if (!curl)
+    return -1;
+
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+  curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_function);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) data);
+
+  CURLcode res = curl_easy_perform(curl);
+  curl_easy_cleanup(curl);
+  curl_global_cleanup();
+
+  return res == CURLE_OK ? 0 : -1;
+}
+
+static int check_chunk(struct req_data *data, int chunk)
+{
+  if (data->size < sizeof(chunk_hdr) || ((chunk_hdr *) data->response)->
+      payload_len != data->size - sizeof(chunk_hdr)) {
+    fprintf(stderr, "chunk %d: bad response, size: %d\n", chunk,
+        (int) data->size);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * returns the refresh time, or a negative value on error
+ */
+static double old_refresh(const char *base_url, uint64_t *nbytes)
+{
+  char url[256];
+  struct req_data count = {0};
+  int err = 0;
+  double start = now_s();
+
+  snprintf(url, sizeof(url), "%supdate/count", base_url);
+  if (old_request(url, &count) < 0 || count.size < sizeof(uint32_t))
+    return -1;
+
+  uint32_t num_chunks = *(uint32_t *) count.response;
+  free(count.response);
+
+  for (uint32_t i = 0; !err && i < num_chunks; i++) {
+    struct req_data chunk = {0};
+    snprintf(url, sizeof(url), "%supdate?chunk=%u", base_url, i);
+    err = old_request(url, &chunk) < 0 || check_chunk(&chunk, i) < 0;
+    *nbytes += chunk.size;
+    free(chunk.response);
+  }
+
+  return err ? -1 : now_s() - start;
+}
+
+static double new_refresh(int parallel, uint64_t *nbytes)
+{
+  struct req_data count = {0};
+  int err = 0;
+  double start = now_s();
+
+  if (handle_request_count(&count) < 0)
+    return -1;
+
+  uint32_t num_chunks = *(uint32_t *) count.response;
+  free(count.response);
+
+  struct req_data *chunks = calloc(num_chunks, sizeof(struct req_data));
+  err = handle_request_chunks(chunks, 0, num_chunks, parallel);
+
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    err = err || check_chunk(&chunks[i], i) < 0;
+    *nbytes += chunks[i].size;
+    free(chunks[i].response);
+  }
+  free(chunks);
+
+  return err ? -1 : now_s() - start;
+}
+
+static int run(const char *name, const char *base_url, int parallel,
+    int refreshes)
+{
+  double first = 0, rest = 0;
+  uint64_t nbytes = 0;
+
+  if (parallel && request_init(base_url) < 0)
+    return -1;
+
+  for (int r = 0; r < refreshes; r++) {
+    double t = parallel ? new_refresh(parallel, &nbytes) :
+      old_refresh(base_url, &nbytes);
+    if (t < 0) {
+      fprintf(stderr, "%s: refresh failed\n", name);
+      return -1;
+    }
+    if (r == 0)
+      first = t;
+    else
+      rest += t;
+  }
+
+  if (parallel)
+    request_cleanup();
+
+  printf("%-10s %8d %12.3f %12.3f %10.0f\n", name, parallel ? parallel : 1,
+      first, refreshes > 1 ? rest / (refreshes - 1) : first,
+      nbytes / 1024.0 / refreshes);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *base_url = "http://127.0.0.1:8081/";
+  int max_parallel = REQUEST_MAX_PARALLEL, refreshes = 3, opt;
+
+  while ((opt = getopt(argc, argv, "u:p:r:")) != -1) {
+    switch (opt) {
+      case 'u': base_url = optarg; break;
+      case 'p': max_parallel = atoi(optarg); break;
+      case 'r': refreshes = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-u base url] [-p max parallel] "
+            "[-r refreshes]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (max_parallel < 1 || max_parallel > REQUEST_MAX_PARALLEL ||
+      refreshes < 1) {
+    fprintf(stderr, "parallel must be in [1, %d], refreshes >= 1\n",
+        REQUEST_MAX_PARALLEL);
+    return 1;
+  }
+
+  printf("backend: %s, %d refreshes per run\n", base_url, refreshes);
+  printf("%-10s %8s %12s %12s %10s\n", "fetch", "parallel", "first (s)",
+      "steady (s)", "KB");
+
+  if (run("per-chunk", base_url, 0, refreshes) < 0)
+    return 1;
+
+  for (int p = 1; p <= max_parallel;
+      p = (p < max_parallel && p * 2 > max_parallel) ? max_parallel : p * 2) {
+    if (run("shared", base_url, p, refreshes) < 0)
+      return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,150 @@
+#include "sched.h"
+
+#include <sys/timerfd.h>
+#include <time.h>
+
+static int tfd = -1;
+static sched_config config;
+static FILE *metrics;
+static unsigned int seed;
+
+/*
+ * when the timer is due, when the current refresh was due and started,
+ * when the one before it started, and the number of failed refreshes
+ * since the last success
+ */
+static double due, started_due, started, prev_started;
+static int retries;
+
+static double mono_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int arm(double t)
+{
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = (time_t) t;
+  its.it_value.tv_nsec = (long) ((t - its.it_value.tv_sec) * 1e9);
+  // a zero it_value disarms the timer
+  if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+    its.it_value.tv_nsec = 1;
+
+  if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+    fprintf(stderr, "sched: timer: %s\r\n", strerror(errno));
+    return -errno;
+  }
+  due = t;
+  return 0;
+}
+
+int sched_init(const sched_config *cfg)
+{
+  config = *cfg;
+  if (config.retry_max < config.retry_min)
+    config.retry_max = config.retry_min;
+
+  if (tfd < 0) {
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (tfd < 0)
+      return -errno;
+  }
+
+  if (metrics)
+    fclose(metrics);
+  metrics = NULL;
+  if (config.metrics_log) {
+    metrics = fopen(config.metrics_log, "a");
+    if (!metrics) {
+      fprintf(stderr, "sched: metrics log %s: %s\r\n", config.metrics_log,
+          strerror(errno));
+    } else {
+      setvbuf(metrics, NULL, _IOLBF, 0);
+    }
+  }
+
+  double now = mono_s();
+  seed = (unsigned int) (getpid() ^ (long) (now * 1e9));
+  started = prev_started = 0;
+  retries = 0;
+
+  dprintf(LVL_EXP, "refresh every %.0f s + up to %.0f s, retry after "
+      "%.0f-%.0f s\r\n", config.interval, config.jitter, config.retry_min,
+      config.retry_max);
+  return arm(now);
+}
+
+int sched_wait(void)
+{
+  uint64_t expirations;
+
+  while (read(tfd, &expirations, sizeof(expirations)) < 0) {
+    if (errno != EINTR) {
+      fprintf(stderr, "sched: wait: %s\r\n", strerror(errno));
+      return -errno;
+    }
+  }
+
+  prev_started = started;
+  started = mono_s();
+  started_due = due;
+  return 0;
+}
+
+static double uniform(double max)
+{
+  return max * rand_r(&seed) / ((double) RAND_MAX + 1);
+}
+
+double sched_next(int err)
+{
+  double delay;
+
+  if (err) {
+    // double the delay on every failure, and spread the retries of many
+    // clients by up to half the delay
+    delay = config.retry_min;
+    for (int i = 0; i < retries && delay < config.retry_max; i++)
+      delay *= 2;
+    if (delay > config.retry_max)
+      delay = config.retry_max;
+    delay += uniform(delay / 2);
+    retries++;
+  } else {
+    delay = config.interval + uniform(config.jitter);
+    retries = 0;
+  }
+
+  // from the start of the refresh, so that its duration does not add up
+  double next = started + delay;
+  if (next < mono_s())
+    next = mono_s();
+  arm(next);
+  return next;
+}
+
+void sched_log(const sched_result *res)
+{
+  char wall[32];
+  struct timespec ts;
+  struct tm tm;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  gmtime_r(&ts.tv_sec, &tm);
+  strftime(wall, sizeof(wall), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+  char line[256];
+  snprintf(line, sizeof(line), "%s mono=%.3f late=%.3f since_last=%.3f "
+      "result=%s fetch=%.3f build=%.3f chunks=%d unchanged=%d switch=%.3f "
+      "retries=%d next_in=%.3f", wall, started, started - started_due,
+      prev_started ? started - prev_started : 0,
+      res->err ? "fail" : "ok", res->fetch_s, res->build_s, res->num_chunks,
+      res->unchanged, res->switch_s, retries, due - mono_s());
+
+  dprintf(LVL_DBG, "%s\r\n", line);
+  if (metrics)
+    fprintf(metrics, "%s\n", line);
+}
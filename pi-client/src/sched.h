@@ -0,0 +1,54 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "common.h"
+
+/*
+ * when to refresh the payload, on CLOCK_MONOTONIC so that neither CPU
+ * idle time nor changes of the wall clock move a refresh. all times are
+ * in seconds.
+ */
+typedef struct sched_config {
+  double interval;      // between two successful refreshes
+  double jitter;        // up to this much is added to every interval
+  double retry_min;     // first retry after a failed refresh
+  double retry_max;     // retries back off exponentially up to this
+  const char *metrics_log;  // file to append a line per refresh to, or NULL
+} sched_config;
+
+/*
+ * outcome of one refresh, for the metrics log
+ */
+typedef struct sched_result {
+  int err;              // 0 if the payload was refreshed
+  double fetch_s;       // fetching the chunks
+  double build_s;       // building the packets
+  int num_chunks;
+  int unchanged;        // chunks the backend answered with a 304
+  double switch_s;      // until the transmit stage sent it, or < 0
+} sched_result;
+
+/*
+ * set up the timer, with the first refresh due now. returns 0, or a
+ * negative error.
+ */
+int sched_init(const sched_config *cfg);
+
+/*
+ * block until the next refresh is due. returns 0, or a negative error.
+ */
+int sched_wait(void);
+
+/*
+ * arm the timer for the next refresh after one that started at the last
+ * sched_wait() and failed if err. returns when it is due, in
+ * CLOCK_MONOTONIC seconds.
+ */
+double sched_next(int err);
+
+/*
+ * append the result of the last refresh to the metrics log
+ */
+void sched_log(const sched_result *res);
+
+#endif // SCHED_H
@@ -0,0 +1,293 @@
+#include "serial.h"
+#include "metrics.h"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+struct serial_port {
+  int fd;
+  int closed;
+  int want_out;
+  const char *name;
+  void (*on_line)(char *line, void *arg);
+  void *arg;
+
+  /*
+   * ring buffer of bytes queued for the port, written by serial_sendv()
+   * from any thread and drained by serial_loop()
+   */
+  pthread_mutex_t tx_lock;
+  uint8_t tx_buf[SERIAL_TX_BUF_SIZE];
+  size_t tx_head, tx_len;
+
+  char line[SERIAL_LINE_SIZE];
+  int linelen;
+};
+
+static serial_port ports[SERIAL_MAX_PORTS];
+static int num_ports, num_open;
+static int epfd = -1;
+// wakes serial_loop() when data is queued, or to stop it
+static int evfd = -1;
+static int stopping;
+
+int serial_init(void)
+{
+  if (epfd >= 0)
+    close(epfd);
+  if (evfd >= 0)
+    close(evfd);
+
+  epfd = epoll_create1(0);
+  evfd = eventfd(0, EFD_NONBLOCK);
+  if (epfd < 0 || evfd < 0)
+    return -errno;
+
+  // evfd is the event without a port
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, evfd, &ev) < 0)
+    return -errno;
+
+  for (int i = 0; i < num_ports; i++)
+    pthread_mutex_destroy(&ports[i].tx_lock);
+  num_ports = num_open = 0;
+  stopping = 0;
+  return 0;
+}
+
+serial_port *serial_add(int fd, const char *name,
+    void (*on_line)(char *line, void *arg), void *arg)
+{
+  if (num_ports == SERIAL_MAX_PORTS) {
+    fprintf(stderr, "serial: more than %d ports\r\n", SERIAL_MAX_PORTS);
+    return NULL;
+  }
+
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    return NULL;
+
+  serial_port *port = &ports[num_ports];
+  memset(port, 0, sizeof(serial_port));
+  port->fd = fd;
+  port->name = name;
+  port->on_line = on_line;
+  port->arg = arg;
+  pthread_mutex_init(&port->tx_lock, NULL);
+
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = port };
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    pthread_mutex_destroy(&port->tx_lock);
+    return NULL;
+  }
+
+  num_ports++;
+  num_open++;
+  return port;
+}
+
+static void serial_wake(void)
+{
+  uint64_t one = 1;
+  if (write(evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    fprintf(stderr, "serial: wake failed: %s\r\n", strerror(errno));
+}
+
+int serial_sendv(serial_port *port, const struct iovec *iov, int iovcnt)
+{
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+
+  pthread_mutex_lock(&port->tx_lock);
+  if (port->closed) {
+    pthread_mutex_unlock(&port->tx_lock);
+    return -EPIPE;
+  }
+  if (len > SERIAL_TX_BUF_SIZE - port->tx_len) {
+    pthread_mutex_unlock(&port->tx_lock);
+    return -EAGAIN;
+  }
+
+  int was_empty = (port->tx_len == 0);
+  for (int i = 0; i < iovcnt; i++) {
+    const uint8_t *p = iov[i].iov_base;
+    for (size_t left = iov[i].iov_len; left > 0; ) {
+      size_t tail = (port->tx_head + port->tx_len) % SERIAL_TX_BUF_SIZE;
+      size_t n = SERIAL_TX_BUF_SIZE - tail;
+      if (n > left)
+        n = left;
+      memcpy(port->tx_buf + tail, p, n);
+      port->tx_len += n;
+      p += n;
+      left -= n;
+    }
+  }
+  pthread_mutex_unlock(&port->tx_lock);
+
+  // serial_loop() is already writing if there was data queued
+  if (was_empty)
+    serial_wake();
+  return 0;
+}
+
+size_t serial_tx_pending(serial_port *port)
+{
+  pthread_mutex_lock(&port->tx_lock);
+  size_t len = port->tx_len;
+  pthread_mutex_unlock(&port->tx_lock);
+  return len;
+}
+
+void serial_stop(void)
+{
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+  serial_wake();
+}
+
+static void serial_close(serial_port *port, const char *why)
+{
+  fprintf(stderr, "serial: %s%s%s, dropping it\r\n", port->name ?
+      port->name : "port", port->name ? ": " : "", why);
+
+  epoll_ctl(epfd, EPOLL_CTL_DEL, port->fd, NULL);
+  pthread_mutex_lock(&port->tx_lock);
+  port->closed = 1;
+  port->tx_len = 0;
+  pthread_mutex_unlock(&port->tx_lock);
+  num_open--;
+}
+
+/*
+ * write out as much of the port's queue as it takes. returns 1 if data
+ * is left, 0 if the queue is empty, or a negative error.
+ */
+static int serial_flush(serial_port *port)
+{
+  int ret = 0;
+
+  pthread_mutex_lock(&port->tx_lock);
+  while (port->tx_len > 0) {
+    size_t n = SERIAL_TX_BUF_SIZE - port->tx_head;
+    if (n > port->tx_len)
+      n = port->tx_len;
+
+    ssize_t wlen = write(port->fd, port->tx_buf + port->tx_head, n);
+    if (wlen < 0) {
+      if (errno == EINTR)
+        continue;
+      ret = (errno == EAGAIN) ? 1 : -errno;
+      break;
+    }
+
+    port->tx_head = (port->tx_head + wlen) % SERIAL_TX_BUF_SIZE;
+    port->tx_len -= wlen;
+  }
+  if (port->tx_len == 0)
+    port->tx_head = 0;
+  pthread_mutex_unlock(&port->tx_lock);
+
+  return ret;
+}
+
+/*
+ * echo what the port sent and pass complete lines to on_line
+ */
+static void serial_input(serial_port *port, const char *buf, ssize_t len)
+{
+  if (!port->name)
+    fwrite(buf, 1, len, stdout);
+
+  for (ssize_t i = 0; i < len; i++) {
+    if (buf[i] == '\n' || port->linelen == SERIAL_LINE_SIZE - 1) {
+      port->line[port->linelen] = '\0';
+      if (port->name)
+        printf("[%s] %s\n", port->name, port->line);
+      if (port->on_line)
+        port->on_line(port->line, port->arg);
+      port->linelen = 0;
+    }
+    // a byte that overflowed the line starts the next one
+    if (buf[i] != '\n')
+      port->line[port->linelen++] = buf[i];
+  }
+}
+
+int serial_loop(void)
+{
+  char buf[SERIAL_READ_SIZE];
+
+  while (num_open > 0) {
+    struct epoll_event events[SERIAL_MAX_PORTS + 1];
+    int n = epoll_wait(epfd, events, SERIAL_MAX_PORTS + 1, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+
+    for (int e = 0; e < n; e++) {
+      serial_port *port = events[e].data.ptr;
+      if (!port) {
+        uint64_t cnt;
+        if (read(evfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+          return -errno;
+        continue;
+      }
+
+      if (port->closed)
+        continue;
+
+      ssize_t len = 0;
+      if (events[e].events & EPOLLIN) {
+        len = read(port->fd, buf, sizeof(buf));
+        if (len < 0 && errno != EAGAIN && errno != EINTR) {
+          serial_close(port, strerror(errno));
+          continue;
+        }
+        if (len > 0)
+          serial_input(port, buf, len);
+      }
+
+      // after a hangup, what is left to read is read first
+      if ((events[e].events & (EPOLLERR | EPOLLHUP)) && len <= 0)
+        serial_close(port, "closed");
+    }
+
+    // data queued before serial_stop() is written out before stopping
+    int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+    int any_left = 0;
+
+    // write whenever data is queued; wait for a port to drain while it
+    // is full
+    for (int i = 0; i < num_ports; i++) {
+      serial_port *port = &ports[i];
+      if (port->closed)
+        continue;
+
+      int left = serial_flush(port);
+      if (left < 0) {
+        metrics_inc(M_SERIAL_WRITE_ERRORS);
+        serial_close(port, strerror(-left));
+        continue;
+      }
+
+      if (left != port->want_out) {
+        struct epoll_event ev = {
+          .events = EPOLLIN | (left ? EPOLLOUT : 0),
+          .data.ptr = port,
+        };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, port->fd, &ev);
+        port->want_out = left;
+      }
+      any_left |= left;
+    }
+
+    if (stop && !any_left)
+      return 0;
+  }
+
+  fprintf(stderr, "serial: all ports closed\r\n");
+  return -EIO;
+}
@@ -0,0 +1,70 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include "common.h"
+
+#include <sys/uio.h>
+
+/*
+ * bytes read from a serial port at a time
+ */
+#define SERIAL_READ_SIZE 4096
+
+/*
+ * bytes queued per serial port. a packet that does not fit is not
+ * queued, and is sent again once the port drained, see serial_sendv().
+ */
+#define SERIAL_TX_BUF_SIZE 4096
+
+/*
+ * max length of a log line from a beacon, longer lines are split
+ */
+#define SERIAL_LINE_SIZE 512
+
+/*
+ * max number of ports, i.e., beacons, that one serial_loop() serves
+ */
+#define SERIAL_MAX_PORTS 8
+
+typedef struct serial_port serial_port;
+
+/*
+ * set up the event loop, without any ports. returns 0, or a negative
+ * error.
+ */
+int serial_init(void);
+
+/*
+ * set up non-blocking I/O on the serial port fd and add it to the loop.
+ * every complete line read from it is passed to on_line, if set, with
+ * arg. what the port sends is echoed to stdout as is, or line by line
+ * prefixed with name if set. returns NULL on an error.
+ */
+serial_port *serial_add(int fd, const char *name,
+    void (*on_line)(char *line, void *arg), void *arg);
+
+/*
+ * queue the concatenation of iov for the port, whole or not at all. safe
+ * to call from any thread. returns 0, -EAGAIN if the queue is too full
+ * and the caller should retry later, or -EPIPE if the port was closed.
+ */
+int serial_sendv(serial_port *port, const struct iovec *iov, int iovcnt);
+
+/*
+ * bytes still queued for the port
+ */
+size_t serial_tx_pending(serial_port *port);
+
+/*
+ * read from and write to all ports as they are ready. a port that is
+ * closed is dropped. returns only on an error, or once all ports are
+ * closed.
+ */
+int serial_loop(void);
+
+/*
+ * make serial_loop() return 0, after it wrote out what is queued
+ */
+void serial_stop(void);
+
+#endif // SERIAL_H
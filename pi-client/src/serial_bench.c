@@ -0,0 +1,317 @@
+/*
+ * Host benchmark of the pi client's serial I/O over a pseudo-terminal,
+ * the old blocking one-byte reads and whole-packet writes against the
+ * epoll loop in serial.c.
+ *
+ * rx: a peer thread writes beacon log lines into one end of the pty, the
+ *     client side reads them and assembles lines
+ * tx: the client side sends framed-size packets, the peer reads them
+ *
+ * Reports the sustained bytes/s and the CPU time of the client side
+ * threads, as a share of the elapsed time.
+ *
+ * Usage: ./serial_bench [-n bytes] [-r bytes/s]
+ *   -r limits the rx peer and the tx packets to the given rate, e.g.
+ *      10472 for 115200 baud with 8E1 framing; 0 writes as fast as the
+ *      pty allows
+ */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <termios.h>
+#include <time.h>
+
+#include "serial.h"
+
+#define LINE_LEN 64
+#define PKT_LEN 256
+
+typedef struct {
+  int fd;
+  long nbytes;
+  long rate;
+  long done;
+} peer_args;
+
+static long nlines, expected_lines;
+static serial_port *port;
+// CPU time of the client side threads, taken as they finish
+static double rx_cpu, loop_cpu, producer_cpu;
+
+static double now_s()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double thread_cpu_s()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_pty(int *master, int *slave)
+{
+  struct termios tty;
+
+  *master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (*master < 0 || grantpt(*master) < 0 || unlockpt(*master) < 0) {
+    perror("posix_openpt");
+    return -1;
+  }
+
+  *slave = open(ptsname(*master), O_RDWR | O_NOCTTY);
+  if (*slave < 0) {
+    perror("open slave");
+    return -1;
+  }
+
+  // raw mode and reads as set_interface_attribs() sets up the port
+  tcgetattr(*slave, &tty);
+  cfmakeraw(&tty);
+  tty.c_cc[VMIN] = 1;
+  tty.c_cc[VTIME] = 1;
+  tcsetattr(*slave, TCSANOW, &tty);
+  tcgetattr(*master, &tty);
+  cfmakeraw(&tty);
+  tcsetattr(*master, TCSANOW, &tty);
+
+  return 0;
+}
+
+/*
+ * beacon side, writes log lines of LINE_LEN bytes
+ */
+static void *peer_write_logs(void *arg)
+{
+  peer_args *a = arg;
+  char line[LINE_LEN];
+  double start = now_s();
+
+  memset(line, 'x', LINE_LEN - 1);
+  line[LINE_LEN - 1] = '\n';
+
+  while (a->done < a->nbytes) {
+    if (a->rate) {
+      double due = start + (double) a->done / a->rate;
+      double wait = due - now_s();
+      if (wait > 0)
+        usleep(wait * 1e6);
+    }
+    if (write(a->fd, line, LINE_LEN) != LINE_LEN)
+      break;
+    a->done += LINE_LEN;
+  }
+  return NULL;
+}
+
+/*
+ * beacon side, reads packets
+ */
+static void *peer_read(void *arg)
+{
+  peer_args *a = arg;
+  char buf[SERIAL_READ_SIZE];
+
+  while (a->done < a->nbytes) {
+    ssize_t len = read(a->fd, buf, sizeof(buf));
+    if (len <= 0)
+      break;
+    a->done += len;
+  }
+  return NULL;
+}
+
+static void count_line(char *line, void *arg)
+{
+  if (++nlines == expected_lines)
+    serial_stop();
+}
+
+/*
+ * the old receive_log()
+ */
+static void *old_rx(void *arg)
+{
+  int fd = *(int *) arg;
+  char line[SERIAL_LINE_SIZE];
+  int linelen = 0;
+
+  while (nlines < expected_lines) {
+    char c[1];
+    int len = read(fd, c, sizeof(char));
+    if (len > 0) {
+      printf("%c", c[0]);
+      if (c[0] == '\n' || linelen == SERIAL_LINE_SIZE - 1) {
+        line[linelen] = '\0';
+        nlines++;
+        linelen = 0;
+      } else {
+        line[linelen++] = c[0];
+      }
+    }
+  }
+  (void) line;
+  rx_cpu = thread_cpu_s();
+  return NULL;
+}
+
+static void *new_loop(void *arg)
+{
+  serial_loop();
+  loop_cpu = thread_cpu_s();
+  return NULL;
+}
+
+/*
+ * sends packets the way gpio_callback() does, with the old blocking
+ * write() or through the serial.c queue
+ */
+typedef struct {
+  int fd;
+  long nbytes;
+  long rate;
+  int use_queue;
+} producer_args;
+
+static void *producer(void *arg)
+{
+  producer_args *a = arg;
+  uint8_t pkt[PKT_LEN];
+  double start = now_s();
+  memset(pkt, 0x55, PKT_LEN);
+
+  for (long sent = 0; sent < a->nbytes; sent += PKT_LEN) {
+    if (a->rate) {
+      double wait = start + (double) sent / a->rate - now_s();
+      if (wait > 0)
+        usleep(wait * 1e6);
+    }
+
+    if (!a->use_queue) {
+      if (write(a->fd, pkt, PKT_LEN) != PKT_LEN)
+        fprintf(stderr, "write error\n");
+      continue;
+    }
+
+    struct iovec iov = { .iov_base = pkt, .iov_len = PKT_LEN };
+    // backpressure: the client sends the packet again on the next edge
+    while (serial_sendv(port, &iov, 1) < 0)
+      usleep(100);
+  }
+
+  if (a->use_queue)
+    serial_stop();
+  producer_cpu = thread_cpu_s();
+  return NULL;
+}
+
+static void report(const char *dir, const char *name, long nbytes,
+    double elapsed, double cpu)
+{
+  fprintf(stderr, "%-4s %-10s %12.0f %10.3f %8.1f %%\n", dir, name,
+      nbytes / elapsed, elapsed, 100 * cpu / elapsed);
+}
+
+static int run_rx(int use_loop, long nbytes, long rate)
+{
+  int master, slave;
+  if (open_pty(&master, &slave) < 0)
+    return -1;
+
+  peer_args peer = { .fd = master, .nbytes = nbytes, .rate = rate };
+  nlines = 0;
+  expected_lines = nbytes / LINE_LEN;
+
+  if (use_loop && (serial_init() < 0 ||
+        !(port = serial_add(slave, NULL, count_line, NULL))))
+    return -1;
+
+  pthread_t client, ptid;
+  double start = now_s();
+  pthread_create(&client, NULL, use_loop ? new_loop : old_rx, &slave);
+  pthread_create(&ptid, NULL, peer_write_logs, &peer);
+
+  pthread_join(client, NULL);
+  double elapsed = now_s() - start;
+  pthread_join(ptid, NULL);
+
+  report("rx", use_loop ? "epoll" : "1-byte", nbytes, elapsed,
+      use_loop ? loop_cpu : rx_cpu);
+  close(slave);
+  close(master);
+  return 0;
+}
+
+static int run_tx(int use_loop, long nbytes, long rate)
+{
+  int master, slave;
+  if (open_pty(&master, &slave) < 0)
+    return -1;
+
+  peer_args peer = { .fd = master, .nbytes = nbytes };
+  producer_args prod = { .fd = slave, .nbytes = nbytes, .rate = rate,
+    .use_queue = use_loop };
+
+  if (use_loop && (serial_init() < 0 ||
+        !(port = serial_add(slave, NULL, NULL, NULL))))
+    return -1;
+
+  pthread_t loop, ptid, prtid;
+  double start = now_s();
+  pthread_create(&ptid, NULL, peer_read, &peer);
+  if (use_loop)
+    pthread_create(&loop, NULL, new_loop, NULL);
+  pthread_create(&prtid, NULL, producer, &prod);
+
+  pthread_join(ptid, NULL);
+  double elapsed = now_s() - start;
+  pthread_join(prtid, NULL);
+  if (use_loop)
+    pthread_join(loop, NULL);
+
+  report("tx", use_loop ? "epoll" : "write", peer.done, elapsed,
+      producer_cpu + (use_loop ? loop_cpu : 0));
+  close(slave);
+  close(master);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  long nbytes = 4 << 20, rate = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+    switch (opt) {
+      case 'n': nbytes = atol(optarg); break;
+      case 'r': rate = atol(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-n bytes] [-r bytes/s]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (nbytes < LINE_LEN || rate < 0) {
+    fprintf(stderr, "bytes must be >= %d, rate >= 0\n", LINE_LEN);
+    return 1;
+  }
+  nbytes -= nbytes % PKT_LEN;
+
+  // the client echoes the beacon log to stdout
+  if (!freopen("/dev/null", "w", stdout))
+    return 1;
+
+  fprintf(stderr, "%ld bytes, rate limit: %ld B/s\n", nbytes, rate);
+  fprintf(stderr, "%-4s %-10s %12s %10s %10s\n", "dir", "io", "bytes/s",
+      "time (s)", "cpu");
+
+  if (run_rx(0, nbytes, rate) < 0 || run_rx(1, nbytes, rate) < 0 ||
+      run_tx(0, nbytes, rate) < 0 || run_tx(1, nbytes, rate) < 0)
+    return 1;
+
+  return 0;
+}
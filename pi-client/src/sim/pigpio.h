@@ -0,0 +1,23 @@
+#ifndef PIGPIO_SIM_H
+#define PIGPIO_SIM_H
+
+/*
+ * host stand-in for the part of pigpio that uart.c uses, to run the
+ * client without a Raspberry Pi, see pigpio_sim.c
+ */
+
+#include <stdint.h>
+
+#define PI_INPUT 0
+#define PI_OUTPUT 1
+
+typedef void (*gpioAlertFuncEx_t)(int gpio, int level, uint32_t tick,
+    void *userdata);
+
+int gpioCfgClock(unsigned micros, unsigned peripheral, unsigned source);
+int gpioInitialise(void);
+void gpioTerminate(void);
+int gpioSetMode(unsigned gpio, unsigned mode);
+int gpioSetAlertFuncEx(unsigned gpio, gpioAlertFuncEx_t f, void *userdata);
+
+#endif // PIGPIO_SIM_H
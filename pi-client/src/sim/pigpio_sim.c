@@ -0,0 +1,140 @@
+/*
+ * host stand-in for pigpio: the request line of every pin with an alert
+ * function toggles every PIGPIO_SIM_EDGE_US microseconds, and every edge
+ * calls the alert function like pigpio does. $PIGPIO_SIM_EDGE_US sets
+ * the period, or a comma-separated list of periods for the pins in the
+ * order their alert functions are set, to pace beacons differently.
+ */
+#include "pigpio.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PIGPIO_SIM_EDGE_US 1000
+#define PIGPIO_SIM_MAX_PINS 32
+
+typedef struct sim_pin {
+  unsigned int gpio;
+  unsigned int edge_us;
+  gpioAlertFuncEx_t func;
+  void *userdata;
+  pthread_t thread;
+  volatile int running;
+} sim_pin;
+
+static sim_pin pins[PIGPIO_SIM_MAX_PINS];
+static int num_pins;
+
+static uint32_t tick_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t) (ts.tv_sec * 1000000ull + ts.tv_nsec / 1000);
+}
+
+static void *edge_main(void *arg)
+{
+  sim_pin *pin = arg;
+  struct timespec next;
+  int level = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (pin->running) {
+    next.tv_nsec += pin->edge_us * 1000l;
+    while (next.tv_nsec >= 1000000000l) {
+      next.tv_nsec -= 1000000000l;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    level = !level;
+    pin->func(pin->gpio, level, tick_us(), pin->userdata);
+  }
+  return NULL;
+}
+
+/*
+ * period of the n-th pin from $PIGPIO_SIM_EDGE_US, the last one given
+ * for pins beyond the list
+ */
+static unsigned int edge_period(int n)
+{
+  const char *env = getenv("PIGPIO_SIM_EDGE_US");
+  unsigned int us = PIGPIO_SIM_EDGE_US;
+
+  for (int i = 0; env && *env && i <= n; i++) {
+    if (atoi(env) > 0)
+      us = atoi(env);
+    env = strchr(env, ',');
+    if (env)
+      env++;
+  }
+  return us;
+}
+
+int gpioCfgClock(unsigned micros, unsigned peripheral, unsigned source)
+{
+  return 0;
+}
+
+int gpioInitialise(void)
+{
+  return 0;
+}
+
+static void stop_pin(sim_pin *pin)
+{
+  if (pin->running) {
+    pin->running = 0;
+    pthread_join(pin->thread, NULL);
+  }
+}
+
+void gpioTerminate(void)
+{
+  for (int i = 0; i < num_pins; i++)
+    stop_pin(&pins[i]);
+  num_pins = 0;
+}
+
+int gpioSetMode(unsigned gpio, unsigned mode)
+{
+  return 0;
+}
+
+int gpioSetAlertFuncEx(unsigned gpio, gpioAlertFuncEx_t f, void *userdata)
+{
+  sim_pin *pin = NULL;
+  for (int i = 0; i < num_pins; i++) {
+    if (pins[i].gpio == gpio)
+      pin = &pins[i];
+  }
+
+  if (pin) {
+    stop_pin(pin);
+  } else {
+    if (num_pins == PIGPIO_SIM_MAX_PINS)
+      return -1;
+    pin = &pins[num_pins];
+    pin->gpio = gpio;
+    pin->edge_us = edge_period(num_pins);
+    num_pins++;
+  }
+
+  if (!f)
+    return 0;
+
+  pin->func = f;
+  pin->userdata = userdata;
+  pin->running = 1;
+  if (pthread_create(&pin->thread, NULL, edge_main, pin) != 0) {
+    fprintf(stderr, "pigpio sim: cannot start edge thread\n");
+    pin->running = 0;
+    return -1;
+  }
+  return 0;
+}
@@ -6,10 +6,8 @@
 #include <stdlib.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
-int fd;
-
-int data_ready = 0;
 time_t t = 0, t2 = 0;
 struct tm tm;
 struct tm tm1, tm2;
@@ -47,41 +45,187 @@ static void set_next_update_time(void)
 }
 #endif
 
-void *receive_log(int fd)
+#if UART_DELTA
+#define NEED_BITMAP_SIZE ((MAX_NUM_CHUNKS + 1 + 7) / 8)
+
+/*
+ * index entries a beacon still needs, from its last need line
+ */
+typedef struct need_state {
+  pthread_mutex_t lock;
+  uint32_t payload_ver;
+  int valid;
+  uint8_t bitmap[NEED_BITMAP_SIZE];
+} need_state;
+#endif
+
+/*
+ * a beacon, on its own serial port and GPIO pin. all beacons send the
+ * same payload, each at the pace of its GPIO edges and through its own
+ * rotation of the chunks, see start_rotation().
+ */
+typedef struct beacon {
+  int id;
+  char name[8];
+  unsigned int pin;
+  serial_port *port;
+  // payload it sends, see take_payload()
+  struct rpi_sl_buf *rsb;
+
+  // the rotation starts at chunk offset
+  uint32_t offset;
+  uint32_t rot_pos;
+  // when the current pass through the rotation started, see send_packet()
+  double cycle_start;
+  int pktidx_r;
+  int chnkidx_r;
+  int curr_chnk_repcnt;
+  int chunks_since_manifest;
+  uint32_t resume_chnkidx;
+
+#if UART_DELTA
+  need_state need;
+#endif
+} beacon;
+
+static beacon beacons[UART_MAX_BEACONS];
+static int num_beacons;
+
+#if UART_DELTA
+static void parse_need_line(beacon *b, char *line)
 {
-  while (1) {
-    char c[1];
-    int len = read(fd, c, sizeof(char));
-    if (len > 0) {
-      printf("%c", c[0]);
-    }
+  char *p = strstr(line, RISK_INDEX_NEED_TAG " ");
+  if (!p)
+    return;
+
+  unsigned int ver, byte;
+  int n = 0, nbytes = 0, nneed = 0;
+  uint8_t bitmap[NEED_BITMAP_SIZE];
+  memset(bitmap, 0, NEED_BITMAP_SIZE);
+
+  p += strlen(RISK_INDEX_NEED_TAG " ");
+  if (sscanf(p, "%8x %n", &ver, &n) != 1 || n == 0)
+    return;
+
+  p += n;
+  while (nbytes < NEED_BITMAP_SIZE && sscanf(p, "%2x", &byte) == 1) {
+    bitmap[nbytes++] = byte;
+    nneed += __builtin_popcount(byte);
+    p += 2;
   }
+
+  pthread_mutex_lock(&b->need.lock);
+  b->need.payload_ver = ver;
+  b->need.valid = 1;
+  memcpy(b->need.bitmap, bitmap, NEED_BITMAP_SIZE);
+  pthread_mutex_unlock(&b->need.lock);
+
+  dprintf(LVL_EXP, "beacon %d needs %d entries of payload ver: 0x%08x\r\n",
+      b->id, nneed, ver);
+}
+
+/*
+ * chunks are sent only if the beacon asked for them. without a need
+ * line for the current payload, e.g., after a restart, send all.
+ */
+static int chunk_needed(beacon *b, uint32_t payload_ver, uint32_t entry)
+{
+  int needed = 1;
+
+  pthread_mutex_lock(&b->need.lock);
+  if (b->need.valid && b->need.payload_ver == payload_ver)
+    needed = (b->need.bitmap[entry / 8] >> (entry % 8)) & 1;
+  pthread_mutex_unlock(&b->need.lock);
+
+  return needed;
+}
+#endif
+
+/*
+ * a log line from beacon arg, see serial_add()
+ */
+static void on_log_line(char *line, void *arg)
+{
+#if UART_DELTA
+  // the beacon asks for chunks on its log output
+  parse_need_line((beacon *) arg, line);
+#endif
 }
 
 // ====
 
-typedef struct ble_pkt {
-  uint8_t payload_data[PER_ADV_SIZE];
-  uint8_t payload_size;
-} ble_pkt;
+/*
+ * chunks of the payload as fetched from the backend, before they are
+ * packetized. a chunk that is in the cache is used from there, see
+ * fetched_chunk().
+ */
+typedef struct fetched_payload {
+  int num_chunks;
+  struct req_data *chunks;
+  cache_chunk *cached;
+  struct req_data manifest;
+  // chunks packetized as they arrived, with REQUEST_STREAM
+  packet_stream *streams;
+  // for the metrics log, see sched.h
+  int unchanged;
+  double fetch_s;
+} fetched_payload;
+
+static void free_fetched_payload(fetched_payload *fp)
+{
+  if (fp->chunks) {
+    for (int i = 0; i < fp->num_chunks; i++)
+      free(fp->chunks[i].response);
+    free(fp->chunks);
+  }
+  cache_release_payload(fp->cached, fp->num_chunks);
+  if (fp->streams) {
+    for (int i = 0; i < fp->num_chunks; i++)
+      packet_stream_free(&fp->streams[i]);
+    free(fp->streams);
+  }
+  free(fp->manifest.response);
+  memset(fp, 0, sizeof(fetched_payload));
+}
 
-typedef struct chunk {
-  uint32_t pkt_arr_idx;
-  uint32_t pkt_cnt;
-} chunk;
+/*
+ * response of chunk i, a chunk_hdr and the chunk
+ */
+static const char *fetched_chunk(fetched_payload *fp, int i, size_t *size)
+{
+  if (fp->cached[i].map) {
+    *size = fp->cached[i].size;
+    return fp->cached[i].data;
+  }
+
+  *size = fp->chunks[i].size;
+  return fp->chunks[i].response;
+}
 
 typedef struct rpi_sl_buf {
-  ble_pkt pkt_arr[MAX_PKTS];
-  int pktidx_w;
-  int chnkidx_w;
-  int pktidx_r;
-  int chnkidx_r;
-  int curr_chnk_repcnt;
   int num_chunks;
-  double last_req_time_s;
+  int num_pkts;
+  uint32_t payload_ver;
+  /*
+   * chunk_arr[num_chunks] holds the manifest, if present, and
+   * chunk_arr[num_chunks+1] the chunk index, with UART_DELTA
+   */
   chunk *chunk_arr;
+  int has_manifest;
+  /*
+   * the packets are views of these, see packet.h
+   */
+  fetched_payload fp;
+  uint32_t *index;
 } rpi_sl_buf;
 
+static double now_s()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 static inline void init_rpi_sl_buf(rpi_sl_buf *rsb)
 {
   if (!rsb)
@@ -95,179 +239,619 @@ static void reset_rpi_sl_buf(rpi_sl_buf *rsb)
   if (!rsb)
     return;
 
-  if (rsb->chunk_arr)
+  if (rsb->chunk_arr) {
+    for (int c = 0; c < rsb->num_chunks + 2; c++)
+      packet_chunk_free(&rsb->chunk_arr[c]);
     free(rsb->chunk_arr);
+  }
+  free_fetched_payload(&rsb->fp);
+  free(rsb->index);
 
   init_rpi_sl_buf(rsb);
 }
 
-void prep_next_pkt(rpi_sl_buf *rsb, char *inbuf, int inoff, int inlen,
-    uint32_t chunkid, uint64_t chunklen, uint32_t pkt_seq)
+/*
+ * describe the packets of a chunk in chunk_arr[slot]
+ */
+static void prep_pkts_from_chunk(rpi_sl_buf *rsb, int slot, uint32_t chunk_id,
+    const char *chunk_data, uint64_t chunk_size)
 {
-  if (!rsb || !inbuf || !inlen)
-    return;
+  chunk *chnk = &rsb->chunk_arr[slot];
 
-  int idx = rsb->pktidx_w;
-  uint8_t *ptr = rsb->pkt_arr[idx].payload_data;
-  rsb->pkt_arr[idx].payload_size = inlen + sizeof(rpi_ble_hdr);
+  if (packet_chunk_init(chnk, chunk_id, chunk_data, chunk_size,
+        RISK_FEC_ENABLE) < 0) {
+    fprintf(stderr, "chunk %u: no memory for parity packets\r\n", chunk_id);
+    packet_chunk_init(chnk, chunk_id, chunk_data, chunk_size, 0);
+  }
+  rsb->num_pkts += chnk->pkt_cnt;
+}
 
-  rpi_ble_hdr *rbh = (rpi_ble_hdr *) ptr;
-  rbh->pkt_seq = pkt_seq;
-  rbh->chunkid = chunkid;
-  rbh->chunklen = chunklen;
-  rbh->numchunks = rsb->num_chunks;
-  ptr += sizeof(rpi_ble_hdr);
-  memcpy(ptr, inbuf+inoff, inlen);
+/*
+ * the payload version is only known once every chunk has been fetched
+ */
+static void set_payload_ver(rpi_sl_buf *rsb)
+{
+  uint32_t crc = CRC32_INIT;
+  for (int c = 0; c < rsb->num_chunks; c++) {
+    crc = crc32_update(crc, (uint8_t *) &rsb->chunk_arr[c].crc,
+        sizeof(uint32_t));
+  }
+  rsb->payload_ver = crc32_final(crc);
 
-  idx = (idx + 1) % MAX_PKTS;
-  rsb->pktidx_w = idx;
+  dprintf(LVL_EXP, "payload ver: 0x%08x\r\n", rsb->payload_ver);
 }
 
-void prep_pkts_from_chunk(rpi_sl_buf *rsb, int chunk_id,
-    char *chunk_data, uint64_t chunk_size)
+#if REQUEST_STREAM
+/*
+ * response data of a chunk, as curl receives it
+ */
+static int stream_chunk(void *sink, const char *data, size_t len)
 {
-#define MAX_PAYLOAD_SIZE (PER_ADV_SIZE - sizeof(rpi_ble_hdr))
-
-  int woff = 0, wlen = 0, tot_len = 0;
-  uint32_t seq = 0;
-
-  rsb->chunk_arr[rsb->chnkidx_w].pkt_arr_idx = rsb->pktidx_w;
-  while (tot_len < chunk_size) {
-    wlen = (chunk_size - tot_len > MAX_PAYLOAD_SIZE) ? MAX_PAYLOAD_SIZE :
-      (chunk_size - tot_len);
-    prep_next_pkt(rsb, chunk_data, woff, wlen, chunk_id, chunk_size, seq);
-    woff += wlen;
-    tot_len += wlen;
-    seq += 1;
-  }
-  rsb->chunk_arr[rsb->chnkidx_w].pkt_cnt = (rsb->pktidx_w -
-      rsb->chunk_arr[rsb->chnkidx_w].pkt_arr_idx);
-  rsb->chnkidx_w = (rsb->chnkidx_w+1) % rsb->num_chunks;
+  metrics_add(M_BYTES_FETCHED, len);
+  return packet_stream_write((packet_stream *) sink, data, len);
 }
+#endif
 
-void make_request(rpi_sl_buf *rsb)
+/*
+ * fetch stage: all chunks of the current payload, and the manifest.
+ * returns 0 if every chunk was fetched and well-formed.
+ */
+static int fetch_payload(fetched_payload *fp)
 {
-  reset_rpi_sl_buf(rsb);
+  memset(fp, 0, sizeof(fetched_payload));
 
   // get number of chunks in payload from backend
   struct req_data chunk_count_data = {0};
-  handle_request_count(&chunk_count_data);
+  if (handle_request_count(&chunk_count_data) < 0)
+    return -1;
 
-  rsb->num_chunks = ((uint32_t *) chunk_count_data.response)[0];
+  fp->num_chunks = ((uint32_t *) chunk_count_data.response)[0];
+  free(chunk_count_data.response);
 
-  if (rsb->num_chunks == 0)
-    return;
+  if (fp->num_chunks == 0 || fp->num_chunks > MAX_NUM_CHUNKS) {
+    fprintf(stderr, "bad chunk count: %d\r\n", fp->num_chunks);
+    fp->num_chunks = 0;
+    return -1;
+  }
 
-  rsb->chunk_arr = (chunk *) malloc(sizeof(chunk) * rsb->num_chunks);
-  memset(rsb->chunk_arr, 0, sizeof(chunk) * rsb->num_chunks);
+  fp->chunks = calloc(fp->num_chunks, sizeof(struct req_data));
+  fp->cached = calloc(fp->num_chunks, sizeof(cache_chunk));
+  if (!fp->chunks || !fp->cached) {
+    free_fetched_payload(fp);
+    return -ENOMEM;
+  }
 
-  for (int i = 0; i < rsb->num_chunks; i++) {
+  // chunks in the cache are only fetched if they changed
+  for (int i = 0; i < fp->num_chunks; i++) {
+    if (cache_load_chunk(i, &fp->cached[i]) == 0)
+      strcpy(fp->chunks[i].etag, fp->cached[i].etag);
+  }
+
+#if REQUEST_STREAM
+  // packetize the chunks while they arrive
+  fp->streams = calloc(fp->num_chunks, sizeof(packet_stream));
+  if (!fp->streams) {
+    free_fetched_payload(fp);
+    return -ENOMEM;
+  }
+  for (int i = 0; i < fp->num_chunks; i++) {
+    packet_stream_init(&fp->streams[i], RISK_FEC_ENABLE);
+    fp->chunks[i].on_data = stream_chunk;
+    fp->chunks[i].sink = &fp->streams[i];
+  }
+#endif
 
-    // make request to backend for the chunk
-    struct req_data req_chunk = {0};
-    handle_request_chunk(&req_chunk, i);
+  // fetch all chunks, REQUEST_PARALLEL at a time
+  double start = now_s();
+  int failed = handle_request_chunks(fp->chunks, 0, fp->num_chunks,
+      REQUEST_PARALLEL);
+
+  int unchanged = 0;
+  for (int i = 0; !failed && i < fp->num_chunks; i++) {
+    struct req_data *rd = &fp->chunks[i];
+    if (rd->status == 304) {
+      if (!fp->cached[i].map)
+        failed++;
+      unchanged++;
+      continue;
+    }
 
-    chunk_hdr *chdr = (chunk_hdr *) req_chunk.response;
-    uint64_t data_size = chdr->payload_len;
+    cache_release_chunk(&fp->cached[i]);
+    metrics_inc(M_CHUNKS_FETCHED);
+#if REQUEST_STREAM
+    if (packet_stream_finish(&fp->streams[i], i) == 0)
+      rd->response = packet_stream_take(&fp->streams[i], &rd->size);
+#else
+    metrics_add(M_BYTES_FETCHED, rd->size);
+#endif
+    chunk_hdr *chdr = (chunk_hdr *) rd->response;
+    if (rd->size < sizeof(chunk_hdr) ||
+        chdr->payload_len > rd->size - sizeof(chunk_hdr)) {
+      dprintf(LVL_EXP, "[%d:%d] short chunk, size: %d\r\n",
+          i, fp->num_chunks, (int) rd->size);
+      failed++;
+      continue;
+    }
 
-    // load chunk into payload_data[]
-    char *risk_payload = req_chunk.response + sizeof(chunk_hdr);
+    // from now on, use the chunk from the cache
+    if (cache_store_chunk(i, rd->etag, rd->response, rd->size) == 0 &&
+        cache_load_chunk(i, &fp->cached[i]) == 0) {
+      free(rd->response);
+      rd->response = NULL;
+    }
+  }
+
+  fp->unchanged = unchanged;
+  fp->fetch_s = now_s() - start;
+  metrics_add(M_CHUNKS_UNCHANGED, unchanged);
+  dprintf(LVL_EXP, "fetched %d chunks in %.3f s, %d unchanged, %d failed\r\n",
+      fp->num_chunks, fp->fetch_s, unchanged, failed);
+
+  if (failed) {
+    free_fetched_payload(fp);
+    return -1;
+  }
+
+  cache_store_payload(fp->cached, fp->num_chunks);
+
+#if RISK_MANIFEST_ENABLE
+  if (handle_request_manifest(&fp->manifest) < 0 ||
+      fp->manifest.size <= sizeof(chunk_hdr)) {
+    free(fp->manifest.response);
+    memset(&fp->manifest, 0, sizeof(struct req_data));
+  }
+#endif
+
+  return 0;
+}
+
+/*
+ * packetize stage: describe the packets of a fetched payload in rsb,
+ * which the transmit stage is not using. rsb takes over the chunks of fp,
+ * which its packets are views of.
+ */
+static void build_payload(rpi_sl_buf *rsb, fetched_payload *fp)
+{
+  reset_rpi_sl_buf(rsb);
+
+  rsb->fp = *fp;
+  memset(fp, 0, sizeof(fetched_payload));
+  fp = &rsb->fp;
+
+  rsb->num_chunks = fp->num_chunks;
+  rsb->chunk_arr = (chunk *) calloc(rsb->num_chunks + 2, sizeof(chunk));
+
+  for (int i = 0; i < rsb->num_chunks; i++) {
+    size_t size;
+    const char *resp = fetched_chunk(fp, i, &size);
+    chunk_hdr *chdr = (chunk_hdr *) resp;
+    uint64_t data_size = chdr->payload_len;
+    const char *risk_payload = resp + sizeof(chunk_hdr);
 
 //    hexdump(risk_payload, data_size);
 //    bitdump(risk_payload, data_size);
-    int chunkidx = rsb->chnkidx_w;
-    prep_pkts_from_chunk(rsb, i, risk_payload, data_size);
-    dprintf(LVL_EXP, "[%d:%d] chunk size: %llu, pkt arr idx: %u cnt: %u\r\n",
-        i, rsb->num_chunks, data_size,
-        rsb->chunk_arr[chunkidx].pkt_arr_idx, rsb->chunk_arr[chunkidx].pkt_cnt);
+    packet_stream *ps = fp->streams ? &fp->streams[i] : NULL;
+    if (ps && ps->done && ps->chnk.len == data_size) {
+      // described while it arrived, only its data may have moved to the
+      // cache since
+      rsb->chunk_arr[i] = ps->chnk;
+      rsb->chunk_arr[i].data = risk_payload;
+      memset(&ps->chnk, 0, sizeof(chunk));
+      ps->done = 0;
+      rsb->num_pkts += rsb->chunk_arr[i].pkt_cnt;
+    } else {
+      prep_pkts_from_chunk(rsb, i, i, risk_payload, data_size);
+    }
+    dprintf(LVL_DBG, "[%d:%d] chunk size: %llu, pkt cnt: %u\r\n",
+        i, rsb->num_chunks, (unsigned long long) data_size,
+        rsb->chunk_arr[i].pkt_cnt);
   }
 
-  rsb->last_req_time_s = ((double) clock()) / CLOCKS_PER_SEC;
-  dprintf(LVL_EXP, "[%04.6f]: #chunks: %d\r\n", rsb->last_req_time_s,
-      rsb->num_chunks);
+  if (fp->streams) {
+    for (int i = 0; i < fp->num_chunks; i++)
+      packet_stream_free(&fp->streams[i]);
+    free(fp->streams);
+    fp->streams = NULL;
+  }
 
-  data_ready = 1;
+#if RISK_MANIFEST_ENABLE
+  if (fp->manifest.response) {
+    chunk_hdr *mhdr = (chunk_hdr *) fp->manifest.response;
+
+    // manifest goes in the extra slot after the last chunk
+    prep_pkts_from_chunk(rsb, rsb->num_chunks, RISK_MANIFEST_CHUNKID,
+        fp->manifest.response + sizeof(chunk_hdr), mhdr->payload_len);
+    rsb->has_manifest = 1;
+    dprintf(LVL_EXP, "manifest size: %llu, pkt cnt: %u\r\n",
+        (unsigned long long) mhdr->payload_len,
+        rsb->chunk_arr[rsb->num_chunks].pkt_cnt);
+  }
+#endif
+
+#if UART_DELTA
+  // index of the chunk CRCs, in the slot after the manifest
+  int num_entries = rsb->num_chunks + (rsb->has_manifest ? 1 : 0);
+  rsb->index = (uint32_t *) malloc(num_entries * sizeof(uint32_t));
+  for (int e = 0; e < num_entries; e++) {
+    rsb->index[e] = rsb->chunk_arr[e].crc;
+  }
+
+  prep_pkts_from_chunk(rsb, rsb->num_chunks + 1, RISK_INDEX_CHUNKID,
+      (char *) rsb->index, num_entries * sizeof(uint32_t));
+#endif
+
+  set_payload_ver(rsb);
+
+  dprintf(LVL_EXP, "#chunks: %d, #pkts: %d\r\n", rsb->num_chunks,
+      rsb->num_pkts);
 }
 
+/*
+ * the transmit stage cycles through payload_bufs[] pointed to by
+ * payload_cur while the request thread builds the next payload in the
+ * other one. the request thread publishes it with request_ready, and the
+ * transmit stage switches to it between two packets, by swapping the
+ * pointer. every beacon moves to payload_cur before its next packet, and
+ * once all have, uart_ready acknowledges the switch.
+ *
+ * the transmit stage holds risk.mutex while it reads a payload, so that
+ * the request thread can take a beacon off the buffer it builds in.
+ */
+static rpi_sl_buf payload_bufs[2];
+static rpi_sl_buf *payload_cur = &payload_bufs[0];
+static rpi_sl_buf *payload_next;
 
-void gpio_callback(int gpio, int level, uint32_t tick, void *rsb_p)
+static struct risk_data risk = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * start the rotation of beacon b through its payload. with UART_STAGGER,
+ * the beacons start at chunks spread evenly over the payload, so that a
+ * dongle in range of several beacons gets different chunks from each.
+ */
+static void start_rotation(beacon *b)
 {
-  if (data_ready == 0) {
-    return;
+  rpi_sl_buf *rsb = b->rsb;
+
+#if UART_STAGGER
+  b->offset = (uint32_t) ((uint64_t) rsb->num_chunks * b->id / num_beacons);
+#else
+  b->offset = 0;
+#endif
+  b->rot_pos = 0;
+  b->cycle_start = now_s();
+  b->pktidx_r = 0;
+  b->curr_chnk_repcnt = 0;
+  b->chunks_since_manifest = 0;
+#if UART_DELTA
+  // every rotation starts with the index
+  b->chnkidx_r = rsb->num_chunks + 1;
+#else
+  b->chnkidx_r = b->offset;
+#endif
+}
+
+/*
+ * called by the transmit stage before each packet of beacon b, with
+ * risk.mutex held. returns the payload to transmit from.
+ */
+static rpi_sl_buf *take_payload(beacon *b)
+{
+  if (risk.request_ready) {
+    payload_cur = payload_next;
+    payload_next = NULL;
+    risk.request_ready = 0;
+    risk.data_ready = 1;
+  }
+  if (!risk.data_ready)
+    return NULL;
+
+  if (b->rsb != payload_cur) {
+    b->rsb = payload_cur;
+    start_rotation(b);
+
+    int switched = 1;
+    for (int i = 0; i < num_beacons; i++)
+      switched &= (beacons[i].rsb == payload_cur);
+    if (switched && !risk.uart_ready) {
+      risk.uart_ready = 1;
+      pthread_cond_signal(&risk.uart_ready_cond);
+    }
   }
 
-  rpi_sl_buf *rsb = (rpi_sl_buf *) rsb_p;
-  double curr_time_sec;
+  return b->rsb;
+}
 
-  if (level == 0) {
-    dprintf(LVL_DBG, "G: %d, T: %u, chnk w: %u r: %u "
-        "pkt w: %u r: %u rep: %u\r\n",
-        gpio, tick, rsb->chnkidx_w, rsb->chnkidx_r,
-        rsb->pktidx_w, rsb->pktidx_r, rsb->curr_chnk_repcnt);
-    goto make_req;
+/*
+ * build a payload while the transmit stage keeps cycling through the
+ * current one, and publish it. frees fp. returns the seconds it took to
+ * build.
+ */
+static double publish_payload(fetched_payload *fp)
+{
+  // take back a payload that was published but not picked up yet, so
+  // that the buffer to build in is the one not being transmitted
+  pthread_mutex_lock(&risk.mutex);
+  risk.request_ready = 0;
+  risk.uart_ready = 0;
+  rpi_sl_buf *rsb = (payload_cur == &payload_bufs[0]) ?
+    &payload_bufs[1] : &payload_bufs[0];
+  // a beacon that has not had an edge since the last switch is still on
+  // the older payload, it moves to the current one on its next edge
+  for (int i = 0; i < num_beacons; i++) {
+    if (beacons[i].rsb == rsb)
+      beacons[i].rsb = NULL;
+  }
+  pthread_mutex_unlock(&risk.mutex);
+
+  double start = now_s();
+  build_payload(rsb, fp);
+  free_fetched_payload(fp);
+  double build_s = now_s() - start;
+  dprintf(LVL_EXP, "built payload ver: 0x%08x in %.3f s\r\n",
+      rsb->payload_ver, build_s);
+
+  pthread_mutex_lock(&risk.mutex);
+  payload_next = rsb;
+  risk.request_ready = 1;
+  pthread_mutex_unlock(&risk.mutex);
+  return build_s;
+}
+
+/*
+ * fetch a new payload and publish it, and fill in res. returns 0 if it
+ * was fetched.
+ */
+static int refresh_payload(sched_result *res)
+{
+  fetched_payload fp;
+  memset(res, 0, sizeof(sched_result));
+  res->switch_s = -1;
+
+  if (fetch_payload(&fp) < 0) {
+    fprintf(stderr, "payload refresh failed, keep sending the current "
+        "one\r\n");
+    return -1;
+  }
+
+  res->fetch_s = fp.fetch_s;
+  res->num_chunks = fp.num_chunks;
+  res->unchanged = fp.unchanged;
+  res->build_s = publish_payload(&fp);
+  return 0;
+}
+
+/*
+ * publish the last complete payload in the cache, so that the beacon has
+ * something to send while the first refresh runs. returns 0 if there was
+ * one.
+ */
+static int load_cached_payload(void)
+{
+  fetched_payload fp;
+  memset(&fp, 0, sizeof(fetched_payload));
+
+  fp.num_chunks = cache_load_payload(&fp.cached);
+  if (fp.num_chunks <= 0)
+    return -1;
+
+  fp.chunks = calloc(fp.num_chunks, sizeof(struct req_data));
+  if (!fp.chunks) {
+    free_fetched_payload(&fp);
+    return -ENOMEM;
   }
 
-  uint32_t chunkidx = rsb->chnkidx_r;
+  dprintf(LVL_EXP, "loaded %d chunks from the cache\r\n", fp.num_chunks);
+  publish_payload(&fp);
+  return 0;
+}
+
+static void timespec_at(struct timespec *ts, double t)
+{
+  ts->tv_sec = (time_t) t;
+  ts->tv_nsec = (long) ((t - ts->tv_sec) * 1e9);
+}
+
+/*
+ * request thread, runs the fetch and packetize stages whenever the
+ * scheduler says so, see sched.h
+ */
+static void *request_main(void *arg)
+{
+  load_cached_payload();
+
+  while (sched_wait() == 0) {
+    sched_result res;
+    double start = now_s();
+    res.err = refresh_payload(&res);
+    struct timespec ts;
+    timespec_at(&ts, sched_next(res.err));
+
+    // wait for the transmit stage to switch over, but not past the next
+    // refresh
+    pthread_mutex_lock(&risk.mutex);
+    while (!res.err && !risk.uart_ready && pthread_cond_timedwait(
+          &risk.uart_ready_cond, &risk.mutex, &ts) == 0)
+      ;
+    if (!res.err && risk.uart_ready) {
+      res.switch_s = now_s() - start;
+      dprintf(LVL_EXP, "sending payload ver: 0x%08x, %.3f s after the "
+          "refresh started\r\n", payload_cur->payload_ver, res.switch_s);
+    }
+    pthread_mutex_unlock(&risk.mutex);
+
+    sched_log(&res);
+    metrics_inc(res.err ? M_REFRESH_FAILED : M_REFRESH_OK);
+    if (!res.err) {
+      metrics_observe(H_FETCH, res.fetch_s);
+      metrics_observe(H_BUILD, res.build_s);
+      if (res.switch_s >= 0)
+        metrics_observe(H_SWITCH, res.switch_s);
+    }
+  }
+
+  fprintf(stderr, "request thread stopped, no more refreshes\r\n");
+  return NULL;
+}
+
+#if UART_DELTA
+/*
+ * next chunk of the rotation of beacon b: the index, then the chunks
+ * from its offset on, wrapping around, and the manifest, of those that
+ * the beacon still needs
+ */
+static uint32_t next_chunk_idx(beacon *b, rpi_sl_buf *rsb, uint32_t chunkidx)
+{
+  uint32_t num_chunks = rsb->num_chunks;
+  uint32_t index_slot = num_chunks + 1;
+
+  if (chunkidx == num_chunks)
+    return index_slot;
+
+  uint32_t pos = (chunkidx == index_slot) ? 0 : b->rot_pos + 1;
+  while (pos < num_chunks && !chunk_needed(b, rsb->payload_ver,
+        (b->offset + pos) % num_chunks))
+    pos++;
+
+  if (pos < num_chunks) {
+    b->rot_pos = pos;
+    return (b->offset + pos) % num_chunks;
+  }
+
+  if (rsb->has_manifest && chunk_needed(b, rsb->payload_ver, num_chunks))
+    return num_chunks;
+
+  return index_slot;
+}
+#else
+/*
+ * next chunk of the carousel, with the manifest interleaved every
+ * RISK_MANIFEST_INTERVAL chunks
+ */
+static uint32_t next_chunk_idx(beacon *b, rpi_sl_buf *rsb, uint32_t chunkidx)
+{
+  if (rsb->has_manifest && chunkidx == (uint32_t) rsb->num_chunks)
+    return b->resume_chnkidx;
+
+  uint32_t next = (chunkidx+1) % rsb->num_chunks;
+
+  if (rsb->has_manifest &&
+      ++b->chunks_since_manifest >= RISK_MANIFEST_INTERVAL) {
+    b->chunks_since_manifest = 0;
+    b->resume_chnkidx = next;
+    return rsb->num_chunks;
+  }
+
+  return next;
+}
+#endif
+
+/*
+ * send the next packet of beacon b from rsb, and move on. returns < 0 if
+ * the packet could not be sent.
+ */
+static int send_packet(beacon *b, rpi_sl_buf *rsb)
+{
+  uint32_t chunkidx = b->chnkidx_r;
   chunk *chnk = &rsb->chunk_arr[chunkidx];
-  int pktidx = rsb->pktidx_r;
-  ble_pkt *pkt = &rsb->pkt_arr[pktidx];
-  uint8_t *ptr = pkt->payload_data;
-//  int outlen = pkt->payload_size;
+  int pktidx = b->pktidx_r;
+
+  // the header is built here, the payload is a view of the chunk
+  ble_pkt pkt;
+  packet_view(chnk, pktidx, rsb->num_chunks, rsb->payload_ver, &pkt);
+#if UART_FRAMED
+  uint8_t frame[FRAME_MAX_ENCODED_LEN(PER_ADV_SIZE)];
+  int outlen = frame_encode2((uint8_t *) &pkt.hdr, sizeof(rpi_ble_hdr),
+      (const uint8_t *) pkt.data, pkt.len, frame);
+  struct iovec iov[1] = {
+    { .iov_base = frame, .iov_len = outlen },
+  };
+#else
+  // raw PER_ADV_SIZE blocks, zero-padded
+  static const uint8_t pad[PER_ADV_SIZE];
+  struct iovec iov[3] = {
+    { .iov_base = &pkt.hdr, .iov_len = sizeof(rpi_ble_hdr) },
+    { .iov_base = (void *) pkt.data, .iov_len = pkt.len },
+    { .iov_base = (void *) pad,
+      .iov_len = PER_ADV_SIZE - sizeof(rpi_ble_hdr) - pkt.len },
+  };
   int outlen = PER_ADV_SIZE;
+#endif
 
-//  hexdump((char *) ptr, outlen);
-
-  int wlen = write(fd, ptr, outlen);
-  if (wlen != outlen) {
-    fprintf(stderr, "write error, len: %d wlen: %d\r\n", outlen, wlen);
+  // the port is backed up, send this packet again on the next edge
+  int err = serial_sendv(b->port, iov, sizeof(iov) / sizeof(iov[0]));
+  if (err < 0) {
+    metrics_inc(err == -EPIPE ? M_TX_PORT_CLOSED : M_TX_QUEUE_FULL);
+    dprintf(LVL_DBG, "beacon %d: not sent: %s, pending: %zu\r\n",
+        b->id, strerror(-err), serial_tx_pending(b->port));
+    return err;
   }
-  dprintf(LVL_DBG, "[%u:%d]/%u,%u len: %u wlen: %d chnk w: %u r: %u "
-      "pkt w: %u r: %u cidx: %u, +1: %u, mod: %u pktidx[mod]: %u "
-      "chnk[idx,cnt]: [%u,%u] rep: %u\r\n",
-      ((uint32_t *) ptr)[1], ((uint32_t *) ptr)[0], ((uint32_t *) ptr)[3],
-      rsb->num_chunks,
-      ((uint32_t *) ptr)[2], wlen, rsb->chnkidx_w, rsb->chnkidx_r,
-      rsb->pktidx_w, rsb->pktidx_r, chunkidx, (chunkidx+1),
-      (chunkidx+1) % rsb->num_chunks,
-      rsb->chunk_arr[((chunkidx+1)%rsb->num_chunks)].pkt_arr_idx,
-      chnk->pkt_arr_idx, chnk->pkt_cnt,
-      rsb->curr_chnk_repcnt);
+  metrics_inc(M_PKTS_SENT);
+  metrics_add(M_BYTES_SENT, outlen);
+  dprintf(LVL_DBG, "%d: [%u:%u]/%u,%u len: %u outlen: %d chnk r: %u "
+      "pkt r: %u chnk cnt: %u rep: %u\r\n", b->id,
+      pkt.hdr.chunkid, pkt.hdr.pkt_seq, pkt.hdr.numchunks, rsb->num_chunks,
+      pkt.hdr.chunklen, outlen, b->chnkidx_r, b->pktidx_r, chnk->pkt_cnt,
+      b->curr_chnk_repcnt);
 
   // next packet
-  pktidx = (pktidx+1) % MAX_PKTS;
+  pktidx++;
 
   // repeat chunk
-  if (pktidx >= ((chnk->pkt_arr_idx + chnk->pkt_cnt) % MAX_PKTS)) {
-    rsb->curr_chnk_repcnt++;
-    pktidx = chnk->pkt_arr_idx;
+  if (pktidx >= chnk->pkt_cnt) {
+    b->curr_chnk_repcnt++;
+    pktidx = 0;
   }
 
   // move to next chunk
-  if (rsb->curr_chnk_repcnt >= CHUNK_REPLICATION) {
-    chunkidx = (chunkidx+1) % rsb->num_chunks;
-    rsb->curr_chnk_repcnt = 0;
-
-    pktidx = rsb->chunk_arr[chunkidx].pkt_arr_idx;
+  if (b->curr_chnk_repcnt >= CHUNK_REPLICATION) {
+    chunkidx = next_chunk_idx(b, rsb, chunkidx);
+    b->curr_chnk_repcnt = 0;
+    pktidx = 0;
+
+    // back at the start of the rotation
+#if UART_DELTA
+    if (chunkidx == (uint32_t) rsb->num_chunks + 1) {
+#else
+    if (chunkidx == b->offset) {
+#endif
+      double now = now_s();
+      metrics_inc(M_CAROUSEL_CYCLES);
+      metrics_observe(H_CYCLE, now - b->cycle_start);
+      b->cycle_start = now;
+    }
   }
 
-  rsb->pktidx_r = pktidx;
-  rsb->chnkidx_r = chunkidx;
+  b->pktidx_r = pktidx;
+  b->chnkidx_r = chunkidx;
+  return 0;
+}
 
-make_req:
+/*
+ * transmit stage, UART_PKTS_PER_EDGE packets per GPIO edge from beacon
+ * arg
+ */
+void gpio_callback(int gpio, int level, uint32_t tick, void *arg)
+{
+  beacon *b = (beacon *) arg;
 
-  curr_time_sec = ((double) clock()) / CLOCKS_PER_SEC;
-  if (curr_time_sec - rsb->last_req_time_s < REQUEST_INTERVAL)
+  metrics_inc(M_GPIO_EDGES);
+  pthread_mutex_lock(&risk.mutex);
+  rpi_sl_buf *rsb = take_payload(b);
+  if (!rsb) {
+    pthread_mutex_unlock(&risk.mutex);
     return;
+  }
 
-//  time_t currtime = time(NULL);
-//  if (currtime < t2)
-//    return;
-//
-//  set_next_update_time();
-
-  // request new risk data from backend after INTERVAL
-  make_request(rsb);
-  rsb->last_req_time_s = curr_time_sec;
+  if (level == 0) {
+    dprintf(LVL_DBG, "%d: G: %d, T: %u, chnk r: %u pkt r: %u rep: %u\r\n",
+        b->id, gpio, tick, b->chnkidx_r, b->pktidx_r, b->curr_chnk_repcnt);
+  } else {
+    for (int i = 0; i < UART_PKTS_PER_EDGE && send_packet(b, rsb) == 0; i++)
+      ;
+  }
+  pthread_mutex_unlock(&risk.mutex);
 }
 
 /*
@@ -314,21 +898,56 @@ int set_interface_attribs(int fd, int speed)
  */
 void *uart_main(void *arg)
 {
-  rpi_sl_buf rsb;
-  init_rpi_sl_buf(&rsb);
+  const uart_config defaults = UART_CONFIG_DEFAULT;
+  const uart_config *cfg = arg ? (const uart_config *) arg : &defaults;
 
-  char *portname = TERMINAL;
+  init_rpi_sl_buf(&payload_bufs[0]);
+  init_rpi_sl_buf(&payload_bufs[1]);
 
-  // open port for read and write over UART
-  fd = open(portname, O_RDWR);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&risk.uart_ready_cond, &attr);
+  pthread_condattr_destroy(&attr);
 
-  if (fd == -1) {
-    fprintf(stderr, "Error opening %s: %s\n", portname, strerror(errno));
+  if (serial_init() < 0) {
+    fprintf(stderr, "Error setting up serial I/O\r\n");
     return 0;
   }
 
-  // baudrate 115200, 8 bits, no parity, 1 stop bit
-  set_interface_attribs(fd, B115200);
+  num_beacons = cfg->num_beacons;
+  for (int i = 0; i < num_beacons; i++) {
+    beacon *b = &beacons[i];
+    const char *portname = cfg->terminals[i];
+
+    b->id = i;
+    b->pin = cfg->pins[i];
+    snprintf(b->name, sizeof(b->name), "b%d", i);
+#if UART_DELTA
+    pthread_mutex_init(&b->need.lock, NULL);
+#endif
+
+    // open port for read and write over UART
+    int fd = open(portname, O_RDWR);
+
+    if (fd == -1) {
+      fprintf(stderr, "Error opening %s: %s\n", portname, strerror(errno));
+      return 0;
+    }
+
+    // baudrate 115200, 8 bits, no parity, 1 stop bit
+    set_interface_attribs(fd, B115200);
+
+    // with more than one beacon, their logs are told apart by name
+    b->port = serial_add(fd, num_beacons > 1 ? b->name : NULL, on_log_line,
+        b);
+    if (!b->port) {
+      fprintf(stderr, "Error setting up %s\n", portname);
+      return 0;
+    }
+
+    dprintf(LVL_EXP, "beacon %d: %s, gpio %u\r\n", i, portname, b->pin);
+  }
 
   // init GPIO
   gpioCfgClock(1, 0, 0);
@@ -338,18 +957,53 @@ void *uart_main(void *arg)
     return 0;
   }
 
-  data_ready = 0;
+  // one libcurl init and set of backend connections for all refreshes
+  if (request_init(cfg->backend_url) < 0) {
+    fprintf(stderr, "Error initialising requests\r\n");
+    return 0;
+  }
+
+  // without a cache, every chunk is fetched on every refresh
+  cache_init(cfg->cache_dir);
+
+  sched_config sched = {
+    .interval = cfg->interval,
+    .jitter = cfg->jitter,
+    .retry_min = REQUEST_RETRY_INTERVAL,
+    .retry_max = REQUEST_RETRY_MAX,
+    .metrics_log = cfg->metrics_log,
+  };
+  if (sched_init(&sched) < 0) {
+    fprintf(stderr, "Error setting up the refresh timer\r\n");
+    return 0;
+  }
 
-  gpioSetMode(PIN, PI_INPUT);
-  gpioSetAlertFuncEx(PIN, gpio_callback, (void *) &rsb);
+  metrics_config metrics = {
+    .interval = METRICS_INTERVAL,
+    .file = cfg->metrics_file,
+    .socket = cfg->metrics_socket,
+  };
+  if (metrics_start(&metrics) < 0)
+    fprintf(stderr, "Error starting metrics, running without\r\n");
+
+  for (int i = 0; i < num_beacons; i++) {
+    gpioSetMode(beacons[i].pin, PI_INPUT);
+    gpioSetAlertFuncEx(beacons[i].pin, gpio_callback, &beacons[i]);
+  }
 
 //  set_next_update_time();
 
-  // make request to backend and fill payload_data
-  make_request(&rsb);
+  // fetch and build payloads in the background, transmit from the GPIO
+  // callback
+  pthread_t req_thread;
+  if (pthread_create(&req_thread, NULL, request_main, NULL) != 0) {
+    fprintf(stderr, "Error starting request thread\r\n");
+    return 0;
+  }
 
-  // read logs from beacon
-  receive_log(fd);
+  // read logs from the beacons, and write out their packets
+  int err = serial_loop();
+  fprintf(stderr, "serial loop failed: %s\r\n", strerror(-err));
 
   // should not get here
   return 0;
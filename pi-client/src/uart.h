@@ -3,7 +3,15 @@
 
 #include "common.h"
 #include "request.h"
+#include "cache.h"
+#include "packet.h"
+#include "serial.h"
+#include "sched.h"
+#include "metrics.h"
 #include "../../common/src/riskinfo.h"
+#include "../../common/src/util/crc32.h"
+#include "../../common/src/util/frame.h"
+#include "../../common/src/settings.h"
 
 #include <fcntl.h> 
 #include <time.h>
@@ -16,19 +24,131 @@
 
 #define TERMINAL "/dev/ttyACM0"
 
-#define PER_ADV_SIZE 250
 #define CHUNK_REPLICATION 1
 
 /*
- * max number of packets that rpi can hold for risk broadcast
+ * max number of beacons that one client feeds, each on its own terminal
+ * and GPIO pin. TERMINAL and PIN are those of the first.
  */
-#define MAX_PKTS 10000
+#define UART_MAX_BEACONS SERIAL_MAX_PORTS
 
 /*
- * interval in seconds to request new risk data from backend
+ * start the rotation of every beacon at a different chunk, spread evenly
+ * over the payload, see start_rotation()
+ */
+#define UART_STAGGER 1
+
+/*
+ * send each packet as a COBS frame with a CRC (see frame.h) instead of
+ * a raw PER_ADV_SIZE block. must match BEACON_UART_FRAMED on the beacon.
+ */
+#define UART_FRAMED 1
+
+/*
+ * start every rotation with the chunk index (see riskinfo.h) and only
+ * send the chunks the beacon asks for. needed by BEACON_CAROUSEL on the
+ * beacon, a beacon without it drops the index. needs UART_FRAMED.
+ */
+#define UART_DELTA 1
+
+#if UART_DELTA && !UART_FRAMED
+#error "UART_DELTA needs UART_FRAMED"
+#endif
+
+/*
+ * packets sent per rising edge. a beacon with BEACON_PER_ADV_CHAINED
+ * reads a whole train per edge, set to PER_ADV_CHAIN_LEN for it, and
+ * to 1 otherwise. needs UART_FRAMED.
+ */
+#define UART_PKTS_PER_EDGE 1
+
+#if UART_PKTS_PER_EDGE > 1 && !UART_FRAMED
+#error "UART_PKTS_PER_EDGE needs UART_FRAMED"
+#endif
+
+/*
+ * append XOR parity packets to every chunk, see riskinfo.h
+ */
+#define RISK_FEC_ENABLE 1
+
+/*
+ * broadcast the signed payload manifest (see riskinfo.h) after every
+ * RISK_MANIFEST_INTERVAL chunks, so that dongles can authenticate chunks
+ * soon after they sync
+ */
+#define RISK_MANIFEST_ENABLE 0
+#define RISK_MANIFEST_INTERVAL 4
+
+/*
+ * interval in seconds to request new risk data from backend, plus a
+ * random delay of up to REQUEST_JITTER so that many clients do not all
+ * refresh at once
  */
 #define REQUEST_INTERVAL 86400
+#define REQUEST_JITTER 600
+
+/*
+ * interval in seconds to retry a failed request, while the last payload
+ * keeps being sent. doubles on every failure up to REQUEST_RETRY_MAX.
+ */
+#define REQUEST_RETRY_INTERVAL 300
+#define REQUEST_RETRY_MAX 3600
+
+/*
+ * packetize every chunk, i.e., compute its crc and parity packets, as
+ * its response arrives instead of after the whole payload was fetched,
+ * see packet_stream
+ */
+#define REQUEST_STREAM 1
+
+/*
+ * one line per refresh with when it ran and how long it took, see
+ * sched_log(). NULL for none.
+ */
+#define REQUEST_METRICS_LOG "/var/log/pancast-refresh.log"
 
+/*
+ * counters and latency histograms of the client, see metrics.h, are
+ * logged as a line of JSON every METRICS_INTERVAL s. the line also
+ * replaces METRICS_FILE, and is sent to every connection to the UNIX
+ * socket METRICS_SOCKET, if set.
+ */
+#define METRICS_INTERVAL 60
+#define METRICS_FILE NULL
+#define METRICS_SOCKET NULL
+
+/*
+ * settings that can be changed from the command line, see client.c.
+ * NULL backend_url and cache_dir are the defaults of request.c and
+ * cache.h.
+ */
+typedef struct uart_config {
+  int num_beacons;
+  const char *terminals[UART_MAX_BEACONS];
+  unsigned int pins[UART_MAX_BEACONS];
+  const char *backend_url;
+  const char *cache_dir;
+  const char *metrics_log;
+  const char *metrics_file;
+  const char *metrics_socket;
+  double interval;
+  double jitter;
+} uart_config;
+
+#define UART_CONFIG_DEFAULT { \
+  .num_beacons = 1, \
+  .terminals = { TERMINAL }, \
+  .pins = { PIN }, \
+  .metrics_log = REQUEST_METRICS_LOG, \
+  .metrics_file = METRICS_FILE, \
+  .metrics_socket = METRICS_SOCKET, \
+  .interval = REQUEST_INTERVAL, \
+  .jitter = REQUEST_JITTER, \
+}
+
+/*
+ * arg is a uart_config, or NULL for the defaults
+ */
 extern void *uart_main(void *arg);
 
 #endif // UART_H
@@ -0,0 +1,279 @@
+"""
+Simulate how the beacons persist their clock (see beacon_clock_increment()
+in beacon/src/beacon.c and zephyr-beacon/src/beacon.c) against a simulated
+flash that counts page erases and only allows writes to erased words.
+
+Compares the old scheme, which saved the clock every minute (to NVM3 on the
+SL beacon, by erasing and rewriting the stat page on the nRF beacon), with
+the time journal: one record per BEACON_CLOCK_JOURNAL_INTERVAL appended to
+a page that is only erased once full, plus a rarer checkpoint. Reports the
+erases per page and year and the years until the most worn page reaches
+the rated erase cycles.
+
+NVM3 is modelled as a log over its pages with one page kept free, each
+counter write taking --nvm3-obj-size bytes; the real object size depends
+on the NVM3 version, so its numbers are an estimate.
+
+Then cuts the power at random points, also halfway through a record and
+between the erase of a full journal and its next record, and checks that
+the clock recovered at boot never goes back past a saved time and is
+less than two journal intervals behind (the interval since the last
+record, and the record torn by the power loss).
+
+Usage: python3 sim_clock_journal.py [--platform sl|nrf] [--years Y]
+           [--journal-interval M] [--checkpoint-interval M] [--cuts N]
+"""
+import argparse
+import random
+
+ERASED = 0xffffffff
+MINUTES_PER_YEAR = 365 * 24 * 60
+
+PLATFORMS = {
+    # page size, rated erase cycles
+    'sl': (8192, 10000),    # EFR32BG22
+    'nrf': (4096, 10000),   # nRF52
+}
+NVM3_SIZE = 40960           # NVM3_DEFAULT_NVM_SIZE
+REPORT_INTERVAL = 60        # BEACON_REPORT_INTERVAL
+REC_SIZE = 8                # time_journal_rec_t
+
+
+class Page:
+    def __init__(self, size):
+        self.words = [ERASED] * (size // 4)
+        self.erases = 0
+
+    def erase(self):
+        self.words = [ERASED] * len(self.words)
+        self.erases += 1
+
+    def write(self, idx, word):
+        assert self.words[idx] == ERASED, 'write to a word not erased'
+        self.words[idx] = word
+
+
+class Journal:
+    """beacon_storage_time_journal_* on a simulated page"""
+    def __init__(self, page_size):
+        self.page = Page(page_size)
+        self.num_recs = page_size // REC_SIZE
+        self.next = 0
+
+    def full(self):
+        return self.next >= self.num_recs
+
+    def reset(self):
+        self.page.erase()
+        self.next = 0
+
+    def append(self, t_cur, torn=False):
+        if self.full():
+            self.reset()
+        self.page.write(2 * self.next, t_cur)
+        if not torn:
+            self.page.write(2 * self.next + 1, ~t_cur & ERASED)
+        self.next += 1
+
+    def load(self):
+        t_cur = None
+        i = 0
+        while i < self.num_recs:
+            t, check = self.page.words[2 * i], self.page.words[2 * i + 1]
+            if t == ERASED and check == ERASED:
+                break
+            if check == ~t & ERASED and (t_cur is None or t > t_cur):
+                t_cur = t
+            i += 1
+        self.next = i
+        return t_cur
+
+
+class Nvm3:
+    """a log of counter writes over pages, with one page kept free"""
+    def __init__(self, page_size, obj_size):
+        self.pages = [Page(page_size) for _ in range(NVM3_SIZE // page_size)]
+        self.page_size = page_size
+        self.obj_size = obj_size
+        self.cur = 0
+        self.used = 0
+        self.value = 0
+        self.writes = 0
+
+    def write(self, value):
+        if self.used + self.obj_size > self.page_size:
+            self.cur = (self.cur + 1) % len(self.pages)
+            # the page after the new one is erased ahead, so one stays free
+            self.pages[(self.cur + 1) % len(self.pages)].erases += 1
+            self.used = 0
+        self.used += self.obj_size
+        self.value = value
+        self.writes += 1
+
+
+def max_erases(pages):
+    return max(p.erases for p in pages)
+
+
+def run_old(platform, minutes, obj_size):
+    page_size, _ = PLATFORMS[platform]
+    clock_erases = report_erases = 0
+    nvm3 = Nvm3(page_size, obj_size)
+    for t in range(1, minutes + 1):
+        if platform == 'sl':
+            nvm3.write(t)
+        else:
+            clock_erases += 1
+        if t % REPORT_INTERVAL == 0:
+            report_erases += 1
+    return {'stat_clock': clock_erases, 'stat_report': report_erases,
+            'journal': 0, 'nvm3': max_erases(nvm3.pages),
+            'nvm3_writes': nvm3.writes}
+
+
+class NewScheme:
+    """_beacon_save_clock_() and the recovery in beacon_load()"""
+    def __init__(self, platform, journal_interval, checkpoint_interval,
+                 obj_size):
+        page_size, _ = PLATFORMS[platform]
+        self.platform = platform
+        self.journal = Journal(page_size)
+        self.stat_clock_erases = 0
+        self.stat_report_erases = 0
+        self.nvm3 = Nvm3(page_size, obj_size)
+        self.checkpoint = 0
+        self.journal_interval = journal_interval
+        self.checkpoint_interval = checkpoint_interval
+        self.journal_t = 0
+        self.checkpoint_t = 0
+
+    def save_checkpoint(self, t):
+        # nvm3_save_clock_cursor() on the SL beacon, the stat page on nRF
+        if self.platform == 'sl':
+            self.nvm3.write(t)
+        else:
+            self.stat_clock_erases += 1
+        self.checkpoint = t
+        self.checkpoint_t = t
+
+    def tick(self, t, torn=False):
+        if t - self.journal_t < self.journal_interval:
+            return
+        if self.journal.full() or (
+                self.platform == 'sl' and
+                t - self.checkpoint_t >= self.checkpoint_interval):
+            self.save_checkpoint(t)
+        self.journal.append(t, torn)
+        self.journal_t = t
+
+    def report(self, t):
+        self.stat_report_erases += 1
+        if self.platform == 'nrf':
+            self.checkpoint = t
+
+    def recover(self, t_init=0):
+        journal = self.journal.load()
+        t_cur = self.checkpoint
+        if journal is not None and journal > t_cur:
+            t_cur = journal
+        t_cur = max(t_cur, t_init)
+        self.journal_t = self.checkpoint_t = t_cur
+        return t_cur
+
+
+def run_new(platform, minutes, journal_interval, checkpoint_interval,
+            obj_size):
+    s = NewScheme(platform, journal_interval, checkpoint_interval, obj_size)
+    for t in range(1, minutes + 1):
+        s.tick(t)
+        if t % REPORT_INTERVAL == 0:
+            s.report(t)
+    return {'stat_clock': s.stat_clock_erases,
+            'stat_report': s.stat_report_erases,
+            'journal': s.journal.page.erases, 'nvm3': max_erases(s.nvm3.pages),
+            'nvm3_writes': s.nvm3.writes}
+
+
+def check_power_loss(platform, cuts, journal_interval, checkpoint_interval,
+                     obj_size, rng):
+    page_size, _ = PLATFORMS[platform]
+    s = NewScheme(platform, journal_interval, checkpoint_interval, obj_size)
+    num_recs = page_size // REC_SIZE
+    t = saved = 0
+    worst = 0
+    for _ in range(cuts):
+        # run to a random point, often around the journal wrap
+        run = rng.randrange(1, 3 * num_recs * journal_interval)
+        for _ in range(run):
+            t += 1
+            s.tick(t)
+            if t % REPORT_INTERVAL == 0:
+                s.report(t)
+            if s.journal_t == t:
+                saved = t
+        kind = rng.randrange(3)
+        if kind == 1:
+            # power lost halfway through the next record
+            t += journal_interval
+            s.tick(t, torn=True)
+        elif kind == 2 and s.journal.full():
+            # power lost right after erasing the full journal
+            t += journal_interval
+            s.save_checkpoint(t)
+            saved = t
+            s.journal.reset()
+        recovered = s.recover()
+        assert recovered >= saved, 'clock went back %u -> %u' % (saved,
+                                                                 recovered)
+        assert recovered <= t
+        worst = max(worst, t - recovered)
+        t = recovered
+    return worst
+
+
+def main():
+    p = argparse.ArgumentParser()
+    p.add_argument('--platform', choices=PLATFORMS, default='sl')
+    p.add_argument('--years', type=float, default=1)
+    p.add_argument('--journal-interval', type=int, default=1)
+    p.add_argument('--checkpoint-interval', type=int, default=24 * 60)
+    p.add_argument('--nvm3-obj-size', type=int, default=12)
+    p.add_argument('--cuts', type=int, default=200)
+    p.add_argument('--seed', type=int, default=1)
+    a = p.parse_args()
+
+    _, cycles = PLATFORMS[a.platform]
+    minutes = int(a.years * MINUTES_PER_YEAR)
+    old = run_old(a.platform, minutes, a.nvm3_obj_size)
+    new = run_new(a.platform, minutes, a.journal_interval,
+                  a.checkpoint_interval, a.nvm3_obj_size)
+
+    print('%s beacon, %.1f years, journal every %u min, checkpoint every '
+          '%u min' % (a.platform, a.years, a.journal_interval,
+                      a.checkpoint_interval if a.platform == 'sl'
+                      else REPORT_INTERVAL))
+    print('erases per page and year:')
+    print('%-8s %12s %12s %12s %12s %14s %12s' % (
+        'scheme', 'stat, clock', 'journal', 'nvm3 page', 'stat, report',
+        'years to wear', 'nvm3 writes'))
+    for name, r in (('old', old), ('journal', new)):
+        worst = max(r['stat_clock'], r['journal'], r['nvm3']) / a.years
+        print('%-8s %12.1f %12.1f %12.1f %12.1f %14.1f %12.0f' % (
+            name, r['stat_clock'] / a.years, r['journal'] / a.years,
+            r['nvm3'] / a.years, r['stat_report'] / a.years,
+            cycles / worst if worst else float('inf'),
+            r['nvm3_writes'] / a.years))
+    print('(years to wear counts the erases for the clock only, the stat '
+          'page is also\n erased with every report; nvm3 writes are per '
+          'year)')
+
+    worst = check_power_loss(a.platform, a.cuts, a.journal_interval,
+                             a.checkpoint_interval, a.nvm3_obj_size,
+                             random.Random(a.seed))
+    assert worst < 2 * a.journal_interval
+    print('%u power cuts: clock never went back, at most %u min lost' %
+          (a.cuts, worst))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,289 @@
+"""
+Simulate a risk payload update on the network beacon with two flash banks
+(see beacon/src/storage.h and the carousel in beacon/app.c), against a
+simulated flash that only allows writes to erased words.
+
+The pi client sends the chunk index, then only the chunks the beacon asks
+for; unchanged chunks are copied from the current bank, a few packets
+after every periodic adv. event. For each fraction of changed chunks, reports
+the time until the beacon switches banks, the bytes sent over UART, and
+the periodic adv. events the carousel missed because flash work ran past
+the event. Every run checks that the new bank holds exactly the packets
+of the new generation, with the new chunk ids and payload version, and
+that the old bank stayed intact until the switch.
+
+Usage: python3 sim_delta_update.py [--chunks N] [--runs R]
+"""
+import argparse
+import random
+import zlib
+
+PER_ADV_SIZE = 250
+HDR_SIZE = 24                   # rpi_ble_hdr
+MAX_PAYLOAD_SIZE = PER_ADV_SIZE - HDR_SIZE
+CHUNK_LEN = 1736                # CF_SIZE_BYTES + HDR_SIZE_BYTES
+RISK_FEC_GROUP_SIZE = 4
+PER_ADV_INTERVAL_MS = 12.5
+
+PAGE_SIZE = 8192
+BANK_PAGES = 4
+SLOT_SIZE = 252
+SLOTS_PER_PAGE = PAGE_SIZE // SLOT_SIZE
+MAX_PKTS = BANK_PAGES * SLOTS_PER_PAGE - 1
+UPDATE_COPY_PKTS = 4
+
+UART_BAUD = 115200
+UART_BITS_PER_BYTE = 11         # 8E1
+PULL_TURNAROUND_MS = 0.5        # GPIO edge to first byte on the pi
+
+
+def num_data_pkts(chunklen):
+    return (chunklen - 1) // MAX_PAYLOAD_SIZE + 1
+
+
+def chunk_pkts(chunkid, crc, chunklen, payload_ver, numchunks):
+    n = num_data_pkts(chunklen)
+    ngroups = (n + RISK_FEC_GROUP_SIZE - 1) // RISK_FEC_GROUP_SIZE
+    return [(seq, chunkid, chunklen, numchunks, crc, payload_ver)
+            for seq in range(n + ngroups)]
+
+
+def pkt_len(pkt):
+    seq, _, chunklen = pkt[0], pkt[1], pkt[2]
+    off = seq * MAX_PAYLOAD_SIZE
+    return HDR_SIZE + (min(MAX_PAYLOAD_SIZE, chunklen - off)
+                       if off < chunklen else MAX_PAYLOAD_SIZE)
+
+
+def frame_ms(nbytes):
+    # COBS adds a byte per 254, plus length, CRC and delimiter
+    nbytes += 2 + 4 + nbytes // 254 + 2
+    return nbytes * UART_BITS_PER_BYTE * 1000 / UART_BAUD + PULL_TURNAROUND_MS
+
+
+class Flash:
+    """NOR flash: erase sets a page to 0xff, writes may only clear bits"""
+
+    def __init__(self, npages, erase_ms, word_us):
+        self.mem = bytearray(b"\xff" * (npages * PAGE_SIZE))
+        self.erase_ms = erase_ms
+        self.word_us = word_us
+
+    def erase(self, page):
+        self.mem[page * PAGE_SIZE:(page + 1) * PAGE_SIZE] = \
+            b"\xff" * PAGE_SIZE
+        return self.erase_ms
+
+    def write(self, off, data):
+        assert off % 4 == 0 and len(data) % 4 == 0
+        for i, b in enumerate(data):
+            assert self.mem[off + i] == 0xff, "write to unerased flash"
+            self.mem[off + i] = b
+        return len(data) // 4 * self.word_us / 1000
+
+    def read(self, off, n):
+        return bytes(self.mem[off:off + n])
+
+
+def pack_pkt(pkt):
+    hdr = b"".join(v.to_bytes(4, "little") for v in pkt)
+    return (len(hdr) + MAX_PAYLOAD_SIZE).to_bytes(2, "little") + hdr + \
+        bytes(SLOT_SIZE - 2 - len(hdr))
+
+
+def unpack_pkt(slot):
+    return tuple(int.from_bytes(slot[2 + 4 * i:6 + 4 * i], "little")
+                 for i in range(6))
+
+
+class Bank:
+    """mirror of the risk store functions in beacon/src/storage.c"""
+
+    def __init__(self, flash, bank):
+        self.flash = flash
+        self.base = bank * BANK_PAGES * PAGE_SIZE
+
+    def slot_off(self, slot):
+        return self.base + (slot // SLOTS_PER_PAGE) * PAGE_SIZE + \
+            (slot % SLOTS_PER_PAGE) * SLOT_SIZE
+
+    def erase(self, page):
+        return self.flash.erase(self.base // PAGE_SIZE + page)
+
+    def append(self, idx, pkt):
+        assert idx < MAX_PKTS, "bank full"
+        return self.flash.write(self.slot_off(idx + 1), pack_pkt(pkt))
+
+    def pkt(self, idx):
+        return unpack_pkt(self.flash.read(self.slot_off(idx + 1), SLOT_SIZE))
+
+
+class Update:
+    """bank page erases and appends, as update_erase_page/update_append"""
+
+    def __init__(self, bank):
+        self.bank = bank
+        self.erased = 0
+        self.npkts = 0
+
+    def erase_next(self):
+        self.erased += 1
+        return self.bank.erase(self.erased - 1)
+
+    def append(self, pkt):
+        t = 0
+        while self.erased <= (self.npkts + 1) // SLOTS_PER_PAGE and \
+                self.erased < BANK_PAGES:
+            t += self.erase_next()
+        t += self.bank.append(self.npkts, pkt)
+        self.npkts += 1
+        return t
+
+
+def generation(chunk_crcs, payload_ver):
+    pkts = []
+    for c, crc in enumerate(chunk_crcs):
+        pkts += chunk_pkts(c, crc, CHUNK_LEN, payload_ver, len(chunk_crcs))
+    return pkts
+
+
+def update(nchunks, frac, rng, erase_ms, word_us):
+    old_crcs = [rng.getrandbits(32) for _ in range(nchunks)]
+    new_crcs = [crc if rng.random() >= frac else rng.getrandbits(32)
+                for crc in old_crcs]
+    rng.shuffle(new_crcs)   # chunk ids may move between generations
+    old_ver, new_ver = 1, 2
+
+    flash = Flash(2 * BANK_PAGES, erase_ms, word_us)
+    cur, nxt = Bank(flash, 0), Bank(flash, 1)
+    old_pkts = generation(old_crcs, old_ver)
+    for page in range(BANK_PAGES):
+        cur.erase(page)
+    for i, p in enumerate(old_pkts):
+        cur.append(i, p)
+    old_image = flash.read(0, BANK_PAGES * PAGE_SIZE)
+
+    # runs of each chunk in the current bank, as carousel_scan_chunks()
+    runs = {}
+    for i, p in enumerate(old_pkts):
+        start, cnt = runs.get(p[4], (i, 0))
+        runs[p[4]] = (start, cnt + 1)
+
+    index = b"".join(c.to_bytes(4, "little") for c in new_crcs)
+    index_pkts = chunk_pkts(0xfffffffe, zlib.crc32(index), len(index),
+                            new_ver, nchunks)
+    src = {e: runs[crc] for e, crc in enumerate(new_crcs) if crc in runs}
+    copies = [(e, runs[new_crcs[e]][0] + k) for e in sorted(src)
+              for k in range(runs[new_crcs[e]][1])]
+    need = set(range(nchunks)) - set(src)
+
+    cpu = 0.0           # ms, the main loop is busy with flash until cpu
+    next_event = PER_ADV_INTERVAL_MS / 2
+    missed = 0
+    uart_bytes = 0
+    upd = Update(nxt)
+    need_known = False
+    have = set()
+    rx_left = len(need)
+
+    # the pi rotation: index, then chunks, needed ones only once known
+    def rotation():
+        while True:
+            for p in index_pkts:
+                yield ("index", p)
+            for c in range(nchunks):
+                if need_known and c not in need:
+                    continue
+                for p in chunk_pkts(c, new_crcs[c], CHUNK_LEN, new_ver,
+                                    nchunks):
+                    yield ("chunk", p)
+
+    pi = rotation()
+    kind, p = next(pi)
+    uart_t = frame_ms(pkt_len(p))   # ms, next frame fully received
+    index_done = False
+    copy_i = 0
+    while len(have) < nchunks:
+        pulling = not index_done or rx_left > 0
+        if not pulling or next_event <= uart_t:
+            # carousel timer, between two periodic adv. events
+            start = max(cpu, next_event)
+            if start > next_event + PER_ADV_INTERVAL_MS / 2:
+                missed += 1
+            cpu = start
+            next_event += PER_ADV_INTERVAL_MS
+            # update_step(), right after the risk data update
+            if index_done and upd.erased < BANK_PAGES:
+                cpu += upd.erase_next()
+            elif index_done:
+                for _ in range(UPDATE_COPY_PKTS):
+                    if copy_i == len(copies):
+                        break
+                    e, slot = copies[copy_i]
+                    q = cur.pkt(slot)
+                    cpu += upd.append((q[0], e, q[2], nchunks, q[4],
+                                       new_ver))
+                    copy_i += 1
+                    if copy_i == len(copies) or copies[copy_i][0] != e:
+                        have.add(e)
+            continue
+
+        # frame decoded, the beacon pulls the next one right away
+        start = max(cpu, uart_t)
+        cpu = start
+        uart_bytes += pkt_len(p)
+        if kind == "index":
+            if p[0] == num_data_pkts(len(index)) - 1 and not index_done:
+                index_done = True
+                need_known = True   # the need line reaches the pi
+        elif index_done and p[1] in need and p[1] not in have:
+            cpu += upd.append(p)
+            if p[0] == len(chunk_pkts(0, 0, CHUNK_LEN, 0, 0)) - 1:
+                have.add(p[1])
+                rx_left -= 1
+        kind, p = next(pi)
+        uart_t = cpu + frame_ms(pkt_len(p))
+
+    assert upd.erased > 0
+    assert flash.read(0, BANK_PAGES * PAGE_SIZE) == old_image, \
+        "current bank modified during the update"
+
+    # the new bank holds every packet of the new generation
+    got = sorted(nxt.pkt(i) for i in range(upd.npkts))
+    want = sorted(generation(new_crcs, new_ver))
+    assert got == want, "new bank does not match the new generation"
+
+    return cpu / 1000, uart_bytes, missed
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--chunks", type=int, default=12)
+    parser.add_argument("--runs", type=int, default=20)
+    parser.add_argument("--erase-ms", type=float, default=12.0,
+                        help="page erase time")
+    parser.add_argument("--word-us", type=float, default=10.0,
+                        help="32-bit word write time")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    pkts_per_chunk = len(chunk_pkts(0, 0, CHUNK_LEN, 0, 0))
+    full_s = args.chunks * sum(frame_ms(pkt_len(p)) for p in
+                               chunk_pkts(0, 0, CHUNK_LEN, 0, 0)) / 1000
+
+    print(f"#chunks: {args.chunks} pkts/chunk: {pkts_per_chunk} "
+          f"full reload over UART: {full_s:.2f} s")
+    print(f"{'changed':>8} {'update(s)':>10} {'uart KB':>8} "
+          f"{'missed events':>14}")
+    for frac in [0.0, 0.1, 0.25, 0.5, 0.75, 1.0]:
+        res = [update(args.chunks, frac, rng, args.erase_ms, args.word_us)
+               for _ in range(args.runs)]
+        secs = sum(r[0] for r in res) / len(res)
+        kbytes = sum(r[1] for r in res) / len(res) / 1024
+        missed = sum(r[2] for r in res) / len(res)
+        print(f"{frac:>8.2f} {secs:>10.2f} {kbytes:>8.1f} {missed:>14.1f}")
+
+
+if __name__ == "__main__":
+    main()
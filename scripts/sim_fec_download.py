@@ -0,0 +1,135 @@
+"""
+Simulate a dongle downloading the risk carousel broadcast by the network
+beacon, with and without XOR parity packets (see common/src/riskinfo.h).
+
+For each packet loss rate and parity group size, reports the mean and 95th
+percentile time until every chunk is complete. The dongle keeps the radio on
+from sync until completion, so this is also the radio-on time, and the
+number of periodic packets the radio had to receive.
+
+Usage: python3 sim_fec_download.py [--chunks N] [--burst B] [--runs R]
+"""
+import argparse
+import random
+
+PER_ADV_SIZE = 250
+HDR_SIZE = 28
+MAX_PAYLOAD_SIZE = PER_ADV_SIZE - HDR_SIZE
+CF_SIZE_BYTES = 1728
+PER_ADV_INTERVAL_MS = 12.5      # PER_ADV_INTERVAL 10 * 1.25 ms
+CHUNK_REPLICATION = 1
+
+NUM_DATA_PKTS = (CF_SIZE_BYTES - 1) // MAX_PAYLOAD_SIZE + 1
+
+
+def num_groups(group_size):
+    if group_size == 0:
+        return 0
+    return (NUM_DATA_PKTS + group_size - 1) // group_size
+
+
+def carousel(num_chunks, group_size):
+    """sequence of (chunkid, pkt_seq) as sent by the pi-client"""
+    seq = []
+    for c in range(num_chunks):
+        for _ in range(CHUNK_REPLICATION):
+            for i in range(NUM_DATA_PKTS + num_groups(group_size)):
+                seq.append((c, i))
+    return seq
+
+
+class LossModel:
+    """Gilbert-Elliott channel with mean loss p and mean burst length b"""
+
+    def __init__(self, p, burst, rng):
+        self.rng = rng
+        self.bad = False
+        self.p_bg = 1.0 / burst if burst > 1 else 1.0
+        self.p_gb = p * self.p_bg / (1.0 - p) if p < 1 else 1.0
+
+    def lost(self):
+        if self.bad:
+            self.bad = self.rng.random() >= self.p_bg
+        else:
+            self.bad = self.rng.random() < self.p_gb
+        return self.bad
+
+
+def download(num_chunks, group_size, loss, rng, max_rot=1000):
+    """mirror of dongle_on_periodic_data(), returns #slots until complete"""
+    pkts = carousel(num_chunks, group_size)
+    ngroups = num_groups(group_size)
+    counts = [[0] * NUM_DATA_PKTS for _ in range(num_chunks)]
+    slot_owner = [-1] * NUM_DATA_PKTS
+    fec_chunk, fec_valid = -1, set()
+    done = [False] * num_chunks
+    ndone = 0
+
+    start = rng.randrange(len(pkts))
+    for t in range(len(pkts) * max_rot):
+        c, i = pkts[(start + t) % len(pkts)]
+        if loss.lost():
+            continue
+
+        if i >= NUM_DATA_PKTS:
+            g = i - NUM_DATA_PKTS
+            if fec_chunk != c:
+                fec_chunk, fec_valid = c, set()
+            fec_valid.add(g)
+        else:
+            if counts[c][i] > 0:
+                continue
+            counts[c][i] = 1
+            slot_owner[i] = c
+            g = i % ngroups if ngroups else 0
+
+        if ngroups and fec_chunk == c and g in fec_valid:
+            grp = range(g, NUM_DATA_PKTS, ngroups)
+            missing = [j for j in grp if counts[c][j] == 0]
+            stale = [j for j in grp if counts[c][j] > 0 and slot_owner[j] != c]
+            if len(missing) == 1 and not stale:
+                counts[c][missing[0]] = 1
+                slot_owner[missing[0]] = c
+
+        if not done[c] and all(counts[c]):
+            done[c] = True
+            ndone += 1
+            if ndone == num_chunks:
+                return t + 1
+
+    return len(pkts) * max_rot
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--chunks", type=int, default=32)
+    parser.add_argument("--burst", type=float, default=1.0,
+                        help="mean loss burst length in packets")
+    parser.add_argument("--runs", type=int, default=200)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    losses = [0.0, 0.01, 0.05, 0.1, 0.2, 0.3]
+    group_sizes = [0, 8, 4, 2]
+
+    print(f"#chunks: {args.chunks} pkts/chunk: {NUM_DATA_PKTS} "
+          f"burst: {args.burst} runs: {args.runs}")
+    print(f"{'loss':>6} {'group':>6} {'cycle(s)':>9} {'mean(s)':>9} "
+          f"{'p95(s)':>9} {'rx pkts':>9}")
+    for p in losses:
+        for gs in group_sizes:
+            cycle = len(carousel(args.chunks, gs)) * PER_ADV_INTERVAL_MS / 1000
+            slots = sorted(download(args.chunks, gs,
+                                    LossModel(p, args.burst, rng), rng)
+                           for _ in range(args.runs))
+            mean = sum(slots) / len(slots) * PER_ADV_INTERVAL_MS / 1000
+            p95 = slots[int(0.95 * (len(slots) - 1))] * PER_ADV_INTERVAL_MS / 1000
+            rx = sum(slots) / len(slots) * (1 - p)
+            label = "off" if gs == 0 else str(gs)
+            print(f"{p:>6.2f} {label:>6} {cycle:>9.2f} {mean:>9.2f} "
+                  f"{p95:>9.2f} {rx:>9.0f}")
+
+
+if __name__ == "__main__":
+    main()
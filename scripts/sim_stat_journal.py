@@ -0,0 +1,263 @@
+"""
+Simulate how the beacons and the dongle persist their stats, against a
+simulated flash that counts page erases and only allows writes to erased
+words, and report the erases per day before and after the stats journal.
+
+Beacons (beacon_storage_save_stat() in beacon/src/storage.c and
+zephyr-beacon/src/storage.c): every report used to erase the stat page.
+Snapshots now go to fixed slots after the clock mark word at the start
+of the page, with a sequence number and a CRC, and the page is erased
+once every slot is used.
+
+Dongle (dongle/src/storage.c, nvm3_lib.c): the stats go to NVM3 with
+every report; the config page, with the keys, was erased and rewritten
+at the first boot after every flash to set the stats checksum. Now only
+changed stats objects are written, and the config is acknowledged by a
+word written once to the erased end of the config page. NVM3 is modelled
+as a log over its pages with one page kept free, objects taking their
+size plus an 8 byte header, so its numbers are an estimate.
+
+Then cuts the power at random points, also within a slot and between the
+erase of a full page and the next snapshot, and checks that the latest
+complete snapshot is recovered, or the one before it if the cut tore it.
+
+Usage: python3 sim_stat_journal.py [--days D] [--report-interval M]
+           [--downloads-per-day N] [--flashes F] [--cuts N]
+"""
+import argparse
+import random
+import struct
+import zlib
+
+ERASED = 0xffffffff
+MINUTES_PER_DAY = 24 * 60
+HDR_SIZE = 16                   # stat_journal_hdr_t
+MARK_SIZE = 4                   # clock at the last erase
+
+BEACONS = {
+    # page size, sizeof(beacon_stats_t)
+    'sl': (8192, 240),
+    'nrf': (4096, 24),
+}
+
+DONGLE_PAGE_SIZE = 8192
+DONGLE_NVM3_SIZE = 24576        # NVM3_DEFAULT_NVM_SIZE
+NVM3_OBJ_HDR = 8
+# stats objects of nvm3_save_stat(), and whether they change between reports
+DONGLE_STAT_OBJS = [
+    ('stat_ints', 80, True),
+    ('stat_grp', 200, True),
+    ('all_download', 160, False),
+    ('completed_download', 160, False),
+    ('all_download_chunk', 200, False),
+    ('completed_download_chunk', 200, False),
+    ('all_download_phy', 160, False),
+    ('completed_download_phy', 160, False),
+]
+
+
+class Page:
+    def __init__(self, size):
+        self.data = bytearray(b'\xff' * size)
+        self.erases = 0
+
+    def erase(self):
+        self.data = bytearray(b'\xff' * len(self.data))
+        self.erases += 1
+
+    def write(self, off, buf, cut=None):
+        """write buf at off, stopping after cut bytes if given"""
+        assert off % 4 == 0 and len(buf) % 4 == 0
+        if cut is not None:
+            buf = buf[:cut - cut % 4]
+        for i in range(0, len(buf), 4):
+            assert self.data[off + i:off + i + 4] == b'\xff' * 4, \
+                'write to a word not erased'
+        self.data[off:off + len(buf)] = buf
+
+    def word(self, off):
+        return struct.unpack_from('<I', self.data, off)[0]
+
+
+class StatJournal:
+    """beacon_storage_{save,read,reset}_stat() on a simulated page"""
+    def __init__(self, page_size, stats_size):
+        self.page = Page(page_size)
+        self.stats_size = stats_size
+        self.slot_size = (HDR_SIZE + stats_size + 3) & ~3
+        self.num_slots = (page_size - MARK_SIZE) // self.slot_size
+        self.next = 0
+        self.seq = 0
+
+    def slot_off(self, i):
+        return MARK_SIZE + i * self.slot_size
+
+    @staticmethod
+    def crc(seq, t_cur, stat):
+        return zlib.crc32(struct.pack('<III', seq, t_cur, len(stat)) + stat)
+
+    def scan(self):
+        latest = None
+        i = 0
+        while i < self.num_slots:
+            off = self.slot_off(i)
+            seq, t_cur, n, crc = struct.unpack_from('<IIII', self.page.data,
+                                                    off)
+            if seq == ERASED:
+                break
+            stat = bytes(self.page.data[off + HDR_SIZE:off + HDR_SIZE + n]) \
+                if n <= self.stats_size else None
+            if stat is not None and crc == self.crc(seq, t_cur, stat) and \
+                    (latest is None or seq > latest[0]):
+                latest = (seq, t_cur, stat)
+            i += 1
+        self.next = i
+        self.seq = latest[0] if latest else 0
+        return latest
+
+    def reset(self):
+        self.page.erase()
+        self.next = 0
+
+    def save(self, t_cur, stat, cut=None):
+        """cut: None, 'erase' (right after an erase), or a byte count"""
+        if self.page.word(0) == 0 or self.next >= self.num_slots:
+            self.reset()
+            if cut == 'erase':
+                return
+        if self.page.word(0) == ERASED:
+            self.page.write(0, struct.pack('<I', t_cur))
+        self.seq += 1
+        hdr = struct.pack('<IIII', self.seq, t_cur, len(stat),
+                          self.crc(self.seq, t_cur, stat))
+        off = self.slot_off(self.next)
+        self.next += 1
+        if isinstance(cut, int):
+            self.page.write(off, hdr + stat, cut)
+            return
+        self.page.write(off, hdr)
+        self.page.write(off + HDR_SIZE, stat)
+
+
+class Nvm3:
+    """a log of object writes over pages, with one page kept free"""
+    def __init__(self, size, page_size):
+        self.erases = [0] * (size // page_size)
+        self.page_size = page_size
+        self.cur = 0
+        self.used = 0
+        self.bytes = 0
+
+    def write(self, size):
+        size += NVM3_OBJ_HDR
+        if self.used + size > self.page_size:
+            self.cur = (self.cur + 1) % len(self.erases)
+            self.erases[(self.cur + 1) % len(self.erases)] += 1
+            self.used = 0
+        self.used += size
+        self.bytes += size
+
+
+def beacon_erases(platform, minutes, report_interval):
+    page_size, stats_size = BEACONS[platform]
+    j = StatJournal(page_size, stats_size)
+    before = 0
+    for t in range(1, minutes + 1):
+        if t % report_interval == 0:
+            before += 1
+            j.save(t, bytes(stats_size))
+    return before, j.page.erases, j.num_slots
+
+
+def dongle_erases(minutes, report_interval, downloads_per_day, flashes):
+    before, after = (Nvm3(DONGLE_NVM3_SIZE, DONGLE_PAGE_SIZE)
+                     for _ in range(2))
+    download_every = MINUTES_PER_DAY // downloads_per_day \
+        if downloads_per_day else 0
+    for t in range(1, minutes + 1):
+        # a completed download also saves the stats, between reports
+        downloaded = download_every and \
+            (t + download_every // 2) % download_every == 0
+        if t % report_interval and not downloaded:
+            continue
+        for _, size, changes in DONGLE_STAT_OBJS:
+            before.write(size)
+            if changes or downloaded:
+                after.write(size)
+    # the config page erase at the first boot after each flash
+    return (max(before.erases), flashes, before.bytes,
+            max(after.erases), 0, after.bytes)
+
+
+def check_power_loss(platform, cuts, rng):
+    page_size, stats_size = BEACONS[platform]
+    j = StatJournal(page_size, stats_size)
+    t = 0
+    saved = []
+    for _ in range(cuts):
+        for _ in range(rng.randrange(1, 2 * j.num_slots)):
+            t += 60
+            stat = bytes(rng.randrange(256) for _ in range(stats_size))
+            j.save(t, stat)
+            saved.append(stat)
+        kind = rng.randrange(3)
+        t += 60
+        stat = bytes(rng.randrange(256) for _ in range(stats_size))
+        if kind and j.next >= j.num_slots:
+            # the snapshots are gone with the page, only the RAM copy had
+            # the latest one
+            saved = []
+        if kind == 1:
+            j.save(t, stat, rng.randrange(4, HDR_SIZE + stats_size))
+        elif kind == 2 and j.next >= j.num_slots:
+            j.save(t, stat, 'erase')
+        latest = j.scan()
+        if saved:
+            assert latest is not None and latest[2] == saved[-1], \
+                'lost the latest complete snapshot'
+        else:
+            assert latest is None
+    return j.page.erases
+
+
+def main():
+    p = argparse.ArgumentParser()
+    p.add_argument('--days', type=int, default=30)
+    p.add_argument('--report-interval', type=int, default=60)
+    p.add_argument('--downloads-per-day', type=int, default=4)
+    p.add_argument('--flashes', type=int, default=1)
+    p.add_argument('--cuts', type=int, default=200)
+    p.add_argument('--seed', type=int, default=1)
+    a = p.parse_args()
+
+    minutes = a.days * MINUTES_PER_DAY
+    print('%u days, a report every %u min, %u downloads a day, %u config '
+          'flashes' % (a.days, a.report_interval, a.downloads_per_day,
+                       a.flashes))
+    print('erases per day, on the most erased page:')
+    print('%-24s %10s %10s' % ('', 'before', 'after'))
+    for platform in BEACONS:
+        before, after, slots = beacon_erases(platform, minutes,
+                                             a.report_interval)
+        print('%-24s %10.2f %10.2f' % ('%s beacon stat page' % platform,
+                                       before / a.days, after / a.days))
+        print('%-24s %21u snapshots per erase' % ('', slots))
+
+    nb, fb, bb, na, fa, ba = dongle_erases(minutes, a.report_interval,
+                                           a.downloads_per_day, a.flashes)
+    print('%-24s %10.2f %10.2f' % ('dongle nvm3 page', nb / a.days,
+                                   na / a.days))
+    print('%-24s %21.0f -> %.0f bytes of stats per day' % (
+        '', bb / a.days, ba / a.days))
+    print('%-24s %10u %10u  (in total, each rewrites the keys)' % (
+        'dongle config page', fb, fa))
+
+    rng = random.Random(a.seed)
+    for platform in BEACONS:
+        erases = check_power_loss(platform, a.cuts, rng)
+        print('%s: %u power cuts, %u erases: latest complete snapshot '
+              'always recovered' % (platform, a.cuts, erases))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,100 @@
+/*
+ * Host benchmark of the SHA-256 compression functions, see sha_256_select_core().
+ *
+ * For each core and message size, reports the throughput in MB/s and the cycles per 64 byte block, padding blocks
+ * included. Run ./test first, it checks every core against the test vectors.
+ *
+ * Built on the host only, see the Makefile.
+ */
+#ifdef MAIN
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sha-256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycles() __rdtsc()
+#define CYCLE_UNIT "cycles"
+#else
+#define cycles() now_ns()
+#define CYCLE_UNIT "ns"
+#endif
+
+/* total bytes hashed per measurement */
+#define BENCH_BYTES (64 * 1024 * 1024)
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* number of compressions for a message of len bytes, with the 0x80 byte and the length */
+static size_t num_blocks(size_t len)
+{
+	return (len + 1 + 8 + SIZE_OF_SHA_256_CHUNK - 1) / SIZE_OF_SHA_256_CHUNK;
+}
+
+static void bench(const uint8_t *data, size_t len)
+{
+	uint8_t hash[SIZE_OF_SHA_256_HASH];
+	volatile uint8_t sink = 0;
+	size_t reps = BENCH_BYTES / len, r;
+
+	if (reps == 0)
+		reps = 1;
+
+	/* warm up */
+	calc_sha_256(hash, data, len);
+
+	const uint64_t start_ns = now_ns();
+	const uint64_t start = cycles();
+	for (r = 0; r < reps; r++) {
+		calc_sha_256(hash, data, len);
+		sink ^= hash[0];
+	}
+	const double elapsed_cycles = (double)(cycles() - start);
+	const double elapsed_s = (now_ns() - start_ns) / 1e9;
+	(void)sink;
+
+	printf("%10lu %10.1f %12.0f %12.1f\n", (unsigned long)len, (double)len * reps / elapsed_s / 1e6,
+	       elapsed_s * 1e9 / reps, elapsed_cycles / (reps * num_blocks(len)));
+}
+
+int main(void)
+{
+	static const char *const core_names[] = {"bytewise", "unrolled", "SHA-NI"};
+	/* an eph ID hash with a 16 byte key, one block, up to bulk payloads */
+	static const size_t sizes[] = {28, 64, 256, 1024, 16 * 1024, 1024 * 1024};
+	uint8_t *data = malloc(1024 * 1024);
+	size_t i;
+	int core;
+
+	if (!data)
+		return 1;
+	for (i = 0; i < 1024 * 1024; i++)
+		data[i] = (uint8_t)(i * 31 + 7);
+
+	for (core = SHA_256_CORE_BYTEWISE; core <= SHA_256_CORE_SHA_NI; core++) {
+		if (sha_256_select_core((enum sha_256_core)core)) {
+			printf("core %s: not available\n\n", core_names[core]);
+			continue;
+		}
+		printf("core %s\n", core_names[core]);
+		printf("%10s %10s %12s %12s\n", "bytes", "MB/s", "ns/msg", CYCLE_UNIT "/block");
+		for (i = 0; i < sizeof sizes / sizeof sizes[0]; i++)
+			bench(data, sizes[i]);
+		printf("\n");
+	}
+
+	free(data);
+	return 0;
+}
+
+#endif /* MAIN */
@@ -0,0 +1,195 @@
+/*
+ * Host check and benchmark for the beacon eph ID generation,
+ * SHA-256(sk | location id | epoch) truncated to BEACON_EPH_ID_HASH_LEN.
+ *
+ * Checks that resuming from the SHA-256 state saved after the secret key and
+ * location gives the same IDs as hashing from scratch, for several key sizes and
+ * 14 days of epochs, and against known IDs for the test config. Then reports the
+ * cycles per ID of both methods.
+ *
+ * Built on the host only, see the Makefile.
+ */
+#ifdef MAIN
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sha-256.h"
+
+#define EPH_ID_LEN 14 /* BEACON_EPH_ID_HASH_LEN */
+#define SK_MAX_SIZE 2048
+#define NUM_EPOCHS (14 * 24 * 4) /* 14 days of 15 minute epochs */
+#define BENCH_IDS 20000
+
+typedef uint64_t location_id_t;
+typedef uint32_t epoch_t;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycles() __rdtsc()
+#define CYCLE_UNIT "cycles"
+#else
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#define cycles() now_ns()
+#define CYCLE_UNIT "ns"
+#endif
+
+/* as _gen_ephid_() before the midstate cache */
+static void ephid_scratch(const uint8_t *sk, size_t sk_size, location_id_t loc, epoch_t epoch,
+			  uint8_t id[EPH_ID_LEN])
+{
+	struct Sha_256 h;
+	uint8_t d[SIZE_OF_SHA_256_HASH];
+	sha_256_init(&h, d);
+	sha_256_write(&h, sk, sk_size);
+	sha_256_write(&h, &loc, sizeof loc);
+	sha_256_write(&h, &epoch, sizeof epoch);
+	sha_256_close(&h);
+	memcpy(id, d, EPH_ID_LEN);
+}
+
+static void ephid_midstate_init(struct Sha_256 *mid, uint8_t *mid_hash, const uint8_t *sk, size_t sk_size,
+				location_id_t loc)
+{
+	sha_256_init(mid, mid_hash);
+	sha_256_write(mid, sk, sk_size);
+	sha_256_write(mid, &loc, sizeof loc);
+}
+
+static void ephid_midstate(const struct Sha_256 *mid, epoch_t epoch, uint8_t id[EPH_ID_LEN])
+{
+	struct Sha_256 h;
+	uint8_t d[SIZE_OF_SHA_256_HASH];
+	sha_256_copy(&h, mid, d);
+	sha_256_write(&h, &epoch, sizeof epoch);
+	sha_256_close(&h);
+	memcpy(id, d, EPH_ID_LEN);
+}
+
+static void id_to_string(char string[2 * EPH_ID_LEN + 1], const uint8_t id[EPH_ID_LEN])
+{
+	int i;
+	for (i = 0; i < EPH_ID_LEN; i++)
+		string += sprintf(string, "%02x", id[i]);
+}
+
+/* TEST_BEACON_SK and TEST_BEACON_LOC_ID of the beacon test config */
+static const uint8_t TEST_SK[] = {0xcb, 0x43, 0xf7, 0x56, 0x16, 0x25, 0xb3, 0xd0,
+				  0xd0, 0xbe, 0xad, 0xf4, 0x55, 0x66, 0x77, 0x99};
+#define TEST_LOC_ID ((0x2222 << 16) + 4)
+
+struct known_id {
+	epoch_t epoch;
+	const char *id;
+};
+
+/* computed independently with Python's hashlib */
+static const struct known_id KNOWN_IDS[] = {{0, "cd5e395aaa7605eb0587dab4e56b"},
+					    {1, "91c84ff4632ee312edeadd29f86c"},
+					    {96, "9d6031b0ee70f08ce63fc4bf159f"},
+					    {1343, "4a7d03b270307d34cb1380eb6d85"}};
+
+static const size_t SK_SIZES[] = {16, 32, 52, 55, 56, 64, 100, 256, 1024, SK_MAX_SIZE};
+
+static uint8_t sk[SK_MAX_SIZE];
+
+static int known_test(void)
+{
+	struct Sha_256 mid;
+	uint8_t mid_hash[SIZE_OF_SHA_256_HASH], id[EPH_ID_LEN];
+	char s[2 * EPH_ID_LEN + 1];
+	size_t i;
+
+	ephid_midstate_init(&mid, mid_hash, TEST_SK, sizeof TEST_SK, TEST_LOC_ID);
+	for (i = 0; i < sizeof KNOWN_IDS / sizeof KNOWN_IDS[0]; i++) {
+		ephid_scratch(TEST_SK, sizeof TEST_SK, TEST_LOC_ID, KNOWN_IDS[i].epoch, id);
+		id_to_string(s, id);
+		if (strcmp(s, KNOWN_IDS[i].id)) {
+			printf("scratch, epoch %u: %s FAILURE!\n", KNOWN_IDS[i].epoch, s);
+			return 1;
+		}
+		ephid_midstate(&mid, KNOWN_IDS[i].epoch, id);
+		id_to_string(s, id);
+		if (strcmp(s, KNOWN_IDS[i].id)) {
+			printf("midstate, epoch %u: %s FAILURE!\n", KNOWN_IDS[i].epoch, s);
+			return 1;
+		}
+	}
+	printf("known test config IDs: SUCCESS!\n");
+	return 0;
+}
+
+static int exact_test(void)
+{
+	struct Sha_256 mid;
+	uint8_t mid_hash[SIZE_OF_SHA_256_HASH], a[EPH_ID_LEN], b[EPH_ID_LEN];
+	size_t i;
+	epoch_t e;
+
+	for (i = 0; i < sizeof SK_SIZES / sizeof SK_SIZES[0]; i++) {
+		const location_id_t loc = 0x0123456789abcdefULL + i;
+		ephid_midstate_init(&mid, mid_hash, sk, SK_SIZES[i], loc);
+		for (e = 0; e < NUM_EPOCHS; e++) {
+			ephid_scratch(sk, SK_SIZES[i], loc, e, a);
+			ephid_midstate(&mid, e, b);
+			if (memcmp(a, b, EPH_ID_LEN)) {
+				printf("sk size %lu, epoch %u: FAILURE!\n", (unsigned long)SK_SIZES[i], e);
+				return 1;
+			}
+		}
+	}
+	printf("midstate IDs match scratch IDs for %d epochs: SUCCESS!\n\n", NUM_EPOCHS);
+	return 0;
+}
+
+static void bench(void)
+{
+	struct Sha_256 mid;
+	uint8_t mid_hash[SIZE_OF_SHA_256_HASH], id[EPH_ID_LEN];
+	volatile uint8_t sink = 0;
+	size_t i;
+	epoch_t e;
+
+	printf("%8s %16s %16s %8s\n", "sk size", "scratch/ID", "midstate/ID", "speedup");
+	for (i = 0; i < sizeof SK_SIZES / sizeof SK_SIZES[0]; i++) {
+		uint64_t start = cycles();
+		for (e = 0; e < BENCH_IDS; e++) {
+			ephid_scratch(sk, SK_SIZES[i], TEST_LOC_ID, e, id);
+			sink ^= id[0];
+		}
+		const double scratch = (double)(cycles() - start) / BENCH_IDS;
+
+		start = cycles();
+		ephid_midstate_init(&mid, mid_hash, sk, SK_SIZES[i], TEST_LOC_ID);
+		for (e = 0; e < BENCH_IDS; e++) {
+			ephid_midstate(&mid, e, id);
+			sink ^= id[0];
+		}
+		const double midstate = (double)(cycles() - start) / BENCH_IDS;
+
+		printf("%8lu %9.0f %6s %9.0f %6s %7.1fx\n", (unsigned long)SK_SIZES[i], scratch, CYCLE_UNIT, midstate,
+		       CYCLE_UNIT, scratch / midstate);
+	}
+	(void)sink;
+}
+
+int main(void)
+{
+	size_t i;
+	for (i = 0; i < sizeof sk; i++)
+		sk[i] = (uint8_t)(i * 7 + 3);
+
+	if (known_test() || exact_test())
+		return 1;
+	bench();
+	return 0;
+}
+
+#endif /* MAIN */
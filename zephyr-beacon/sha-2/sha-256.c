@@ -2,6 +2,16 @@
 
 #define TOTAL_LEN_LEN 8
 
+/*
+ * The x86 SHA extensions are used when the CPU has them, for host-side bulk hashing. Other targets, such as the
+ * beacons, only build the portable cores.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SHA_256_X86 1
+#else
+#define SHA_256_X86 0
+#endif
+
 /*
  * ABOUT bool: this file does not use bool in order to be as pre-C99 compatible as possible.
  */
@@ -25,14 +35,29 @@ static inline uint32_t right_rot(uint32_t value, unsigned int count)
 	return value >> count | value << (32 - count);
 }
 
+/*
+ * Initialize array of round constants:
+ * (first 32 bits of the fractional parts of the cube roots of the first 64 primes 2..311):
+ */
+static const uint32_t k[] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98,
+    0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8,
+    0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+    0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2};
+
+#ifdef SHA_256_CORE_SELECT
 /*
  * @brief Update a hash value under calculation with a new chunk of data.
  * @param h Pointer to the first hash item, of a total of eight.
  * @param p Pointer to the chunk data, which has a standard length.
  *
- * @note This is the SHA-256 work horse.
+ * @note This is the original byte-oriented work horse, kept as a reference for the other cores.
  */
-static inline void consume_chunk(uint32_t *h, const uint8_t *p)
+static void consume_chunk_bytewise(uint32_t *h, const uint8_t *p)
 {
 	unsigned i, j;
 	uint32_t ah[8];
@@ -75,22 +100,6 @@ static inline void consume_chunk(uint32_t *h, const uint8_t *p)
 			const uint32_t s1 = right_rot(ah[4], 6) ^ right_rot(ah[4], 11) ^ right_rot(ah[4], 25);
 			const uint32_t ch = (ah[4] & ah[5]) ^ (~ah[4] & ah[6]);
 
-			/*
-			 * Initialize array of round constants:
-			 * (first 32 bits of the fractional parts of the cube roots of the first 64 primes 2..311):
-			 */
-			static const uint32_t k[] = {
-			    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
-			    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
-			    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
-			    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
-			    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
-			    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
-			    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
-			    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-			    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
-			    0xc67178f2};
-
 			const uint32_t temp1 = ah[7] + s1 + ch + k[i << 4 | j] + w[j];
 			const uint32_t s0 = right_rot(ah[0], 2) ^ right_rot(ah[0], 13) ^ right_rot(ah[0], 22);
 			const uint32_t maj = (ah[0] & ah[1]) ^ (ah[0] & ah[2]) ^ (ah[1] & ah[2]);
@@ -112,6 +121,193 @@ static inline void consume_chunk(uint32_t *h, const uint8_t *p)
 		h[i] += ah[i];
 }
 
+static void consume_chunks_bytewise(uint32_t *h, const uint8_t *p, size_t n)
+{
+	for (; n > 0; n--, p += SIZE_OF_SHA_256_CHUNK)
+		consume_chunk_bytewise(h, p);
+}
+#endif
+
+/*
+ * @brief Load a big-endian 32-bit word.
+ *
+ * @note With GCC or Clang this is a single word load, plus a byte swap on little-endian targets. The chunk buffer and
+ * word-aligned input make it an aligned load.
+ */
+static inline uint32_t load_be32(const uint8_t *p)
+{
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint32_t v;
+	memcpy(&v, p, sizeof v);
+	return __builtin_bswap32(v);
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	uint32_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+#else
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+#endif
+}
+
+#define BSIG0(x) (right_rot(x, 2) ^ right_rot(x, 13) ^ right_rot(x, 22))
+#define BSIG1(x) (right_rot(x, 6) ^ right_rot(x, 11) ^ right_rot(x, 25))
+#define SSIG0(x) (right_rot(x, 7) ^ right_rot(x, 18) ^ ((x) >> 3))
+#define SSIG1(x) (right_rot(x, 17) ^ right_rot(x, 19) ^ ((x) >> 10))
+#define CH(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+
+/*
+ * One round. Instead of shifting the eight working variables, the callers rotate the names they pass in.
+ */
+#define ROUND(a, b, c, d, e, f, g, h, j)                                                                               \
+	do {                                                                                                           \
+		const uint32_t temp1 = h + BSIG1(e) + CH(e, f, g) + k[i + (j)] + w[j];                                 \
+		d += temp1;                                                                                            \
+		h = temp1 + BSIG0(a) + MAJ(a, b, c);                                                                   \
+	} while (0)
+
+#define ROUNDS_8(j)                                                                                                    \
+	do {                                                                                                           \
+		ROUND(a, b, c, d, e, f, g, h, (j) + 0);                                                                \
+		ROUND(h, a, b, c, d, e, f, g, (j) + 1);                                                                \
+		ROUND(g, h, a, b, c, d, e, f, (j) + 2);                                                                \
+		ROUND(f, g, h, a, b, c, d, e, (j) + 3);                                                                \
+		ROUND(e, f, g, h, a, b, c, d, (j) + 4);                                                                \
+		ROUND(d, e, f, g, h, a, b, c, (j) + 5);                                                                \
+		ROUND(c, d, e, f, g, h, a, b, (j) + 6);                                                                \
+		ROUND(b, c, d, e, f, g, h, a, (j) + 7);                                                                \
+	} while (0)
+
+/*
+ * @brief Update a hash value under calculation with n consecutive chunks of data.
+ * @param state Pointer to the first hash item, of a total of eight.
+ * @param p Pointer to the chunk data, n times the standard length.
+ * @param n Number of chunks.
+ *
+ * @note This is the SHA-256 work horse. The working variables are kept in locals, the rounds are unrolled 16 at a
+ * time and the message schedule for the next 16 rounds is computed in place before them, so the 16-word window of
+ * the original implementation is kept.
+ */
+static void consume_chunks_unrolled(uint32_t *state, const uint8_t *p, size_t n)
+{
+	for (; n > 0; n--, p += SIZE_OF_SHA_256_CHUNK) {
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		uint32_t w[16];
+		unsigned i, j;
+
+		for (j = 0; j < 16; j++)
+			w[j] = load_be32(p + 4 * j);
+
+		for (i = 0; i < 64; i += 16) {
+			if (i > 0) {
+				for (j = 0; j < 16; j++)
+					w[j] += SSIG1(w[(j + 14) & 0xf]) + w[(j + 9) & 0xf] + SSIG0(w[(j + 1) & 0xf]);
+			}
+			ROUNDS_8(0);
+			ROUNDS_8(8);
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+}
+
+#undef ROUNDS_8
+#undef ROUND
+
+#if SHA_256_X86
+#include <cpuid.h>
+#include <immintrin.h>
+
+/*
+ * @brief Same as consume_chunks_unrolled(), with the x86 SHA extensions.
+ *
+ * @note The SHA instructions keep the working variables as ABEF and CDGH, so the state is shuffled once per call
+ * rather than once per chunk.
+ */
+__attribute__((target("sha,sse4.1"))) static void consume_chunks_sha_ni(uint32_t *state, const uint8_t *p, size_t n)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, tmp;
+
+	tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+	state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xb1);	       /* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1b);      /* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);      /* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0); /* CDGH */
+
+	for (; n > 0; n--, p += SIZE_OF_SHA_256_CHUNK) {
+		const __m128i abef = state0, cdgh = state1;
+		__m128i w[4];
+		unsigned i;
+
+		for (i = 0; i < 16; i++) {
+			__m128i msg;
+			if (i < 4) {
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), mask);
+			} else {
+				/* w[i] = msg2(msg1(w[i-4], w[i-3]) + w[i-2..i-1] shifted by one word, w[i-1]) */
+				tmp = _mm_alignr_epi8(w[(i - 1) & 3], w[(i - 2) & 3], 4);
+				msg = _mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i - 3) & 3]), tmp);
+				w[i & 3] = _mm_sha256msg2_epu32(msg, w[(i - 1) & 3]);
+			}
+			msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&k[4 * i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0e);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);	       /* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xb1);      /* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xf0); /* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);      /* HGFE */
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+static int cpu_has_sha_ni(void)
+{
+	unsigned eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3))
+		return 0;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ebx >> 29) & 1;
+}
+#endif
+
+typedef void (*consume_chunks_fn)(uint32_t *state, const uint8_t *p, size_t n);
+
+#if SHA_256_X86 || defined(SHA_256_CORE_SELECT)
+static consume_chunks_fn consume_chunks_core;
+
+static void consume_chunks(uint32_t *state, const uint8_t *p, size_t n)
+{
+	if (!consume_chunks_core) {
+		consume_chunks_core = consume_chunks_unrolled;
+#if SHA_256_X86
+		if (cpu_has_sha_ni())
+			consume_chunks_core = consume_chunks_sha_ni;
+#endif
+	}
+	consume_chunks_core(state, p, n);
+}
+#else
+#define consume_chunks consume_chunks_unrolled
+#endif
+
 /*
  * Public functions. See header file for documentation.
  */
@@ -148,9 +344,10 @@ void sha_256_write(struct Sha_256 *sha_256, const void *data, size_t len)
 		 * necessary. We operate directly on the input data instead.
 		 */
 		if (sha_256->space_left == SIZE_OF_SHA_256_CHUNK && len >= SIZE_OF_SHA_256_CHUNK) {
-			consume_chunk(sha_256->h, p);
-			len -= SIZE_OF_SHA_256_CHUNK;
-			p += SIZE_OF_SHA_256_CHUNK;
+			const size_t consumed_len = len - len % SIZE_OF_SHA_256_CHUNK;
+			consume_chunks(sha_256->h, p, consumed_len / SIZE_OF_SHA_256_CHUNK);
+			len -= consumed_len;
+			p += consumed_len;
 			continue;
 		}
 		/* General case, no particular optimization. */
@@ -160,7 +357,7 @@ void sha_256_write(struct Sha_256 *sha_256, const void *data, size_t len)
 		len -= consumed_len;
 		p += consumed_len;
 		if (sha_256->space_left == 0) {
-			consume_chunk(sha_256->h, sha_256->chunk);
+			consume_chunks(sha_256->h, sha_256->chunk, 1);
 			sha_256->chunk_pos = sha_256->chunk;
 			sha_256->space_left = SIZE_OF_SHA_256_CHUNK;
 		} else {
@@ -189,7 +386,7 @@ uint8_t *sha_256_close(struct Sha_256 *sha_256)
 	 */
 	if (space_left < TOTAL_LEN_LEN) {
 		memset(pos, 0x00, space_left);
-		consume_chunk(h, sha_256->chunk);
+		consume_chunks(h, sha_256->chunk, 1);
 		pos = sha_256->chunk;
 		space_left = SIZE_OF_SHA_256_CHUNK;
 	}
@@ -204,7 +401,7 @@ uint8_t *sha_256_close(struct Sha_256 *sha_256)
 		pos[i] = (uint8_t)len;
 		len >>= 8;
 	}
-	consume_chunk(h, sha_256->chunk);
+	consume_chunks(h, sha_256->chunk, 1);
 	/* Produce the final hash value (big-endian): */
 	int j;
 	uint8_t *const hash = sha_256->hash;
@@ -217,6 +414,36 @@ uint8_t *sha_256_close(struct Sha_256 *sha_256)
 	return sha_256->hash;
 }
 
+void sha_256_copy(struct Sha_256 *dst, const struct Sha_256 *src, uint8_t hash[SIZE_OF_SHA_256_HASH])
+{
+	*dst = *src;
+	dst->hash = hash;
+	dst->chunk_pos = dst->chunk + (src->chunk_pos - src->chunk);
+}
+
+#ifdef SHA_256_CORE_SELECT
+int sha_256_select_core(enum sha_256_core core)
+{
+	switch (core) {
+	case SHA_256_CORE_BYTEWISE:
+		consume_chunks_core = consume_chunks_bytewise;
+		return 0;
+	case SHA_256_CORE_UNROLLED:
+		consume_chunks_core = consume_chunks_unrolled;
+		return 0;
+	case SHA_256_CORE_SHA_NI:
+#if SHA_256_X86
+		if (cpu_has_sha_ni()) {
+			consume_chunks_core = consume_chunks_sha_ni;
+			return 0;
+		}
+#endif
+		return -1;
+	}
+	return -1;
+}
+#endif
+
 void calc_sha_256(uint8_t hash[SIZE_OF_SHA_256_HASH], const void *input, size_t len)
 {
 	struct Sha_256 sha_256;
@@ -45,8 +45,6 @@
 //
 // GLOBAL MEMORY
 //
-K_HEAP_DEFINE(zephyr_beacon_config, 4096);
-
 // Config
 static beacon_config_t config;
 
@@ -56,6 +54,21 @@ static beacon_timer_t beacon_time;    // Beacon Clock
 static beacon_eph_id_t beacon_eph_id; // Ephemeral ID
 static beacon_epoch_counter_t epoch;  // track the current time epoch
 static beacon_timer_t cycles;         // total number of updates.
+static beacon_timer_t clock_journal_t; // clock at the last journal record
+// sha-256 state after the secret key and location ID, each eph ID
+// only adds the epoch to a copy of it
+static hash_t ephid_midstate;
+static digest_t ephid_midstate_digest;
+#if BEACON_EPHID_RING_SIZE
+// eph IDs of the coming epochs, slot epoch % BEACON_EPHID_RING_SIZE
+typedef struct
+{
+  uint8_t valid;
+  beacon_epoch_counter_t epoch;
+  beacon_eph_id_t id;
+} beacon_ephid_slot_t;
+static beacon_ephid_slot_t ephid_ring[BEACON_EPHID_RING_SIZE];
+#endif
 static struct k_timer kernel_time_lp;         // periodic timer for new ephid gen
 static struct k_timer kernel_time_alternater; // alternate Pancast and GAEN packets
 static struct k_timer led_timer;      // periodic LED blinking
@@ -94,11 +107,11 @@ static uint32_t num_ms_in_min = 60000;
 
 #if MODE__NRF_BEACON_TEST_CONFIG
 
-static pubkey_t TEST_BACKEND_PK = {
+static const pubkey_t TEST_BACKEND_PK = {
   {0xad, 0xf4, 0xca, 0x6c, 0xa6, 0xd9, 0x11, 0x22}
 };
 
-static beacon_sk_t TEST_BEACON_SK = {
+static const beacon_sk_t TEST_BEACON_SK = {
   {0xcb, 0x43, 0xf7, 0x56, 0x16, 0x25, 0xb3, 0xd0,
    0xd0, 0xbe, 0xad, 0xf4, 0x55, 0x66, 0x77, 0x88}
 };
@@ -111,23 +124,22 @@ static bt_wrapper_t payload; // container for actual blutooth payload
 // ROUTINES
 //
 
-static void beacon_config_init(beacon_config_t *cfg, int reset)
+static void beacon_config_init(beacon_config_t *cfg)
 {
   if (!cfg)
     return;
 
-  if (!reset) {
-    cfg->backend_pk = k_heap_alloc(&zephyr_beacon_config, PK_MAX_SIZE, K_FOREVER);
-    cfg->beacon_sk = k_heap_alloc(&zephyr_beacon_config, SK_MAX_SIZE, K_FOREVER);
-  }
+  // the keys are viewed in flash by beacon_storage_load_config
+  cfg->backend_pk_size = 0;
+  cfg->backend_pk = NULL;
 
-  memset(cfg->backend_pk, 0, PK_MAX_SIZE);
-  memset(cfg->beacon_sk, 0, SK_MAX_SIZE);
+  cfg->beacon_sk_size = 0;
+  cfg->beacon_sk = NULL;
 }
 
-static void beacon_load(int reset)
+static void beacon_load()
 {
-  beacon_config_init(&config, reset);
+  beacon_config_init(&config);
   beacon_storage_init(&storage);
   // Load data
   beacon_storage_load_config(&storage, &config);
@@ -136,13 +148,20 @@ static void beacon_load(int reset)
   config.beacon_location_id = TEST_BEACON_LOC_ID;
   config.t_init = TEST_BEACON_INIT_TIME;
   config.backend_pk_size = TEST_BACKEND_KEY_SIZE;
-  memcpy(config.backend_pk, &TEST_BACKEND_PK, config.backend_pk_size);
+  config.backend_pk = &TEST_BACKEND_PK;
   config.beacon_sk_size = TEST_BEACON_SK_SIZE;
-  memcpy(config.beacon_sk, &TEST_BEACON_SK, config.beacon_sk_size);
+  config.beacon_sk = &TEST_BEACON_SK;
   storage.test_filter_size = TEST_FILTER_LEN;
   beacon_storage_save_stat(&storage, &config, &stats, sizeof(beacon_stats_t));
 //  beacon_storage_save_config(&storage, &config);
 #endif
+
+  // the journal is ahead of the stat page, unless it was just erased
+  beacon_timer_t journal_t_cur;
+  if (beacon_storage_time_journal_load(&storage, &journal_t_cur) == 0 &&
+      journal_t_cur > config.t_cur) {
+    config.t_cur = journal_t_cur;
+  }
 }
 
 static void beacon_info()
@@ -210,6 +229,8 @@ static void beacon_stats_print()
   log_infof("[%u] last report time: %u #epochs: %u #pkts: %u chksum: 0x%0x\r\n",
       beacon_time, stats.start, stats.epochs, stats.sent_broadcast_packets,
       stats.storage_checksum);
+  log_infof("eph IDs precomputed: %u computed at epoch change: %u\r\n",
+      stats.ephids_precomputed, stats.ephids_computed);
 }
 #endif
 
@@ -317,28 +338,81 @@ static void _beacon_encode_()
   _form_payload_();
 }
 
-static void _gen_ephid_()
+/*
+ * absorb the parts of the eph ID hash that do not change with the
+ * epoch, once the config is loaded
+ */
+static void _init_ephid_()
+{
+  sha_256_init(&ephid_midstate, ephid_midstate_digest.bytes);
+  sha_256_write(&ephid_midstate, config.beacon_sk, config.beacon_sk_size);
+  sha_256_write(&ephid_midstate, &config.beacon_location_id,
+      sizeof(beacon_location_id_t));
+#if BEACON_EPHID_RING_SIZE
+  memset(ephid_ring, 0, sizeof(ephid_ring));
+#endif
+}
+
+static void _compute_ephid_(beacon_epoch_counter_t e, beacon_eph_id_t *id)
 {
   hash_t h;
   digest_t d;
-#define init() sha_256_init(&h, d.bytes)
+#define init() sha_256_copy(&h, &ephid_midstate, d.bytes)
 #define add(data, size) sha_256_write(&h, data, size)
 #define complete() sha_256_close(&h)
-  // Initialize hash
+  // Resume after the secret key and location
   init();
   // Add relevant data
-  add(config.beacon_sk, config.beacon_sk_size);
-  add(&config.beacon_location_id, sizeof(beacon_location_id_t));
-  add(&epoch, sizeof(beacon_epoch_counter_t));
+  add(&e, sizeof(beacon_epoch_counter_t));
   // finalize and copy to id
   complete();
   // Little endian so these are the least significant
-  memcpy(&beacon_eph_id, &d, BEACON_EPH_ID_HASH_LEN);
+  memcpy(id, &d, BEACON_EPH_ID_HASH_LEN);
 #undef complete
 #undef add
 #undef init
 }
 
+static void _gen_ephid_()
+{
+#if BEACON_EPHID_RING_SIZE
+  beacon_ephid_slot_t *slot = &ephid_ring[epoch % BEACON_EPHID_RING_SIZE];
+  if (slot->valid && slot->epoch == epoch) {
+    memcpy(&beacon_eph_id, &slot->id, sizeof(beacon_eph_id_t));
+    stats.ephids_precomputed++;
+    return;
+  }
+#endif
+  _compute_ephid_(epoch, &beacon_eph_id);
+  stats.ephids_computed++;
+}
+
+/*
+ * compute the eph ID of the next epoch missing from the ring, called
+ * before the beacon loop waits for the clock timer, so that the epoch
+ * change only copies an ID.
+ * returns 1 if an ID was computed, 0 if the ring is full
+ */
+static int beacon_ephid_precompute()
+{
+#if BEACON_EPHID_RING_SIZE
+  beacon_epoch_counter_t cur = epoch_i(beacon_time, config.t_init);
+  for (beacon_epoch_counter_t e = cur + 1;
+      e < cur + BEACON_EPHID_RING_SIZE; e++) {
+    beacon_ephid_slot_t *slot = &ephid_ring[e % BEACON_EPHID_RING_SIZE];
+    if (slot->valid && slot->epoch == e)
+      continue;
+
+    slot->valid = 0;
+    slot->epoch = e;
+    _compute_ephid_(e, &slot->id);
+    slot->valid = 1;
+    return 1;
+  }
+#endif
+  return 0;
+}
+
 static void _beacon_epoch_()
 {
   static beacon_epoch_counter_t old_epoch;
@@ -456,8 +530,8 @@ static void beacon_stats_init()
 #ifdef MODE__STAT
   stats.epochs = 1;
   stats.start = beacon_time;
-  beacon_storage_read_stat(&storage, &stats, sizeof(beacon_stats_t));
-  if (!stats.storage_checksum) {
+  if (beacon_storage_read_stat(&storage, &stats, sizeof(beacon_stats_t)) == 0 &&
+      !stats.storage_checksum) {
     log_infof("%s", "Existing Statistics Found\r\n");
     beacon_stats_print();
   } else {
@@ -500,6 +574,26 @@ static int beacon_legacy_advertise()
   return err;
 }
 
+/*
+ * append the clock to the time journal every BEACON_CLOCK_JOURNAL_INTERVAL.
+ * the stat page, saved with every report, is the checkpoint. it is also
+ * saved before a full journal page is erased, so a reset right after the
+ * erase resumes from the checkpoint rather than from an older time.
+ */
+static void _beacon_save_clock_()
+{
+  if (config.t_cur - clock_journal_t < BEACON_CLOCK_JOURNAL_INTERVAL)
+    return;
+
+  if (beacon_storage_time_journal_full(&storage)) {
+    beacon_storage_save_stat(&storage, &config, &stats,
+        sizeof(beacon_stats_t));
+  }
+
+  beacon_storage_time_journal_append(&storage, config.t_cur);
+  clock_journal_t = config.t_cur;
+}
+
 int beacon_clock_increment(beacon_timer_t time)
 {
   beacon_time += time;
@@ -508,7 +602,7 @@ int beacon_clock_increment(beacon_timer_t time)
 
   // update beacon time in config and save to flash
   config.t_cur = beacon_time;
-  beacon_storage_save_stat(&storage, &config, &stats, sizeof(beacon_stats_t));
+  _beacon_save_clock_();
 //  beacon_storage_save_config(&storage, &config);
 
   // update stats and save to flash
@@ -522,9 +616,11 @@ void beacon_loop()
 {
   uint32_t lp_timer_status = 0;
   _alternate_advertisement_content_(0);
+  while (beacon_ephid_precompute());
   while ((lp_timer_status = k_timer_status_sync(&kernel_time_lp))) {
     beacon_clock_increment(lp_timer_status);
     _alternate_advertisement_content_(0);
+    while (beacon_ephid_precompute());
   }
 }
 
@@ -540,6 +636,7 @@ void beacon_gaen_pancast_loop()
     while ((rem_time = k_timer_remaining_get(&kernel_time_lp)) > 0) {
       _alternate_advertisement_content_((count % 2));
       count++;
+      beacon_ephid_precompute();
       lp_timer_status = k_timer_status_get(&kernel_time_lp);
       beacon_clock_increment(lp_timer_status);
       alt_timer_status = k_timer_status_sync(&kernel_time_alternater);
@@ -556,12 +653,15 @@ void _beacon_broadcast_(int err, int reset)
 {
   log_expf("init beacon err: %d reset: %d\r\n", err, reset);
 
-  beacon_load(reset);
+  beacon_load();
+  _init_ephid_();
 
   if (reset) {
     config.t_cur = config.t_init;
+    beacon_storage_reset_stat(&storage);
     beacon_storage_save_stat(&storage, &config, &stats, sizeof(beacon_stats_t));
 //  beacon_storage_save_config(&storage, &config);
+    beacon_storage_time_journal_reset(&storage);
   }
 
   beacon_info();
@@ -570,6 +670,7 @@ void _beacon_broadcast_(int err, int reset)
   cycles = 0;
 
   beacon_time = config.t_cur > config.t_init ? config.t_cur : config.t_init;
+  clock_journal_t = beacon_time;
 
   beacon_stats_init();
 
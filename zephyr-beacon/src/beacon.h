@@ -18,9 +18,9 @@ typedef struct
   beacon_timer_t t_init;                   // Beacon initial clock
   beacon_timer_t t_cur;                    // Beacon current clock
   key_size_t backend_pk_size;              // Size of backend public key
-  pubkey_t *backend_pk;                    // Backend public key
+  const pubkey_t *backend_pk;              // Backend public key, in flash
   key_size_t beacon_sk_size;               // Size of secret key
-  beacon_sk_t *beacon_sk;                  // Secret Key
+  const beacon_sk_t *beacon_sk;            // Secret Key, in flash
 } beacon_config_t;
 
 typedef struct bt_data bt_data_t;
@@ -60,6 +60,12 @@ typedef struct
    * total number of legacy adv. packets sent
    */
   uint32_t sent_broadcast_packets;
+  /*
+   * eph IDs taken from the precomputed ring, and computed at the
+   * epoch change
+   */
+  uint32_t ephids_precomputed;
+  uint32_t ephids_computed;
 } beacon_stats_t;
 
 extern beacon_stats_t stats;
@@ -39,6 +39,28 @@
  */
 #define BEACON_EPOCH_LENGTH 15
 
+/*
+ * number of eph IDs kept precomputed for the coming epochs, filled
+ * while the beacon loop is idle
+ * 0 - compute the eph ID at the epoch change
+ */
+#define BEACON_EPHID_RING_SIZE 4
+
+/*
+ * clock persistence. the clock cursor is appended to the time journal
+ * every BEACON_CLOCK_JOURNAL_INTERVAL minutes, and checkpointed to the
+ * stat page with each report and before the journal page is erased. at
+ * boot the clock resumes from the later of the two.
+ */
+#define BEACON_CLOCK_JOURNAL_INTERVAL 1
+
+/*
+ * the keys are read in place from the memory-mapped config page. set to
+ * reserve a RAM buffer that beacon_storage_save_config() copies them to
+ * before it erases that page, when rewriting the config on the beacon.
+ */
+#define BEACON_CONFIG_REWRITE 0
+
 /*
  * Tx power config limits for Nordic beacon
  */
@@ -1,4 +1,8 @@
+#include <kernel.h>
+#include <stddef.h>
 #include <string.h>
+#include <sys/crc.h>
+#include <sys/util.h>
 
 #include <settings.h>
 #include <storage.h>
@@ -53,7 +57,8 @@ int _flash_read_(beacon_storage *sto, storage_addr_t off, void *data, size_t siz
  * flash_get_write_block_size(sto-dev),
  * which is 4 for nordic beacons
  */
-int _flash_write_(beacon_storage *sto, storage_addr_t off, void *data, size_t size)
+int _flash_write_(beacon_storage *sto, storage_addr_t off, const void *data,
+    size_t size)
 {
   int ret = flash_write(sto->dev, off, data, size);
   log_debugf("size: %d bytes, addr: 0x%x, flash off: 0x%0x, ret: %d\r\n",
@@ -61,6 +66,32 @@ int _flash_write_(beacon_storage *sto, storage_addr_t off, void *data, size_t si
   return ret;
 }
 
+/*
+ * read-only view of size bytes of the config at off, NULL if the range
+ * is not within the config page
+ */
+static const void *_config_view_(beacon_storage *sto, storage_addr_t off,
+    size_t size)
+{
+  if (off < sto->map.config ||
+      off + size > sto->map.config + sto->page_size) {
+    log_errorf("config view 0x%x (%u B) outside config page 0x%x\r\n",
+        (uint32_t) off, size, (uint32_t) sto->map.config);
+    return NULL;
+  }
+  return storage_mapped_addr(off);
+}
+
+static int _in_config_page_(beacon_storage *sto, const void *p)
+{
+  return p >= storage_mapped_addr(sto->map.config) &&
+    p < storage_mapped_addr(sto->map.config + sto->page_size);
+}
+
+#if BEACON_CONFIG_REWRITE
+K_HEAP_DEFINE(config_keys_heap, sizeof(pubkey_t) + sizeof(beacon_sk_t) + 64);
+#endif
+
 void beacon_storage_get_info(beacon_storage *sto)
 {
   sto->num_pages = 0;
@@ -91,6 +122,67 @@ void beacon_storage_init(beacon_storage *sto)
 //  sto->map.stat = sto->total_size - (3*sto->page_size);
 }
 
+#define stat_journal_num_slots(sto) \
+  (((sto)->page_size - sizeof(beacon_timer_t)) / STAT_JOURNAL_SLOT_SIZE)
+#define stat_journal_slot_addr(sto, idx) \
+  ((sto)->map.stat + sizeof(beacon_timer_t) + \
+   ((idx) * STAT_JOURNAL_SLOT_SIZE))
+
+/*
+ * crc of a header and its snapshot, which is read from flash at off
+ * if stat is NULL
+ */
+static uint32_t _stat_journal_crc_(beacon_storage *sto,
+    const stat_journal_hdr_t *hdr, const void *stat, storage_addr_t off)
+{
+  uint8_t buf[64];
+  uint32_t crc = crc32_ieee_update(0, (const uint8_t *) hdr,
+      offsetof(stat_journal_hdr_t, crc));
+
+  if (stat)
+    return crc32_ieee_update(crc, (const uint8_t *) stat, hdr->len);
+
+  for (uint32_t done = 0, n; done < hdr->len; done += n) {
+    n = MIN(sizeof(buf), hdr->len - done);
+    _flash_read_(sto, off + done, buf, n);
+    crc = crc32_ieee_update(crc, buf, n);
+  }
+  return crc;
+}
+
+/*
+ * find the latest valid snapshot and the next free slot, returns the
+ * address of the snapshot or 0. slots are used in order, a torn one is
+ * skipped as it cannot be reused until erased.
+ */
+static storage_addr_t _stat_journal_scan_(beacon_storage *sto,
+    stat_journal_hdr_t *latest)
+{
+  stat_journal_hdr_t hdr;
+  storage_addr_t off, latest_off = 0;
+  uint32_t i;
+
+  for (i = 0; i < stat_journal_num_slots(sto); i++) {
+    off = stat_journal_slot_addr(sto, i);
+    _flash_read_(sto, off, &hdr, sizeof(stat_journal_hdr_t));
+    if (hdr.seq == 0xffffffff)
+      break;
+    off += sizeof(stat_journal_hdr_t);
+    if (hdr.len <= sizeof(beacon_stats_t) &&
+        hdr.crc == _stat_journal_crc_(sto, &hdr, NULL, off) &&
+        (!latest_off || hdr.seq > latest->seq)) {
+      *latest = hdr;
+      latest_off = off;
+    }
+  }
+  sto->stat_journal_next = i;
+  sto->stat_journal_seq = latest_off ? latest->seq : 0;
+
+  log_debugf("stat journal: %u slots used, seq: %u\r\n", i,
+      sto->stat_journal_seq);
+  return latest_off;
+}
+
 /*
  * Read data from flashed storage
  * Format matches the fixed structure which is also used as a
@@ -116,10 +208,14 @@ void beacon_storage_load_config(beacon_storage *sto, beacon_config_t *cfg)
         cfg->backend_pk_size, PK_MAX_SIZE);
     cfg->backend_pk_size = PK_MAX_SIZE;
   }
-  read(PK_MAX_SIZE, cfg->backend_pk->bytes);
-  hexdumpn(cfg->backend_pk->bytes, 16, "    Server PK");
-  // slide through the extra space for a pubkey
-//  off += PK_MAX_SIZE - cfg->backend_pk_size;
+  // keys are not copied to RAM, the config points at them in flash
+  cfg->backend_pk = _config_view_(sto, off, sizeof(pubkey_t));
+  if (!cfg->backend_pk)
+    cfg->backend_pk_size = 0;
+  else {
+    hexdumpn(cfg->backend_pk->bytes, 16, "    Server PK");
+  }
+  off += PK_MAX_SIZE;
 
   read(sizeof(key_size_t), &cfg->beacon_sk_size);
   log_expf("beacon key off: 0x%0x, size: %u\r\n",
@@ -129,10 +225,13 @@ void beacon_storage_load_config(beacon_storage *sto, beacon_config_t *cfg)
         cfg->beacon_sk_size, SK_MAX_SIZE);
     cfg->beacon_sk_size = SK_MAX_SIZE;
   }
-  read(SK_MAX_SIZE, cfg->beacon_sk->bytes);
-  hexdumpn(cfg->beacon_sk->bytes, 16, "nRF Beacon SK");
-  // slide through the extra space for a pubkey
-//  off += SK_MAX_SIZE - cfg->beacon_sk_size;
+  cfg->beacon_sk = _config_view_(sto, off, sizeof(beacon_sk_t));
+  if (!cfg->beacon_sk)
+    cfg->beacon_sk_size = 0;
+  else {
+    hexdumpn(cfg->beacon_sk->bytes, 16, "nRF Beacon SK");
+  }
+  off += SK_MAX_SIZE;
 
   read(sizeof(sto->test_filter_size), &sto->test_filter_size);
 
@@ -155,6 +254,17 @@ void beacon_storage_load_config(beacon_storage *sto, beacon_config_t *cfg)
   off = sto->map.stat;
   read(sizeof(beacon_timer_t), &cfg->t_cur);
 #undef read
+  // the page may have been erased right before a power loss
+  if (cfg->t_cur == 0xffffffff)
+    cfg->t_cur = 0;
+
+  // the latest snapshot is a later checkpoint of the clock
+  stat_journal_hdr_t latest;
+  if (_stat_journal_scan_(sto, &latest) && latest.t_cur > cfg->t_cur)
+    cfg->t_cur = latest.t_cur;
+
+  sto->map.time_journal = sto->map.stat + sto->page_size;
+  sto->time_journal_next = 0;
   log_debugf("%s", "Config loaded.\r\n");
 }
 
@@ -178,6 +288,34 @@ void beacon_storage_save_config(beacon_storage *sto, beacon_config_t *cfg)
   off = sto->map.config;
 #endif
 
+  storage_addr_t pk_off, sk_off;
+  uint8_t *keys = NULL;
+
+  /*
+   * the keys are usually views of this page, copy them out before it is
+   * erased and view the rewritten ones after. a key that could not be
+   * viewed is NULL and written as zeros.
+   */
+  if (!cfg->backend_pk || !cfg->beacon_sk ||
+      _in_config_page_(sto, cfg->backend_pk) ||
+      _in_config_page_(sto, cfg->beacon_sk)) {
+#if BEACON_CONFIG_REWRITE
+    keys = k_heap_alloc(&config_keys_heap,
+        sizeof(pubkey_t) + sizeof(beacon_sk_t), K_NO_WAIT);
+#endif
+    if (!keys) {
+      log_errorf("%s", "no buffer to copy the keys, config not saved\r\n");
+      return;
+    }
+    memset(keys, 0, sizeof(pubkey_t) + sizeof(beacon_sk_t));
+    if (cfg->backend_pk)
+      memcpy(keys, cfg->backend_pk, sizeof(pubkey_t));
+    if (cfg->beacon_sk)
+      memcpy(keys + sizeof(pubkey_t), cfg->beacon_sk, sizeof(beacon_sk_t));
+    cfg->backend_pk = (const pubkey_t *) keys;
+    cfg->beacon_sk = (const beacon_sk_t *) (keys + sizeof(pubkey_t));
+  }
+
   // erase from the beginning of config page
   pre_erase(sto, off, total_size);
 
@@ -195,15 +333,24 @@ void beacon_storage_save_config(beacon_storage *sto, beacon_config_t *cfg)
   write(&cfg->t_init, sizeof(beacon_timer_t));
 //  write(&cfg->t_cur, sizeof(beacon_timer_t));
   write(&cfg->backend_pk_size, sizeof(key_size_t));
+  pk_off = off;
   write(cfg->backend_pk, PK_MAX_SIZE);
 //  off += PK_MAX_SIZE - cfg->backend_pk_size;
   write(&cfg->beacon_sk_size, sizeof(key_size_t));
+  sk_off = off;
   write(cfg->beacon_sk, SK_MAX_SIZE);
 //  off += SK_MAX_SIZE - cfg->beacon_sk_size;
 
   // write test filter len
   write(&sto->test_filter_size, sizeof(sto->test_filter_size));
 
+  cfg->backend_pk = _config_view_(sto, pk_off, sizeof(pubkey_t));
+  cfg->beacon_sk = _config_view_(sto, sk_off, sizeof(beacon_sk_t));
+#if BEACON_CONFIG_REWRITE
+  if (keys)
+    k_heap_free(&config_keys_heap, keys);
+#endif
+
 #if 0
   // write test filter
   write(test_filter, sto->test_filter_size);
@@ -212,17 +359,111 @@ void beacon_storage_save_config(beacon_storage *sto, beacon_config_t *cfg)
 
 void beacon_storage_save_stat(beacon_storage *sto, beacon_config_t *cfg,
     void *stat, size_t len)
+{
+  stat_journal_hdr_t hdr;
+  beacon_timer_t t_mark;
+
+  if (len > sizeof(beacon_stats_t)) {
+    log_errorf("stat snapshot too large (%u > %u)\r\n", len,
+        sizeof(beacon_stats_t));
+    return;
+  }
+
+  if (sto->stat_journal_next >= stat_journal_num_slots(sto))
+    beacon_storage_reset_stat(sto);
+
+  _flash_read_(sto, sto->map.stat, &t_mark, sizeof(beacon_timer_t));
+  if (t_mark == 0xffffffff) {
+    _flash_write_(sto, sto->map.stat, &cfg->t_cur, sizeof(beacon_timer_t));
+  }
+
+  hdr.seq = ++sto->stat_journal_seq;
+  hdr.t_cur = cfg->t_cur;
+  hdr.len = len;
+  hdr.crc = _stat_journal_crc_(sto, &hdr, stat, 0);
+
+  // header first, so that a torn slot is not taken for a free one
+  storage_addr_t off = stat_journal_slot_addr(sto, sto->stat_journal_next);
+  _flash_write_(sto, off, &hdr, sizeof(stat_journal_hdr_t));
+  _flash_write_(sto, off + sizeof(stat_journal_hdr_t), stat, len);
+  sto->stat_journal_next++;
+}
+
+int beacon_storage_read_stat(beacon_storage *sto, void *stat, size_t len)
+{
+  stat_journal_hdr_t latest;
+  storage_addr_t off = _stat_journal_scan_(sto, &latest);
+  if (!off)
+    return -1;
+
+  // snapshots of an older, shorter stats struct leave new fields zero
+  memset(stat, 0, len);
+  _flash_read_(sto, off, stat, MIN(latest.len, len));
+  return 0;
+}
+
+void beacon_storage_reset_stat(beacon_storage *sto)
 {
   beacon_storage_erase(sto, sto->map.stat);
-  storage_addr_t off = sto->map.stat;
-  _flash_write_(sto, off, &cfg->t_cur, sizeof(beacon_timer_t));
-  off += sizeof(beacon_timer_t);
-  _flash_write_(sto, off, stat, len);
+  sto->stat_journal_next = 0;
+}
+
+#define time_journal_num_recs(sto) \
+  ((sto)->page_size / sizeof(time_journal_rec_t))
+#define time_journal_rec_addr(sto, idx) \
+  ((sto)->map.time_journal + ((idx) * sizeof(time_journal_rec_t)))
+
+int beacon_storage_time_journal_load(beacon_storage *sto,
+    beacon_timer_t *t_cur)
+{
+  time_journal_rec_t rec;
+  int found = -1;
+  uint32_t i;
+
+  for (i = 0; i < time_journal_num_recs(sto); i++) {
+    _flash_read_(sto, time_journal_rec_addr(sto, i), &rec,
+        sizeof(time_journal_rec_t));
+    if (rec.t_cur == 0xffffffff && rec.check == 0xffffffff)
+      break;
+    // a torn record is skipped, its slot cannot be reused until erased
+    if (rec.check == ~rec.t_cur && (found < 0 || rec.t_cur > *t_cur)) {
+      *t_cur = rec.t_cur;
+      found = 0;
+    }
+  }
+  sto->time_journal_next = i;
+
+  log_expf("time journal: %u records, t_cur: %u\r\n", i,
+      found ? 0 : *t_cur);
+  return found;
+}
+
+int beacon_storage_time_journal_full(beacon_storage *sto)
+{
+  return sto->time_journal_next >= time_journal_num_recs(sto);
+}
+
+void beacon_storage_time_journal_append(beacon_storage *sto,
+    beacon_timer_t t_cur)
+{
+  time_journal_rec_t rec = { .t_cur = t_cur, .check = ~t_cur };
+
+  if (beacon_storage_time_journal_full(sto))
+    beacon_storage_time_journal_reset(sto);
+
+  _flash_write_(sto, time_journal_rec_addr(sto, sto->time_journal_next),
+      &rec, sizeof(time_journal_rec_t));
+  sto->time_journal_next++;
 }
 
-void beacon_storage_read_stat(beacon_storage *sto, void *stat, size_t len)
+void beacon_storage_time_journal_reset(beacon_storage *sto)
 {
-  _flash_read_(sto, sto->map.stat, stat, len);
+  beacon_storage_erase(sto, sto->map.time_journal);
+  sto->time_journal_next = 0;
 }
 
+#undef time_journal_rec_addr
+#undef time_journal_num_recs
+#undef stat_journal_slot_addr
+#undef stat_journal_num_slots
 #undef next_multiple
@@ -20,11 +20,48 @@
 typedef off_t storage_addr_t;
 typedef const struct device flash_device_t;
 
+/*
+ * address of a flash offset in the memory map of the nRF52, where the
+ * internal flash is mapped at CONFIG_FLASH_BASE_ADDRESS
+ */
+#define storage_mapped_addr(off) \
+  ((const void *) (CONFIG_FLASH_BASE_ADDRESS + (off)))
+
+/*
+ * time journal, an append-only log of the clock cursor in the page after
+ * the stat page. records are appended in order and the page is only
+ * erased once it is full, the last valid record is the saved clock.
+ */
+typedef struct
+{
+  beacon_timer_t t_cur;
+  uint32_t check; // ~t_cur, tells a written record from an erased or torn one
+} time_journal_rec_t;
+
+/*
+ * the stat page starts with the clock at its last erase, followed by a
+ * journal of stats snapshots in fixed slots, each with the clock at the
+ * time. snapshots are appended and the page is only erased once every
+ * slot is used. the valid snapshot with the highest sequence number is
+ * the current one.
+ */
+typedef struct
+{
+  uint32_t seq;
+  beacon_timer_t t_cur;
+  uint32_t len;
+  uint32_t crc; // crc32 of the fields above and the snapshot
+} stat_journal_hdr_t;
+
+#define STAT_JOURNAL_SLOT_SIZE \
+  ((sizeof(stat_journal_hdr_t) + sizeof(beacon_stats_t) + 3) & ~3)
+
 typedef struct
 {
   storage_addr_t config;  // address of device configuration
   storage_addr_t test_filter; // test cuckoo filter
   storage_addr_t stat;    // address of saved statistics
+  storage_addr_t time_journal; // clock cursor log
 } _beacon_storage_map_;
 
 typedef struct
@@ -37,6 +74,9 @@ typedef struct
   _beacon_storage_map_ map;
   uint64_t numErasures;
   uint32_t test_filter_size;
+  uint32_t time_journal_next; // index of the next free journal record
+  uint32_t stat_journal_next; // index of the next free stats slot
+  uint32_t stat_journal_seq;  // sequence number of the last snapshot
 } beacon_storage;
 
 // STORAGE INIT
@@ -52,8 +92,29 @@ void beacon_storage_init(beacon_storage *sto);
 void beacon_storage_load_config(beacon_storage *sto, beacon_config_t *cfg);
 void beacon_storage_save_config(beacon_storage *sto, beacon_config_t *cfg);
 
+/*
+ * STATS
+ * *save_stat* appends a snapshot to the stats journal, *read_stat* loads
+ * the latest valid one and returns -1 if there is none. *reset_stat*
+ * erases the page, dropping the snapshots and the saved clock.
+ */
 void beacon_storage_save_stat(beacon_storage *sto, beacon_config_t *cfg,
     void * stat, size_t len);
-void beacon_storage_read_stat(beacon_storage *sto, void * stat, size_t len);
+int beacon_storage_read_stat(beacon_storage *sto, void * stat, size_t len);
+void beacon_storage_reset_stat(beacon_storage *sto);
+
+/*
+ * TIME JOURNAL
+ * *time_journal_load* finds the last valid record and the next free one,
+ * it returns -1 if the journal holds no valid record. *time_journal_append*
+ * erases the page first when it is full, *time_journal_full* tells the
+ * caller to checkpoint the clock elsewhere before that.
+ */
+int beacon_storage_time_journal_load(beacon_storage *sto,
+    beacon_timer_t *t_cur);
+int beacon_storage_time_journal_full(beacon_storage *sto);
+void beacon_storage_time_journal_append(beacon_storage *sto,
+    beacon_timer_t t_cur);
+void beacon_storage_time_journal_reset(beacon_storage *sto);
 
 #endif /* STORAGE__H */